@@ -239,12 +239,14 @@ ATOM(bool_t, io,                        0, boolean,, "")
 ATOM(bool_t, jni,                       0, boolean,, "")
 ATOM(bool_t, verbose_io,                0, boolean,, "")
 ATOM(bool_t, keyring,                   0, boolean,, "")
+ATOM(bool_t, crypto,                    0, boolean,, "")
 ATOM(bool_t, mdprequests,               0, boolean,, "")
 ATOM(bool_t, mdp_filter,                0, boolean,, "")
 ATOM(bool_t, msp,                       0, boolean,, "")
 ATOM(bool_t, monitor,                   0, boolean,, "")
 ATOM(bool_t, radio_link,                0, boolean,, "")
 ATOM(bool_t, overlaybuffer,             0, boolean,, "")
+ATOM(bool_t, pool,                      0, boolean,, "")
 ATOM(bool_t, overlayframes,             0, boolean,, "")
 ATOM(bool_t, packets_sent,              0, boolean,, "")
 ATOM(bool_t, overlaytick,               0, boolean,, "")
@@ -347,6 +349,11 @@ END_STRUCT
 STRUCT(mdp)
 ATOM(bool_t,                enable_inet, 0, boolean,, "If true, allow mdp clients to connect over loopback UDP")
 STRING(256,                 filter_rules_path, "", str_nonempty,, "Path of file containing MDP filter rules, either absolute or relative to instance directory")
+ATOM(unsigned short,        crypto_threads, 2, ushort,, "Number of threads used to encrypt and decrypt MDP payloads, zero to use the main thread")
+END_STRUCT
+
+STRUCT(keyring)
+ATOM(bool_t,                slot_hints, 0, boolean,, "If true, keep an index beside the keyring file so that entering a PIN only decrypts the slots it unlocks")
 END_STRUCT
 
 STRUCT(vomp)
@@ -405,17 +412,22 @@ END_STRUCT
 STRUCT(rhizome_http)
 ATOM(bool_t,                enable,     1, boolean,, "If true, Rhizome HTTP server is started")
 ATOM(uint16_t,              port,       HTTPD_PORT_DEFAULT, uint16_nonzero,, "Port number for Rhizome HTTP server")
+ATOM(uint32_t,              max_connections, 32, uint32_nonzero,, "Maximum number of simultaneous HTTP connections")
+ATOM(uint64_t,              keepalive_timeout, 5000, uint64_scaled,, "Close a persistent HTTP connection if idle for this long between requests, zero to close after every response")
 END_STRUCT
 
 STRUCT(rhizome_mdp)
 ATOM(bool_t,                enable,     1, boolean,, "If true, Rhizome MDP server is started")
 ATOM(uint64_t,              stall_timeout,      1000, uint64_scaled,, "Timeout to request more data.")
 ATOM(uint64_t,              block_size, 512, uint64_scaled,, "Transfer block size.")
+ATOM(uint32_t,              cache_entries, 256, uint32_nonzero,, "Maximum number of payloads kept open for MDP transfers")
+ATOM(uint32_t,              cache_files, 64, uint32_nonzero,, "Maximum number of payload files kept open for MDP transfers")
 END_STRUCT
 
 STRUCT(rhizome_advertise)
 ATOM(bool_t,                enable,     1, boolean,, "If true, Rhizome advertisements are sent")
 ATOM(uint32_t,              interval,   500, uint32_nonzero,, "Interval between Rhizome advertisements")
+ATOM(bool_t,                summary,    1, boolean,, "If true, send neighbours a compact summary of all bundles, so that a few differences can be found in a single message")
 END_STRUCT
 
 STRUCT(rhizome)
@@ -425,8 +437,10 @@ ATOM(bool_t,                reliable_clock, 1, boolean,, "If false, consider the
 ATOM(bool_t,                clean_on_open,  0, boolean,, "If true, Rhizome database is cleaned at start of every command")
 STRING(256,                 datastore_path, "", str_nonempty,, "Path of rhizome storage directory, absolute or relative to instance directory")
 ATOM(uint64_t,              database_size,  UINT64_MAX, uint64_scaled,, "Maximum size of database in bytes")
+ATOM(bool_t,                database_wal,   0, boolean,, "If true, use SQLite write-ahead logging for the Rhizome database")
 ATOM(uint64_t,              min_free_space, 100*1024*1024, uint64_scaled,, "Minimum free space to preserve on the disk")
 ATOM(uint32_t,              max_blob_size,  128 * 1024, uint32_scaled,, "Store payloads larger than this in files not SQLite blobs")
+ATOM(bool_t,                chunked_storage, 0, boolean,, "If true, store payloads as content-defined chunks that are shared with other payloads, and fetch them by chunk over MDP")
 ATOM(uint64_t,              idle_timeout,           RHIZOME_IDLE_TIMEOUT, uint64_scaled,, "Rhizome transfer timeout if no data received.")
 ATOM(uint32_t,              fetch_delay_ms,         50, uint32_nonzero,, "Delay from receiving first bundle advert to initiating fetch")
 SUB_STRUCT(rhizome_direct,  direct,)
@@ -506,6 +520,7 @@ SUB_STRUCT(log,             log,)
 SUB_STRUCT(server,          server,)
 SUB_STRUCT(monitor,         monitor,)
 SUB_STRUCT(mdp,             mdp,)
+SUB_STRUCT(keyring,         keyring,)
 SUB_STRUCT(dna,             dna,)
 SUB_STRUCT(vomp,            vomp,)
 SUB_STRUCT(debug,           debug,)
@@ -0,0 +1,482 @@
+/*
+Serval DNA cryptography worker threads
+Copyright (C) 2026 Serval Project Inc.
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <assert.h>
+#include <poll.h>
+#ifdef HAVE_PTHREAD
+#  include <pthread.h>
+#endif
+#include "serval.h"
+#include "conf.h"
+#include "crypto_workers.h"
+#include "keyring.h"
+#include "net.h"
+#include "mem.h"
+#include "debug.h"
+#include "server.h"
+
+#define CRYPTO_WORKERS_MAX 8
+// the most jobs a worker takes from the queue at once
+#define CRYPTO_BATCH_SIZE 16
+// signatures take much longer to check, so crypto_jobs_run() hands them out in smaller batches
+#define CRYPTO_SYNC_BATCH_SIZE 4
+
+#define JOB_QUEUED 0
+#define JOB_BUSY 1
+#define JOB_DONE 2
+
+struct crypto_worker_stats crypto_worker_stats;
+
+struct crypto_job *crypto_job_new(enum crypto_job_op op, const uint8_t *box_sk, const sid_t *known_key, const sid_t *unknown_key)
+{
+  struct crypto_job *job = emalloc_zero(sizeof(struct crypto_job));
+  if (!job)
+    return NULL;
+  job->op = op;
+  job->known_key = *known_key;
+  job->unknown_key = *unknown_key;
+  const unsigned char *nm_bytes = keyring_find_nm_bytes(known_key, unknown_key);
+  if (nm_bytes){
+    bcopy(nm_bytes, job->nm_bytes, sizeof job->nm_bytes);
+    job->have_nm = 1;
+  }else
+    bcopy(box_sk, job->box_sk, sizeof job->box_sk);
+  return job;
+}
+
+void crypto_job_free(struct crypto_job *job)
+{
+  sodium_memzero(job, sizeof *job);
+  free(job);
+}
+
+void crypto_job_verify(struct crypto_job *job, const uint8_t *message, size_t len, const uint8_t *signature, const uint8_t *sign_pk)
+{
+  bzero(job, sizeof *job);
+  job->op = CRYPTO_JOB_SIGN_VERIFY;
+  job->input = message;
+  job->input_len = len;
+  job->signature = signature;
+  job->sign_pk = sign_pk;
+}
+
+void crypto_job_call(struct crypto_job *job, int (*function)(void *context), void *context)
+{
+  bzero(job, sizeof *job);
+  job->op = CRYPTO_JOB_CALL;
+  job->function = function;
+  job->context = context;
+}
+
+// called by a worker thread, or by the main thread if there are no workers
+static void crypto_job_run(struct crypto_job *job)
+{
+  if (job->op == CRYPTO_JOB_CALL){
+    job->result = job->function(job->context);
+    return;
+  }
+  if (job->op == CRYPTO_JOB_SIGN_VERIFY){
+    job->result = crypto_sign_verify_detached(job->signature, job->input, job->input_len, job->sign_pk);
+    return;
+  }
+  if (!job->have_nm){
+    if (crypto_box_beforenm(job->nm_bytes, job->unknown_key.binary, job->box_sk)){
+      job->result = -1;
+      return;
+    }
+    job->have_nm = 1;
+    job->_calculated_nm = 1;
+  }
+  switch (job->op){
+  case CRYPTO_JOB_BOX:
+    job->result = crypto_box_easy_afternm(job->output, job->input, job->input_len, job->nonce, job->nm_bytes);
+    break;
+  case CRYPTO_JOB_BOX_OPEN:
+    job->result = crypto_box_open_easy_afternm(job->output, job->input, job->input_len, job->nonce, job->nm_bytes);
+    break;
+  default:
+    job->result = -1;
+  }
+}
+
+static void crypto_job_complete(struct crypto_job *job)
+{
+  crypto_worker_stats.jobs++;
+  if (job->_calculated_nm){
+    crypto_worker_stats.calculated_nm++;
+    keyring_store_nm_bytes(&job->known_key, &job->unknown_key, job->nm_bytes);
+  }
+  job->done(job);
+}
+
+#ifdef HAVE_PTHREAD
+
+/* Jobs stay in one list, in the order they were submitted, until the main thread takes them back.
+ * Workers claim batches from next_claim onwards.  When the job at the head of the list is done, a
+ * byte is written to the pipe to wake up the main thread.
+ *
+ * While the main thread is waiting in crypto_jobs_run(), workers claim its jobs before any others,
+ * from sync_next onwards.
+ */
+static struct crypto_workers{
+  pthread_t threads[CRYPTO_WORKERS_MAX];
+  unsigned thread_count;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  struct crypto_job *head;
+  struct crypto_job *tail;
+  struct crypto_job *next_claim;
+  unsigned outstanding;
+  struct crypto_job *sync_jobs;
+  unsigned sync_next;
+  unsigned sync_count;
+  unsigned sync_outstanding;
+  int pipe[2];
+  uint8_t signalled;
+  uint8_t stop;
+  uint8_t failed;
+} workers = {.pipe = {-1, -1}};
+
+DEFINE_ALARM(crypto_workers_poll);
+
+// claim and run a batch of the synchronous jobs, called with the mutex held
+static void crypto_workers_run_sync()
+{
+  unsigned i, first = workers.sync_next;
+  unsigned n = workers.sync_count - first;
+  if (n > CRYPTO_SYNC_BATCH_SIZE)
+    n = CRYPTO_SYNC_BATCH_SIZE;
+  workers.sync_next += n;
+  struct crypto_job *jobs = workers.sync_jobs;
+  pthread_mutex_unlock(&workers.mutex);
+
+  for (i = 0; i < n; i++)
+    crypto_job_run(&jobs[first + i]);
+
+  pthread_mutex_lock(&workers.mutex);
+  crypto_worker_stats.batches++;
+  workers.sync_outstanding -= n;
+  pthread_cond_broadcast(&workers.cond);
+}
+
+static void *crypto_worker(void *UNUSED(context))
+{
+  pthread_mutex_lock(&workers.mutex);
+  while (1){
+    while (!workers.next_claim && workers.sync_next == workers.sync_count && !workers.stop)
+      pthread_cond_wait(&workers.cond, &workers.mutex);
+    if (workers.sync_next < workers.sync_count){
+      crypto_workers_run_sync();
+      continue;
+    }
+    struct crypto_job *batch = workers.next_claim;
+    if (!batch)
+      break;
+    unsigned i, n = 0;
+    struct crypto_job *job = batch;
+    while (job && n < CRYPTO_BATCH_SIZE){
+      job->_state = JOB_BUSY;
+      job = job->_next;
+      n++;
+    }
+    workers.next_claim = job;
+    pthread_mutex_unlock(&workers.mutex);
+
+    // the main thread may append to the last job of the batch, so count them, and never follow
+    // the _next link of the last one without holding the lock
+    for (i = 0, job = batch; ; job = job->_next){
+      crypto_job_run(job);
+      if (++i == n)
+	break;
+    }
+
+    pthread_mutex_lock(&workers.mutex);
+    crypto_worker_stats.batches++;
+    for (i = 0, job = batch; ; job = job->_next){
+      job->_state = JOB_DONE;
+      if (++i == n)
+	break;
+    }
+    workers.outstanding -= n;
+    if (!workers.signalled && workers.head->_state == JOB_DONE){
+      workers.signalled = 1;
+      if (write(workers.pipe[1], "", 1) == -1){
+	// the pipe can only be full if the main thread has already been woken
+      }
+    }
+    pthread_cond_broadcast(&workers.cond);
+  }
+  pthread_mutex_unlock(&workers.mutex);
+  return NULL;
+}
+
+/* Only the thread that called fork() carries on in the child process, so the child forgets the
+ * workers and any jobs that it inherited, and starts its own workers if it needs them.  The
+ * scheduler still watches the inherited pipe, but closing the child's copy of it leaves the
+ * parent's watch intact.
+ */
+static void crypto_workers_forked()
+{
+  pthread_mutex_init(&workers.mutex, NULL);
+  pthread_cond_init(&workers.cond, NULL);
+  workers.thread_count = 0;
+  workers.head = workers.tail = workers.next_claim = NULL;
+  workers.outstanding = 0;
+  workers.sync_jobs = NULL;
+  workers.sync_next = workers.sync_count = workers.sync_outstanding = 0;
+  workers.signalled = workers.stop = workers.failed = 0;
+  if (workers.pipe[0] != -1) {
+    close(workers.pipe[0]);
+    close(workers.pipe[1]);
+    workers.pipe[0] = workers.pipe[1] = -1;
+  }
+}
+
+static int crypto_workers_start()
+{
+  if (workers.thread_count)
+    return 1;
+  if (workers.failed || config.mdp.crypto_threads == 0)
+    return 0;
+  // don't try again if anything fails, the main thread can do the work itself
+  workers.failed = 1;
+  static uint8_t registered = 0;
+  if (!registered) {
+    int err = pthread_atfork(NULL, NULL, crypto_workers_forked);
+    if (err) {
+      WARNF("pthread_atfork: %s", strerror(err));
+      return 0;
+    }
+    registered = 1;
+  }
+  pthread_mutex_init(&workers.mutex, NULL);
+  pthread_cond_init(&workers.cond, NULL);
+  unsigned count = config.mdp.crypto_threads;
+  if (count > CRYPTO_WORKERS_MAX)
+    count = CRYPTO_WORKERS_MAX;
+  while (workers.thread_count < count){
+    int err = pthread_create(&workers.threads[workers.thread_count], NULL, crypto_worker, NULL);
+    if (err){
+      WARNF("pthread_create: %s", strerror(err));
+      break;
+    }
+    workers.thread_count++;
+  }
+  if (!workers.thread_count){
+    pthread_cond_destroy(&workers.cond);
+    pthread_mutex_destroy(&workers.mutex);
+    return 0;
+  }
+  workers.failed = 0;
+  DEBUGF(crypto, "Started %u crypto worker threads", workers.thread_count);
+  return 1;
+}
+
+/* Jobs submitted with crypto_job_submit() are completed through the scheduler, which watches a pipe
+ * for the workers to write to.  The pipe is only made when the first such job is submitted, as
+ * crypto_jobs_run() has no need of it.
+ */
+static int crypto_workers_watch()
+{
+  if (workers.pipe[0] != -1)
+    return 1;
+  int fds[2];
+  if (pipe(fds) == -1){
+    WHY_perror("pipe");
+    return 0;
+  }
+  if (set_nonblock(fds[0]) == -1 || set_nonblock(fds[1]) == -1){
+    close(fds[0]);
+    close(fds[1]);
+    return 0;
+  }
+  pthread_mutex_lock(&workers.mutex);
+  workers.pipe[0] = fds[0];
+  workers.pipe[1] = fds[1];
+  pthread_mutex_unlock(&workers.mutex);
+  ALARM_STRUCT(crypto_workers_poll).poll.fd = workers.pipe[0];
+  ALARM_STRUCT(crypto_workers_poll).poll.events = POLLIN;
+  if (!is_watching(&ALARM_STRUCT(crypto_workers_poll)))
+    watch(&ALARM_STRUCT(crypto_workers_poll));
+  return 1;
+}
+
+// take back every finished job from the head of the queue, and complete them
+static void crypto_workers_complete()
+{
+  pthread_mutex_lock(&workers.mutex);
+  struct crypto_job *done = NULL, *last = NULL;
+  while (workers.head && workers.head->_state == JOB_DONE){
+    if (!done)
+      done = workers.head;
+    last = workers.head;
+    workers.head = workers.head->_next;
+  }
+  if (!workers.head)
+    workers.tail = NULL;
+  if (last)
+    last->_next = NULL;
+  workers.signalled = 0;
+  pthread_mutex_unlock(&workers.mutex);
+
+  while (done){
+    struct crypto_job *job = done;
+    done = job->_next;
+    job->_next = NULL;
+    crypto_job_complete(job);
+  }
+}
+
+void crypto_workers_poll(struct sched_ent *alarm)
+{
+  if (alarm->poll.revents & POLLIN){
+    char buf[16];
+    while (read(alarm->poll.fd, buf, sizeof buf) > 0)
+      ;
+    crypto_workers_complete();
+  }
+}
+
+void crypto_job_submit(struct crypto_job *job)
+{
+  if (!crypto_workers_start() || !crypto_workers_watch()){
+    crypto_job_run(job);
+    crypto_job_complete(job);
+    return;
+  }
+  job->_state = JOB_QUEUED;
+  job->_next = NULL;
+  pthread_mutex_lock(&workers.mutex);
+  if (workers.tail)
+    workers.tail->_next = job;
+  else
+    workers.head = job;
+  workers.tail = job;
+  if (!workers.next_claim)
+    workers.next_claim = job;
+  workers.outstanding++;
+  pthread_cond_signal(&workers.cond);
+  pthread_mutex_unlock(&workers.mutex);
+}
+
+void crypto_jobs_run(struct crypto_job *jobs, unsigned count)
+{
+  if (count == 0)
+    return;
+  crypto_worker_stats.jobs += count;
+  if (!crypto_workers_start()){
+    unsigned i;
+    for (i = 0; i < count; i++)
+      crypto_job_run(&jobs[i]);
+    return;
+  }
+  pthread_mutex_lock(&workers.mutex);
+  assert(workers.sync_count == 0);
+  workers.sync_jobs = jobs;
+  workers.sync_next = 0;
+  workers.sync_count = workers.sync_outstanding = count;
+  pthread_cond_broadcast(&workers.cond);
+  // help the workers, then wait for them to finish
+  while (workers.sync_next < workers.sync_count)
+    crypto_workers_run_sync();
+  while (workers.sync_outstanding)
+    pthread_cond_wait(&workers.cond, &workers.mutex);
+  workers.sync_jobs = NULL;
+  workers.sync_next = workers.sync_count = 0;
+  pthread_mutex_unlock(&workers.mutex);
+}
+
+void crypto_workers_flush()
+{
+  if (!workers.thread_count)
+    return;
+  // completing a job may submit another one
+  pthread_mutex_lock(&workers.mutex);
+  while (workers.head){
+    while (workers.outstanding)
+      pthread_cond_wait(&workers.cond, &workers.mutex);
+    pthread_mutex_unlock(&workers.mutex);
+    crypto_workers_complete();
+    pthread_mutex_lock(&workers.mutex);
+  }
+  pthread_mutex_unlock(&workers.mutex);
+}
+
+static void crypto_workers_shutdown()
+{
+  if (workers.thread_count){
+    crypto_workers_flush();
+    pthread_mutex_lock(&workers.mutex);
+    workers.stop = 1;
+    pthread_cond_broadcast(&workers.cond);
+    pthread_mutex_unlock(&workers.mutex);
+    unsigned i;
+    for (i = 0; i < workers.thread_count; i++)
+      pthread_join(workers.threads[i], NULL);
+    workers.thread_count = 0;
+    workers.stop = 0;
+    pthread_cond_destroy(&workers.cond);
+    pthread_mutex_destroy(&workers.mutex);
+    if (workers.pipe[0] != -1){
+      unwatch(&ALARM_STRUCT(crypto_workers_poll));
+      close(workers.pipe[0]);
+      close(workers.pipe[1]);
+      workers.pipe[0] = workers.pipe[1] = -1;
+      ALARM_STRUCT(crypto_workers_poll).poll.fd = -1;
+    }
+  }
+  DEBUGF(crypto, "Crypto workers completed %u jobs in %u batches, calculated %u shared secrets",
+    crypto_worker_stats.jobs, crypto_worker_stats.batches, crypto_worker_stats.calculated_nm);
+  DEBUGF(crypto, "Shared secret cache %u hits, %u misses, %u evictions",
+    keyring_nm_stats.hits, keyring_nm_stats.misses, keyring_nm_stats.evictions);
+}
+
+#else // !HAVE_PTHREAD
+
+void crypto_job_submit(struct crypto_job *job)
+{
+  crypto_job_run(job);
+  crypto_job_complete(job);
+}
+
+void crypto_jobs_run(struct crypto_job *jobs, unsigned count)
+{
+  crypto_worker_stats.jobs += count;
+  unsigned i;
+  for (i = 0; i < count; i++)
+    crypto_job_run(&jobs[i]);
+}
+
+void crypto_workers_flush()
+{
+}
+
+static void crypto_workers_shutdown()
+{
+  DEBUGF(crypto, "Shared secret cache %u hits, %u misses, %u evictions",
+    keyring_nm_stats.hits, keyring_nm_stats.misses, keyring_nm_stats.evictions);
+}
+
+#endif // !HAVE_PTHREAD
+
+DEFINE_TRIGGER(shutdown, crypto_workers_shutdown);
@@ -0,0 +1,106 @@
+/*
+Serval DNA cryptography worker threads
+Copyright (C) 2026 Serval Project Inc.
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#ifndef __SERVAL_DNA__CRYPTO_WORKERS_H
+#define __SERVAL_DNA__CRYPTO_WORKERS_H
+
+#include <sodium.h>
+#include "serval_types.h"
+
+/* Authenticated encryption of MDP payloads is handed to a pool of worker threads (up to
+ * mdp.crypto_threads), so that the main thread can keep servicing the network while several calls
+ * and streams are busy.  Each worker takes a batch of queued jobs at a time.  Completed jobs are
+ * handed back to the main thread through the scheduler, and their completion functions are called
+ * in the order the jobs were submitted.
+ *
+ * If the keyring has not cached the shared secret for a job's pair of keys, the worker calculates
+ * it from our secret key, and it is added to the keyring's cache when the job completes.
+ *
+ * A worker only reads the input and writes the output of its job, so neither may be touched until
+ * the job completes.  Without any worker threads, a job is completed before crypto_job_submit()
+ * returns.
+ *
+ * crypto_jobs_run() is for callers that need the results straight away, like bulk verification of
+ * manifest signatures.  The jobs are shared between the workers and the calling thread, are not
+ * completed through the scheduler, and have no completion function.  A CRYPTO_JOB_CALL job runs
+ * any function that is safe to call from another thread, like trial decryption of a keyring slot.
+ */
+
+enum crypto_job_op{
+  CRYPTO_JOB_BOX,
+  CRYPTO_JOB_BOX_OPEN,
+  CRYPTO_JOB_SIGN_VERIFY,
+  CRYPTO_JOB_CALL
+};
+
+struct crypto_job;
+typedef void (*crypto_job_done)(struct crypto_job *job);
+
+struct crypto_job{
+  enum crypto_job_op op;
+  // our public key, and theirs
+  sid_t known_key;
+  sid_t unknown_key;
+  // the shared secret, or if we don't have it yet, our secret key to calculate it from
+  uint8_t have_nm;
+  uint8_t nm_bytes[crypto_box_BEFORENMBYTES];
+  uint8_t box_sk[crypto_box_SECRETKEYBYTES];
+  uint8_t nonce[crypto_box_NONCEBYTES];
+  // the output must have room for input_len + crypto_box_MACBYTES when boxing,
+  // or input_len - crypto_box_MACBYTES when opening
+  const uint8_t *input;
+  size_t input_len;
+  uint8_t *output;
+  // the detached signature of the input, and the key that signed it
+  const uint8_t *signature;
+  const uint8_t *sign_pk;
+  // the function to call with the context, it must not log or touch the scheduler
+  int (*function)(void *context);
+  // zero if the operation succeeded
+  int result;
+  crypto_job_done done;
+  void *context;
+
+  uint8_t _calculated_nm;
+  uint8_t _state;
+  struct crypto_job *_next;
+};
+
+struct crypto_worker_stats{
+  unsigned jobs;
+  unsigned batches;
+  unsigned calculated_nm;
+};
+extern struct crypto_worker_stats crypto_worker_stats;
+
+struct crypto_job *crypto_job_new(enum crypto_job_op op, const uint8_t *box_sk, const sid_t *known_key, const sid_t *unknown_key);
+void crypto_job_submit(struct crypto_job *job);
+void crypto_job_free(struct crypto_job *job);
+
+// fill in a job to check the signature of a message, the caller owns all of the memory
+void crypto_job_verify(struct crypto_job *job, const uint8_t *message, size_t len, const uint8_t *signature, const uint8_t *sign_pk);
+// fill in a job to call a function with a context, the caller owns the context
+void crypto_job_call(struct crypto_job *job, int (*function)(void *context), void *context);
+// run every job, and return once they have all finished
+void crypto_jobs_run(struct crypto_job *jobs, unsigned count);
+
+// wait for every submitted job, and call their completion functions
+void crypto_workers_flush();
+
+#endif
@@ -149,33 +149,33 @@ static char *reply_bufend = NULL;
 static void
 dna_helper_close_pipes()
 {
+  if (sched_requests.poll.fd != -1) {
+    unwatch(&sched_requests);
+    sched_requests.poll.fd = -1;
+  }
   if (dna_helper_stdin != -1) {
     DEBUGF(dnahelper, "DNAHELPER closing stdin pipe fd=%d", dna_helper_stdin);
     close(dna_helper_stdin);
     dna_helper_stdin = -1;
   }
-  if (sched_requests.poll.fd != -1) {
-    unwatch(&sched_requests);
-    sched_requests.poll.fd = -1;
+  if (sched_replies.poll.fd != -1) {
+    unwatch(&sched_replies);
+    sched_replies.poll.fd = -1;
   }
   if (dna_helper_stdout != -1) {
     DEBUGF(dnahelper, "DNAHELPER closing stdout pipe fd=%d", dna_helper_stdout);
     close(dna_helper_stdout);
     dna_helper_stdout = -1;
   }
-  if (sched_replies.poll.fd != -1) {
-    unwatch(&sched_replies);
-    sched_replies.poll.fd = -1;
+  if (sched_errors.poll.fd != -1) {
+    unwatch(&sched_errors);
+    sched_errors.poll.fd = -1;
   }
   if (dna_helper_stderr != -1) {
     DEBUGF(dnahelper, "DNAHELPER closing stderr pipe fd=%d", dna_helper_stderr);
     close(dna_helper_stderr);
     dna_helper_stderr = -1;
   }
-  if (sched_errors.poll.fd != -1) {
-    unwatch(&sched_errors);
-    sched_errors.poll.fd = -1;
-  }
 }
 
 int
@@ -353,9 +353,9 @@ static void monitor_requests(struct sched_ent *alarm)
   // case it is still open.  See issue #5.
   if (sched_requests.poll.revents & (POLLHUP | POLLERR | POLLNVAL)) {
     DEBUGF(dnahelper, "DNAHELPER closing stdin fd=%d", dna_helper_stdin);
+    unwatch(&sched_requests);
     close(dna_helper_stdin);
     dna_helper_stdin = -1;
-    unwatch(&sched_requests);
     sched_requests.poll.fd = -1;
     dna_helper_kill();
   }
@@ -498,17 +498,17 @@ static void monitor_replies(struct sched_ent *alarm)
 	discarding_until_nl = 1;
       }
     } else if(nread==0 || nread==-1){
+      unwatch(&sched_replies);
       close(dna_helper_stdout);
       dna_helper_stdout = -1;
-      unwatch(&sched_replies);
       sched_replies.poll.fd = -1;
     }
   }
   if (sched_replies.poll.revents & (POLLHUP | POLLERR | POLLNVAL)) {
     DEBUGF(dnahelper, "DNAHELPER closing stdout fd=%d", dna_helper_stdout);
+    unwatch(&sched_replies);
     close(dna_helper_stdout);
     dna_helper_stdout = -1;
-    unwatch(&sched_replies);
     sched_replies.poll.fd = -1;
     dna_helper_kill();
   }
@@ -527,17 +527,17 @@ static void monitor_errors(struct sched_ent *alarm)
     if (nread > 0)
       WHYF("DNAHELPER stderr %s", alloca_toprint(-1, buffer, nread));
     if (nread==0 || nread==-1){
+      unwatch(&sched_errors);
       close(dna_helper_stderr);
       dna_helper_stderr = -1;
-      unwatch(&sched_errors);
       sched_errors.poll.fd = -1;
     }
   }
   if (sched_errors.poll.revents & (POLLHUP | POLLERR | POLLNVAL)) {
     DEBUGF(dnahelper, "DNAHELPER closing stderr fd=%d", dna_helper_stderr);
+    unwatch(&sched_errors);
     close(dna_helper_stderr);
     dna_helper_stderr = -1;
-    unwatch(&sched_errors);
     sched_errors.poll.fd = -1;
   }
 }
@@ -48,25 +48,198 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 
 #include <inttypes.h> // for PRIu64
 #include "fdqueue.h"
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
 #include "conf.h"
 #include "net.h"
 #include "str.h"
+#include "mem.h"
 #include "strbuf.h"
 #include "strbuf_helpers.h"
 
-#define MAX_WATCHED_FDS 128
+#define MAX_WATCHED_FDS 1024
 __thread struct pollfd fds[MAX_WATCHED_FDS];
 __thread int fdcount=0;
 __thread struct sched_ent *fd_callbacks[MAX_WATCHED_FDS];
 
-__thread struct sched_ent *wake_list=NULL;
-__thread struct sched_ent *run_soon=NULL;
-__thread struct sched_ent *run_now=NULL;
+/* Scheduled alarms are kept in pairing heaps, so that schedule() and unschedule() cost O(log n)
+ * amortised instead of O(n).  Each heap is ordered by one of the alarm's times, with ties broken
+ * by the order in which the alarms were scheduled.  An alarm is in either the run_soon heap or the
+ * run_now heap (sharing the same links), and also in the wake_list heap while it is in run_soon,
+ * unless it never needs to wake the CPU.
+ */
+struct sched_heap {
+  struct sched_ent *root;
+  size_t node_offset;
+  size_t time_offset;
+};
+
+#define SCHED_HEAP(NODE, TIME) { \
+    .root = NULL, \
+    .node_offset = offsetof(struct sched_ent, NODE), \
+    .time_offset = offsetof(struct sched_ent, TIME), \
+  }
+
+__thread struct sched_heap wake_list = SCHED_HEAP(_wake, wake_at);
+__thread struct sched_heap run_soon = SCHED_HEAP(_run, run_after);
+__thread struct sched_heap run_now = SCHED_HEAP(_run, run_before);
+__thread uint32_t sched_sequence = 0;
+
+// values of sched_ent._scheduled
+#define SCHED_RUN_SOON 1
+#define SCHED_RUN_NOW 2
+
+// Watched alarms that are ready for IO.  The backend collects all of them before any are called,
+// so _unwatch() must remove an alarm from this list in case an earlier callback unwatches (and
+// frees) it.
+struct fd_ready {
+  struct sched_ent *alarm;
+  short revents;
+};
+__thread struct fd_ready fd_ready[MAX_WATCHED_FDS];
+__thread int fd_ready_count=0;
+
+// The fds[] and fd_callbacks[] arrays are always kept up to date, regardless of the backend, so
+// that a backend can be (re)opened at any time by registering everything in them.
+struct fd_backend {
+  const char *name;
+  int (*open)();
+  void (*close)();
+  int (*add)(struct sched_ent *alarm);
+  int (*modify)(struct sched_ent *alarm);
+  void (*remove)(struct sched_ent *alarm, int fd);
+  // wait for IO, fill fd_ready[] and return the number of ready alarms, or -1 on error
+  int (*wait)(int timeout_ms);
+};
+extern __thread struct fd_backend *fd_backend;
 
 struct profile_total poll_stats={NULL,0,"Idle (in poll)",0,0,0,0};
 
 #define alloca_alarm_name(alarm) ((alarm)->stats ? alloca_str_toprint((alarm)->stats->name) : "Unnamed")
 
+static inline struct sched_heap_node *heap_node(const struct sched_heap *heap, struct sched_ent *alarm)
+{
+  return (struct sched_heap_node *)((char *)alarm + heap->node_offset);
+}
+
+static inline time_ms_t heap_time(const struct sched_heap *heap, const struct sched_ent *alarm)
+{
+  return *(const time_ms_t *)((const char *)alarm + heap->time_offset);
+}
+
+static int heap_before(const struct sched_heap *heap, const struct sched_ent *a, const struct sched_ent *b)
+{
+  time_ms_t ta = heap_time(heap, a);
+  time_ms_t tb = heap_time(heap, b);
+  if (ta != tb)
+    return ta < tb;
+  return (int32_t)(a->_sequence - b->_sequence) < 0;
+}
+
+// join two heaps by making the later root the first child of the earlier root
+static struct sched_ent *heap_meld(const struct sched_heap *heap, struct sched_ent *a, struct sched_ent *b)
+{
+  if (!a)
+    return b;
+  if (!b)
+    return a;
+  if (heap_before(heap, b, a)){
+    struct sched_ent *t = a;
+    a = b;
+    b = t;
+  }
+  struct sched_heap_node *na = heap_node(heap, a);
+  struct sched_heap_node *nb = heap_node(heap, b);
+  nb->prev = a;
+  nb->next = na->child;
+  if (na->child)
+    heap_node(heap, na->child)->prev = b;
+  na->child = b;
+  return a;
+}
+
+// combine a list of siblings into a single heap, melding pairs left to right, then the results
+// right to left
+static struct sched_ent *heap_merge_pairs(const struct sched_heap *heap, struct sched_ent *first)
+{
+  struct sched_ent *pairs = NULL;
+  while (first){
+    struct sched_ent *a = first;
+    struct sched_heap_node *na = heap_node(heap, a);
+    struct sched_ent *b = na->next;
+    na->next = na->prev = NULL;
+    if (b){
+      struct sched_heap_node *nb = heap_node(heap, b);
+      first = nb->next;
+      nb->next = nb->prev = NULL;
+    }else
+      first = NULL;
+    a = heap_meld(heap, a, b);
+    heap_node(heap, a)->next = pairs;
+    pairs = a;
+  }
+  struct sched_ent *root = NULL;
+  while (pairs){
+    struct sched_ent *a = pairs;
+    pairs = heap_node(heap, a)->next;
+    heap_node(heap, a)->next = NULL;
+    root = heap_meld(heap, root, a);
+  }
+  return root;
+}
+
+static void heap_insert(struct sched_heap *heap, struct sched_ent *alarm)
+{
+  struct sched_heap_node *n = heap_node(heap, alarm);
+  n->child = n->next = n->prev = NULL;
+  heap->root = heap_meld(heap, heap->root, alarm);
+}
+
+static int heap_contains(struct sched_heap *heap, struct sched_ent *alarm)
+{
+  return heap->root == alarm || heap_node(heap, alarm)->prev;
+}
+
+static void heap_remove(struct sched_heap *heap, struct sched_ent *alarm)
+{
+  struct sched_heap_node *n = heap_node(heap, alarm);
+  struct sched_ent *children = heap_merge_pairs(heap, n->child);
+  if (heap->root == alarm){
+    heap->root = children;
+  }else{
+    struct sched_heap_node *prev = heap_node(heap, n->prev);
+    if (prev->child == alarm)
+      prev->child = n->next;
+    else
+      prev->next = n->next;
+    if (n->next)
+      heap_node(heap, n->next)->prev = n->prev;
+    heap->root = heap_meld(heap, heap->root, children);
+  }
+  n->child = n->next = n->prev = NULL;
+}
+
+// visit every alarm in a heap, in no particular order
+static struct sched_ent *heap_walk_next(const struct sched_heap *heap, struct sched_ent *alarm)
+{
+  struct sched_heap_node *n = heap_node(heap, alarm);
+  if (n->child)
+    return n->child;
+  while (alarm){
+    n = heap_node(heap, alarm);
+    if (n->next)
+      return n->next;
+    // climb back through the earlier siblings to the parent
+    while (n->prev && heap_node(heap, n->prev)->child != alarm){
+      alarm = n->prev;
+      n = heap_node(heap, alarm);
+    }
+    alarm = n->prev;
+  }
+  return NULL;
+}
+
 int list_alarms(int log_level)
 {
   int count=0;
@@ -74,19 +247,19 @@ int list_alarms(int log_level)
   struct sched_ent *alarm;
   
   LOGF(log_level, "Run now;");
-  for (alarm = run_now; alarm; alarm=alarm->_next_run){
+  for (alarm = run_now.root; alarm; alarm = heap_walk_next(&run_now, alarm)){
     count ++;
     LOGF(log_level, "%p %s deadline in %"PRId64"ms", alarm->function, alloca_alarm_name(alarm), alarm->run_before - now);
   }
     
   LOGF(log_level, "Run soon;");
-  for (alarm = run_soon; alarm; alarm=alarm->_next_run){
+  for (alarm = run_soon.root; alarm; alarm = heap_walk_next(&run_soon, alarm)){
     count ++;
     LOGF(log_level, "%p %s run in %"PRId64"ms", alarm->function, alloca_alarm_name(alarm), alarm->run_after - now);
   }
 
   LOGF(log_level, "Wake at;");
-  for (alarm = wake_list; alarm; alarm = alarm->_next_wake){
+  for (alarm = wake_list.root; alarm; alarm = heap_walk_next(&wake_list, alarm)){
     count ++;
     LOGF(log_level, "%p %s wake in %"PRId64"ms", alarm->function, alloca_alarm_name(alarm), alarm->wake_at - now);
   }
@@ -101,93 +274,29 @@ int list_alarms(int log_level)
   return count;
 }
 
-static void insert_run_now(struct sched_ent *alarm)
-{
-  struct sched_ent **list = &run_now;
-  
-  while(*list){
-    if ((*list)->run_before > alarm->run_before)
-      break;
-    list = &(*list)->_next_run;
-  }
-  alarm->_next_run = *list;
-  *list = alarm;
-}
-
-static void insert_run_soon(struct sched_ent *alarm)
-{
-  struct sched_ent **list = &run_soon;
-  
-  while(*list){
-    if ((*list)->run_after > alarm->run_after)
-      break;
-    list = &(*list)->_next_run;
-  }
-  alarm->_next_run = *list;
-  *list = alarm;
-}
-
-static void remove_run_list(struct sched_ent *alarm, struct sched_ent **list)
-{
-  while(*list){
-    if (*list==alarm){
-      *list = alarm->_next_run;
-      list = &alarm->_next_run;
-      alarm->_next_run=NULL;
-      return;
-    }else{
-      list = &(*list)->_next_run;
-    }
-  }
-}
-
-static void insert_wake_list(struct sched_ent *alarm)
-{
-  if (alarm->wake_at == TIME_MS_NEVER_WILL)
-    return;
-  struct sched_ent **list = &wake_list, *last = NULL;
-  while(*list){
-    if ((*list)->wake_at > alarm->wake_at)
-      break;
-    last = (*list);
-    list = &last->_next_wake;
-  }
-  alarm->_next_wake = *list;
-  if (*list)
-    (*list)->_prev_wake = alarm;
-  alarm->_prev_wake = last;
-  *list = alarm;
-}
-
-static void remove_wake_list(struct sched_ent *alarm)
-{
-  struct sched_ent *prev = alarm->_prev_wake;
-  struct sched_ent *next = alarm->_next_wake;
-  
-  if (prev)
-    prev->_next_wake = next;
-  else if(wake_list==alarm)
-    wake_list = next;
-    
-  if (next)
-    next->_prev_wake = prev;
-  
-  alarm->_prev_wake = NULL;
-  alarm->_next_wake = NULL;
-}
-
 // move alarms from run_soon to run_now
 static void move_run_list(){
   time_ms_t now = gettime_ms();
-  while(run_soon && run_soon->run_after <= now){
-    struct sched_ent *alarm = run_soon;
-    run_soon = run_soon->_next_run;
-    remove_wake_list(alarm);
-    insert_run_now(alarm);
+  while(run_soon.root && run_soon.root->run_after <= now){
+    struct sched_ent *alarm = run_soon.root;
+    heap_remove(&run_soon, alarm);
+    if (heap_contains(&wake_list, alarm))
+      heap_remove(&wake_list, alarm);
+    heap_insert(&run_now, alarm);
+    alarm->_scheduled = SCHED_RUN_NOW;
     DEBUGF(io, "Moved %s from run_soon to run_now", alloca_alarm_name(alarm));
   }
 }
 
+// remove the most urgent alarm from run_now, so that it can be called
+static struct sched_ent *next_run_now(){
+  struct sched_ent *alarm = run_now.root;
+  heap_remove(&run_now, alarm);
+  alarm->_scheduled=0;
+  alarm->run_after = TIME_MS_NEVER_WILL;
+  return alarm;
+}
+
 // add an alarm to the list of scheduled function calls.
 // simply populate .alarm with the absolute time, and .function with the method to call.
 // on calling .poll.revents will be zero.
@@ -222,9 +331,11 @@ void _schedule(struct __sourceloc __whence, struct sched_ent *alarm)
   // don't bother to schedule an alarm that will (by definition) never run
   // not an error as it simplifies calling API use
   if (alarm->run_after != TIME_MS_NEVER_WILL){
-    insert_wake_list(alarm);
-    insert_run_soon(alarm);
-    alarm->_scheduled=1;
+    alarm->_sequence = sched_sequence++;
+    if (alarm->wake_at != TIME_MS_NEVER_WILL)
+      heap_insert(&wake_list, alarm);
+    heap_insert(&run_soon, alarm);
+    alarm->_scheduled=SCHED_RUN_SOON;
   }
 }
 
@@ -237,13 +348,320 @@ void _unschedule(struct __sourceloc __whence, struct sched_ent *alarm)
     
   DEBUGF(io, "unschedule(alarm=%s)", alloca_alarm_name(alarm));
 
-  remove_run_list(alarm, &run_now);
-  remove_run_list(alarm, &run_soon);
-  remove_wake_list(alarm);
+  if (alarm->_scheduled == SCHED_RUN_NOW)
+    heap_remove(&run_now, alarm);
+  else
+    heap_remove(&run_soon, alarm);
+  if (heap_contains(&wake_list, alarm))
+    heap_remove(&wake_list, alarm);
   alarm->_scheduled=0;
   alarm->run_after = TIME_MS_NEVER_WILL;
 }
 
+static int poll_wait(int timeout_ms)
+{
+  int r = poll(fds, fdcount, timeout_ms);
+  if (r==-1 && errno!=EINTR)
+    WHY_perror("poll");
+
+  if (IF_DEBUG(io)) {
+    strbuf b = strbuf_alloca(1024);
+    int i;
+    for (i = 0; i < fdcount; ++i) {
+      if (i)
+	strbuf_puts(b, ", ");
+      strbuf_sprintf(b, "%d:", fds[i].fd);
+      strbuf_append_poll_events(b, fds[i].events);
+      strbuf_puts(b, "->");
+      strbuf_append_poll_events(b, fds[i].revents);
+    }
+    DEBUGF(io, "poll(fds=(%s), fdcount=%d, ms=%d) -> %d", strbuf_str(b), fdcount, timeout_ms, r);
+  }
+
+  fd_ready_count = 0;
+  if (r>0){
+    int i;
+    for(i=fdcount -1;i>=0;i--){
+      if (fd_callbacks[i] && fd_callbacks[i]->poll.fd == fds[i].fd && fds[i].revents) {
+	fd_ready[fd_ready_count].alarm = fd_callbacks[i];
+	fd_ready[fd_ready_count].revents = fds[i].revents;
+	fd_ready_count++;
+      }
+    }
+  }
+  return r==-1 ? -1 : fd_ready_count;
+}
+
+static struct fd_backend poll_backend = {
+  .name = "poll",
+  .wait = poll_wait,
+};
+
+#ifdef HAVE_SYS_EPOLL_H
+
+/* Level-triggered, not edge-triggered, because many callbacks deliberately read only one packet
+ * per call and rely on being called again while there is more to read.
+ *
+ * epoll(7) only allows each file descriptor to be registered once, but more than one alarm may
+ * watch the same file descriptor (eg, one for POLLIN and another for POLLOUT), so the alarms
+ * watching each file descriptor are chained together, and the descriptor is registered for the
+ * union of their events.  On Linux, the EPOLL* event bits have the same values as their POLL*
+ * counterparts.
+ */
+
+struct fd_watchers {
+  struct sched_ent *alarms;
+  // regular files cannot be added to an epoll set, but poll(2) always reports them as ready
+  uint8_t unpollable;
+};
+
+__thread int epoll_fd=-1;
+__thread pid_t epoll_pid=0;
+__thread struct fd_watchers *epoll_watchers=NULL;
+__thread int epoll_watchers_size=0;
+__thread int epoll_unpollable_count=0;
+
+static int epoll_register(struct sched_ent *alarm);
+static struct fd_backend epoll_backend;
+
+static void epoll_close()
+{
+  if (epoll_fd!=-1)
+    close(epoll_fd);
+  epoll_fd=-1;
+  if (epoll_watchers)
+    free(epoll_watchers);
+  epoll_watchers=NULL;
+  epoll_watchers_size=0;
+  epoll_unpollable_count=0;
+}
+
+static int epoll_open()
+{
+  if (epoll_fd!=-1 && epoll_pid==getpid())
+    return 0;
+  // a forked child must not share its parent's epoll instance
+  epoll_close();
+  if ((epoll_fd = epoll_create1(EPOLL_CLOEXEC))==-1)
+    return WHY_perror("epoll_create1");
+  epoll_pid = getpid();
+  int i;
+  for (i = 0; i < fdcount; ++i)
+    if (epoll_register(fd_callbacks[i])==-1)
+      return -1;
+  return 0;
+}
+
+static int epoll_sync(int fd, int op)
+{
+  struct fd_watchers *w = &epoll_watchers[fd];
+  if (w->unpollable)
+    return 0;
+  struct epoll_event ev = {.events = 0, .data.fd = fd};
+  struct sched_ent *alarm;
+  for (alarm = w->alarms; alarm; alarm = alarm->_next_fd_watch)
+    ev.events |= alarm->poll.events;
+  if (epoll_ctl(epoll_fd, op, fd, &ev)==-1){
+    if (op==EPOLL_CTL_ADD && errno==EPERM){
+      DEBUGF(io, "#%d does not support epoll, treating it as always ready", fd);
+      w->unpollable = 1;
+      epoll_unpollable_count++;
+      return 0;
+    }
+    return WHYF_perror("epoll_ctl(%d, %s, %d, %s)", epoll_fd,
+	op==EPOLL_CTL_ADD?"EPOLL_CTL_ADD":"EPOLL_CTL_MOD", fd, alloca_poll_events(ev.events));
+  }
+  return 0;
+}
+
+static int epoll_register(struct sched_ent *alarm)
+{
+  int fd = alarm->poll.fd;
+  // like poll(2), ignore negative file descriptors
+  if (fd<0)
+    return 0;
+  if (fd>=epoll_watchers_size){
+    int size = epoll_watchers_size ? epoll_watchers_size : 64;
+    while(size<=fd)
+      size*=2;
+    struct fd_watchers *w = erealloc(epoll_watchers, size * sizeof(struct fd_watchers));
+    if (!w)
+      return -1;
+    bzero(&w[epoll_watchers_size], (size - epoll_watchers_size) * sizeof(struct fd_watchers));
+    epoll_watchers = w;
+    epoll_watchers_size = size;
+  }
+  struct fd_watchers *w = &epoll_watchers[fd];
+  int op = w->alarms ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+  alarm->_next_fd_watch = w->alarms;
+  w->alarms = alarm;
+  if (epoll_sync(fd, op)==-1){
+    w->alarms = alarm->_next_fd_watch;
+    alarm->_next_fd_watch = NULL;
+    return -1;
+  }
+  return 0;
+}
+
+// Returns 1 if the epoll instance was already open.  Otherwise opens it, which registers every
+// watched alarm, or falls back to poll(2) if that fails, and returns 0.
+static int epoll_check()
+{
+  if (epoll_fd!=-1 && epoll_pid==getpid())
+    return 1;
+  if (epoll_open()==-1){
+    WARN("Falling back to poll()");
+    epoll_close();
+    fd_backend = &poll_backend;
+  }
+  return 0;
+}
+
+static int epoll_add(struct sched_ent *alarm)
+{
+  if (!epoll_check())
+    return 0;
+  return epoll_register(alarm);
+}
+
+static int epoll_modify(struct sched_ent *alarm)
+{
+  if (!epoll_check() || alarm->poll.fd<0)
+    return 0;
+  return epoll_sync(alarm->poll.fd, EPOLL_CTL_MOD);
+}
+
+static void epoll_remove(struct sched_ent *alarm, int fd)
+{
+  if (!epoll_check())
+    return;
+  if (fd<0 || fd>=epoll_watchers_size)
+    return;
+  struct fd_watchers *w = &epoll_watchers[fd];
+  struct sched_ent **list = &w->alarms;
+  while(*list && *list!=alarm)
+    list = &(*list)->_next_fd_watch;
+  if (!*list)
+    return;
+  *list = alarm->_next_fd_watch;
+  alarm->_next_fd_watch = NULL;
+  if (w->unpollable){
+    if (!w->alarms){
+      w->unpollable = 0;
+      epoll_unpollable_count--;
+    }
+  }else if (w->alarms){
+    epoll_sync(fd, EPOLL_CTL_MOD);
+  }else if (epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL)==-1 && errno!=EBADF && errno!=ENOENT){
+    WHYF_perror("epoll_ctl(%d, EPOLL_CTL_DEL, %d)", epoll_fd, fd);
+  }
+}
+
+static void push_ready(struct sched_ent *alarm, short revents)
+{
+  // poll(2) always reports these, whether they were requested or not
+  revents &= alarm->poll.events | POLLERR | POLLHUP | POLLNVAL;
+  if (revents){
+    fd_ready[fd_ready_count].alarm = alarm;
+    fd_ready[fd_ready_count].revents = revents;
+    fd_ready_count++;
+  }
+}
+
+static int epoll_wait_ready(int timeout_ms)
+{
+  epoll_check();
+  if (fd_backend != &epoll_backend)
+    return poll_wait(timeout_ms);
+  if (epoll_unpollable_count)
+    timeout_ms = 0;
+
+  struct epoll_event events[MAX_WATCHED_FDS];
+  int r = epoll_wait(epoll_fd, events, MAX_WATCHED_FDS, timeout_ms);
+  if (r==-1){
+    if (errno!=EINTR)
+      WHY_perror("epoll_wait");
+    return -1;
+  }
+
+  fd_ready_count = 0;
+  int i;
+  for (i = 0; i < r; ++i){
+    int fd = events[i].data.fd;
+    if (fd<0 || fd>=epoll_watchers_size)
+      continue;
+    struct sched_ent *alarm;
+    for (alarm = epoll_watchers[fd].alarms; alarm; alarm = alarm->_next_fd_watch)
+      push_ready(alarm, events[i].events);
+  }
+  if (epoll_unpollable_count){
+    for (i = fdcount - 1; i >= 0; --i){
+      int fd = fds[i].fd;
+      if (fd>=0 && fd<epoll_watchers_size && epoll_watchers[fd].unpollable)
+	push_ready(fd_callbacks[i], POLLIN | POLLOUT);
+    }
+  }
+
+  if (IF_DEBUG(io)) {
+    strbuf b = strbuf_alloca(1024);
+    for (i = 0; i < fd_ready_count; ++i) {
+      if (i)
+	strbuf_puts(b, ", ");
+      strbuf_sprintf(b, "%d:", fd_ready[i].alarm->poll.fd);
+      strbuf_append_poll_events(b, fd_ready[i].revents);
+    }
+    DEBUGF(io, "epoll_wait(fdcount=%d, ms=%d) -> %d (%s)", fdcount, timeout_ms, r, strbuf_str(b));
+  }
+  return fd_ready_count;
+}
+
+static struct fd_backend epoll_backend = {
+  .name = "epoll",
+  .open = epoll_open,
+  .close = epoll_close,
+  .add = epoll_add,
+  .modify = epoll_modify,
+  .remove = epoll_remove,
+  .wait = epoll_wait_ready,
+};
+
+__thread struct fd_backend *fd_backend = &epoll_backend;
+#else
+__thread struct fd_backend *fd_backend = &poll_backend;
+#endif
+
+const char *fd_backend_name()
+{
+  return fd_backend->name;
+}
+
+// switch to another event backend, eg, to compare their performance
+int fd_select_backend(const char *name)
+{
+  struct fd_backend *backend = NULL;
+  if (strcmp(name, poll_backend.name)==0)
+    backend = &poll_backend;
+#ifdef HAVE_SYS_EPOLL_H
+  else if (strcmp(name, epoll_backend.name)==0)
+    backend = &epoll_backend;
+#endif
+  if (!backend)
+    return WHYF("Unsupported event backend %s", alloca_str_toprint(name));
+  if (backend == fd_backend)
+    return 0;
+  if (fd_backend->close)
+    fd_backend->close();
+  fd_backend = &poll_backend;
+  if (backend->open && backend->open()==-1){
+    if (backend->close)
+      backend->close();
+    return WHYF("Failed to open event backend %s", backend->name);
+  }
+  fd_backend = backend;
+  DEBUGF(io, "Using %s event backend", fd_backend->name);
+  return 0;
+}
+
 // start watching a file handle, call this function again if you wish to change the event mask
 int _watch(struct __sourceloc __whence, struct sched_ent *alarm)
 {
@@ -259,6 +677,15 @@ int _watch(struct __sourceloc __whence, struct sched_ent *alarm)
   if (alarm->_poll_index>=0 && fd_callbacks[alarm->_poll_index]==alarm){
     // updating event flags
     DEBUGF(io, "Updating watch %s, #%d for %s", alloca_alarm_name(alarm), alarm->poll.fd, alloca_poll_events(alarm->poll.events));
+    int old_fd = fds[alarm->_poll_index].fd;
+    fds[alarm->_poll_index]=alarm->poll;
+    if (old_fd != alarm->poll.fd){
+      if (fd_backend->remove)
+	fd_backend->remove(alarm, old_fd);
+      if (fd_backend->add)
+	return fd_backend->add(alarm);
+    }else if (fd_backend->modify)
+      return fd_backend->modify(alarm);
   }else{
     DEBUGF(io, "Adding watch %s, #%d for %s", alloca_alarm_name(alarm), alarm->poll.fd, alloca_poll_events(alarm->poll.events));
     if (fdcount>=MAX_WATCHED_FDS)
@@ -268,8 +695,15 @@ int _watch(struct __sourceloc __whence, struct sched_ent *alarm)
     alarm->poll.revents = 0;
     alarm->_poll_index=fdcount;
     fdcount++;
+    fds[alarm->_poll_index]=alarm->poll;
+    if (fd_backend->add && fd_backend->add(alarm)==-1){
+      fdcount--;
+      fds[fdcount].fd=-1;
+      fd_callbacks[fdcount]=NULL;
+      alarm->_poll_index=-1;
+      return -1;
+    }
   }
-  fds[alarm->_poll_index]=alarm->poll;
   return 0;
 }
 
@@ -299,6 +733,13 @@ int _unwatch(struct __sourceloc __whence, struct sched_ent *alarm)
   fds[fdcount].fd=-1;
   fd_callbacks[fdcount]=NULL;
   alarm->_poll_index=-1;
+  if (fd_backend->remove)
+    fd_backend->remove(alarm, alarm->poll.fd);
+  // don't call this alarm if it was ready, but has not been called yet
+  int i;
+  for (i = 0; i < fd_ready_count; ++i)
+    if (fd_ready[i].alarm == alarm)
+      fd_ready[i].alarm = NULL;
   DEBUGF(io, "%s stopped watching #%d for %s", alloca_alarm_name(alarm), alarm->poll.fd, alloca_poll_events(alarm->poll.events));
   return 0;
 }
@@ -340,32 +781,28 @@ int fd_poll2(time_ms_t (*waiting)(time_ms_t, time_ms_t, time_ms_t), void (*wokeu
   IN();
   
   // clear the run now list of any alarms that are overdue
-  if (run_now && run_now->run_before <= gettime_ms()){
-    struct sched_ent *alarm = run_now;
-    run_now = alarm->_next_run;
-    alarm->_scheduled=0;
-    alarm->run_after = TIME_MS_NEVER_WILL;
-    call_alarm(alarm, 0);
+  if (run_now.root && run_now.root->run_before <= gettime_ms()){
+    call_alarm(next_run_now(), 0);
     RETURN(1);
   }
   
   // return 0 when there's nothing to do, it doesn't make sense to wait for infinity
-  if (!run_now && !wake_list && fdcount==0)
+  if (!run_now.root && !wake_list.root && fdcount==0)
     RETURN(0);
   
   time_ms_t now = gettime_ms();
   time_ms_t wait_until=TIME_MS_NEVER_WILL;
   uint8_t called_waiting = 0;
   
-  if (run_now){
+  if (run_now.root){
     wait_until = now;
   }else{
     time_ms_t next_run=TIME_MS_NEVER_WILL;
-    if(run_soon)
-      next_run = run_soon->run_after;
+    if(run_soon.root)
+      next_run = run_soon.root->run_after;
     
-    if (wake_list)
-      wait_until = wake_list->wake_at;
+    if (wake_list.root)
+      wait_until = wake_list.root->wake_at;
       
     if (waiting && wait_until > now){
       wait_until = waiting(now, next_run, wait_until);
@@ -390,29 +827,12 @@ int fd_poll2(time_ms_t (*waiting)(time_ms_t, time_ms_t, time_ms_t), void (*wokeu
       wait = wait_until - now;
     
     if (fdcount){
-      DEBUGF(io, "Calling poll with %dms wait", wait);
+      DEBUGF(io, "Calling %s with %dms wait", fd_backend->name, wait);
 	
       fd_func_enter(__HERE__, &call_stats);
-      r = poll(fds, fdcount, wait);
+      r = fd_backend->wait(wait);
       fd_func_exit(__HERE__, &call_stats);
       
-      if (r==-1 && errno!=EINTR)
-	WHY_perror("poll");
-      
-      if (IF_DEBUG(io)) {
-	strbuf b = strbuf_alloca(1024);
-	int i;
-	for (i = 0; i < fdcount; ++i) {
-	  if (i)
-	    strbuf_puts(b, ", ");
-	  strbuf_sprintf(b, "%d:", fds[i].fd);
-	  strbuf_append_poll_events(b, fds[i].events);
-	  strbuf_puts(b, "->");
-	  strbuf_append_poll_events(b, fds[i].revents);
-	}
-	DEBUGF(io, "poll(fds=(%s), fdcount=%d, ms=%d) -> %d", strbuf_str(b), fdcount, wait, r);
-      }
-      
     }else if(wait>0){
       fd_func_enter(__HERE__, &call_stats);
       sleep_ms(wait);
@@ -428,32 +848,33 @@ int fd_poll2(time_ms_t (*waiting)(time_ms_t, time_ms_t, time_ms_t), void (*wokeu
   
   // We don't want a single alarm to be able to reschedule itself and starve all IO
   // So we only check for new overdue alarms if we attempted to sleep
-  if (wait && run_now && run_now->run_before <= gettime_ms())
+  if (wait && run_now.root && run_now.root->run_before <= gettime_ms()){
+    fd_ready_count=0;
     RETURN(1);
+  }
   
   // process all watched IO handles once (we need to be fair)
   if (r>0) {
     int i;
-    for(i=fdcount -1;i>=0;i--){
-      if (fd_callbacks[i] && fd_callbacks[i]->poll.fd == fds[i].fd && fds[i].revents) {
+    for(i=0;i<fd_ready_count;i++){
+      struct sched_ent *alarm = fd_ready[i].alarm;
+      if (alarm) {
+	short revents = fd_ready[i].revents;
 	errno=0;
 	// Work around OSX behaviour that doesn't set POLLERR on 
 	// devices that have been deconfigured, e.g., a USB serial adapter
 	// that has been removed.
-	if (errno == ENXIO) fds[i].revents|=POLLERR;
-	call_alarm(fd_callbacks[i], fds[i].revents);
+	if (errno == ENXIO) revents|=POLLERR;
+	call_alarm(alarm, revents);
       }
     }
+    fd_ready_count=0;
     // time may have passed while processing IO, or processing IO could trigger a new overdue alarm
     move_run_list();
     
-  }else if (run_now){
+  }else if (run_now.root){
     // No IO, no overdue alarms but another alarm is runnable? run a single alarm before polling again
-    struct sched_ent *alarm = run_now;
-    run_now = alarm->_next_run;
-    alarm->_scheduled=0;
-    alarm->run_after = TIME_MS_NEVER_WILL;
-    call_alarm(alarm, 0);
+    call_alarm(next_run_now(), 0);
   }
   
   RETURN(1);
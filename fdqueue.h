@@ -81,10 +81,21 @@ struct sched_ent;
 
 typedef void (*ALARM_FUNCP) (struct sched_ent *alarm);
 
+// pairing heap links, private to fdqueue.c
+struct sched_heap_node{
+  struct sched_ent *child;
+  struct sched_ent *next;
+  // previous sibling, or parent if this is the first child
+  struct sched_ent *prev;
+};
+
 struct sched_ent{
-  struct sched_ent *_next_wake;
-  struct sched_ent *_prev_wake;
-  struct sched_ent *_next_run;
+  // in the run_soon or run_now heap
+  struct sched_heap_node _run;
+  // in the wake_list heap
+  struct sched_heap_node _wake;
+  // breaks ties between alarms with the same time, so they run in the order they were scheduled
+  uint32_t _sequence;
   uint8_t _scheduled;
   
   ALARM_FUNCP function;
@@ -105,6 +116,8 @@ struct sched_ent{
   
   struct profile_total *stats;
   int _poll_index;
+  // other alarms watching the same file descriptor (epoll backend only)
+  struct sched_ent *_next_fd_watch;
 };
 
 #define STRUCT_SCHED_ENT_UNUSED {\
@@ -143,6 +156,15 @@ struct sched_ent{
   }while(0)
 
 #define is_scheduled(X) ((X)->_scheduled)
+
+/* Watched file descriptors are monitored by an event backend; epoll(7) if the
+ * kernel supports it, otherwise poll(2).  The epoll backend cannot deregister
+ * a file descriptor that has already been closed, so callers must always
+ * unwatch() before they close().
+ */
+const char *fd_backend_name();
+int fd_select_backend(const char *name);
+
 int is_watching(struct sched_ent *alarm);
 void _schedule(struct __sourceloc, struct sched_ent *alarm);
 void _unschedule(struct __sourceloc, struct sched_ent *alarm);
@@ -156,6 +178,7 @@ int fd_poll2(time_ms_t (*waiting)(time_ms_t, time_ms_t, time_ms_t), void (*wokeu
 #define fd_poll() fd_poll2(NULL, NULL)
 
 /* function timing routines */
+void fd_clearstat(struct profile_total *s);
 int fd_clearstats();
 int fd_showstats();
 int fd_checkalarms();
@@ -2,6 +2,7 @@ HDRS=	fifo.h \
 	overlay_buffer.h \
 	overlay_address.h \
 	overlay_packet.h \
+	overlay_queue_test.h \
 	overlay_interface.h \
 	section.h \
 	trigger.h \
@@ -20,6 +21,7 @@ HDRS=	fifo.h \
 	serval.h \
 	server.h \
 	route_link.h \
+	route_link_test.h \
 	keyring.h \
 	socket.h \
 	cli.h \
@@ -43,6 +45,7 @@ HDRS=	fifo.h \
 	net.h \
 	fdqueue.h \
 	http_server.h \
+	list_writer.h \
 	xprintf.h \
 	lang.h \
 	constants.h \
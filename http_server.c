@@ -23,6 +23,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include "lang.h" // for FALLTHROUGH
 #include "serval_types.h"
 #include "http_server.h"
+#include "list_writer.h"
 #include "sighandlers.h"
 #include "conf.h"
 #include "log.h"
@@ -36,9 +37,17 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include "net.h"
 #include "mem.h"
 #include "version_servald.h"
+#ifdef HAVE_SYS_SENDFILE_H
+#include <sys/sendfile.h>
+#endif
 
 #define BOUNDARY_STRING_MAXLEN  70 // legislated limit from RFC-1341
 
+// Framing of a chunked response body (RFC-7230 section 4.1).
+#define CHUNK_HEAD	10 // "XXXXXXXX\r\n" before each chunk
+#define CHUNK_LAST	5  // "0\r\n\r\n" after the last chunk
+#define CHUNK_FRAMING	(CHUNK_HEAD + 2 + CHUNK_LAST)
+
 /* The (struct http_request).verb field points to one of these static strings, so that a simple
  * equality test can be used, eg, (r->verb == HTTP_VERB_GET) instead of a strcmp().
  *
@@ -83,6 +92,7 @@ const struct mime_content_type CONTENT_TYPE_FAVICON = { .type = "image", .subtyp
 const struct mime_content_type CONTENT_TYPE_TEXT = { .type = "text", .subtype = "plain", .charset = "utf-8" };
 const struct mime_content_type CONTENT_TYPE_HTML = { .type = "text", .subtype = "html", .charset = "utf-8" };
 const struct mime_content_type CONTENT_TYPE_JSON = { .type = "application", .subtype = "json" };
+const struct mime_content_type CONTENT_TYPE_CBOR = { .type = "application", .subtype = "cbor" };
 const struct mime_content_type CONTENT_TYPE_BLOB = { .type = "application", .subtype = "octet-stream" };
 
 static struct profile_total http_server_stats = {
@@ -111,21 +121,16 @@ static int http_request_parse_header(struct http_request *r);
 static int http_request_start_body(struct http_request *r);
 static int http_request_parse_body_form_data(struct http_request *r);
 static void http_request_start_response(struct http_request *r);
+static void http_request_parse_received(struct http_request *r);
 
-void http_request_init(struct http_request *r, int sockfd)
+// Set up the parsing state to receive a new request.
+static void _http_request_start_receiving(struct http_request *r)
 {
-  assert(sockfd != -1);
   r->request_header.content_length = CONTENT_LENGTH_UNKNOWN;
   r->request_content_remaining = CONTENT_LENGTH_UNKNOWN;
   r->response.header.content_length = CONTENT_LENGTH_UNKNOWN;
   r->response.header.resource_length = CONTENT_LENGTH_UNKNOWN;
   r->response.header.minor_version = 1;
-  r->alarm.stats = &http_server_stats;
-  r->alarm.function = http_server_poll;
-  assert(r->idle_timeout >= 0);
-  if (r->idle_timeout == 0)
-    r->idle_timeout = 10000; // 10 seconds
-  r->alarm.poll.fd = sockfd;
   r->alarm.poll.events = POLLIN;
   r->phase = RECEIVE;
   r->reserved = r->buffer;
@@ -133,6 +138,19 @@ void http_request_init(struct http_request *r, int sockfd)
   // reserved ok.
   r->received = r->decode_ptr = r->end_received = r->end_decoded = r->parsed = r->cursor = r->buffer + sizeof(void*) * (1 + NELS(r->query_parameters));
   r->parser = http_request_parse_verb;
+}
+
+void http_request_init(struct http_request *r, int sockfd)
+{
+  assert(sockfd != -1);
+  r->alarm.stats = &http_server_stats;
+  r->alarm.function = http_server_poll;
+  assert(r->idle_timeout >= 0);
+  if (r->idle_timeout == 0)
+    r->idle_timeout = 10000; // 10 seconds
+  assert(r->keepalive_timeout >= 0);
+  r->alarm.poll.fd = sockfd;
+  _http_request_start_receiving(r);
   watch(&r->alarm);
   http_request_set_idle_timeout(r);
 }
@@ -199,10 +217,26 @@ void http_request_finalise(struct http_request *r)
     r->finalise(r);
   r->finalise = NULL;
   http_request_free_response_buffer(r);
+  if (r->pipelined) {
+    free(r->pipelined);
+    r->pipelined = NULL;
+    r->pipelined_length = 0;
+  }
   r->phase = DONE;
   OUT();
 }
 
+/* Return true if the connection is being kept open after a response and no part of the next
+ * request has arrived yet, so it can be closed without losing anything.
+ */
+int http_request_is_idle(const struct http_request *r)
+{
+  return r->phase == RECEIVE
+      && r->request_count != 0
+      && r->parser == http_request_parse_verb
+      && r->end_received == r->received;
+}
+
 struct substring {
   const char *start;
   const char *end;
@@ -1018,7 +1052,7 @@ static int http_request_start_parsing_headers(struct http_request *r)
  *
  * If the end of headers is parsed (blank line), then sets r->parser to the next parsing function
  * and returns 0.  If a single header line is successfully parsed, returns 0 after advancing
- * r->parsed.  If parsing cannot complete due to running out of data, returns 0 without changing
+ * r->parsed.  If parsing cannot complete due to running out of data, returns 100 without changing
  * r->parser, so this function will be called again once more data has been read.  Returns a 4nn or
  * 5nn HTTP result code if parsing fails.  Returns -1 if an unexpected error occurs.
  *
@@ -1027,7 +1061,8 @@ static int http_request_start_parsing_headers(struct http_request *r)
 static int http_request_parse_header(struct http_request *r)
 {
   DEBUG_DUMP_PARSER(r);
-  _skip_to_eol(r);
+  if (!_skip_to_eol(r))
+    return 100; // read more and try again
   const char *const eol = r->cursor;
   _skip_eol(r);
   if (eol == r->parsed) { // if EOL is at start of line (ie, blank line)...
@@ -1124,6 +1159,27 @@ static int http_request_parse_header(struct http_request *r)
     return 0;
   }
   _rewind(r);
+  if (_skip_literal_nocase(r, "Connection:")) {
+    struct substring token;
+    do {
+      _skip_optional_space(r);
+      if (!_skip_token(r, &token))
+	break;
+      size_t len = token.end - token.start;
+      if (len == 5 && strncasecmp(token.start, "close", len) == 0)
+	r->request_header.connection_close = 1;
+      else if (len == 10 && strncasecmp(token.start, "keep-alive", len) == 0)
+	r->request_header.connection_keep_alive = 1;
+      _skip_optional_space(r);
+    } while (r->cursor < eol && _skip_literal(r, ","));
+    r->cursor = nextline;
+    _commit(r);
+    IDEBUGF(r->debug, "Parsed HTTP request Connection:%s%s",
+	r->request_header.connection_close ? " close" : "",
+	r->request_header.connection_keep_alive ? " keep-alive" : "");
+    return 0;
+  }
+  _rewind(r);
   if (_skip_literal_nocase(r, "Transfer-Encoding:")) {
     if (r->request_header.chunked){
       IDEBUGF(r->debug, "Skipping duplicate HTTP header Transfer-Encoding: %s", alloca_toprint(50, sol, r->end_decoded - sol));
@@ -1389,6 +1445,20 @@ static int http_request_start_body(struct http_request *r)
 
   if (r->request_header.content_length != CONTENT_LENGTH_UNKNOWN) {
     size_t unparsed = r->end_decoded - r->parsed;
+    // On a connection that may be kept alive, anything received past the end of content is the
+    // start of the next (pipelined) request, so save it until this request has been answered.
+    if (unparsed > r->request_header.content_length && r->keepalive_timeout && !r->decoder) {
+      assert(r->pipelined == NULL);
+      const char *end = r->parsed + r->request_header.content_length;
+      size_t len = r->end_received - end;
+      if ((r->pipelined = emalloc(len)) == NULL)
+	return 500;
+      memcpy(r->pipelined, end, len);
+      r->pipelined_length = len;
+      r->end_received = r->end_decoded = r->decode_ptr = (char *) end;
+      unparsed = r->request_header.content_length;
+      IDEBUGF(r->debug, "Received %zu bytes of pipelined request", len);
+    }
     if (unparsed > r->request_header.content_length) {
       IDEBUGF(r->debug, "Malformed request: already read %zu bytes past end of content",
 	(size_t)(unparsed - r->request_header.content_length));
@@ -1860,7 +1930,15 @@ static void http_request_receive(struct http_request *r)
   // We got some data, so reset the inactivity timer and invoke the parsing state machine to process
   // it.  The state machine invokes the caller-supplied callback functions.
   http_request_set_idle_timeout(r);
-  // Parse the unparsed and received data.
+  http_request_parse_received(r);
+  OUT();
+}
+
+/* Invoke the parsing state machine on the unparsed and received data.
+ */
+static void http_request_parse_received(struct http_request *r)
+{
+  IN();
   bool_t decode_more=1;
 
   while (r->phase == RECEIVE) {
@@ -1947,6 +2025,104 @@ static void http_request_receive(struct http_request *r)
   OUT();
 }
 
+/* Send the part of the response content that the content generator asked to be sent from a file.
+ * Where sendfile(2) is not available, read the next part of the file into the (empty) response
+ * buffer instead.
+ *
+ * Returns the number of bytes sent or buffered, zero if the socket cannot accept any more, or -1
+ * if the connection must be closed.
+ */
+static ssize_t http_request_send_file(struct http_request *r)
+{
+  assert(r->sendfile_remaining > 0);
+  assert(r->response_buffer_sent == r->response_buffer_length);
+  // Never send more than the rest of the Content-Length, whatever the generator asked for.
+  http_size_t len = r->sendfile_remaining;
+  if (r->response_length != CONTENT_LENGTH_UNKNOWN && len > r->response_length - r->response_sent)
+    len = r->response_length - r->response_sent;
+  assert(len > 0);
+#ifdef HAVE_SYS_SENDFILE_H
+  off_t offset = r->sendfile_offset;
+  sigPipeFlag = 0;
+  ssize_t written = sendfile(r->alarm.poll.fd, r->sendfile_fd, &offset, len);
+  if (written == -1) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK)
+      return 0;
+    IDEBUGF(r->debug, "HTTP socket sendfile error: %s [errno=%d]", strerror(errno), errno);
+    return -1;
+  }
+  if (sigPipeFlag) {
+    IDEBUG(r->debug, "Received SIGPIPE on HTTP socket sendfile, closing connection");
+    return -1;
+  }
+  if (written == 0) {
+    WHYF("HTTP response file ended prematurely at offset %"PRIu64, r->sendfile_offset);
+    return -1;
+  }
+  r->response_sent += (size_t) written;
+  IDEBUGF(r->debug, "Sent %zu bytes from fd %d to HTTP socket, total %"PRIhttp_size_t", remaining=%"PRIhttp_size_t,
+	(size_t) written, r->sendfile_fd, r->response_sent, r->response_length - r->response_sent);
+#else
+  if (len > r->response_buffer_size)
+    len = r->response_buffer_size;
+  ssize_t written = pread(r->sendfile_fd, r->response_buffer, len, r->sendfile_offset);
+  if (written == -1) {
+    WHYF_perror("pread(%d,%p,%zu,%"PRIu64")", r->sendfile_fd, r->response_buffer, (size_t) len, r->sendfile_offset);
+    return -1;
+  }
+  if (written == 0) {
+    WHYF("HTTP response file ended prematurely at offset %"PRIu64, r->sendfile_offset);
+    return -1;
+  }
+  r->response_buffer_sent = 0;
+  r->response_buffer_length = (size_t) written;
+#endif
+  r->sendfile_offset += (size_t) written;
+  r->sendfile_remaining -= (size_t) written;
+  return written;
+}
+
+/* Once a response has been completely sent on a connection that is being kept alive, release the
+ * state of the finished request and start receiving the next one.  Any part of the next request
+ * that arrived with the finished one is parsed straight away.
+ */
+static void http_request_next(struct http_request *r)
+{
+  IN();
+  assert(r->phase == TRANSMIT);
+  assert(r->keep_alive);
+  if (r->reset)
+    r->reset(r);
+  http_request_free_response_buffer(r);
+  // Clear all the per-request state, but keep the caller's handlers.
+  HTTP_REQUEST_PARSER *handle_first_line = r->handle_first_line;
+  HTTP_REQUEST_PARSER *handle_headers = r->handle_headers;
+  bzero((char *) &r->verb, r->buffer - (char *) &r->verb);
+  r->handle_first_line = handle_first_line;
+  r->handle_headers = handle_headers;
+  ++r->request_count;
+  _http_request_start_receiving(r);
+  watch(&r->alarm);
+  if (r->pipelined) {
+    IDEBUGF(r->debug, "Parsing %zu pipelined bytes of request %u", r->pipelined_length, r->request_count + 1);
+    assert(r->pipelined_length <= (size_t)(r->buffer + sizeof r->buffer - r->received));
+    memcpy(r->received, r->pipelined, r->pipelined_length);
+    r->end_received = r->end_decoded = r->decode_ptr = r->received + r->pipelined_length;
+    free(r->pipelined);
+    r->pipelined = NULL;
+    r->pipelined_length = 0;
+    http_request_set_idle_timeout(r);
+    http_request_parse_received(r);
+  } else {
+    // Until the next request starts to arrive, the connection is idle.
+    r->alarm.alarm = gettime_ms() + r->keepalive_timeout;
+    r->alarm.deadline = r->alarm.alarm + 500;
+    unschedule(&r->alarm);
+    schedule(&r->alarm);
+  }
+  OUT();
+}
+
 /* Write the current contents of the response buffer to the HTTP socket.  When no more bytes can be
  * written, return so that socket polling can continue.  Once all bytes are sent, if there is a
  * content generator function and the request is not paused, invoke it to put more content in the
@@ -1974,6 +2150,22 @@ static void http_request_send_response(struct http_request *r)
     }
     if (unsent == 0)
       r->response_buffer_sent = r->response_buffer_length = 0;
+    if (unsent == 0 && r->sendfile_remaining) {
+      ssize_t sent = http_request_send_file(r);
+      if (sent == -1) {
+	http_request_finalise(r);
+	RETURNVOID;
+      }
+      // If the socket would not accept everything, go back to polling.
+      if (sent == 0)
+	RETURNVOID;
+#ifdef HAVE_SYS_SENDFILE_H
+      // Reset inactivity timer.
+      if (r->phase != PAUSE)
+	http_request_set_idle_timeout(r);
+#endif
+      continue;
+    }
     if (r->phase == PAUSE) {
       // If the generator has paused the request, keep polling i/o for output until the response
       // buffer is all sent, then stop polling i/o.
@@ -1981,7 +2173,7 @@ static void http_request_send_response(struct http_request *r)
 	unwatch(&r->alarm);
 	RETURNVOID; // nothing left to send
       }
-    } else if (r->response.content_generator) {
+    } else if (r->response.content_generator && r->sendfile_remaining == 0) {
       // If the buffer is smaller than the content generator needs, and it contains no unsent
       // content, then allocate a larger buffer.
       if (r->response_buffer_need > r->response_buffer_size && unsent == 0) {
@@ -2000,10 +2192,13 @@ static void http_request_send_response(struct http_request *r)
 	r->response_buffer_sent = 0;
       }
       // If there is enough unfilled room at the end of the buffer, then fill the buffer with some
-      // more content.
+      // more content.  A chunked response needs room around the content for the chunk framing.
       assert(r->response_buffer_length <= r->response_buffer_size);
       size_t unfilled = r->response_buffer_size - r->response_buffer_length;
-      if (unfilled > 0 && unfilled >= r->response_buffer_need) {
+      size_t framing = r->response_chunked ? CHUNK_FRAMING : 0;
+      if (unfilled > framing && unfilled >= r->response_buffer_need) {
+	char *const chunk = r->response_buffer + r->response_buffer_length;
+	unfilled -= framing;
 	// The content generator must fill or partly fill the part of the buffer we indicate and
 	// return the number of bytes appended.  If it returns zero, it means it has no more
 	// content (EOF), and must not be called again.  If the return value exceeds the buffer size
@@ -2012,26 +2207,51 @@ static void http_request_send_response(struct http_request *r)
 	// -1, it means an unrecoverable error occurred, and the generator must not be called again.
 	struct http_content_generator_result result;
 	bzero(&result, sizeof result);
-	int ret = r->response.content_generator(r, (unsigned char *) r->response_buffer + r->response_buffer_length, unfilled, &result);
+	int ret = r->response.content_generator(r, (unsigned char *) chunk + (framing ? CHUNK_HEAD : 0), unfilled, &result);
 	if (ret == -1) {
 	  WHY("Content generation error, closing connection");
 	  http_request_finalise(r);
 	  RETURNVOID;
 	}
 	assert(result.generated <= unfilled);
+	if (framing && result.generated) {
+	  // Fixed-width chunk size, so the header can be written after the content it precedes.
+	  size_t n = result.generated;
+	  int i;
+	  for (i = CHUNK_HEAD - 3; i >= 0; --i, n >>= 4)
+	    chunk[i] = hexdigit_upper[n & 0xF];
+	  memcpy(chunk + CHUNK_HEAD - 2, "\r\n", 2);
+	  memcpy(chunk + CHUNK_HEAD + result.generated, "\r\n", 2);
+	  r->response_buffer_length += CHUNK_HEAD + 2;
+	}
 	r->response_buffer_length += result.generated;
-	r->response_buffer_need = result.need;
-	if (result.generated == 0 && result.need <= unfilled && r->phase != PAUSE) {
+	r->response_buffer_need = result.need ? result.need + framing : 0;
+	if (result.sendfile_length && framing) {
+	  WHY("HTTP response generator cannot send a file in a chunked response, closing connection");
+	  http_request_finalise(r);
+	  RETURNVOID;
+	}
+	if (result.sendfile_length) {
+	  r->sendfile_fd = result.sendfile_fd;
+	  r->sendfile_offset = result.sendfile_offset;
+	  r->sendfile_remaining = result.sendfile_length;
+	}
+	if (result.generated == 0 && result.sendfile_length == 0 && result.need <= unfilled && r->phase != PAUSE) {
 	  WHYF("HTTP response generator produced no content at offset %"PRIhttp_size_t" (ret=%d)", r->response_sent, ret);
 	  http_request_finalise(r);
 	  RETURNVOID;
 	}
 	IDEBUGF(r->debug, "Generated HTTP %zu bytes of content, need %zu bytes of buffer (ret=%d)", result.generated, result.need, ret);
-	if (r->phase != PAUSE && ret == 0)
+	if (r->phase != PAUSE && ret == 0) {
 	  r->response.content_generator = NULL; // ensure we never invoke again
+	  if (framing) {
+	    memcpy(r->response_buffer + r->response_buffer_length, "0\r\n\r\n", CHUNK_LAST);
+	    r->response_buffer_length += CHUNK_LAST;
+	  }
+	}
 	continue;
       }
-    } else if (remaining != CONTENT_LENGTH_UNKNOWN && unsent < remaining) {
+    } else if (r->sendfile_remaining == 0 && remaining != CONTENT_LENGTH_UNKNOWN && unsent < remaining) {
       WHYF("HTTP response generator finished prematurely at offset %"PRIhttp_size_t"/%"PRIhttp_size_t" (%"PRIhttp_size_t" bytes remaining)",
 	  r->response_sent, r->response_length, remaining);
       http_request_finalise(r);
@@ -2073,8 +2293,13 @@ static void http_request_send_response(struct http_request *r)
     if ((size_t) written < (size_t) unsent)
       RETURNVOID;
   }
-  IDEBUG(r->debug, "Done, closing connection");
-  http_request_finalise(r);
+  if (r->keep_alive) {
+    IDEBUG(r->debug, "Done, keeping connection open");
+    http_request_next(r);
+  } else {
+    IDEBUG(r->debug, "Done, closing connection");
+    http_request_finalise(r);
+  }
   OUT();
 }
 
@@ -2082,7 +2307,9 @@ static void _http_request_start_transmitting(struct http_request *r)
 {
   assert(r->phase == RECEIVE || r->phase == PAUSE);
   r->phase = TRANSMIT;
-  r->alarm.poll.events = POLLIN|POLLOUT;
+  // Keep polling for input (and discarding it) unless the connection is being kept alive, in which
+  // case any input is the next request, to be read once this response has been sent.
+  r->alarm.poll.events = r->keep_alive ? POLLOUT : POLLIN|POLLOUT;
   watch(&r->alarm);
   http_request_set_idle_timeout(r);
 }
@@ -2356,7 +2583,11 @@ static int _render_response(struct http_request *r)
   assert(hr.header.content_type->type[0]);
   assert(hr.header.content_type->subtype[0]);
   strbuf_sprintf(sb, "HTTP/1.%d %03u %s\r\n", hr.header.minor_version, hr.status_code, hr.reason);
-  strbuf_puts(sb, "Connection: Close\r\n");
+  if (r->keep_alive) {
+    strbuf_puts(sb, "Connection: Keep-Alive\r\n");
+    strbuf_sprintf(sb, "Keep-Alive: timeout=%u\r\n", (unsigned)(r->keepalive_timeout / 1000));
+  } else
+    strbuf_puts(sb, "Connection: Close\r\n");
   strbuf_sprintf(sb, "Server: servald %s\r\n", version_servald);
   strbuf_puts(sb, "Content-Type: ");
   strbuf_append_mime_content_type(sb, hr.header.content_type);
@@ -2377,6 +2608,8 @@ static int _render_response(struct http_request *r)
   }
   if (hr.header.content_length != CONTENT_LENGTH_UNKNOWN)
     strbuf_sprintf(sb, "Content-Length: %"PRIhttp_size_t"\r\n", hr.header.content_length);
+  else if (r->response_chunked)
+    strbuf_puts(sb, "Transfer-Encoding: chunked\r\n");
   if (hr.header.allow_origin.null || hr.header.allow_origin.scheme[0]) {
     strbuf_puts(sb, "Access-Control-Allow-Origin: ");
     if (hr.header.allow_origin.null) {
@@ -2475,6 +2708,24 @@ static void http_request_start_response(struct http_request *r)
     RETURNVOID;
   }
 
+  // The connection can only be kept open if the whole request has been consumed, and the client
+  // can tell where the response ends, either from its Content-Length or by chunked encoding, which
+  // only HTTP/1.1 clients understand.
+  r->keep_alive = r->keepalive_timeout
+	       && r->request_content_remaining == 0
+	       && r->decoder == NULL
+	       && r->version_major == 1
+	       && (r->version_minor == 0 ? r->request_header.connection_keep_alive : !r->request_header.connection_close);
+  r->response_chunked = 0;
+  if (   r->keep_alive
+      && r->response.content_generator
+      && r->response.header.content_length == CONTENT_LENGTH_UNKNOWN
+  ) {
+    if (r->version_minor != 0 && r->response.header.minor_version != 0)
+      r->response_chunked = 1;
+    else
+      r->keep_alive = 0;
+  }
   // Ensure conformance to HTTP standards.
   if (r->response.status_code == 401 && r->response.header.www_authenticate.scheme == NOAUTH) {
     WHY("HTTP 401 response missing WWW-Authenticate header, sending 500 Server Error instead");
@@ -2594,3 +2845,32 @@ int generate_http_content_from_strbuf_chunks(
   }
   return ret;
 }
+
+/* Like generate_http_content_from_strbuf_chunks(), but the chunker writes list rows straight into
+ * the response buffer through a list writer, which rolls back any row that does not fit.
+ */
+int generate_http_content_from_list_chunks(
+  struct http_request *r,
+  struct list_writer *w,
+  unsigned char *buf,
+  size_t bufsz,
+  struct http_content_generator_result *result,
+  HTTP_CONTENT_GENERATOR_LIST_CHUNKER *chunker
+)
+{
+  assert(bufsz > 0);
+  lw_buffer(w, buf, bufsz);
+  int ret;
+  while ((ret = chunker(r, w)) != -1) {
+    if (lw_overrun(w)) {
+      IDEBUGF(r->debug, "overrun by %zu bytes", w->committed + w->need - bufsz);
+      result->need = w->need;
+      ret = 1; // the item must be written again
+      break;
+    }
+    result->generated = w->committed;
+    if (ret == 0)
+      break;
+  }
+  return ret;
+}
@@ -74,6 +74,7 @@ extern const struct mime_content_type CONTENT_TYPE_FAVICON;
 extern const struct mime_content_type CONTENT_TYPE_TEXT;
 extern const struct mime_content_type CONTENT_TYPE_HTML;
 extern const struct mime_content_type CONTENT_TYPE_JSON;
+extern const struct mime_content_type CONTENT_TYPE_CBOR;
 extern const struct mime_content_type CONTENT_TYPE_BLOB;
 
 struct http_client_authorization {
@@ -107,6 +108,8 @@ struct http_request_headers {
   struct http_client_authorization authorization;
   bool_t expect:1;
   bool_t chunked:1;
+  bool_t connection_close:1;
+  bool_t connection_keep_alive:1;
 };
 
 struct http_response_headers {
@@ -125,6 +128,11 @@ struct http_response_headers {
 struct http_content_generator_result {
   size_t generated;
   size_t need;
+  // Instead of generating content into the buffer, a generator may ask for the next part of the
+  // content to be sent directly from a file, using sendfile(2) where available.
+  size_t sendfile_length;
+  int sendfile_fd;
+  uint64_t sendfile_offset;
 };
 
 typedef int (HTTP_CONTENT_GENERATOR)(struct http_request *, unsigned char *, size_t, struct http_content_generator_result *);
@@ -178,6 +186,7 @@ void http_request_init(struct http_request *r, int sockfd);
 void http_request_free_response_buffer(struct http_request *r);
 int http_request_set_response_bufsize(struct http_request *r, size_t bufsiz);
 void http_request_finalise(struct http_request *r);
+int http_request_is_idle(const struct http_request *r);
 void http_request_pause_response(struct http_request *r, time_ms_t until);
 void http_request_resume_response(struct http_request *r);
 void http_request_response_static(struct http_request *r, int result, const struct mime_content_type *content_type, const char *body, uint64_t bytes);
@@ -187,6 +196,10 @@ void http_request_simple_response(struct http_request *r, uint16_t result, const
 typedef int (HTTP_CONTENT_GENERATOR_STRBUF_CHUNKER)(struct http_request *, strbuf);
 int generate_http_content_from_strbuf_chunks(struct http_request *, char *, size_t, struct http_content_generator_result *, HTTP_CONTENT_GENERATOR_STRBUF_CHUNKER *);
 
+struct list_writer;
+typedef int (HTTP_CONTENT_GENERATOR_LIST_CHUNKER)(struct http_request *, struct list_writer *);
+int generate_http_content_from_list_chunks(struct http_request *, struct list_writer *, unsigned char *, size_t, struct http_content_generator_result *, HTTP_CONTENT_GENERATOR_LIST_CHUNKER *);
+
 typedef int HTTP_REQUEST_PARSER(struct http_request *);
 typedef void HTTP_RENDERER(const struct http_request *, strbuf);
 
@@ -207,6 +220,13 @@ struct http_request {
   // The following are used for parsing the HTTP request.
   time_ms_t initiate_time; // time connection was initiated
   time_ms_t idle_timeout; // disconnect if no bytes received for this long
+  // If the caller sets a keep-alive timeout, the connection is kept open for further requests
+  // after each response that allows it, and closed if idle between requests for this long.
+  time_ms_t keepalive_timeout;
+  unsigned request_count; // number of responses completed on this connection
+  void (*reset)(struct http_request *); // release caller's per-request state before next request
+  char *pipelined; // copy of bytes received after the end of this request, or NULL
+  size_t pipelined_length;
   struct socket_address client_addr; // caller may supply this
   // The parsed HTTP request is accumulated into the following fields.
   const char *verb; // points to nul terminated static string, "GET", "PUT", etc.
@@ -248,6 +268,8 @@ struct http_request {
   // TRANSMIT phase.
   struct http_response response;
   HTTP_RENDERER *render_extra_headers;
+  bool_t keep_alive; // leave the connection open after this response
+  bool_t response_chunked; // send content of unknown length with chunked Transfer-Encoding
   // The following are used during TRANSMIT phase to control buffering and
   // sending.
   http_size_t response_length; // total response bytes (header + content)
@@ -258,6 +280,10 @@ struct http_request {
   size_t response_buffer_length;
   size_t response_buffer_sent;
   void (*response_free_buffer)(void*);
+  // Content to be sent from a file, after the response buffer is empty.
+  int sendfile_fd;
+  uint64_t sendfile_offset;
+  http_size_t sendfile_remaining;
   // This buffer is used during RECEIVE and TRANSMIT phase.
   char buffer[8 * 1024];
 };
@@ -0,0 +1,347 @@
+/*
+ Serval DNA - HTTP server testing command line functions
+ Copyright (C) 2026 Serval Project Inc.
+
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU General Public License
+ as published by the Free Software Foundation; either version 2
+ of the License, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <assert.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "cli.h"
+#include "conf.h"
+#include "commandline.h"
+#include "httpd.h"
+#include "base64.h"
+#include "mem.h"
+#include "numeric_str.h"
+#include "str.h"
+#include "strbuf.h"
+#include "strbuf_helpers.h"
+
+DEFINE_FEATURE(cli_http_tests);
+
+// How many requests the pipelined benchmark sends before reading any responses.
+#define BENCHMARK_PIPELINE_DEPTH 8
+
+struct benchmark_connection {
+  int sock;
+  char buf[16384];
+  size_t len; // bytes in buf
+};
+
+static int benchmark_connect(struct benchmark_connection *c, uint16_t port)
+{
+  struct sockaddr_in addr;
+  bzero(&addr, sizeof addr);
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if ((c->sock = socket(AF_INET, SOCK_STREAM, 0)) == -1)
+    return WHY_perror("socket");
+  if (connect(c->sock, (struct sockaddr *) &addr, sizeof addr) == -1) {
+    WHYF_perror("connect(port=%u)", port);
+    close(c->sock);
+    return -1;
+  }
+  c->len = 0;
+  return 0;
+}
+
+static int benchmark_send(struct benchmark_connection *c, const char *request, size_t len)
+{
+  while (len) {
+    ssize_t n = write(c->sock, request, len);
+    if (n == -1)
+      return WHY_perror("write");
+    request += n;
+    len -= n;
+  }
+  return 0;
+}
+
+// Make sure at least 'want' bytes are in the buffer.  Returns 0 at EOF, -1 on error.
+static int benchmark_fill(struct benchmark_connection *c, size_t want)
+{
+  while (c->len < want) {
+    if (c->len == sizeof c->buf)
+      return WHY("HTTP response header too long");
+    ssize_t n = read(c->sock, c->buf + c->len, sizeof c->buf - c->len);
+    if (n == -1)
+      return WHY_perror("read");
+    if (n == 0)
+      return 0;
+    c->len += n;
+  }
+  return 1;
+}
+
+static void benchmark_consume(struct benchmark_connection *c, size_t len)
+{
+  assert(len <= c->len);
+  memmove(c->buf, c->buf + len, c->len - len);
+  c->len -= len;
+}
+
+// Discard 'len' bytes of content.  Returns 1 if successful, 0 at premature EOF, -1 on error.
+static int benchmark_skip(struct benchmark_connection *c, uint64_t len)
+{
+  while (len) {
+    int r = benchmark_fill(c, 1);
+    if (r != 1)
+      return r;
+    size_t n = c->len < len ? c->len : len;
+    benchmark_consume(c, n);
+    len -= n;
+  }
+  return 1;
+}
+
+// Return the end of the line starting at 'p', or NULL if the buffer ends first.
+static char *benchmark_eol(struct benchmark_connection *c, char *p)
+{
+  char *e = memchr(p, '\n', c->buf + c->len - p);
+  return e ? e + 1 : NULL;
+}
+
+// Return the end of the response header in the buffer, or NULL if it is not all there yet.
+static char *benchmark_header_end(struct benchmark_connection *c)
+{
+  char *p;
+  for (p = c->buf; p + 4 <= c->buf + c->len; ++p)
+    if (p[0] == '\r' && p[1] == '\n' && p[2] == '\r' && p[3] == '\n')
+      return p + 4;
+  return NULL;
+}
+
+/* Read one whole response, delimited by Content-Length, chunked encoding or the end of the
+ * connection.  Returns 1 if the server left the connection open, 0 if it closed it, -1 on error.
+ */
+static int benchmark_response(struct benchmark_connection *c)
+{
+  char *end;
+  while ((end = benchmark_header_end(c)) == NULL) {
+    int r = benchmark_fill(c, c->len + 1);
+    if (r != 1)
+      return r == 0 ? WHY("Connection closed before HTTP response header") : -1;
+  }
+  if (strncmp(c->buf, "HTTP/1.", 7) != 0 || strncmp(c->buf + 8, " 200 ", 5) != 0)
+    return WHYF("Unexpected HTTP response: %s", alloca_toprint(40, c->buf, end - c->buf));
+  uint64_t content_length = UINT64_MAX;
+  int chunked = 0, close_ = 0;
+  char *line;
+  for (line = benchmark_eol(c, c->buf); line < end - 2; line = benchmark_eol(c, line)) {
+    const char *v;
+    if (strcase_startswith(line, "Content-Length:", &v))
+      str_to_uint64(v + strspn(v, " "), 10, &content_length, &v);
+    else if (strcase_startswith(line, "Transfer-Encoding: chunked", NULL))
+      chunked = 1;
+    else if (strcase_startswith(line, "Connection: close", NULL))
+      close_ = 1;
+  }
+  benchmark_consume(c, end - c->buf);
+  int r;
+  if (chunked) {
+    uint64_t size;
+    do {
+      while ((line = c->len ? benchmark_eol(c, c->buf) : NULL) == NULL)
+	if ((r = benchmark_fill(c, c->len + 1)) != 1)
+	  return r ? -1 : WHY("Connection closed within HTTP chunk header");
+      const char *after;
+      if (!str_to_uint64(c->buf, 16, &size, &after))
+	return WHYF("Malformed HTTP chunk header: %s", alloca_toprint(20, c->buf, line - c->buf));
+      benchmark_consume(c, line - c->buf);
+      if ((r = benchmark_skip(c, size + 2)) != 1)
+	return r ? -1 : WHY("Connection closed within HTTP chunk");
+    } while (size);
+  } else if (content_length != UINT64_MAX) {
+    if ((r = benchmark_skip(c, content_length)) != 1)
+      return r ? -1 : WHY("Connection closed within HTTP content");
+  } else {
+    while ((r = benchmark_skip(c, sizeof c->buf)) == 1)
+      ;
+    return r;
+  }
+  return close_ ? 0 : 1;
+}
+
+/* Send 'count' requests, each on a new connection or all on one kept-alive connection, with up to
+ * 'depth' requests in flight at once.  Returns the elapsed milliseconds, or -1 on error.
+ */
+static time_ms_t benchmark_requests(uint16_t port, const char *request, unsigned count, int keep_alive, unsigned depth)
+{
+  struct benchmark_connection *c = emalloc(sizeof *c);
+  if (!c)
+    return -1;
+  size_t len = strlen(request);
+  time_ms_t start = gettime_ms();
+  unsigned sent = 0, received = 0;
+  int open = 0;
+  while (received < count) {
+    if (!open) {
+      if (benchmark_connect(c, port) == -1)
+	break;
+      open = 1;
+    }
+    while (sent < count && sent - received < depth) {
+      if (benchmark_send(c, request, len) == -1)
+	goto done;
+      ++sent;
+    }
+    int r = benchmark_response(c);
+    if (r == -1)
+      break;
+    ++received;
+    if (r == 0 || !keep_alive) {
+      close(c->sock);
+      open = 0;
+      if (keep_alive && received < count) {
+	WHYF("Server closed kept-alive connection after %u requests", received);
+	break;
+      }
+    }
+  }
+done:
+  if (open)
+    close(c->sock);
+  free(c);
+  return received == count ? gettime_ms() - start : -1;
+}
+
+DEFINE_CMD(app_http_load_test, 0,
+   "Run HTTP server load test against a running daemon, with and without persistent connections",
+   "test","http","load","<port>","<path>","[<count>]","[<userpass>]");
+static int app_http_load_test(const struct cli_parsed *parsed, struct cli_context *context)
+{
+  const char *port_arg, *path, *count_arg, *userpass;
+  if (cli_arg(parsed, "port", &port_arg, cli_uint, NULL) == -1
+    || cli_arg(parsed, "path", &path, cli_absolute_path, NULL) == -1
+    || cli_arg(parsed, "count", &count_arg, cli_uint, NULL) == -1
+    || cli_arg(parsed, "userpass", &userpass, NULL, NULL) == -1)
+    return -1;
+  uint16_t port = atoi(port_arg);
+  unsigned count = count_arg ? atoi(count_arg) : 1000;
+  if (count == 0)
+    return WHY("Count must be at least one");
+
+  static const struct {
+    const char *name;
+    int keep_alive;
+    unsigned depth;
+  } modes[] = {
+    { "connection per request", 0, 1 },
+    { "keep-alive", 1, 1 },
+    { "keep-alive, pipelined", 1, BENCHMARK_PIPELINE_DEPTH },
+  };
+  unsigned i;
+  for (i = 0; i < NELS(modes); ++i) {
+    strbuf request = strbuf_alloca(1024);
+    strbuf_sprintf(request, "GET %s HTTP/1.1\r\nHost: localhost:%u\r\n", path, port);
+    if (userpass) {
+      size_t len = strlen(userpass);
+      char *b64 = alloca(BASE64_ENCODED_LEN(len) + 1);
+      b64[base64_encode(b64, (const unsigned char *) userpass, len)] = '\0';
+      strbuf_sprintf(request, "Authorization: Basic %s\r\n", b64);
+    }
+    if (!modes[i].keep_alive)
+      strbuf_puts(request, "Connection: close\r\n");
+    strbuf_puts(request, "\r\n");
+    if (strbuf_overrun(request))
+      return WHY("HTTP request too long");
+    time_ms_t elapsed = benchmark_requests(port, strbuf_str(request), count, modes[i].keep_alive, modes[i].depth);
+    if (elapsed == -1)
+      return WHYF("%s benchmark failed", modes[i].name);
+    if (elapsed <= 0)
+      elapsed = 1;
+    cli_printf(context, "%6u requests - %-24s took %"PRId64"ms - %.0f requests/second\n",
+	count, modes[i].name, (int64_t)elapsed, count * 1000.0 / elapsed);
+  }
+  return 0;
+}
+
+/* The linear scan that httpd_dispatch() used before the routes were compiled into a trie.
+ */
+static const struct http_handler *benchmark_route_linear(const char *path, const char **remainderp)
+{
+  const struct http_handler *handler, *found = NULL;
+  size_t match_len = 0;
+  for (handler = SECTION_START(httpd); handler < SECTION_END(httpd); ++handler) {
+    size_t path_len = strlen(handler->path);
+    if (found && path_len < match_len)
+      continue;
+    const char *p;
+    if (str_startswith(path, handler->path, &p)) {
+      match_len = path_len;
+      found = handler;
+      *remainderp = p;
+    }
+  }
+  return found;
+}
+
+DEFINE_CMD(app_http_route_test, 0,
+   "Run HTTP request routing speed test",
+   "test","http","route","[<count>]");
+static int app_http_route_test(const struct cli_parsed *parsed, struct cli_context *context)
+{
+  const char *count_arg;
+  if (cli_arg(parsed, "count", &count_arg, cli_uint, NULL) == -1)
+    return -1;
+  unsigned count = count_arg ? atoi(count_arg) : 1000000;
+  if (httpd_routes_compile() == -1)
+    return -1;
+  // Every registered path, plus a typical request below it, plus a few that match nothing useful.
+  unsigned handlers = SECTION_END(httpd) - SECTION_START(httpd);
+  unsigned npaths = handlers * 2 + 2;
+  char **paths = alloca(sizeof(char *) * npaths);
+  unsigned i, j;
+  for (i = 0; i < handlers; ++i) {
+    const char *path = SECTION_START(httpd)[i].path;
+    paths[i * 2] = alloca(strlen(path) + 1);
+    strcpy(paths[i * 2], path);
+    paths[i * 2 + 1] = alloca(strlen(path) + 80);
+    sprintf(paths[i * 2 + 1], "%s%s", path, "45CBFEB008E20C1F59CD5DA4C5BC21B9D69381577A202AE478FCAED1A86ACE1A/list.json");
+  }
+  paths[i * 2] = "/no/such/route";
+  paths[i * 2 + 1] = "";
+  // Both routers must agree on every path.
+  for (j = 0; j < npaths; ++j) {
+    const char *rem1 = NULL, *rem2 = NULL;
+    const struct http_handler *h1 = benchmark_route_linear(paths[j], &rem1);
+    const struct http_handler *h2 = httpd_route(paths[j], &rem2);
+    if (h1 != h2 || rem1 != rem2)
+      return WHYF("Routers disagree on %s: %s vs %s", alloca_str_toprint(paths[j]),
+	  h1 ? h1->path : "NULL", h2 ? h2->path : "NULL");
+  }
+  cli_printf(context, "Benchmarking routing of %u paths among %u handlers:\n", npaths, handlers);
+  int trie;
+  for (trie = 0; trie <= 1; ++trie) {
+    uintptr_t check = 0;
+    time_ms_t start = gettime_ms();
+    for (i = 0; i < count; ++i) {
+      const char *rem = NULL;
+      const char *path = paths[i % npaths];
+      check += (uintptr_t) (trie ? httpd_route(path, &rem) : benchmark_route_linear(path, &rem));
+    }
+    time_ms_t elapsed = gettime_ms() - start;
+    if (elapsed <= 0)
+      elapsed = 1;
+    cli_printf(context, "%8u requests - %-12s took %"PRId64"ms - %.0f routes/second (check %"PRIxPTR")\n",
+	count, trie ? "prefix trie" : "linear scan", (int64_t)elapsed, count * 1000.0 / elapsed, check & 0xFFFF);
+  }
+  return 0;
+}
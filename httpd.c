@@ -18,15 +18,16 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 */
 
 #include <sys/ioctl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include "httpd.h"
 #include "mem.h"
 #include "net.h"
 #include "conf.h"
 #include "str.h"
+#include "strbuf_helpers.h"
 #include "server.h"
 
-#define RHIZOME_SERVER_MAX_LIVE_REQUESTS 32
-
 const struct mime_content_type CONTENT_TYPE_SID_HEX = {
   .type = "serval",
   .subtype = "sid",
@@ -53,36 +54,185 @@ static unsigned int http_request_uuid_counter = 0;
 static httpd_request * current_httpd_requests = NULL;
 unsigned int current_httpd_request_count = 0;
 
-static int httpd_dispatch(struct http_request *hr)
+/* The paths of all the handlers are compiled into a prefix trie, so that a request path can be
+ * routed to the handler with the longest matching prefix in a single pass over the path.  Node 0 is
+ * the root (empty prefix).  The children of each node are linked through their 'sibling' fields.
+ */
+struct route_node {
+  char c; // last character of this node's prefix
+  uint16_t child; // first child, 0 if none
+  uint16_t sibling; // next child of the same parent, 0 if none
+  int16_t handler; // index of the handler whose path is this prefix, -1 if none
+};
+
+static struct route_node *route_nodes = NULL;
+static unsigned route_node_count = 0;
+// One for each handler, in section order, then one for requests that match no route.
+static struct httpd_route_stats *route_stats = NULL;
+static unsigned route_stats_count = 0;
+
+int httpd_routes_compile()
 {
-  httpd_request *r = (httpd_request *) hr;
-  INFOF("HTTP SERVER, %s %s", r->http.verb, r->http.path);
-  r->http.response.content_generator = NULL;
-  
-  struct http_handler *parser=NULL;
-  const char *remainder=NULL;
-  struct http_handler *handler;
-  size_t match_len=0;
+  if (route_nodes)
+    return 0;
+  unsigned handlers = SECTION_END(httpd) - SECTION_START(httpd);
+  size_t maxnodes = 1;
+  const struct http_handler *handler;
+  for (handler = SECTION_START(httpd); handler < SECTION_END(httpd); ++handler)
+    maxnodes += strlen(handler->path);
+  assert(maxnodes <= UINT16_MAX);
+  assert(handlers <= INT16_MAX);
+  struct route_node *nodes = emalloc_zero(sizeof(struct route_node) * maxnodes);
+  struct httpd_route_stats *stats = emalloc_zero(sizeof(struct httpd_route_stats) * (handlers + 1));
+  if (!nodes || !stats) {
+    free(nodes);
+    free(stats);
+    return -1;
+  }
+  unsigned count = 1;
+  nodes[0].handler = -1;
   for (handler = SECTION_START(httpd); handler < SECTION_END(httpd); ++handler) {
-    size_t path_len = strlen(handler->path);
-    if (parser && path_len < match_len)
-      continue;
-    
+    unsigned n = 0;
     const char *p;
-    if (str_startswith(r->http.path, handler->path, &p)){
-      match_len = path_len;
-      parser = handler;
+    for (p = handler->path; *p; ++p) {
+      uint16_t *link = &nodes[n].child;
+      while (*link && nodes[*link].c != *p)
+	link = &nodes[*link].sibling;
+      if (!*link) {
+	assert(count < maxnodes);
+	nodes[count].c = *p;
+	nodes[count].handler = -1;
+	*link = count++;
+      }
+      n = *link;
+    }
+    // As with the linear scan this replaces, a later duplicate path overrides an earlier one.
+    nodes[n].handler = handler - SECTION_START(httpd);
+    stats[handler - SECTION_START(httpd)].path = handler->path;
+  }
+  route_nodes = nodes;
+  route_node_count = count;
+  route_stats = stats;
+  route_stats_count = handlers + 1;
+  DEBUGF(httpd, "Compiled %u HTTP routes into %u trie nodes", handlers, count);
+  return 0;
+}
+
+/* Return the handler with the longest path that is a prefix of the given path, or NULL if there is
+ * none, and set *remainderp to the rest of the path after that prefix.
+ */
+const struct http_handler *httpd_route(const char *path, const char **remainderp)
+{
+  if (!route_nodes && httpd_routes_compile() == -1)
+    return NULL;
+  int best = -1;
+  const char *remainder = NULL;
+  const char *p = path;
+  unsigned n = 0;
+  while (1) {
+    if (route_nodes[n].handler != -1) {
+      best = route_nodes[n].handler;
       remainder = p;
     }
+    if (!*p)
+      break;
+    for (n = route_nodes[n].child; n && route_nodes[n].c != *p; n = route_nodes[n].sibling)
+      ;
+    if (!n)
+      break;
+    ++p;
+  }
+  if (best == -1)
+    return NULL;
+  *remainderp = remainder;
+  return SECTION_START(httpd) + best;
+}
+
+/* Return the upper bound of the histogram bucket that contains the given percentile of requests.
+ */
+static time_ms_t httpd_route_percentile(const struct httpd_route_stats *stats, unsigned percent)
+{
+  uint64_t want = (stats->requests * percent + 99) / 100;
+  uint64_t seen = 0;
+  unsigned i;
+  for (i = 0; i < HTTPD_ROUTE_HISTOGRAM_BUCKETS - 1; ++i)
+    if ((seen += stats->histogram[i]) >= want)
+      return (time_ms_t) 1 << i;
+  return stats->max_time;
+}
+
+static int cmp_route_requests(const void *a, const void *b)
+{
+  const struct httpd_route_stats *sa = *(const struct httpd_route_stats **) a;
+  const struct httpd_route_stats *sb = *(const struct httpd_route_stats **) b;
+  return sa->requests < sb->requests ? 1 : sa->requests > sb->requests ? -1 : 0;
+}
+
+/* Append an HTML table of the routes that have been requested, busiest first.
+ */
+void httpd_route_stats_html(strbuf b)
+{
+  if (!route_stats)
+    return;
+  const struct httpd_route_stats *sorted[route_stats_count];
+  unsigned i, n = 0;
+  for (i = 0; i < route_stats_count; ++i)
+    if (route_stats[i].requests)
+      sorted[n++] = &route_stats[i];
+  qsort(sorted, n, sizeof sorted[0], cmp_route_requests);
+  strbuf_puts(b, "<table><tr><th>Route</th><th>Requests</th><th>Mean ms</th><th>p50 ms</th><th>p99 ms</th><th>Max ms</th></tr>");
+  for (i = 0; i < n; ++i) {
+    const struct httpd_route_stats *st = sorted[i];
+    strbuf_puts(b, "<tr><td>");
+    if (st->path)
+      strbuf_html_escape(b, st->path, strlen(st->path));
+    else
+      strbuf_puts(b, "(no route)");
+    strbuf_sprintf(b, "</td><td>%"PRIu64"</td><td>%.1f</td><td>&lt;%"PRItime_ms_t"</td><td>&lt;%"PRItime_ms_t"</td><td>%"PRItime_ms_t"</td></tr>",
+	st->requests, (double) st->total_time / st->requests,
+	httpd_route_percentile(st, 50), httpd_route_percentile(st, 99), st->max_time);
+  }
+  strbuf_puts(b, "</table>");
+}
+
+// Count a finished request against the route it was dispatched to.
+static void httpd_route_account(httpd_request *r)
+{
+  if (!r->route)
+    return;
+  time_ms_t elapsed = gettime_ms() - r->route_start;
+  if (elapsed < 0)
+    elapsed = 0;
+  unsigned bucket = 0;
+  while (bucket < HTTPD_ROUTE_HISTOGRAM_BUCKETS - 1 && elapsed >= (time_ms_t) 1 << bucket)
+    ++bucket;
+  r->route->requests++;
+  r->route->total_time += elapsed;
+  if (elapsed > r->route->max_time)
+    r->route->max_time = elapsed;
+  r->route->histogram[bucket]++;
+  r->route = NULL;
+}
+
+static int httpd_dispatch(struct http_request *hr)
+{
+  httpd_request *r = (httpd_request *) hr;
+  DEBUGF(httpd, "%s %s", r->http.verb, r->http.path);
+  r->http.response.content_generator = NULL;
+  const char *remainder = NULL;
+  const struct http_handler *handler = httpd_route(r->http.path, &remainder);
+  if (route_stats) {
+    r->route = &route_stats[handler ? handler - SECTION_START(httpd) : route_stats_count - 1];
+    r->route_start = gettime_ms();
   }
-  if (parser){
-    int result = parser->parser(r, remainder);
+  if (handler) {
+    int result = handler->parser(r, remainder);
     if (result == -1 || (result >= 200 && result < 600))
       return result;
     if (result == 1)
       return 0;
     if (result)
-      return WHYF("dispatch function for %s returned invalid result %d", parser->path, result);
+      return WHYF("dispatch function for %s returned invalid result %d", handler->path, result);
   }
   return 404;
 }
@@ -161,6 +311,8 @@ int httpd_server_start(const uint16_t port_low, const uint16_t port_high)
     return 2;
   httpd_server_last_start_attempt  = now;
   DEBUGF(httpd, "Starting HTTP server");
+  if (httpd_routes_compile() == -1)
+    return -1;
 
   uint16_t port;
   for (port = port_low; port <= port_high; ++port) {
@@ -237,6 +389,7 @@ success:
 static void httpd_server_finalise_http_request(struct http_request *hr)
 {
   httpd_request *r = (httpd_request *) hr;
+  httpd_route_account(r);
   DEBUGF(httpd, "current_httpd_request_count=%u current_httpd_requests=%p r=%p r->next=%p r->prev=%p", current_httpd_request_count, current_httpd_requests, r, r->next, r->prev);
   if (r->next) {
     assert(current_httpd_request_count >= 2);
@@ -269,6 +422,47 @@ static void httpd_server_finalise_http_request(struct http_request *hr)
   }
 }
 
+/* Release all the state of a request that has been answered, so that the next request on the same
+ * connection starts afresh.
+ */
+static void httpd_server_reset_http_request(struct http_request *hr)
+{
+  httpd_request *r = (httpd_request *) hr;
+  httpd_route_account(r);
+  rhizome_bundle_result_free(&r->bundle_result);
+  if (r->manifest) {
+    rhizome_manifest_free(r->manifest);
+    r->manifest = NULL;
+  }
+  if (r->finalise_union) {
+    r->finalise_union(r);
+    r->finalise_union = NULL;
+  }
+  bzero((char *) &r->manifest, (char *)(r + 1) - (char *) &r->manifest);
+  r->payload_status = INVALID_RHIZOME_PAYLOAD_STATUS; // will cause FATAL unless set
+  r->bundle_result = INVALID_RHIZOME_BUNDLE_RESULT; // will cause FATAL unless set
+}
+
+/* If the server already has its maximum number of connections, then make room for a new one by
+ * closing the connection that has been idle (kept alive between requests) the longest.  Returns 0
+ * if there is room, -1 if not.
+ */
+static int httpd_server_make_room()
+{
+  if (current_httpd_request_count < config.rhizome.http.max_connections)
+    return 0;
+  httpd_request *r, *oldest = NULL;
+  for (r = current_httpd_requests; r; r = r->next)
+    if (http_request_is_idle(&r->http) && (!oldest || r->http.alarm.alarm < oldest->http.alarm.alarm))
+      oldest = r;
+  if (!oldest)
+    return -1;
+  DEBUGF(httpd, "Closing idle connection httpd/%u to make room", oldest->http.uuid);
+  http_request_finalise(&oldest->http);
+  oldest->http.release(oldest);
+  return 0;
+}
+
 void httpd_server_poll(struct sched_ent *alarm)
 {
   if (alarm->poll.revents & (POLLIN | POLLOUT)) {
@@ -281,11 +475,22 @@ void httpd_server_poll(struct sched_ent *alarm)
 	WARN_perror("accept");
     } else {
       set_nonblock(sock);
+      // Responses are written in whole buffers, so Nagle's algorithm only delays the last part of
+      // each response until the client acknowledges the previous one, which stalls kept-alive and
+      // pipelined requests.
+      int on = 1;
+      if (setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &on, sizeof on) == -1)
+	WARN_perror("setsockopt(TCP_NODELAY)");
       ++http_request_uuid_counter;
       strbuf_sprintf(&log_context, "httpd/%u", http_request_uuid_counter);
       INFOF("HTTP SERVER, ACCEPT %s", alloca_socket_address(&addr));
-      httpd_request *request = emalloc_zero(sizeof(httpd_request));
-      if (request == NULL) {
+      httpd_request *request = NULL;
+      if (httpd_server_make_room() == -1) {
+	static const char busy[] = "HTTP/1.0 503 Service Unavailable\r\nConnection: Close\r\nContent-Length: 0\r\n\r\n";
+	WARNF("Too many HTTP connections (%u), refusing %s", current_httpd_request_count, alloca_socket_address(&addr));
+	write_nonblock(sock, busy, sizeof busy - 1);
+	close(sock);
+      } else if ((request = emalloc_zero(sizeof(httpd_request))) == NULL) {
 	WHY("Cannot respond to HTTP request, out of memory");
 	close(sock);
       } else {
@@ -305,8 +510,10 @@ void httpd_server_poll(struct sched_ent *alarm)
 	request->http.debug = INDIRECT_CONFIG_DEBUG(httpd);
 	request->http.disable_tx = INDIRECT_CONFIG_DEBUG(nohttptx);
 	request->http.finalise = httpd_server_finalise_http_request;
+	request->http.reset = httpd_server_reset_http_request;
 	request->http.release = free;
 	request->http.idle_timeout = RHIZOME_IDLE_TIMEOUT;
+	request->http.keepalive_timeout = config.rhizome.http.keepalive_timeout;
 	http_request_init(&request->http, sock);
       }
     }
@@ -552,3 +759,22 @@ int http_response_init_content_range(httpd_request *r, size_t resource_length)
   }
   return 0;
 }
+
+/* Prepare to respond with a list in the format chosen by the "format" query parameter, either
+ * "json" (the default) or "cbor".  Returns the content type of the response, or NULL after
+ * responding with 400 Bad Request if the format is not supported.
+ */
+const struct mime_content_type *http_response_list_init(httpd_request *r, unsigned columns)
+{
+  const char *format = http_request_get_query_param(&r->http, "format");
+  if (format == NULL || strcmp(format, "json") == 0) {
+    lw_init(&r->list, LIST_FORMAT_JSON, columns);
+    return &CONTENT_TYPE_JSON;
+  }
+  if (strcmp(format, "cbor") == 0) {
+    lw_init(&r->list, LIST_FORMAT_CBOR, columns);
+    return &CONTENT_TYPE_CBOR;
+  }
+  http_request_simple_response(&r->http, 400, "Unsupported list format");
+  return NULL;
+}
@@ -22,6 +22,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #define __SERVAL_DNA__HTTPD_H
 
 #include "http_server.h"
+#include "list_writer.h"
 #include "keyring.h"
 #include "meshms.h"
 #include "os.h"
@@ -65,6 +66,11 @@ typedef struct httpd_request
   struct httpd_request *next;
   struct httpd_request *prev;
 
+  /* The route that was dispatched, and when, for the route statistics.
+   */
+  struct httpd_route_stats *route;
+  time_ms_t route_start;
+
   /* For requests/responses that pertain to a single manifest.
    */
   rhizome_manifest *manifest;
@@ -89,6 +95,10 @@ typedef struct httpd_request
    */
   void (*trigger_rhizome_bundle_added)(struct httpd_request *, rhizome_manifest *);
 
+  /* For responses that list rows, in JSON or CBOR.
+   */
+  struct list_writer list;
+
   /* Finaliser for union contents (below).
    */
   void (*finalise_union)(struct httpd_request *);
@@ -174,7 +184,6 @@ typedef struct httpd_request
     struct {
       enum list_phase phase;
       uint64_t rowid_highest;
-      size_t rowcount;
       time_ms_t end_time;
       struct rhizome_list_cursor cursor;
     }
@@ -184,7 +193,6 @@ typedef struct httpd_request
     */
     struct {
       enum list_phase phase;
-      size_t rowcount;
       struct meshms_conversations *conv;
       struct meshms_conversation_iterator iter;
     }
@@ -203,7 +211,6 @@ typedef struct httpd_request
         latest;
       time_ms_t end_time;
       enum list_phase phase;
-      size_t rowcount;
       struct meshms_message_iterator iter;
       unsigned dirty;
       int finished;
@@ -269,6 +276,23 @@ struct http_handler {
 
 DECLARE_SECTION(struct http_handler, httpd);
 
+/* Request counters and a latency histogram for each route (handler path), measured from dispatch
+ * until the response has been sent.
+ */
+#define HTTPD_ROUTE_HISTOGRAM_BUCKETS 16 // bucket 0 is under 1ms, bucket n is under 2^n ms
+
+struct httpd_route_stats {
+  const char *path; // NULL for requests that matched no route
+  uint64_t requests;
+  time_ms_t total_time;
+  time_ms_t max_time;
+  uint64_t histogram[HTTPD_ROUTE_HISTOGRAM_BUCKETS];
+};
+
+int httpd_routes_compile();
+const struct http_handler *httpd_route(const char *path, const char **remainderp);
+void httpd_route_stats_html(strbuf b);
+
 #define DECLARE_HANDLER(PATH, FUNC) \
   static HTTP_HANDLER FUNC;\
   static struct http_handler __##FUNC IN_SECTION(httpd) = {\
@@ -282,12 +306,21 @@ int http_response_content_type(httpd_request *r, uint16_t result, const char *wh
 int http_response_content_disposition(httpd_request *r, uint16_t result, const char *what, const char *type);
 int http_response_form_part(httpd_request *r, uint16_t result, const char *what, const char *partname, const char *text, size_t textlen);
 int http_response_init_content_range(httpd_request *r, size_t resource_length);
+const struct mime_content_type *http_response_list_init(httpd_request *r, unsigned columns);
 int accumulate_text(httpd_request *r, const char *partname, char *textbuf, size_t textsiz, size_t *textlenp, const char *buf, size_t len);
 
 int rhizome_response_content_init_filehash(httpd_request *r, const rhizome_filehash_t *hash);
 int rhizome_response_content_init_payload(httpd_request *r, rhizome_manifest *);
 HTTP_CONTENT_GENERATOR rhizome_payload_content;
 
+#define LIST_TOKEN_STRLEN (BASE64_ENCODED_LEN(sizeof(serval_uuid_t) + 8))
+#define alloca_list_token(rowid) list_token_to_str(alloca(LIST_TOKEN_STRLEN + 1), (rowid))
+char *list_token_to_str(char *buf, uint64_t rowid);
+
+#define RHIZOME_LIST_COLUMNS 14
+extern const char *const rhizome_list_headers[RHIZOME_LIST_COLUMNS];
+void rhizome_list_write_row(struct list_writer *w, struct rhizome_list_cursor *c, uint64_t *rowid_highest);
+
 struct http_response_parts {
   uint16_t code;
   char *reason;
@@ -20,6 +20,11 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 
 #include <stdio.h>
 #include <assert.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
 #include "serval.h"
 #include "conf.h"
 #include "constants.h"
@@ -33,6 +38,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include "rotbuf.h"
 #include "route_link.h"
 #include "commandline.h"
+#include "crypto_workers.h"
 
 static keyring_file *keyring_open_or_create(const char *path, int writeable);
 static int keyring_initialise(keyring_file *k);
@@ -52,20 +58,58 @@ struct combined_sk{
   uint8_t box_key[crypto_box_SECRETKEYBYTES];
 };
 
-static int _keyring_open(keyring_file *k, const char *path, const char *mode)
+static int _keyring_open(keyring_file *k, const char *path, int flags)
 {
-  DEBUGF(keyring, "opening %s in \"%s\" mode", alloca_str_toprint(path), mode);
+  const char *mode = (flags & O_CREAT) ? "create" : (flags & O_ACCMODE) == O_RDWR ? "read-write" : "read-only";
+  DEBUGF(keyring, "opening %s in %s mode", alloca_str_toprint(path), mode);
   if (sodium_init()==-1)
     return WHY("Failed to initialise libsodium");
-  k->file = fopen(path, mode);
-  if (!k->file) {
-    if (errno != EPERM && errno != ENOENT)
-      return WHYF_perror("fopen(%s, \"%s\")", alloca_str_toprint(path), mode);
-    DEBUGF(keyring, "cannot open %s in \"%s\" mode", alloca_str_toprint(path), mode);
+  k->fd = open(path, flags, 0666);
+  if (k->fd == -1) {
+    if (errno != EPERM && errno != ENOENT && errno != EACCES)
+      return WHYF_perror("open(%s, %s)", alloca_str_toprint(path), mode);
+    DEBUGF(keyring, "cannot open %s in %s mode", alloca_str_toprint(path), mode);
   }
   return 0;
 }
 
+/* Map the whole file, after it has been opened or has grown.  Nothing is read until it is used.
+ */
+static int keyring_map(keyring_file *k)
+{
+  if (k->map && k->map_size == k->file_size)
+    return 0;
+  if (k->map) {
+    munmap((void *)k->map, k->map_size);
+    k->map = NULL;
+    k->map_size = 0;
+  }
+  if (k->file_size == 0)
+    return 0;
+  void *map = mmap(NULL, k->file_size, PROT_READ, MAP_SHARED, k->fd, 0);
+  if (map == MAP_FAILED)
+    return WHYF_perror("mmap(NULL, %zu, PROT_READ, MAP_SHARED, %d, 0)", k->file_size, k->fd);
+  /* Slots are mostly read one at a time, skipping the ones that a PIN's hints rule out, so don't
+     let the kernel read ahead into the pages around each one */
+  posix_madvise(map, k->file_size, POSIX_MADV_RANDOM);
+  k->map = map;
+  k->map_size = k->file_size;
+  return 0;
+}
+
+/* Another process may have shrunk or replaced the file since it was mapped, and reading a mapped
+ * page beyond the end of the file raises SIGBUS, so the size is checked before the map is read.
+ */
+static int keyring_check_map(const keyring_file *k)
+{
+  struct stat st;
+  if (fstat(k->fd, &st) == -1)
+    return WHYF_perror("fstat(%d)", k->fd);
+  if ((size_t)st.st_size < k->map_size)
+    return WHYF("Keyring file has shrunk from %zu to %zu bytes since it was opened", k->map_size, (size_t)st.st_size);
+  return 0;
+}
+
 /*
  * Open keyring file and  detect its size.
  */
@@ -75,30 +119,36 @@ static keyring_file *keyring_open_or_create(const char *path, int writeable)
   keyring_file *k = emalloc_zero(sizeof(keyring_file));
   if (!k)
     return NULL;
+  k->fd = -1;
   /* Open keyring file read-write if we can, else use it read-only, else create it. */
-  if (writeable && _keyring_open(k, path, "r+") == -1) {
+  if (writeable && _keyring_open(k, path, O_RDWR) == -1) {
     keyring_free(k);
     return NULL;
   }
-  if (!k->file && _keyring_open(k, path, "r") == -1) {
+  if (k->fd == -1 && _keyring_open(k, path, O_RDONLY) == -1) {
     keyring_free(k);
     return NULL;
   }
-  if (!k->file && writeable && _keyring_open(k, path, "w+") == -1) {
+  if (k->fd == -1 && writeable && _keyring_open(k, path, O_RDWR | O_CREAT) == -1) {
     keyring_free(k);
     return NULL;
   }
-  if (!k->file) {
+  if (k->fd == -1) {
     WHYF_perror("cannot open or create keyring file %s", alloca_str_toprint(path));
     keyring_free(k);
     return NULL;
   }
-  if (fseeko(k->file, 0, SEEK_END)) {
-    WHYF_perror("fseeko(%s, 0, SEEK_END)", alloca_str_toprint(path));
+  struct stat st;
+  if (fstat(k->fd, &st) == -1) {
+    WHYF_perror("fstat(%s)", alloca_str_toprint(path));
+    keyring_free(k);
+    return NULL;
+  }
+  k->file_size = st.st_size;
+  if (keyring_map(k) == -1) {
     keyring_free(k);
     return NULL;
   }
-  k->file_size = ftello(k->file);
   return k;
 }
 
@@ -108,43 +158,33 @@ static keyring_file *keyring_open_or_create(const char *path, int writeable)
 static int keyring_initialise(keyring_file *k)
 {
   // Write 2KB of zeroes, followed by 2KB of random bytes as salt.
-  if (fseeko(k->file, 0, SEEK_SET))
-    return WHYF_perror("fseeko(%d, 0, SEEK_SET)", fileno(k->file));
   unsigned char buffer[KEYRING_PAGE_SIZE];
   bzero(&buffer[0], KEYRING_BAM_BYTES);
   randombytes_buf(&buffer[KEYRING_BAM_BYTES], KEYRING_PAGE_SIZE - KEYRING_BAM_BYTES);
-  if (fwrite(buffer, KEYRING_PAGE_SIZE, 1, k->file) != 1) {
-    WHYF_perror("fwrite(%p, %zu, 1, %d)", buffer, KEYRING_PAGE_SIZE - KEYRING_BAM_BYTES, fileno(k->file));
+  if (pwrite(k->fd, buffer, KEYRING_PAGE_SIZE, 0) != (ssize_t)KEYRING_PAGE_SIZE) {
+    WHYF_perror("pwrite(%d, %p, %zu, 0)", k->fd, buffer, KEYRING_PAGE_SIZE);
     return WHYF("Could not write page into keyring file");
   }
   k->file_size = KEYRING_PAGE_SIZE;
-  return 0;
+  return keyring_map(k);
 }
 
 /*
- * Read the BAM and create initial context using the stored salt.
+ * Copy the BAM of each slab, and create initial context using the stored salt.  Only the first page
+ * of each slab is read from the file.
  */
 static int keyring_load(keyring_file *k, const char *pin)
 {
-  /* Read BAMs for each slab in the file */
+  if (keyring_check_map(k) == -1)
+    return -1;
   keyring_bam **b=&k->bam;
   size_t offset = 0;
-  while (offset < k->file_size) {
-    /* Read bitmap from slab.  If offset is zero, read the salt */
-    if (fseeko(k->file, (off_t)offset, SEEK_SET)) {
-      WHYF_perror("fseeko(%d, %zd, SEEK_SET)", fileno(k->file), offset);
-      return WHY("Could not seek to BAM in keyring file");
-    }
+  while (offset + KEYRING_PAGE_SIZE <= k->file_size) {
     *b = emalloc_zero(sizeof(keyring_bam));
     if (!*b)
       return WHYF("Could not allocate keyring_bam structure");
     (*b)->file_offset = offset;
-    /* Read bitmap */
-    int r = fread((*b)->bitmap, KEYRING_BAM_BYTES, 1, k->file);
-    if (r != 1) {
-      WHYF_perror("fread(%p, %zd, 1, %d)", (*b)->bitmap, KEYRING_BAM_BYTES, fileno(k->file));
-      return WHYF("Could not read BAM from keyring file");
-    }
+    bcopy(&k->map[offset], (*b)->bitmap, KEYRING_BAM_BYTES);
     /* Read salt if this is the first bitmap block.
        We setup a context for this self-supplied key-ring salt.
        (other keyring salts may be provided later on, resulting in
@@ -155,16 +195,14 @@ static int keyring_load(keyring_file *k, const char *pin)
       k->KeyRingSalt = emalloc(k->KeyRingSaltLen);
       if (!k->KeyRingSalt)
 	return WHYF("Could not allocate keyring_context->salt");
-      r = fread(k->KeyRingSalt, k->KeyRingSaltLen, 1, k->file);
-      if (r!=1) {
-	WHYF_perror("fread(%p, %d, 1, %d)", k->KeyRingSalt, k->KeyRingSaltLen, fileno(k->file));
-	return WHYF("Could not read salt from keyring file");
-      }
+      bcopy(&k->map[KEYRING_BAM_BYTES], k->KeyRingSalt, k->KeyRingSaltLen);
     }
     /* Skip to next slab, and find next bam pointer. */
     offset += KEYRING_PAGE_SIZE * (KEYRING_BAM_BYTES << 3);
     b = &(*b)->next;
   }
+  if (!k->bam)
+    return WHY("Keyring file has no BAM");
   return 0;
 }
 
@@ -214,31 +252,211 @@ keypair *keyring_identity_keytype(const keyring_identity *id, unsigned keytype)
   return kp;
 }
 
-keypair *keyring_find_did(keyring_iterator *it, const char *did)
+/* Identities are found through hash indexes of their SID, signing key, DID and public tags,
+ * chained through the identities and keypairs themselves, like the shared secret cache.  The
+ * indexes are kept up to date as identities are added and removed and as their DIDs and tags are
+ * set, so a lookup does not walk the whole keyring.
+ */
+#define KEYRING_INDEX_MIN_BUCKETS 64
+
+static uint32_t index_hash_bytes(uint32_t hash, const unsigned char *bytes, size_t len)
+{
+  // FNV-1a
+  while (len--)
+    hash = (hash ^ *bytes++) * 16777619;
+  return hash;
+}
+
+// DIDs are compared without regard to case
+static unsigned did_hash(const char *did)
+{
+  uint32_t hash = 2166136261;
+  for (; *did; ++did)
+    hash = (hash ^ (unsigned char)tolower(*did)) * 16777619;
+  return hash;
+}
+
+static unsigned tag_hash(const char *name, const unsigned char *value, size_t length)
+{
+  return index_hash_bytes(index_hash_bytes(2166136261, (const unsigned char *)name, strlen(name) + 1), value, length);
+}
+
+// public keys are random, so their first bytes will do
+static unsigned key_hash(const unsigned char *key)
 {
+  return key[0] | key[1] << 8 | key[2] << 16 | (unsigned)key[3] << 24;
+}
+
+static keyring_identity **sid_bucket(keyring_file *k, const sid_t *sid)
+{
+  return &k->sid_index[key_hash(sid->binary) & (k->index_buckets - 1)];
+}
+
+static keyring_identity **sign_bucket(keyring_file *k, const identity_t *sign)
+{
+  return &k->sign_index[key_hash(sign->binary) & (k->index_buckets - 1)];
+}
+
+// Returns the bucket for a DID or public tag keypair, or NULL if the keypair is not indexed.
+static keypair **keypair_bucket(keyring_file *k, const keypair *kp)
+{
+  const char *name;
+  const unsigned char *value;
+  size_t length;
+  switch (kp->type) {
+    case KEYTYPE_DID:
+      return &k->did_index[did_hash((const char *)kp->private_key) & (k->index_buckets - 1)];
+    case KEYTYPE_PUBLIC_TAG:
+      if (keyring_unpack_tag(kp->public_key, kp->public_key_len, &name, &value, &length) == 0)
+	return &k->tag_index[tag_hash(name, value, length) & (k->index_buckets - 1)];
+  }
+  return NULL;
+}
+
+/* Index a DID or public tag keypair of an identity in the keyring.  Each bucket is kept in the
+ * order that identities were added, so that lookups return them in the same order as the
+ * keyring iterator.
+ */
+static void keyring_index_keypair(keyring_file *k, keyring_identity *id, keypair *kp)
+{
+  keypair **b = keypair_bucket(k, kp);
+  if (!b)
+    return;
+  while (*b)
+    b = &(*b)->index_next;
+  kp->identity = id;
+  kp->index_next = NULL;
+  *b = kp;
+}
+
+static void keyring_unindex_keypair(keyring_file *k, keypair *kp)
+{
+  keypair **b = keypair_bucket(k, kp);
+  if (!b)
+    return;
+  while (*b && *b != kp)
+    b = &(*b)->index_next;
+  if (*b)
+    *b = kp->index_next;
+  kp->identity = NULL;
+  kp->index_next = NULL;
+}
+
+static void keyring_index_identity(keyring_file *k, keyring_identity *id)
+{
+  keyring_identity **b = sid_bucket(k, id->box_pk);
+  while (*b)
+    b = &(*b)->sid_next;
+  *b = id;
+  if (id->sign_keypair) {
+    b = sign_bucket(k, &id->sign_keypair->public_key);
+    while (*b)
+      b = &(*b)->sign_next;
+    *b = id;
+  }
   keypair *kp;
-  while((kp=keyring_next_keytype(it, KEYTYPE_DID))){
-    if ((!did[0])
-	||(did[0]=='*'&&did[1]==0)
-	||(!strcasecmp(did,(char *)kp->private_key))
-    ) {
-      return kp;
+  for (kp = id->keypairs; kp; kp = kp->next)
+    keyring_index_keypair(k, id, kp);
+  id->keyring = k;
+}
+
+/* Make room in the indexes for one more identity, rebuilding them from the identity list when
+ * they fill up.
+ */
+static int keyring_grow_index(keyring_file *k)
+{
+  if (k->index_count < k->index_buckets)
+    return 0;
+  unsigned buckets = k->index_buckets ? k->index_buckets * 2 : KEYRING_INDEX_MIN_BUCKETS;
+  keyring_identity **sid_index = emalloc_zero(buckets * sizeof *sid_index);
+  keyring_identity **sign_index = emalloc_zero(buckets * sizeof *sign_index);
+  keypair **did_index = emalloc_zero(buckets * sizeof *did_index);
+  keypair **tag_index = emalloc_zero(buckets * sizeof *tag_index);
+  if (!sid_index || !sign_index || !did_index || !tag_index) {
+    free(sid_index);
+    free(sign_index);
+    free(did_index);
+    free(tag_index);
+    // longer chains are better than no room at all
+    return k->index_buckets ? 0 : -1;
+  }
+  free(k->sid_index);
+  free(k->sign_index);
+  free(k->did_index);
+  free(k->tag_index);
+  k->sid_index = sid_index;
+  k->sign_index = sign_index;
+  k->did_index = did_index;
+  k->tag_index = tag_index;
+  k->index_buckets = buckets;
+  DEBUGF(keyring, "Rebuilding keyring indexes with %u buckets", buckets);
+  keyring_identity *id;
+  for (id = k->identities; id; id = id->next) {
+    if (id->keyring == k) {
+      id->sid_next = id->sign_next = NULL;
+      keyring_index_identity(k, id);
     }
   }
-  return NULL;
+  return 0;
+}
+
+static void keyring_unindex_identity(keyring_file *k, keyring_identity *id)
+{
+  if (id->keyring != k)
+    return;
+  keyring_identity **b = sid_bucket(k, id->box_pk);
+  while (*b && *b != id)
+    b = &(*b)->sid_next;
+  if (*b)
+    *b = id->sid_next;
+  if (id->sign_keypair) {
+    b = sign_bucket(k, &id->sign_keypair->public_key);
+    while (*b && *b != id)
+      b = &(*b)->sign_next;
+    if (*b)
+      *b = id->sign_next;
+  }
+  keypair *kp;
+  for (kp = id->keypairs; kp; kp = kp->next)
+    keyring_unindex_keypair(k, kp);
+  id->sid_next = id->sign_next = NULL;
+  id->keyring = NULL;
+  k->index_count--;
+}
+
+/* Finds the next identity with a matching DID.  The iterator must be new, or have last been moved
+ * by a call to keyring_find_did() with the same DID.  An empty DID or "*" matches every DID.
+ */
+keypair *keyring_find_did(keyring_iterator *it, const char *did)
+{
+  if (!did[0] || (did[0]=='*' && did[1]==0))
+    return keyring_next_keytype(it, KEYTYPE_DID);
+  keyring_file *k = it->file;
+  if (!k->index_buckets)
+    return NULL;
+  keypair *kp = it->keypair ? it->keypair->index_next : k->did_index[did_hash(did) & (k->index_buckets - 1)];
+  while (kp && (kp->type != KEYTYPE_DID || strcasecmp(did, (char *)kp->private_key)))
+    kp = kp->index_next;
+  it->keypair = kp;
+  it->identity = kp ? kp->identity : NULL;
+  return kp;
 }
 
 keyring_identity *keyring_find_identity_sid(keyring_file *k, const sid_t *sidp){
-  keyring_identity *id = k->identities;
-  while(id && (!id->box_pk || cmp_sid_t(id->box_pk,sidp)!=0))
-    id = id->next;
+  if (!k->index_buckets)
+    return NULL;
+  keyring_identity *id = *sid_bucket(k, sidp);
+  while(id && cmp_sid_t(id->box_pk,sidp)!=0)
+    id = id->sid_next;
   return id;
 }
 
 keyring_identity *keyring_find_identity(keyring_file *k, const identity_t *sign){
-  keyring_identity *id = k->identities;
-  while(id && (!id->box_pk || cmp_identity_t(&id->sign_keypair->public_key, sign)!=0))
-    id = id->next;
+  if (!k->index_buckets)
+    return NULL;
+  keyring_identity *id = *sign_bucket(k, sign);
+  while(id && cmp_identity_t(&id->sign_keypair->public_key, sign)!=0)
+    id = id->sign_next;
   return id;
 }
 
@@ -276,9 +494,13 @@ void keyring_free(keyring_file *k)
 {
   if (!k) return;
 
-  /* Close keyring file handle */
-  if (k->file) fclose(k->file);
-  k->file=NULL;
+  /* Unmap and close keyring file */
+  if (k->map)
+    munmap((void *)k->map, k->map_size);
+  k->map = NULL;
+  if (k->fd != -1)
+    close(k->fd);
+  k->fd = -1;
 
   /* Free BAMs (no substructure, so easy) */
   keyring_bam *b=k->bam;
@@ -305,6 +527,12 @@ void keyring_free(keyring_file *k)
     k->KeyRingSalt = NULL;
     k->KeyRingSaltLen = 0;
   }
+  if (k->hints)
+    free(k->hints);
+  if (k->hints_changed)
+    free(k->hints_changed);
+  if (k->hints_path)
+    free(k->hints_path);
   
   /* Wipe out any loaded identities */
   while(k->identities){
@@ -312,6 +540,10 @@ void keyring_free(keyring_file *k)
     k->identities=i->next;
     keyring_free_identity(i);
   }
+  free(k->sid_index);
+  free(k->sign_index);
+  free(k->did_index);
+  free(k->tag_index);
   
   /* Wipe everything, just to be sure. */
   bzero(k,sizeof(keyring_file));
@@ -327,6 +559,7 @@ int keyring_release_identities_by_pin(keyring_file *f, const char *pin)
     keyring_identity *id = (*i);
     if (id->PKRPin && strcmp(id->PKRPin, pin) == 0){
       (*i) = id->next;
+      keyring_unindex_identity(f, id);
       keyring_free_identity(id);
     }else{
       i=&id->next;
@@ -342,6 +575,7 @@ int keyring_release_subscriber(keyring_file *k, const sid_t *sid)
     keyring_identity *id = (*i);
     if (cmp_sid_t(id->box_pk,sid)==0){
       (*i) = id->next;
+      keyring_unindex_identity(k, id);
       keyring_free_identity(id);
       return 0;
     }
@@ -1195,6 +1429,7 @@ static int keyring_finalise_identity(uint8_t *dirty, keyring_identity *id)
 	     so replace it */
 	  WARN("SAS key is invalid -- regenerating.");
 	  crypto_sign_keypair(kp->public_key, kp->private_key);
+	  id->dirty = 1;
 	  if (dirty)
 	    *dirty = 1;
 	}
@@ -1216,58 +1451,327 @@ static int keyring_finalise_identity(uint8_t *dirty, keyring_identity *id)
 }
 
 
-/* Read the slot, and try to decrypt it.  Decryption is symmetric with encryption, so the same
- * function is used for munging the slot before making use of it, whichever way we are going.  Once
- * munged, we then need to verify that the slot is valid, and if so unpack the details of the
- * identity.
+/* The hint key for a PIN is hashed with the salt of each slot to make the slot's hint.
+ */
+static void keyring_hint_key(const keyring_file *k, const char *pin, unsigned char *key)
+{
+  crypto_hash_sha512_state state;
+  crypto_hash_sha512_init(&state);
+  crypto_hash_sha512_update(&state, k->KeyRingSalt, k->KeyRingSaltLen);
+  crypto_hash_sha512_update(&state, (const unsigned char *)k->KeyRingPin, strlen(k->KeyRingPin));
+  crypto_hash_sha512_update(&state, (const unsigned char *)pin, strlen(pin));
+  crypto_hash_sha512_final(&state, key);
+  sodium_memzero(&state, sizeof state);
+}
+
+/* Only the part of the salt that is kept in the hint is hashed, so that a hint can be checked
+ * without reading its slot.
+ */
+static void keyring_slot_hint(const unsigned char *key, const unsigned char *pkrsalt, unsigned char *hint)
+{
+  unsigned char hash[crypto_hash_sha512_BYTES];
+  crypto_hash_sha512_state state;
+  crypto_hash_sha512_init(&state);
+  crypto_hash_sha512_update(&state, key, crypto_hash_sha512_BYTES);
+  crypto_hash_sha512_update(&state, pkrsalt, KEYRING_HINT_SALT_BYTES);
+  crypto_hash_sha512_final(&state, hash);
+  bcopy(pkrsalt, hint, KEYRING_HINT_SALT_BYTES);
+  bcopy(hash, &hint[KEYRING_HINT_SALT_BYTES], KEYRING_HINT_BYTES - KEYRING_HINT_SALT_BYTES);
+}
+
+static int keyring_grow_hints(keyring_file *k, unsigned slot)
+{
+  if (slot < k->hint_slots)
+    return 0;
+  unsigned count = k->hint_slots ? k->hint_slots : KEYRING_ALLOC_CHUNK;
+  while (count <= slot)
+    count *= 2;
+  unsigned char *hints = erealloc(k->hints, count * KEYRING_HINT_BYTES);
+  if (!hints)
+    return -1;
+  bzero(&hints[k->hint_slots * KEYRING_HINT_BYTES], (count - k->hint_slots) * KEYRING_HINT_BYTES);
+  k->hints = hints;
+  unsigned char *changed = erealloc(k->hints_changed, (count + 7) >> 3);
+  if (!changed)
+    return -1;
+  bzero(&changed[(k->hint_slots + 7) >> 3], ((count + 7) >> 3) - ((k->hint_slots + 7) >> 3));
+  k->hints_changed = changed;
+  k->hint_slots = count;
+  return 0;
+}
+
+static void keyring_hint_changed(keyring_file *k, unsigned slot)
+{
+  k->hints_changed[slot >> 3] |= 1 << (slot & 7);
+  k->hints_dirty = 1;
+}
+
+static int keyring_hint_is_changed(const keyring_file *k, unsigned slot)
+{
+  return (k->hints_changed[slot >> 3] & (1 << (slot & 7))) != 0;
+}
+
+/* Record the hint for a slot, or forget it if key is NULL.  Only hints that change are marked to be
+ * written.
+ */
+static int keyring_set_hint(keyring_file *k, unsigned slot, const unsigned char *key, const unsigned char *pkrsalt)
+{
+  static const unsigned char none[KEYRING_HINT_BYTES];
+  if (!key) {
+    if (slot < k->hint_slots && memcmp(&k->hints[slot * KEYRING_HINT_BYTES], none, sizeof none) != 0) {
+      bzero(&k->hints[slot * KEYRING_HINT_BYTES], KEYRING_HINT_BYTES);
+      keyring_hint_changed(k, slot);
+    }
+    return 0;
+  }
+  if (keyring_grow_hints(k, slot) == -1)
+    return -1;
+  unsigned char hint[KEYRING_HINT_BYTES];
+  keyring_slot_hint(key, pkrsalt, hint);
+  if (memcmp(&k->hints[slot * KEYRING_HINT_BYTES], hint, sizeof hint) != 0) {
+    bcopy(hint, &k->hints[slot * KEYRING_HINT_BYTES], sizeof hint);
+    keyring_hint_changed(k, slot);
+  }
+  return 0;
+}
+
+/* Returns true if the slot's hint shows that it cannot be unlocked by the PIN whose hint key is
+ * given.  Slots without a hint must be tried.  If pkrsalt is given, the hint is checked against
+ * it, and a hint made for an older salt is forgotten so the slot is tried; otherwise the hint is
+ * assumed to be current.
+ */
+static int keyring_hint_excludes(keyring_file *k, unsigned slot, const unsigned char *key, const unsigned char *pkrsalt)
+{
+  static const unsigned char none[KEYRING_HINT_SALT_BYTES];
+  if (slot >= k->hint_slots)
+    return 0;
+  unsigned char *hint = &k->hints[slot * KEYRING_HINT_BYTES];
+  if (memcmp(hint, none, KEYRING_HINT_SALT_BYTES) == 0)
+    return 0;
+  if (pkrsalt && memcmp(hint, pkrsalt, KEYRING_HINT_SALT_BYTES) != 0) {
+    bzero(hint, KEYRING_HINT_BYTES);
+    keyring_hint_changed(k, slot);
+    return 0;
+  }
+  unsigned char expected[KEYRING_HINT_BYTES];
+  keyring_slot_hint(key, hint, expected);
+  return memcmp(hint, expected, KEYRING_HINT_BYTES) != 0;
+}
+
+static void keyring_get_stamp(const keyring_file *k, struct keyring_file_stamp *stamp)
+{
+  struct stat st;
+  bzero(stamp, sizeof *stamp);
+  if (fstat(k->fd, &st) == -1) {
+    WHYF_perror("fstat(%d)", k->fd);
+    return;
+  }
+  stamp->inode = st.st_ino;
+  stamp->size = st.st_size;
+  stamp->mtime = st.st_mtime;
+  stamp->ctime = st.st_ctime;
+}
+
+static int keyring_stamp_equal(const struct keyring_file_stamp *a, const struct keyring_file_stamp *b)
+{
+  return a->size && a->inode == b->inode && a->size == b->size && a->mtime == b->mtime && a->ctime == b->ctime;
+}
+
+/* A file written again within the same second could keep the same stamp, so a stamp is only
+ * recorded once its change time is safely in the past.
+ */
+static int keyring_stamp_settled(const struct keyring_file_stamp *stamp)
+{
+  return stamp->size && (uint64_t)time(NULL) > stamp->ctime + 1;
+}
+
+static const char keyring_hints_magic[8] = "SVKHINT2";
+// the hints file also holds the start of the keyring salt, so that hints for another keyring are ignored
+#define KEYRING_HINTS_SALT_BYTES 16
+#define KEYRING_HINTS_STAMP_BYTES (4 * sizeof(uint64_t))
+#define KEYRING_HINTS_HEADER (sizeof keyring_hints_magic + KEYRING_HINTS_SALT_BYTES + KEYRING_HINTS_STAMP_BYTES)
+
+static void keyring_load_hints(keyring_file *k, const char *path)
+{
+  FILE *f = fopen(path, "r");
+  if (!f) {
+    if (errno != ENOENT)
+      WARNF_perror("fopen(%s, \"r\")", alloca_str_toprint(path));
+    return;
+  }
+  unsigned char header[KEYRING_HINTS_HEADER];
+  if (fread(header, sizeof header, 1, f) != 1
+    || memcmp(header, keyring_hints_magic, sizeof keyring_hints_magic) != 0
+    || memcmp(&header[sizeof keyring_hints_magic], k->KeyRingSalt, KEYRING_HINTS_SALT_BYTES) != 0) {
+    DEBUGF(keyring, "ignoring %s, it does not belong to this keyring", alloca_str_toprint(path));
+    fclose(f);
+    return;
+  }
+  const unsigned char *stamp = &header[sizeof keyring_hints_magic + KEYRING_HINTS_SALT_BYTES];
+  k->hints_stamp.inode = read_uint64(&stamp[0]);
+  k->hints_stamp.size = read_uint64(&stamp[8]);
+  k->hints_stamp.mtime = read_uint64(&stamp[16]);
+  k->hints_stamp.ctime = read_uint64(&stamp[24]);
+  unsigned char hint[KEYRING_HINT_BYTES];
+  unsigned slot;
+  for (slot = 0; fread(hint, sizeof hint, 1, f) == 1 && keyring_grow_hints(k, slot) == 0; ++slot)
+    bcopy(hint, &k->hints[slot * KEYRING_HINT_BYTES], sizeof hint);
+  fclose(f);
+  DEBUGF(keyring, "loaded %u slot hints from %s", slot, alloca_str_toprint(path));
+}
+
+/* Write the hints that have changed since the file was last written, or all of them if the file does
+ * not yet hold hints for this keyring.  The header, with the stamp that says whether the hints can
+ * be trusted, is written last.
  */
-static int keyring_decrypt_pkr(keyring_file *k, const char *pin, int slot_number)
-{
-  DEBUGF(keyring, "k=%p, pin=%s slot_number=%d", k, alloca_str_toprint(pin), slot_number);
-  unsigned char slot[KEYRING_PAGE_SIZE];
-  keyring_identity *id=NULL;
-
-  /* 1. Read slot. */
-  if (fseeko(k->file,slot_number*KEYRING_PAGE_SIZE,SEEK_SET))
-    return WHY_perror("fseeko");
-  if (fread(slot, KEYRING_PAGE_SIZE, 1, k->file) != 1)
-    return WHY_perror("fread");
-  /* 2. Decrypt data from slot. */
-  if (keyring_munge_block(slot, KEYRING_PAGE_SIZE, k->KeyRingSalt, k->KeyRingSaltLen, k->KeyRingPin, pin)) {
-    WHYF("keyring_munge_block() failed, slot=%u", slot_number);
-    goto kdp_safeexit;
-  }
-  /* 3. Unpack contents of slot into a new identity in the provided context. */
-  DEBUGF(keyring, "unpack slot %u", slot_number);
-  if (((id = keyring_unpack_identity(slot, pin)) == NULL))
-    goto kdp_safeexit; // Not a valid slot
-  id->slot = slot_number;
-  /* 4. Verify that slot is self-consistent (check MAC) */
+static int keyring_save_hints(keyring_file *k)
+{
+  if (!k->hints_path)
+    return 0;
+  int fd = open(k->hints_path, O_RDWR | O_CREAT, 0666);
+  if (fd == -1)
+    return WHYF_perror("open(%s, O_RDWR|O_CREAT, 0666)", alloca_str_toprint(k->hints_path));
+  unsigned slots = k->file_size / KEYRING_PAGE_SIZE;
+  if (slots > k->hint_slots)
+    slots = k->hint_slots;
+  unsigned char header[KEYRING_HINTS_HEADER];
+  int all = pread(fd, header, sizeof header, 0) != (ssize_t)sizeof header
+    || memcmp(header, keyring_hints_magic, sizeof keyring_hints_magic) != 0
+    || memcmp(&header[sizeof keyring_hints_magic], k->KeyRingSalt, KEYRING_HINTS_SALT_BYTES) != 0;
+  int ret = 0;
+  if (all && ftruncate(fd, KEYRING_HINTS_HEADER) == -1)
+    ret = WHYF_perror("ftruncate(%s, %zu)", alloca_str_toprint(k->hints_path), KEYRING_HINTS_HEADER);
+  // each run of changed hints is written at once
+  unsigned slot = 0;
+  while (ret == 0 && slot < slots) {
+    if (!all && !keyring_hint_is_changed(k, slot)) {
+      ++slot;
+      continue;
+    }
+    unsigned end = slot + 1;
+    while (end < slots && (all || keyring_hint_is_changed(k, end)))
+      ++end;
+    size_t len = (end - slot) * KEYRING_HINT_BYTES;
+    off_t offset = KEYRING_HINTS_HEADER + (off_t)slot * KEYRING_HINT_BYTES;
+    if (pwrite(fd, &k->hints[slot * KEYRING_HINT_BYTES], len, offset) != (ssize_t)len)
+      ret = WHYF_perror("pwrite(%s, %zu, %lld)", alloca_str_toprint(k->hints_path), len, (long long)offset);
+    slot = end;
+  }
+  if (ret == 0) {
+    bcopy(keyring_hints_magic, header, sizeof keyring_hints_magic);
+    bcopy(k->KeyRingSalt, &header[sizeof keyring_hints_magic], KEYRING_HINTS_SALT_BYTES);
+    unsigned char *stamp = &header[sizeof keyring_hints_magic + KEYRING_HINTS_SALT_BYTES];
+    write_uint64(&stamp[0], k->hints_stamp.inode);
+    write_uint64(&stamp[8], k->hints_stamp.size);
+    write_uint64(&stamp[16], k->hints_stamp.mtime);
+    write_uint64(&stamp[24], k->hints_stamp.ctime);
+    if (pwrite(fd, header, sizeof header, 0) != (ssize_t)sizeof header)
+      ret = WHYF_perror("pwrite(%s, %zu, 0)", alloca_str_toprint(k->hints_path), sizeof header);
+  }
+  if (close(fd) == -1)
+    ret = WHYF_perror("close(%s)", alloca_str_toprint(k->hints_path));
+  if (ret == 0 && k->hints_changed)
+    bzero(k->hints_changed, (k->hint_slots + 7) >> 3);
+  return ret;
+}
+
+struct keyring_unlock_stats keyring_unlock_stats;
+
+// How many slots are read and handed to the crypto worker threads at once.
+#define KEYRING_UNLOCK_BATCH 64
+
+struct slot_trial {
+  keyring_file *keyring;
+  const char *pin;
+  unsigned slot;
+  keyring_identity *identity;
+  unsigned char block[KEYRING_PAGE_SIZE];
+};
+
+/* Try to decrypt a slot.  Decryption is symmetric with encryption, so the same function is used
+ * for munging the slot before making use of it, whichever way we are going.  Once munged, we then
+ * need to verify that the slot is valid, and if so unpack the details of the identity.
+ *
+ * Called by the crypto worker threads, so this only reads the keyring file structure.  Returns 0
+ * and sets trial->identity if the slot holds a valid identity for the PIN, 1 if it does not, or -1
+ * if the slot could not be decrypted at all.
+ */
+static int keyring_try_slot(void *context)
+{
+  struct slot_trial *trial = context;
+  keyring_file *k = trial->keyring;
+  keyring_identity *id = NULL;
   unsigned char hash[crypto_hash_sha512_BYTES];
-  if (keyring_identity_mac(id, slot, hash))
-    goto kdp_safeexit;
+  int ret = 1;
+
+  trial->identity = NULL;
+  bzero(hash, sizeof hash);
+  /* 1. Decrypt data from slot. */
+  if (keyring_munge_block(trial->block, KEYRING_PAGE_SIZE, k->KeyRingSalt, k->KeyRingSaltLen, k->KeyRingPin, trial->pin)) {
+    ret = -1;
+    goto kts_safeexit;
+  }
+  /* 2. Unpack contents of slot into a new identity. */
+  DEBUGF(keyring, "unpack slot %u", trial->slot);
+  if (((id = keyring_unpack_identity(trial->block, trial->pin)) == NULL))
+    goto kts_safeexit; // Not a valid slot
+  id->slot = trial->slot;
+  /* 3. Verify that slot is self-consistent (check MAC) */
+  if (keyring_identity_mac(id, trial->block, hash))
+    goto kts_safeexit;
   /* compare hash to record */
-  if (memcmp(hash, &slot[PKR_SALT_BYTES], crypto_hash_sha512_BYTES)) {
-    DEBUGF(keyring, "slot %u is not valid (MAC mismatch)", slot_number);
+  if (memcmp(hash, &trial->block[PKR_SALT_BYTES], crypto_hash_sha512_BYTES)) {
+    DEBUGF(keyring, "slot %u is not valid (MAC mismatch)", trial->slot);
     if (IF_DEBUG(keyring)){
       dump("computed",hash,crypto_hash_sha512_BYTES);
-      dump("stored",&slot[PKR_SALT_BYTES],crypto_hash_sha512_BYTES);
+      dump("stored",&trial->block[PKR_SALT_BYTES],crypto_hash_sha512_BYTES);
     }
-    goto kdp_safeexit;
+    goto kts_safeexit;
   }
+  trial->identity = id;
+  id = NULL;
+  ret = 0;
 
-  if (keyring_commit_identity(k, id)!=1)
-    goto kdp_safeexit;
-
-  return 0;
-
- kdp_safeexit:
-  /* Clean up any potentially sensitive data before exiting */
-  bzero(slot,KEYRING_PAGE_SIZE);
+ kts_safeexit:
+  /* Clean up any potentially sensitive data before exiting, but keep the salt for the slot's hint */
+  bzero(&trial->block[PKR_SALT_BYTES], KEYRING_PAGE_SIZE - PKR_SALT_BYTES);
   bzero(hash,crypto_hash_sha512_BYTES);
   if (id)
     keyring_free_identity(id);
-  return 1;
+  return ret;
+}
+
+/* Try a batch of slots, spread across the crypto worker threads, and add the identities they hold
+ * to the keyring in slot order.  Returns the number of identities added.
+ */
+static unsigned keyring_run_trials(keyring_file *k, struct slot_trial *trials, struct crypto_job *jobs, unsigned count, const unsigned char *hint_key)
+{
+  unsigned i, found = 0;
+  // the log is not thread safe, so with debug.keyring every slot is tried on this thread
+  if (IF_DEBUG(keyring)) {
+    for (i = 0; i < count; ++i)
+      jobs[i].result = keyring_try_slot(&trials[i]);
+  } else {
+    for (i = 0; i < count; ++i)
+      crypto_job_call(&jobs[i], keyring_try_slot, &trials[i]);
+    crypto_jobs_run(jobs, count);
+  }
+  for (i = 0; i < count; ++i) {
+    keyring_identity *id = trials[i].identity;
+    if (jobs[i].result == -1)
+      WHYF("keyring_munge_block() failed, slot=%u", trials[i].slot);
+    if (!id)
+      continue;
+    if (keyring_commit_identity(k, id) != 1) {
+      keyring_free_identity(id);
+      continue;
+    }
+    ++found;
+    // remember which PIN unlocks the slot, if it was not known already
+    if (k->hints_path)
+      keyring_set_hint(k, id->slot, hint_key, trials[i].block);
+  }
+  return found;
 }
 
 /* Try all valid slots with the PIN and see if we find any identities with that PIN.
@@ -1291,7 +1795,30 @@ int keyring_enter_pin(keyring_file *k, const char *pin)
   }
   if (identitiesFound)
     RETURN(identitiesFound);
-    
+  if (keyring_check_map(k) == -1)
+    RETURN(-1);
+
+  struct slot_trial *trials = emalloc(KEYRING_UNLOCK_BATCH * sizeof *trials);
+  struct crypto_job *jobs = emalloc(KEYRING_UNLOCK_BATCH * sizeof *jobs);
+  if (!trials || !jobs) {
+    free(trials);
+    free(jobs);
+    RETURN(-1);
+  }
+  unsigned char hint_key[crypto_hash_sha512_BYTES];
+  keyring_hint_key(k, pin, hint_key);
+  unsigned count = 0;
+  // while the file is unchanged since every hint last matched its slot, the slots need not be read
+  struct keyring_file_stamp stamp;
+  keyring_get_stamp(k, &stamp);
+  int trusted = k->hint_slots && keyring_stamp_equal(&stamp, &k->hints_stamp);
+  if (trusted)
+    DEBUG(keyring, "keyring unchanged since slot hints were checked, trusting them");
+  int complete = 1;
+  // otherwise every occupied slot is read in order, which reading ahead speeds up
+  if (!trusted && k->map)
+    posix_madvise((void *)k->map, k->map_size, POSIX_MADV_NORMAL);
+
   unsigned slot;
   for(slot=0;slot<k->file_size/KEYRING_PAGE_SIZE;slot++) {
     /* slot zero is the BAM and salt, so skip it */
@@ -1310,18 +1837,56 @@ int keyring_enter_pin(keyring_file *k, const char *pin)
       int position=slot&(KEYRING_BAM_BITS-1);
       int byte=position>>3;
       int bit=position&7;
-      if (b->bitmap[byte]&(1<<bit)) {
-	/* Slot is occupied, so check it.
-	    We have to check it for each keyring context (ie keyring pin) */
-	if (keyring_decrypt_pkr(k, pin, slot) == 0)
-	  ++identitiesFound;
+      if (!(b->bitmap[byte]&(1<<bit)))
+	continue;
+      /* Slot is occupied, so try it unless its hint rules out this PIN. */
+      if (file_offset + KEYRING_PAGE_SIZE > k->map_size) {
+	complete = 0;
+	break;
+      }
+      keyring_unlock_stats.slots++;
+      if (!trusted)
+	keyring_unlock_stats.read++;
+      if (keyring_hint_excludes(k, slot, hint_key, trusted ? NULL : &k->map[file_offset])) {
+	keyring_unlock_stats.skipped++;
+	continue;
+      }
+      if (trusted)
+	keyring_unlock_stats.read++;
+      keyring_unlock_stats.tried++;
+      struct slot_trial *trial = &trials[count];
+      bcopy(&k->map[file_offset], trial->block, KEYRING_PAGE_SIZE);
+      trial->keyring = k;
+      trial->pin = pin;
+      trial->slot = slot;
+      if (++count == KEYRING_UNLOCK_BATCH) {
+	identitiesFound += keyring_run_trials(k, trials, jobs, count, hint_key);
+	count = 0;
       }
     }
   }
+  if (count)
+    identitiesFound += keyring_run_trials(k, trials, jobs, count, hint_key);
+  keyring_unlock_stats.found += identitiesFound;
+
+  bzero(trials, KEYRING_UNLOCK_BATCH * sizeof *trials);
+  free(trials);
+  free(jobs);
+  bzero(hint_key, sizeof hint_key);
+  if (!trusted && k->map)
+    posix_madvise((void *)k->map, k->map_size, POSIX_MADV_RANDOM);
+
+  // every hint has now been compared with its slot, so they can be trusted until the file changes
+  if (!trusted && complete && k->hint_slots && keyring_stamp_settled(&stamp)) {
+    k->hints_stamp = stamp;
+    k->hints_dirty = 1;
+  }
 
   if (k->dirty)
     keyring_commit(k);
-  
+  else if (k->hints_dirty && keyring_save_hints(k) == 0)
+    k->hints_dirty = 0;
+
   RETURN(identitiesFound);
   OUT();
 }
@@ -1341,10 +1906,13 @@ static void set_slot(keyring_file *k, unsigned slot, int bitvalue)
   unsigned position = slot & (KEYRING_BAM_BITS - 1);
   unsigned byte = position >> 3;
   unsigned bit = position & 7;
+  unsigned char was = k->bam->bitmap[byte];
   if (bitvalue)
     k->bam->bitmap[byte] |= (1 << bit);
   else
     k->bam->bitmap[byte] &= ~(1 << bit);
+  if (k->bam->bitmap[byte] != was)
+    k->bam->dirty = 1;
 }
 
 /* Find free slot in keyring.  Slot 0 in any slab is the BAM and possible keyring salt, so only
@@ -1371,6 +1939,8 @@ static int keyring_commit_identity(keyring_file *k, keyring_identity *id)
   // Do nothing if an identity with this sid already exists
   if (keyring_find_identity_sid(k, id->box_pk))
     return 0;
+  if (keyring_grow_index(k) == -1)
+    return -1;
   set_slot(k, id->slot, 1);
 
   keyring_identity **i=&k->identities;
@@ -1378,6 +1948,8 @@ static int keyring_commit_identity(keyring_file *k, keyring_identity *id)
     i=&(*i)->next;
 
   *i=id;
+  keyring_index_identity(k, id);
+  k->index_count++;
   add_subscriber(id);
   return 1;
 }
@@ -1448,6 +2020,7 @@ keyring_identity *keyring_create_identity(keyring_file *k, const char *pin)
     goto kci_safeexit;
 
   /* Everything went fine */
+  id->dirty = 1;
   k->dirty = 1;
   return id;
 
@@ -1457,32 +2030,30 @@ keyring_identity *keyring_create_identity(keyring_file *k, const char *pin)
   return NULL;
 }
 
-static int write_random_slot(keyring_file *k, unsigned slot)
+struct keyring_commit_stats keyring_commit_stats;
+
+static int write_page(keyring_file *k, unsigned slot, const unsigned char *page)
 {
-  if (test_slot(k, slot)!=0)
-    return 0;
+  off_t file_offset = (off_t)KEYRING_PAGE_SIZE * slot;
+  if (pwrite(k->fd, page, KEYRING_PAGE_SIZE, file_offset) != (ssize_t)KEYRING_PAGE_SIZE)
+    return WHYF_perror("pwrite(%d, %p, %zu, %ld)", k->fd, page, KEYRING_PAGE_SIZE, (long)file_offset);
+  keyring_commit_stats.pages_written++;
+  return 0;
+}
 
+static int write_random_page(keyring_file *k, unsigned slot)
+{
   DEBUGF(keyring, "Fill slot %u with randomness", slot);
   uint8_t random_data[KEYRING_PAGE_SIZE];
   randombytes_buf(random_data, sizeof random_data);
-
-  off_t file_offset = KEYRING_PAGE_SIZE * slot;
-
-  if (fseeko(k->file, k->file_size, SEEK_SET) == -1)
-    return WHYF_perror("fseeko(%d, %ld, SEEK_SET)", fileno(k->file), (long)file_offset);
-  if (fwrite(random_data, sizeof random_data, 1, k->file) != 1)
-    return WHYF_perror("fwrite(%p, %ld, 1, %d)", random_data, sizeof random_data, fileno(k->file));
-
-  if (k->file_size < file_offset + KEYRING_PAGE_SIZE)
-      k->file_size = file_offset + KEYRING_PAGE_SIZE;
-
-  return 0;
+  keyring_set_hint(k, slot, NULL, NULL);
+  return write_page(k, slot, random_data);
 }
 
-/* Remove the given identity from the keyring by overwriting it's slot in the keyring file with
- * random data, and unlinking it from the in-memory cache list.  Does NOT call
- * keyring_free_identity(id), so the identity's contents remain intact; the caller must free the
- * identity if desired.
+/* Remove the given identity from the keyring by freeing its slot, and unlinking it from the
+ * in-memory cache list.  The next call to keyring_commit() overwrites the slot in the keyring file
+ * with random data.  Does NOT call keyring_free_identity(id), so the identity's contents remain
+ * intact; the caller must free the identity if desired.
  */
 void keyring_destroy_identity(keyring_file *k, keyring_identity *id)
 {
@@ -1497,8 +2068,9 @@ void keyring_destroy_identity(keyring_file *k, keyring_identity *id)
   // Mark the slot as unused in the BAM.
   set_slot(k, id->slot, 0);
 
-  // Fill the slot in the file with random bytes.
-  write_random_slot(k, id->slot);
+  // Fill the slot in the file with random bytes when the keyring is committed.
+  unsigned position = id->slot & (KEYRING_BAM_BITS - 1);
+  k->bam->scrub[position >> 3] |= 1 << (position & 7);
 
   // Unlink the identity from the in-memory cache.
   keyring_identity **i = &k->identities;
@@ -1506,44 +2078,64 @@ void keyring_destroy_identity(keyring_file *k, keyring_identity *id)
     i = &(*i)->next;
   if (*i == id)
     *i = id->next;
+  keyring_unindex_identity(k, id);
 }
 
+/* Write every changed identity, BAM and freed slot to the keyring file, then sync it.  Slots that
+ * are added to the end of the file are filled with random bytes, up to a multiple of
+ * KEYRING_ALLOC_CHUNK slots, so that the file does not show which slots are in use.
+ */
 int keyring_commit(keyring_file *k)
 {
   DEBUGF(keyring, "k=%p", k);
   unsigned errorCount = 0;
-  /* Write all BAMs */
+  unsigned old_slots = k->file_size / KEYRING_PAGE_SIZE;
+  unsigned slot_count = old_slots;
+  unsigned pages_written = keyring_commit_stats.pages_written;
+  keyring_commit_stats.commits++;
+  /* Write the BAMs that have changed */
   keyring_bam *b;
   for (b = k->bam; b; b = b->next) {
-    if (fseeko(k->file, b->file_offset, SEEK_SET) == -1) {
-      WHYF_perror("fseeko(%d, %ld, SEEK_SET)", fileno(k->file), (long)b->file_offset);
-      errorCount++;
-    } else if (fwrite(b->bitmap, KEYRING_BAM_BYTES, 1, k->file) != 1) {
-      WHYF_perror("fwrite(%p, %ld, 1, %d)", b->bitmap, (long)KEYRING_BAM_BYTES, fileno(k->file));
-      errorCount++;
-    } else if (fwrite(k->KeyRingSalt, k->KeyRingSaltLen, 1, k->file)!=1) {
-      WHYF_perror("fwrite(%p, %ld, 1, %d)", k->KeyRingSalt, (long)k->KeyRingSaltLen, fileno(k->file));
+    if (!b->dirty)
+      continue;
+    unsigned char page[KEYRING_PAGE_SIZE];
+    bcopy(b->bitmap, page, KEYRING_BAM_BYTES);
+    bcopy(k->KeyRingSalt, &page[KEYRING_BAM_BYTES], k->KeyRingSaltLen);
+    if (write_page(k, b->file_offset / KEYRING_PAGE_SIZE, page) == -1)
       errorCount++;
-    }
-  }
-  /* For each identity in each context, write the record to disk.
-     This re-salts every identity as it is re-written, and the pin
-     for each identity and context is used, so changing a keypair or pin
-     is as simple as updating the keyring_identity or related structure,
-     and then calling this function. */
+    else
+      b->dirty = 0;
+  }
+  /* Write each identity that has changed, which re-salts it.  The pin for each identity and
+     context is used, so changing a keypair or pin is as simple as updating the keyring_identity
+     or related structure, and then calling this function. */
+  // identities usually share a few PINs, so keep the hint key for the last one
+  unsigned char hint_key[crypto_hash_sha512_BYTES];
+  const char *hint_pin = NULL;
   keyring_iterator it;
   keyring_iterator_start(k, &it);
   while(keyring_next_identity(&it)){
     if (it.identity->slot == 0){
       it.identity->slot = find_free_slot(k);
+      it.identity->dirty = 1;
       DEBUGF(keyring, "Allocate identity into slot %u", it.identity->slot);
     }
+    if (!it.identity->dirty)
+      continue;
     unsigned char pkr[KEYRING_PAGE_SIZE];
 
     if (keyring_pack_identity(it.identity, pkr)){
       errorCount++;
       continue;
     }
+    if (k->hints_path) {
+      const char *pin = it.identity->PKRPin ? it.identity->PKRPin : "";
+      if (!hint_pin || strcmp(hint_pin, pin) != 0) {
+	keyring_hint_key(k, pin, hint_key);
+	hint_pin = pin;
+      }
+      keyring_set_hint(k, it.identity->slot, hint_key, pkr);
+    }
     /* Now crypt and store block */
     /* Crypt */
     if (keyring_munge_block(pkr, KEYRING_PAGE_SIZE,
@@ -1555,51 +2147,57 @@ int keyring_commit(keyring_file *k)
     }
 
     /* Store */
-    off_t file_offset = KEYRING_PAGE_SIZE * it.identity->slot;
-
-    while ((off_t)k->file_size < file_offset){
-      // write randomness into any blank keyring entries
-      // ignoring any range we are about to write anyway
-      unsigned slot = k->file_size / KEYRING_PAGE_SIZE;
-      if (write_random_slot(k, slot)!=0){
-	errorCount++;
-	break;
-      }
-    }
-
     DEBUGF(keyring, "Write identity to slot %u", it.identity->slot);
-
-    if (fseeko(k->file, file_offset, SEEK_SET) == -1) {
-      WHYF_perror("fseeko(%d, %ld, SEEK_SET)", fileno(k->file), (long)file_offset);
+    if (write_page(k, it.identity->slot, pkr) == -1) {
       errorCount++;
       continue;
     }
+    it.identity->dirty = 0;
+    if (slot_count <= it.identity->slot)
+      slot_count = it.identity->slot + 1;
+  }
+  bzero(hint_key, sizeof hint_key);
 
-    if (fwrite(pkr, KEYRING_PAGE_SIZE, 1, k->file) != 1) {
-      WHYF_perror("fwrite(%p, %ld, 1, %d)", pkr, (long)KEYRING_PAGE_SIZE, fileno(k->file));
-      errorCount++;
-      continue;
+  /* Overwrite the slots of destroyed identities */
+  for (b = k->bam; b; b = b->next) {
+    unsigned first = b->file_offset / KEYRING_PAGE_SIZE;
+    unsigned i;
+    for (i = 0; i < KEYRING_BAM_BITS; ++i) {
+      if (!(b->scrub[i >> 3] & (1 << (i & 7))))
+	continue;
+      if (first + i < old_slots && !(b->bitmap[i >> 3] & (1 << (i & 7))) && write_random_page(k, first + i) == -1)
+	errorCount++;
+      else
+	b->scrub[i >> 3] &= ~(1 << (i & 7));
     }
-
-    if (k->file_size < file_offset + KEYRING_PAGE_SIZE)
-      k->file_size = file_offset + KEYRING_PAGE_SIZE;
   }
 
-  // keep writing random bytes until the number of slots that might be used is an exact multiple of KEYRING_ALLOC_CHUNK
-  while(1){
-    unsigned slot_count = k->file_size / KEYRING_PAGE_SIZE;
-    if ((slot_count % KEYRING_ALLOC_CHUNK) == 0)
-      break;
-    if (write_random_slot(k, slot_count)!=0)
-      break;
+  /* Fill any new slots that no identity was written to with random bytes, and keep going until
+     the number of slots that might be used is an exact multiple of KEYRING_ALLOC_CHUNK */
+  if (slot_count % KEYRING_ALLOC_CHUNK)
+    slot_count += KEYRING_ALLOC_CHUNK - slot_count % KEYRING_ALLOC_CHUNK;
+  unsigned slot;
+  for (slot = old_slots; slot < slot_count; ++slot) {
+    if ((slot >= KEYRING_BAM_BITS || !test_slot(k, slot)) && write_random_page(k, slot) == -1)
+      errorCount++;
   }
 
-  if (fflush(k->file) == -1) {
-    WHYF_perror("fflush(%d)", fileno(k->file));
+  if (fsync(k->fd) == -1) {
+    WHYF_perror("fsync(%d)", k->fd);
     errorCount++;
   }
+  if (k->file_size < (size_t)slot_count * KEYRING_PAGE_SIZE) {
+    k->file_size = (size_t)slot_count * KEYRING_PAGE_SIZE;
+    if (keyring_map(k) == -1)
+      errorCount++;
+  }
+  // the file has changed, so the hints must be compared with their slots again before they are trusted
+  if (errorCount || keyring_commit_stats.pages_written != pages_written)
+    bzero(&k->hints_stamp, sizeof k->hints_stamp);
+  if (keyring_save_hints(k) == -1)
+    errorCount++;
   if (!errorCount)
-    k->dirty=0;
+    k->dirty = k->hints_dirty = 0;
   return errorCount ? WHYF("%u errors commiting keyring to disk", errorCount) : 0;
 }
 
@@ -1621,7 +2219,8 @@ int keyring_set_did(keyring_identity *id, const char *did, const char *name)
       return -1;
     keyring_identity_add_keypair(id, kp);
     DEBUG(keyring, "Created DID record for identity");
-  }
+  }else if (id->keyring)
+    keyring_unindex_keypair(id->keyring, kp);
 
   /* Store DID unpacked for ease of searching */
   size_t len=strlen(did);
@@ -1639,6 +2238,9 @@ int keyring_set_did(keyring_identity *id, const char *did, const char *name)
     dump("{keyring} storing did",&kp->private_key[0],32);
     dump("{keyring} storing name",&kp->public_key[0],64);
   }
+  if (id->keyring)
+    keyring_index_keypair(id->keyring, id, kp);
+  id->dirty = 1;
   return 0;
 }
 
@@ -1650,6 +2252,7 @@ int keyring_set_pin(keyring_identity *id, const char *pin)
   }
   if (pin && *pin)
     id->PKRPin = str_edup(pin);
+  id->dirty = 1;
   return 0;
 }
 
@@ -1705,7 +2308,8 @@ int keyring_set_public_tag(keyring_identity *id, const char *name, const unsigne
     if ((kp = keyring_alloc_keypair(KEYTYPE_PUBLIC_TAG, 0)) == NULL)
       return -1;
     keyring_identity_add_keypair(id, kp);
-  }
+  }else if (id->keyring)
+    keyring_unindex_keypair(id->keyring, kp);
   
   if (kp->public_key)
     free(kp->public_key);
@@ -1720,6 +2324,9 @@ int keyring_set_public_tag(keyring_identity *id, const char *name, const unsigne
   
   if (IF_DEBUG(keyring))
     dump("{keyring} New tag", kp->public_key, kp->public_key_len);
+  if (id->keyring)
+    keyring_index_keypair(id->keyring, id, kp);
+  id->dirty = 1;
   return 0;
 }
 
@@ -1738,16 +2345,27 @@ keypair * keyring_find_public_tag(keyring_iterator *it, const char *name, const
   return NULL;
 }
 
+/* Finds the next identity with a public tag of the given name and value.  Like keyring_find_did(),
+ * the iterator must be new, or have last been moved by a call with the same tag and value.
+ */
 keypair * keyring_find_public_tag_value(keyring_iterator *it, const char *name, const unsigned char *value, size_t length)
 {
-  const unsigned char *stored_value;
-  size_t stored_length;
-  keypair *keypair;
-  while((keypair=keyring_find_public_tag(it, name, &stored_value, &stored_length))){
-    if (stored_length == length && memcmp(value, stored_value, length)==0)
-      return keypair;
+  keyring_file *k = it->file;
+  if (!k->index_buckets)
+    return NULL;
+  keypair *kp = it->keypair ? it->keypair->index_next : k->tag_index[tag_hash(name, value, length) & (k->index_buckets - 1)];
+  for (; kp; kp = kp->index_next) {
+    const char *stored_name;
+    const unsigned char *stored_value;
+    size_t stored_length;
+    if (kp->type == KEYTYPE_PUBLIC_TAG
+      && keyring_unpack_tag(kp->public_key, kp->public_key_len, &stored_name, &stored_value, &stored_length) == 0
+      && stored_length == length && strcmp(name, stored_name) == 0 && memcmp(value, stored_value, length) == 0)
+      break;
   }
-  return NULL;
+  it->keypair = kp;
+  it->identity = kp ? kp->identity : NULL;
+  return kp;
 }
 
 // sign the hash of a message, adding the signature to the end of the message buffer.
@@ -1889,6 +2507,14 @@ static keyring_file *keyring_open_create_instance(const char *pin, int force_cre
     keyring_free(k);
     return NULL;
   }
+  if (config.keyring.slot_hints) {
+    char hintsFile[1024];
+    if (FORMF_SERVAL_ETC_PATH(hintsFile, "%s.hints", env)) {
+      keyring_load_hints(k, hintsFile);
+      if (writeable)
+	k->hints_path = str_edup(hintsFile);
+    }
+  }
   RETURN(k);
   OUT();
 }
@@ -1922,49 +2548,124 @@ keyring_file *keyring_open_instance_cli(const struct cli_parsed *parsed)
   can indeed be reused.
 */
 
-/* XXX We need a more efficient implementation than a linear list, but it will
-   do for now. */
+/* Shared secrets are found through a hash of both keys, and once the cache is full, the least
+   recently used one is replaced. The cache is only used by the main thread. */
 struct nm_record {
-  /* 96 bytes per record */
   sid_t known_key;
   sid_t unknown_key;
   unsigned char nm_bytes[crypto_box_BEFORENMBYTES];
+  struct nm_record *hash_next;
+  struct nm_record *lru_prev;
+  struct nm_record *lru_next;
 };
 
-unsigned nm_slots_used=0;
-/* 512 x 96 bytes = 48KB, not too big */
+/* 512 x 120 bytes = 60KB, not too big */
 #define NM_CACHE_SLOTS 512
-struct nm_record nm_cache[NM_CACHE_SLOTS];
+#define NM_CACHE_BUCKETS 1024
+static struct nm_record nm_cache[NM_CACHE_SLOTS];
+static struct nm_record *nm_buckets[NM_CACHE_BUCKETS];
+// most recently used first
+static struct nm_record *nm_lru_head=NULL, *nm_lru_tail=NULL;
+static unsigned nm_slots_used=0;
+struct keyring_nm_stats keyring_nm_stats;
 
-unsigned char *keyring_get_nm_bytes(const uint8_t *box_sk, const sid_t *box_pk, const sid_t *unknown_sidp)
+static struct nm_record **nm_bucket(const sid_t *known_key, const sid_t *unknown_key)
 {
-  IN();
+  // both are public keys, so any of their bytes will do
+  unsigned hash = (known_key->binary[0] | known_key->binary[1]<<8)
+		^ (unknown_key->binary[0] | unknown_key->binary[1]<<8);
+  return &nm_buckets[hash % NM_CACHE_BUCKETS];
+}
 
-  /* See if we have it cached already */
-  unsigned i;
-  for(i=0;i<nm_slots_used;i++){
-    if (cmp_sid_t(&nm_cache[i].known_key, box_pk) != 0) continue;
-    if (cmp_sid_t(&nm_cache[i].unknown_key, unknown_sidp) != 0) continue;
-    RETURN(nm_cache[i].nm_bytes);
+static void nm_lru_unlink(struct nm_record *r)
+{
+  if (r->lru_prev)
+    r->lru_prev->lru_next = r->lru_next;
+  else
+    nm_lru_head = r->lru_next;
+  if (r->lru_next)
+    r->lru_next->lru_prev = r->lru_prev;
+  else
+    nm_lru_tail = r->lru_prev;
+}
+
+static void nm_lru_push(struct nm_record *r)
+{
+  r->lru_prev = NULL;
+  r->lru_next = nm_lru_head;
+  if (nm_lru_head)
+    nm_lru_head->lru_prev = r;
+  else
+    nm_lru_tail = r;
+  nm_lru_head = r;
+}
+
+// look for a cached shared secret, without calculating it
+unsigned char *keyring_find_nm_bytes(const sid_t *box_pk, const sid_t *unknown_sidp)
+{
+  struct nm_record *r;
+  for (r = *nm_bucket(box_pk, unknown_sidp); r; r = r->hash_next){
+    if (cmp_sid_t(&r->known_key, box_pk) == 0 && cmp_sid_t(&r->unknown_key, unknown_sidp) == 0){
+      keyring_nm_stats.hits++;
+      if (r != nm_lru_head){
+	nm_lru_unlink(r);
+	nm_lru_push(r);
+      }
+      return r->nm_bytes;
+    }
   }
+  keyring_nm_stats.misses++;
+  return NULL;
+}
+
+// remember a shared secret that has been calculated elsewhere
+unsigned char *keyring_store_nm_bytes(const sid_t *box_pk, const sid_t *unknown_sidp, const unsigned char *nm_bytes)
+{
+  struct nm_record **bucket = nm_bucket(box_pk, unknown_sidp);
+  struct nm_record *r;
+  for (r = *bucket; r; r = r->hash_next)
+    if (cmp_sid_t(&r->known_key, box_pk) == 0 && cmp_sid_t(&r->unknown_key, unknown_sidp) == 0)
+      return r->nm_bytes;
 
-  /* Not in the cache, so prepare to cache it (or return failure if known is not
-     in fact a known key */
-  /* work out where to store it */
   if (nm_slots_used<NM_CACHE_SLOTS) {
-    i=nm_slots_used; nm_slots_used++; 
+    r = &nm_cache[nm_slots_used++];
   } else {
-    i=randombytes_uniform(NM_CACHE_SLOTS);
-  }
+    // replace the least recently used record
+    r = nm_lru_tail;
+    nm_lru_unlink(r);
+    struct nm_record **p = nm_bucket(&r->known_key, &r->unknown_key);
+    while (*p != r)
+      p = &(*p)->hash_next;
+    *p = r->hash_next;
+    keyring_nm_stats.evictions++;
+  }
+  r->known_key = *box_pk;
+  r->unknown_key = *unknown_sidp;
+  bcopy(nm_bytes, r->nm_bytes, crypto_box_BEFORENMBYTES);
+  r->hash_next = *bucket;
+  *bucket = r;
+  nm_lru_push(r);
+  return r->nm_bytes;
+}
+
+unsigned char *keyring_get_nm_bytes(const uint8_t *box_sk, const sid_t *box_pk, const sid_t *unknown_sidp)
+{
+  IN();
+
+  /* See if we have it cached already */
+  unsigned char *nm_bytes = keyring_find_nm_bytes(box_pk, unknown_sidp);
+  if (nm_bytes)
+    RETURN(nm_bytes);
 
   /* calculate and store */
-  nm_cache[i].known_key = *box_pk;
-  nm_cache[i].unknown_key = *unknown_sidp;
-  if (crypto_box_beforenm(nm_cache[i].nm_bytes, unknown_sidp->binary, box_sk)){
+  unsigned char calculated[crypto_box_BEFORENMBYTES];
+  if (crypto_box_beforenm(calculated, unknown_sidp->binary, box_sk)){
     WHY("crypto_box_beforenm failed");
     RETURN(NULL);
   }
-  RETURN(nm_cache[i].nm_bytes);
+  nm_bytes = keyring_store_nm_bytes(box_pk, unknown_sidp, calculated);
+  bzero(calculated, sizeof calculated);
+  RETURN(nm_bytes);
   OUT();
 }
 
@@ -2098,6 +2799,7 @@ int keyring_load_from_dump(keyring_file *k, unsigned entry_pinc, const char **en
 	keyring_free_keypair(kp);
 	return -1;
       }
+      id->dirty = 1;
       if (pini < entry_pinc  && (id->PKRPin = str_edup(entry_pinv[pini++])) == NULL) {
 	keyring_free_keypair(kp);
 	keyring_free_identity(id);
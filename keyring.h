@@ -34,6 +34,9 @@ typedef struct keypair {
   unsigned char *public_key;
   size_t public_key_len;
   struct keypair *next;
+  // DID and public tag keypairs are indexed by value, see keyring_find_did()
+  struct keyring_identity *identity;
+  struct keypair *index_next;
 } keypair;
 
 /* Contains just the list of private:public key pairs and types,
@@ -50,12 +53,18 @@ typedef struct keyring_identity {
   char *PKRPin;
   struct subscriber *subscriber;
   unsigned int slot;
+  // changed since it was last written to its slot
+  uint8_t dirty;
   struct keyring_challenge *challenge;
   const uint8_t *box_sk;
   const sid_t *box_pk;
   const sign_keypair_t *sign_keypair;
   struct keyring_identity *next;
   keypair *keypairs;
+  // the keyring whose indexes hold this identity, and the next identities in the same buckets
+  struct keyring_file *keyring;
+  struct keyring_identity *sid_next;
+  struct keyring_identity *sign_next;
 } keyring_identity;
 
 #define KEYRING_PAGE_SIZE ((size_t)4096)
@@ -69,18 +78,63 @@ typedef struct keyring_identity {
 typedef struct keyring_bam {
   size_t file_offset;
   unsigned char bitmap[KEYRING_BAM_BYTES];
+  // slots that have been freed, to be filled with random bytes by the next commit
+  unsigned char scrub[KEYRING_BAM_BYTES];
+  uint8_t dirty;
   struct keyring_bam *next;
 } keyring_bam;
 
+/* With keyring.slot_hints, each slot has a hint in a file beside the keyring: the start of the
+ * slot's salt, and two bytes of a hash of that with the PIN of the identity in the slot.  Entering
+ * a PIN skips the slots whose hints do not match it.  A hint is only trusted while its salt matches
+ * the slot, which is re-salted on every commit, so a stale hint file only costs time.
+ *
+ * Comparing the salt means reading the slot's page, so the hints file also records the keyring
+ * file's stamp from when every hint was last found to match its slot.  While the file still has
+ * that stamp, entering a PIN reads only the pages of the slots that it has to try.
+ */
+#define KEYRING_HINT_SALT_BYTES 4
+#define KEYRING_HINT_BYTES (KEYRING_HINT_SALT_BYTES + 2)
+
+// All zero if unknown.  Times are whole seconds, as some file systems keep no more.
+struct keyring_file_stamp {
+  uint64_t inode;
+  uint64_t size;
+  uint64_t mtime;
+  uint64_t ctime;
+};
+
 typedef struct keyring_file {
   keyring_bam *bam;
   char *KeyRingPin;
   unsigned char *KeyRingSalt;
   int KeyRingSaltLen;
   keyring_identity *identities;
-  FILE *file;
+  /* The file is mapped read-only, so that opening it and entering a PIN only touch the pages that
+   * are needed.  A commit writes just the pages that have changed, then syncs the file once.
+   */
+  int fd;
+  const unsigned char *map;
+  size_t map_size;
   size_t file_size;
   uint8_t dirty;
+  char *hints_path;
+  // KEYRING_HINT_BYTES for each slot, all zero if the slot has no hint
+  unsigned char *hints;
+  // a bit for each slot whose hint has changed since the hints file was written
+  unsigned char *hints_changed;
+  unsigned hint_slots;
+  uint8_t hints_dirty;
+  struct keyring_file_stamp hints_stamp;
+  /* Hash indexes of the identities by SID, signing key, DID and public tag value.  All four have
+   * index_buckets buckets, a power of two that doubles as identities are added.
+   */
+  unsigned index_buckets;
+  unsigned index_count;
+  keyring_identity **sid_index;
+  keyring_identity **sign_index;
+  keypair **did_index;
+  keypair **tag_index;
 } keyring_file;
 
 typedef struct keyring_iterator{
@@ -138,6 +192,31 @@ int keyring_load_from_dump(keyring_file *k, unsigned entry_pinc, const char **en
 int keyring_dump(keyring_file *k, XPRINTF xpf, int include_secret);
 
 unsigned char *keyring_get_nm_bytes(const uint8_t *box_sk, const sid_t *box_pk, const sid_t *unknown_sidp);
+unsigned char *keyring_find_nm_bytes(const sid_t *box_pk, const sid_t *unknown_sidp);
+unsigned char *keyring_store_nm_bytes(const sid_t *box_pk, const sid_t *unknown_sidp, const unsigned char *nm_bytes);
+
+struct keyring_nm_stats{
+  unsigned hits;
+  unsigned misses;
+  unsigned evictions;
+};
+extern struct keyring_nm_stats keyring_nm_stats;
+
+struct keyring_unlock_stats{
+  unsigned slots;
+  // slot pages read, to compare hint salts or to try the PIN
+  unsigned read;
+  unsigned skipped;
+  unsigned tried;
+  unsigned found;
+};
+extern struct keyring_unlock_stats keyring_unlock_stats;
+
+struct keyring_commit_stats{
+  unsigned commits;
+  unsigned pages_written;
+};
+extern struct keyring_commit_stats keyring_commit_stats;
 
 struct internal_mdp_header;
 struct overlay_buffer;
@@ -0,0 +1,384 @@
+/*
+ Serval DNA - keyring testing command line functions
+ Copyright (C) 2026 Serval Project Inc.
+
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU General Public License
+ as published by the Free Software Foundation; either version 2
+ of the License, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include "cli.h"
+#include "conf.h"
+#include "commandline.h"
+#include "instance.h"
+#include "keyring.h"
+#include "mem.h"
+#include "str.h"
+#include "strbuf.h"
+#include "strbuf_helpers.h"
+
+DEFINE_FEATURE(cli_keyring_tests);
+
+// The benchmarks use their own keyring file in the instance directory, and remove it afterwards.
+#define BENCHMARK_KEYRING "benchmark.keyring"
+
+static const char *benchmark_pin(char *buf, size_t len, unsigned n)
+{
+  return strbuf_str(strbuf_sprintf(strbuf_local(buf, len), "pin%u", n));
+}
+
+static void benchmark_keyring_remove()
+{
+  char path[1024];
+  if (FORMF_SERVAL_ETC_PATH(path, "%s", BENCHMARK_KEYRING))
+    unlink(path);
+  if (FORMF_SERVAL_ETC_PATH(path, "%s.hints", BENCHMARK_KEYRING))
+    unlink(path);
+}
+
+/* Create a keyring of 'count' identities, spread evenly over 'pins' PINs.
+ */
+static int benchmark_keyring_create(unsigned count, unsigned pins)
+{
+  keyring_file *k = keyring_create_instance();
+  if (!k)
+    return -1;
+  unsigned i;
+  for (i = 0; i < count; ++i) {
+    char pin[20];
+    if (!keyring_create_identity(k, benchmark_pin(pin, sizeof pin, i % pins))) {
+      keyring_free(k);
+      return WHYF("Only created %u of %u benchmark identities", i, count);
+    }
+  }
+  int ret = keyring_commit(k);
+  keyring_free(k);
+  return ret;
+}
+
+// Count the pages of the keyring file that are in memory.
+static unsigned benchmark_resident_pages(const keyring_file *k)
+{
+  size_t pages = (k->map_size + getpagesize() - 1) / getpagesize();
+  unsigned char *vec = emalloc(pages);
+  if (!vec)
+    return 0;
+  unsigned resident = 0;
+  if (mincore((void *)k->map, k->map_size, (void *)vec) == 0) {
+    size_t i;
+    for (i = 0; i < pages; ++i)
+      if (vec[i] & 1)
+	++resident;
+  }
+  free(vec);
+  return resident;
+}
+
+/* Open the benchmark keyring and enter the first PIN, returning the elapsed time, or -1 if the
+ * wrong number of identities was found.  The file is dropped from the page cache first, so that
+ * the pages it has in memory afterwards are the ones entering the PIN read from disk.  Unless
+ * trust_stamp is set, the slot hints are compared with every slot, as they would be if the file
+ * had changed since the hints were saved.
+ */
+static time_ms_t benchmark_unlock(unsigned expected, int trust_stamp, unsigned *paged_in)
+{
+  bzero(&keyring_unlock_stats, sizeof keyring_unlock_stats);
+  time_ms_t start = gettime_ms();
+  keyring_file *k = keyring_open_instance("");
+  if (!k)
+    return -1;
+  if (!trust_stamp)
+    bzero(&k->hints_stamp, sizeof k->hints_stamp);
+  posix_fadvise(k->fd, 0, 0, POSIX_FADV_DONTNEED);
+  unsigned resident = benchmark_resident_pages(k);
+  int found = keyring_enter_pin(k, "pin0");
+  time_ms_t elapsed = gettime_ms() - start;
+  *paged_in = benchmark_resident_pages(k) - resident;
+  keyring_free(k);
+  if (found < 0 || (unsigned)found != expected)
+    return WHYF("Found %d identities, expected %u", found, expected);
+  return elapsed;
+}
+
+DEFINE_CMD(app_keyring_unlock_test, 0,
+   "Run keyring PIN unlocking speed test, with and without crypto threads and slot hints",
+   "test","keyring","unlock","[<count>]","[<pins>]");
+static int app_keyring_unlock_test(const struct cli_parsed *parsed, struct cli_context *context)
+{
+  const char *count_arg, *pins_arg;
+  cli_arg(parsed, "count", &count_arg, cli_uint, NULL);
+  cli_arg(parsed, "pins", &pins_arg, cli_uint, NULL);
+  unsigned count = count_arg ? atoi(count_arg) : 1000;
+  unsigned pins = pins_arg ? atoi(pins_arg) : 10;
+  if (count == 0 || pins == 0)
+    return 0;
+  if (count >= KEYRING_BAM_BITS)
+    return WHYF("At most %u identities fit in a keyring", (unsigned)KEYRING_BAM_BITS - 1);
+
+  if (setenv("SERVALD_KEYRING_PATH", BENCHMARK_KEYRING, 1) == -1)
+    return WHY_perror("setenv");
+  int ret = -1;
+  unsigned short threads = config.mdp.crypto_threads;
+  time_ms_t start = gettime_ms();
+  if (benchmark_keyring_create(count, pins) == -1)
+    goto end;
+  cli_printf(context, "Created %u identities with %u PINs in %"PRId64"ms\n", count, pins, (int64_t)(gettime_ms() - start));
+
+  unsigned expected = (count + pins - 1) / pins;
+  static const char *passes[] = {"main thread", "crypto threads", "slot hints", "settled hints"};
+  unsigned pass;
+  for (pass = 0; pass < NELS(passes); ++pass) {
+    // the crypto threads only start once, so the main thread pass must go first
+    config.mdp.crypto_threads = pass == 0 ? 0 : threads;
+    config.keyring.slot_hints = pass >= 2;
+    if (pass == 3) {
+      // once the file has not changed for a while, entering a PIN records its stamp with the hints
+      sleep(2);
+      keyring_file *k = keyring_open_instance("");
+      if (!k)
+	goto end;
+      keyring_enter_pin(k, "pin0");
+      keyring_free(k);
+    }
+    if (pass == 2) {
+      // entering every PIN once records the hints for all the slots
+      keyring_file *k = keyring_open_instance("");
+      if (!k)
+	goto end;
+      unsigned i;
+      for (i = 0; i < pins; ++i) {
+	char pin[20];
+	keyring_enter_pin(k, benchmark_pin(pin, sizeof pin, i));
+      }
+      keyring_free(k);
+    }
+    unsigned paged_in;
+    time_ms_t elapsed = benchmark_unlock(expected, pass == 3, &paged_in);
+    if (elapsed == -1)
+      goto end;
+    if (elapsed <= 0)
+      elapsed = 1;
+    cli_printf(context, "%-16s took %6"PRId64"ms - %8.0f slots/second (%u slots, %u tried, %u skipped, %u found, %u read, %u paged in)\n",
+	passes[pass], (int64_t)elapsed, keyring_unlock_stats.slots * 1000.0 / elapsed,
+	keyring_unlock_stats.slots, keyring_unlock_stats.tried, keyring_unlock_stats.skipped,
+	keyring_unlock_stats.found, keyring_unlock_stats.read, paged_in);
+  }
+  ret = 0;
+end:
+  config.mdp.crypto_threads = threads;
+  config.keyring.slot_hints = 0;
+  benchmark_keyring_remove();
+  unsetenv("SERVALD_KEYRING_PATH");
+  return ret;
+}
+
+static void benchmark_commit_report(struct cli_context *context, const char *what, time_ms_t start, unsigned pages)
+{
+  cli_printf(context, "%-24s took %6"PRId64"ms, wrote %u pages\n", what, (int64_t)(gettime_ms() - start),
+    keyring_commit_stats.pages_written - pages);
+}
+
+DEFINE_CMD(app_keyring_commit_test, 0,
+   "Run keyring open and commit speed test, changing one identity in a large keyring",
+   "test","keyring","commit","[<count>]");
+static int app_keyring_commit_test(const struct cli_parsed *parsed, struct cli_context *context)
+{
+  const char *count_arg;
+  cli_arg(parsed, "count", &count_arg, cli_uint, NULL);
+  unsigned count = count_arg ? atoi(count_arg) : 1000;
+  if (count == 0)
+    return 0;
+  if (count >= KEYRING_BAM_BITS - 1)
+    return WHYF("At most %u identities fit in a keyring", (unsigned)KEYRING_BAM_BITS - 2);
+
+  if (setenv("SERVALD_KEYRING_PATH", BENCHMARK_KEYRING, 1) == -1)
+    return WHY_perror("setenv");
+  int ret = -1;
+  keyring_file *k = NULL;
+  time_ms_t start = gettime_ms();
+  unsigned pages = keyring_commit_stats.pages_written;
+  if (benchmark_keyring_create(count, 1) == -1)
+    goto end;
+  benchmark_commit_report(context, "create", start, pages);
+
+  start = gettime_ms();
+  if ((k = keyring_open_instance("")) == NULL)
+    goto end;
+  cli_printf(context, "%-24s took %6"PRId64"ms, %zu byte file\n", "open", (int64_t)(gettime_ms() - start), k->file_size);
+
+  start = gettime_ms();
+  int found = keyring_enter_pin(k, "pin0");
+  cli_printf(context, "%-24s took %6"PRId64"ms, %d identities\n", "enter PIN", (int64_t)(gettime_ms() - start), found);
+  if (found < 0 || (unsigned)found != count) {
+    WHYF("Found %d identities, expected %u", found, count);
+    goto end;
+  }
+
+  start = gettime_ms();
+  pages = keyring_commit_stats.pages_written;
+  if (keyring_set_did(k->identities, "5551234", "Benchmark") == -1 || keyring_commit(k) == -1)
+    goto end;
+  benchmark_commit_report(context, "set DID and commit", start, pages);
+
+  start = gettime_ms();
+  pages = keyring_commit_stats.pages_written;
+  keyring_identity *id = keyring_create_identity(k, "pin0");
+  if (!id || keyring_commit(k) == -1)
+    goto end;
+  benchmark_commit_report(context, "add identity and commit", start, pages);
+
+  start = gettime_ms();
+  pages = keyring_commit_stats.pages_written;
+  keyring_destroy_identity(k, id);
+  keyring_free_identity(id);
+  if (keyring_commit(k) == -1)
+    goto end;
+  benchmark_commit_report(context, "remove and commit", start, pages);
+  ret = 0;
+end:
+  keyring_free(k);
+  benchmark_keyring_remove();
+  unsetenv("SERVALD_KEYRING_PATH");
+  return ret;
+}
+
+static void benchmark_lookup_report(struct cli_context *context, const char *what, time_ms_t elapsed, unsigned lookups)
+{
+  if (elapsed <= 0)
+    elapsed = 1;
+  cli_printf(context, "%-24s took %6"PRId64"ms - %10.0f lookups/second\n", what, (int64_t)elapsed, lookups * 1000.0 / elapsed);
+}
+
+/* Look up every identity in the keyring by SID, signing key, DID and public tag, both through the
+ * indexes and by walking the identity list, as the keyring did before it had indexes.
+ */
+DEFINE_CMD(app_keyring_lookup_test, 0,
+   "Run keyring identity lookup speed test, with and without the indexes",
+   "test","keyring","lookup","[<count>]");
+static int app_keyring_lookup_test(const struct cli_parsed *parsed, struct cli_context *context)
+{
+  const char *count_arg;
+  cli_arg(parsed, "count", &count_arg, cli_uint, NULL);
+  unsigned count = count_arg ? atoi(count_arg) : 1000;
+  if (count == 0)
+    return 0;
+  if (count >= KEYRING_BAM_BITS)
+    return WHYF("At most %u identities fit in a keyring", (unsigned)KEYRING_BAM_BITS - 1);
+
+  if (setenv("SERVALD_KEYRING_PATH", BENCHMARK_KEYRING, 1) == -1)
+    return WHY_perror("setenv");
+  int ret = -1;
+  keyring_file *k = NULL;
+  time_ms_t start = gettime_ms();
+  if (benchmark_keyring_create(count, 1) == -1)
+    goto end;
+  if ((k = keyring_open_instance("")) == NULL)
+    goto end;
+  int found = keyring_enter_pin(k, "pin0");
+  if (found < 0 || (unsigned)found != count) {
+    WHYF("Found %d identities, expected %u", found, count);
+    goto end;
+  }
+  keyring_identity *id;
+  unsigned i = 0;
+  for (id = k->identities; id; id = id->next, ++i) {
+    char did[20];
+    benchmark_pin(did, sizeof did, i);
+    if (keyring_set_did(id, did, "Benchmark") == -1
+      || keyring_set_public_tag(id, "benchmark", (const unsigned char *)did, strlen(did)) == -1)
+      goto end;
+  }
+  cli_printf(context, "Loaded %u identities in %"PRId64"ms\n", count, (int64_t)(gettime_ms() - start));
+
+  unsigned pass;
+  for (pass = 0; pass < 2; ++pass) {
+    const char *how = pass == 0 ? "linear" : "indexed";
+    unsigned matched = 0;
+    keyring_iterator it;
+    char what[40];
+
+    start = gettime_ms();
+    for (id = k->identities; id; id = id->next) {
+      keyring_identity *f;
+      if (pass == 0) {
+	keyring_iterator_start(k, &it);
+	while ((f = keyring_next_identity(&it)) && cmp_sid_t(f->box_pk, id->box_pk) != 0)
+	  ;
+      } else
+	f = keyring_find_identity_sid(k, id->box_pk);
+      matched += f == id;
+    }
+    benchmark_lookup_report(context, strbuf_str(strbuf_sprintf(strbuf_local_buf(what), "%s SID", how)), gettime_ms() - start, count);
+
+    start = gettime_ms();
+    for (id = k->identities; id; id = id->next) {
+      keyring_identity *f;
+      if (pass == 0) {
+	keyring_iterator_start(k, &it);
+	while ((f = keyring_next_identity(&it)) && cmp_identity_t(&f->sign_keypair->public_key, &id->sign_keypair->public_key) != 0)
+	  ;
+      } else
+	f = keyring_find_identity(k, &id->sign_keypair->public_key);
+      matched += f == id;
+    }
+    benchmark_lookup_report(context, strbuf_str(strbuf_sprintf(strbuf_local_buf(what), "%s signing key", how)), gettime_ms() - start, count);
+
+    start = gettime_ms();
+    for (i = 0, id = k->identities; id; id = id->next, ++i) {
+      char did[20];
+      benchmark_pin(did, sizeof did, i);
+      keyring_iterator_start(k, &it);
+      keypair *kp;
+      if (pass == 0) {
+	while ((kp = keyring_next_keytype(&it, KEYTYPE_DID)) && strcasecmp(did, (const char *)kp->private_key) != 0)
+	  ;
+      } else
+	kp = keyring_find_did(&it, did);
+      matched += kp && it.identity == id;
+    }
+    benchmark_lookup_report(context, strbuf_str(strbuf_sprintf(strbuf_local_buf(what), "%s DID", how)), gettime_ms() - start, count);
+
+    start = gettime_ms();
+    for (i = 0, id = k->identities; id; id = id->next, ++i) {
+      char did[20];
+      benchmark_pin(did, sizeof did, i);
+      keyring_iterator_start(k, &it);
+      keypair *kp;
+      if (pass == 0) {
+	const unsigned char *value;
+	size_t length;
+	while ((kp = keyring_find_public_tag(&it, "benchmark", &value, &length))
+	  && (length != strlen(did) || memcmp(value, did, length) != 0))
+	  ;
+      } else
+	kp = keyring_find_public_tag_value(&it, "benchmark", (const unsigned char *)did, strlen(did));
+      matched += kp && it.identity == id;
+    }
+    benchmark_lookup_report(context, strbuf_str(strbuf_sprintf(strbuf_local_buf(what), "%s public tag", how)), gettime_ms() - start, count);
+
+    if (matched != count * 4) {
+      WHYF("%s lookups found %u of %u identities", how, matched, count * 4);
+      goto end;
+    }
+  }
+  ret = 0;
+end:
+  keyring_free(k);
+  benchmark_keyring_remove();
+  unsetenv("SERVALD_KEYRING_PATH");
+  return ret;
+}
@@ -0,0 +1,396 @@
+/*
+Copyright (C) 2026 Serval Project Inc.
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#include <string.h>
+#include <assert.h>
+#include "list_writer.h"
+
+#define CBOR_UINT	(0 << 5)
+#define CBOR_NEGINT	(1 << 5)
+#define CBOR_BYTES	(2 << 5)
+#define CBOR_TEXT	(3 << 5)
+#define CBOR_ARRAY	(4 << 5)
+#define CBOR_MAP	(5 << 5)
+#define CBOR_FALSE	0xF4
+#define CBOR_TRUE	0xF5
+#define CBOR_NULL	0xF6
+#define CBOR_INDEFINITE_ARRAY 0x9F
+#define CBOR_INDEFINITE_MAP 0xBF
+#define CBOR_BREAK	0xFF
+
+static const char hexdigit[] = "0123456789ABCDEF";
+
+void lw_init(struct list_writer *w, enum list_format format, unsigned columns)
+{
+  memset(w, 0, sizeof *w);
+  w->format = format;
+  w->columns = columns;
+}
+
+/* Start filling a new buffer.  Any item that overran the previous buffer must be written again.
+ */
+void lw_buffer(struct list_writer *w, unsigned char *buf, size_t size)
+{
+  w->buf = buf;
+  w->size = size;
+  w->length = 0;
+  w->committed = 0;
+  w->need = 0;
+  w->column = 0;
+}
+
+// Once an item has overrun the buffer, the rest of it is only counted, not written.
+static inline void put(struct list_writer *w, const void *bytes, size_t len)
+{
+  if (w->length + len <= w->size)
+    memcpy(w->buf + w->length, bytes, len);
+  w->length += len;
+}
+
+static inline void putc_(struct list_writer *w, unsigned char c)
+{
+  if (w->length < w->size)
+    w->buf[w->length] = c;
+  w->length++;
+}
+
+// Keep or roll back the item that has just been written.
+static int commit(struct list_writer *w)
+{
+  if (w->length > w->size) {
+    w->need = w->length - w->committed;
+    w->length = w->committed;
+    return 0;
+  }
+  w->committed = w->length;
+  return 1;
+}
+
+static void cbor_head(struct list_writer *w, unsigned char major, uint64_t value)
+{
+  unsigned char head[9];
+  size_t n;
+  if (value < 24) {
+    head[0] = major | value;
+    n = 1;
+  } else if (value <= 0xFF) {
+    head[0] = major | 24;
+    n = 2;
+  } else if (value <= 0xFFFF) {
+    head[0] = major | 25;
+    n = 3;
+  } else if (value <= 0xFFFFFFFF) {
+    head[0] = major | 26;
+    n = 5;
+  } else {
+    head[0] = major | 27;
+    n = 9;
+  }
+  size_t i;
+  for (i = n - 1; i > 0; --i, value >>= 8)
+    head[i] = value & 0xFF;
+  put(w, head, n);
+}
+
+static void json_uint64(struct list_writer *w, uint64_t value)
+{
+  char digits[20];
+  char *p = digits + sizeof digits;
+  do {
+    *--p = '0' + value % 10;
+    value /= 10;
+  } while (value);
+  put(w, p, digits + sizeof digits - p);
+}
+
+static void json_char(struct list_writer *w, uint32_t c)
+{
+  char esc[12];
+  switch (c) {
+    case '"':  put(w, "\\\"", 2); return;
+    case '\\': put(w, "\\\\", 2); return;
+    case '\b': put(w, "\\b", 2); return;
+    case '\f': put(w, "\\f", 2); return;
+    case '\n': put(w, "\\n", 2); return;
+    case '\r': put(w, "\\r", 2); return;
+    case '\t': put(w, "\\t", 2); return;
+  }
+  uint32_t units[2];
+  unsigned n = 1, i;
+  if (c >= 0x10000) {
+    c -= 0x10000;
+    units[0] = 0xD800 + ((c >> 10) & 0x3FF);
+    units[1] = 0xDC00 + (c & 0x3FF);
+    n = 2;
+  } else
+    units[0] = c;
+  for (i = 0; i < n; ++i) {
+    esc[i * 6] = '\\';
+    esc[i * 6 + 1] = 'u';
+    esc[i * 6 + 2] = hexdigit[(units[i] >> 12) & 0xF];
+    esc[i * 6 + 3] = hexdigit[(units[i] >> 8) & 0xF];
+    esc[i * 6 + 4] = hexdigit[(units[i] >> 4) & 0xF];
+    esc[i * 6 + 5] = hexdigit[units[i] & 0xF];
+  }
+  put(w, esc, n * 6);
+}
+
+/* Produces the same escaping as strbuf_json_string(): printable ASCII is copied in runs, and
+ * everything else is decoded from UTF-8 and escaped.
+ */
+static void json_string(struct list_writer *w, const char *str, size_t len)
+{
+  static const uint32_t offsetsFromUTF8[6] = {
+    0x00000000UL, 0x00003080UL, 0x000E2080UL,
+    0x03C82080UL, 0xFA082080UL, 0x82082080UL
+  };
+  const unsigned char *s = (const unsigned char *)str;
+  const unsigned char *e = s + len;
+  putc_(w, '"');
+  while (s < e) {
+    const unsigned char *run = s;
+    while (s < e && *s >= 0x20 && *s < 0x7F && *s != '"' && *s != '\\')
+      ++s;
+    if (s != run)
+      put(w, run, s - run);
+    if (s == e)
+      break;
+    uint32_t c = 0;
+    unsigned sz = 0;
+    do {
+      c = (c << 6) + *s++;
+      sz++;
+    } while (s < e && (*s & 0xC0) == 0x80 && sz < 6);
+    json_char(w, c - offsetsFromUTF8[sz - 1]);
+  }
+  putc_(w, '"');
+}
+
+// Separate JSON values within a row.
+static inline void value(struct list_writer *w)
+{
+  assert(w->column < w->columns);
+  if (w->format == LIST_FORMAT_JSON && w->column)
+    putc_(w, ',');
+  w->column++;
+}
+
+static void field_name(struct list_writer *w, const char *name)
+{
+  size_t len = strlen(name);
+  if (w->format == LIST_FORMAT_JSON) {
+    json_string(w, name, len);
+    putc_(w, ':');
+  } else {
+    cbor_head(w, CBOR_TEXT, len);
+    put(w, name, len);
+  }
+}
+
+void lw_start(struct list_writer *w)
+{
+  if (w->format == LIST_FORMAT_JSON)
+    put(w, "{\n", 2);
+  else
+    putc_(w, CBOR_INDEFINITE_MAP);
+}
+
+void lw_field_uint64(struct list_writer *w, const char *name, uint64_t v)
+{
+  field_name(w, name);
+  if (w->format == LIST_FORMAT_JSON) {
+    json_uint64(w, v);
+    put(w, ",\n", 2);
+  } else
+    cbor_head(w, CBOR_UINT, v);
+}
+
+void lw_field_string(struct list_writer *w, const char *name, const char *str)
+{
+  field_name(w, name);
+  size_t len = str ? strlen(str) : 0;
+  if (w->format == LIST_FORMAT_JSON) {
+    if (str)
+      json_string(w, str, len);
+    else
+      put(w, "null", 4);
+    put(w, ",\n", 2);
+  } else if (str) {
+    cbor_head(w, CBOR_TEXT, len);
+    put(w, str, len);
+  } else
+    putc_(w, CBOR_NULL);
+}
+
+int lw_header(struct list_writer *w, const char *const *headers)
+{
+  unsigned i;
+  field_name(w, "header");
+  switch (w->format) {
+    case LIST_FORMAT_JSON:
+      putc_(w, '[');
+      for (i = 0; i != w->columns; ++i) {
+	if (i)
+	  putc_(w, ',');
+	json_string(w, headers[i], strlen(headers[i]));
+      }
+      put(w, "],\n", 3);
+      field_name(w, "rows");
+      putc_(w, '[');
+      break;
+    case LIST_FORMAT_CBOR:
+      cbor_head(w, CBOR_ARRAY, w->columns);
+      for (i = 0; i != w->columns; ++i) {
+	size_t len = strlen(headers[i]);
+	cbor_head(w, CBOR_TEXT, len);
+	put(w, headers[i], len);
+      }
+      field_name(w, "rows");
+      putc_(w, CBOR_INDEFINITE_ARRAY);
+      break;
+  }
+  return commit(w);
+}
+
+void lw_row_start(struct list_writer *w)
+{
+  w->column = 0;
+  switch (w->format) {
+    case LIST_FORMAT_JSON:
+      if (w->rowcount)
+	putc_(w, ',');
+      put(w, "\n[", 2);
+      break;
+    case LIST_FORMAT_CBOR:
+      cbor_head(w, CBOR_ARRAY, w->columns);
+      break;
+  }
+}
+
+/* Returns 1 if the row fitted in the buffer, or 0 if it was rolled back.
+ */
+int lw_row_end(struct list_writer *w)
+{
+  assert(w->column == w->columns);
+  if (w->format == LIST_FORMAT_JSON)
+    putc_(w, ']');
+  if (!commit(w))
+    return 0;
+  ++w->rowcount;
+  return 1;
+}
+
+int lw_trailer(struct list_writer *w)
+{
+  switch (w->format) {
+    case LIST_FORMAT_JSON:
+      put(w, "\n]\n}\n", 5);
+      break;
+    case LIST_FORMAT_CBOR:
+      putc_(w, CBOR_BREAK); // rows
+      putc_(w, CBOR_BREAK); // map
+      break;
+  }
+  return commit(w);
+}
+
+void lw_null(struct list_writer *w)
+{
+  value(w);
+  if (w->format == LIST_FORMAT_JSON)
+    put(w, "null", 4);
+  else
+    putc_(w, CBOR_NULL);
+}
+
+void lw_boolean(struct list_writer *w, int b)
+{
+  value(w);
+  if (w->format == LIST_FORMAT_JSON)
+    put(w, b ? "true" : "false", b ? 4 : 5);
+  else
+    putc_(w, b ? CBOR_TRUE : CBOR_FALSE);
+}
+
+void lw_uint64(struct list_writer *w, uint64_t v)
+{
+  value(w);
+  if (w->format == LIST_FORMAT_JSON)
+    json_uint64(w, v);
+  else
+    cbor_head(w, CBOR_UINT, v);
+}
+
+void lw_int64(struct list_writer *w, int64_t v)
+{
+  value(w);
+  if (w->format == LIST_FORMAT_JSON) {
+    if (v < 0) {
+      putc_(w, '-');
+      json_uint64(w, -(uint64_t)v);
+    } else
+      json_uint64(w, v);
+  } else if (v < 0)
+    cbor_head(w, CBOR_NEGINT, -1 - v);
+  else
+    cbor_head(w, CBOR_UINT, v);
+}
+
+void lw_string(struct list_writer *w, const char *str)
+{
+  if (str)
+    lw_string_len(w, str, strlen(str));
+  else
+    lw_null(w);
+}
+
+void lw_string_len(struct list_writer *w, const char *str, size_t len)
+{
+  value(w);
+  if (w->format == LIST_FORMAT_JSON)
+    json_string(w, str, len);
+  else {
+    cbor_head(w, CBOR_TEXT, len);
+    put(w, str, len);
+  }
+}
+
+void lw_hex(struct list_writer *w, const unsigned char *bin, size_t len)
+{
+  if (!bin) {
+    lw_null(w);
+    return;
+  }
+  value(w);
+  if (w->format == LIST_FORMAT_CBOR) {
+    cbor_head(w, CBOR_BYTES, len);
+    put(w, bin, len);
+    return;
+  }
+  putc_(w, '"');
+  if (w->length + len * 2 <= w->size) {
+    unsigned char *p = w->buf + w->length;
+    size_t i;
+    for (i = 0; i != len; ++i) {
+      *p++ = hexdigit[bin[i] >> 4];
+      *p++ = hexdigit[bin[i] & 0xF];
+    }
+  }
+  w->length += len * 2;
+  putc_(w, '"');
+}
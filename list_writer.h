@@ -0,0 +1,87 @@
+/*
+Copyright (C) 2026 Serval Project Inc.
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#ifndef __SERVAL_DNA__LIST_WRITER_H
+#define __SERVAL_DNA__LIST_WRITER_H
+
+#include <sys/types.h>
+#include <stdint.h>
+
+/* Streams a table of rows, as returned by the RESTful list requests, straight into a caller's
+ * buffer, either as JSON:
+ *
+ *    {
+ *    "header":["col1","col2",...],
+ *    "rows":[
+ *    [val1,val2,...],
+ *    ...
+ *    ]
+ *    }
+ *
+ * or as the equivalent CBOR (RFC 7049): an indefinite-length map of "header" to an array of
+ * strings and "rows" to an indefinite-length array of fixed-length arrays.  Hex values become CBOR
+ * byte strings.  A list may have extra named fields before the header.
+ *
+ * The header (with lw_start() and any fields before it), each row and the trailer are written
+ * whole or not at all.  An item that does not fit in the rest of the buffer is rolled back, and the
+ * writer remembers how many bytes it needed, so that the caller can supply a larger buffer and write
+ * the item again.  Only the row count carries over from one buffer to the next, so the writer can
+ * live in a request across many calls of a content generator.
+ */
+
+enum list_format { LIST_FORMAT_JSON = 0, LIST_FORMAT_CBOR };
+
+struct list_writer {
+  enum list_format format;
+  unsigned columns;
+  // Number of rows written so far.
+  size_t rowcount;
+  // The buffer currently being filled.  'length' may exceed 'size' while an item is overrunning.
+  unsigned char *buf;
+  size_t size;
+  size_t length;
+  // End of the last complete item in the buffer.
+  size_t committed;
+  // If non-zero, the last item did not fit and needs this many bytes of free space.
+  size_t need;
+  // Number of values written in the current row.
+  unsigned column;
+};
+
+void lw_init(struct list_writer *w, enum list_format format, unsigned columns);
+void lw_buffer(struct list_writer *w, unsigned char *buf, size_t size);
+
+void lw_start(struct list_writer *w);
+void lw_field_uint64(struct list_writer *w, const char *name, uint64_t value);
+void lw_field_string(struct list_writer *w, const char *name, const char *str);
+int lw_header(struct list_writer *w, const char *const *headers);
+void lw_row_start(struct list_writer *w);
+int lw_row_end(struct list_writer *w);
+int lw_trailer(struct list_writer *w);
+
+void lw_null(struct list_writer *w);
+void lw_boolean(struct list_writer *w, int value);
+void lw_uint64(struct list_writer *w, uint64_t value);
+void lw_int64(struct list_writer *w, int64_t value);
+void lw_string(struct list_writer *w, const char *str); // str can be NULL
+void lw_string_len(struct list_writer *w, const char *str, size_t len);
+void lw_hex(struct list_writer *w, const unsigned char *bin, size_t len); // bin can be NULL
+
+#define lw_overrun(W) ((W)->need != 0)
+
+#endif
@@ -185,26 +185,16 @@ static int app_meshmb_find(const struct cli_parsed *parsed, struct cli_context *
 
   while ((n = rhizome_list_next(&cursor)) == 1) {
     rowcount++;
-    rhizome_manifest *m = cursor.manifest;
-    cli_put_long(context, m->rowid, ":");
-    cli_put_hexvalue(context, m->keypair.public_key.binary, sizeof m->keypair.public_key.binary, ":");
-
-    switch (m->authorship) {
-      case AUTHOR_NOT_CHECKED:
-      case AUTHOR_AUTHENTIC:
-      case AUTHOR_LOCAL:
-      case AUTHOR_REMOTE:
-	cli_put_hexvalue(context, m->author.binary, sizeof m->author.binary, ":");
-	break;
-
-      default:
-	cli_put_string(context, NULL, ":");
-	break;
-    }
-
-    cli_put_long(context, m->version, ":");
-    cli_put_long(context, m->has_date ? m->date : 0, ":");
-    cli_put_string(context, m->name, "\n");
+    const struct rhizome_list_row *row = &cursor.row;
+    int64_t date;
+    if (!rhizome_manifest_summary_int64(&row->summary, "date", &date))
+      date = 0;
+    cli_put_long(context, row->rowid, ":");
+    cli_put_hexvalue(context, row->summary.bid.binary, sizeof row->summary.bid.binary, ":");
+    cli_put_hexvalue(context, row->has_author ? row->author.binary : NULL, sizeof row->author.binary, ":");
+    cli_put_long(context, row->summary.version, ":");
+    cli_put_long(context, date, ":");
+    cli_put_string(context, row->name, "\n");
   }
   rhizome_list_release(&cursor);
   cli_end_table(context, rowcount);
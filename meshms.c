@@ -164,7 +164,7 @@ static enum meshms_status get_database_conversations(const keyring_identity *id,
     p->tail = tail;
     p->size = size;
   }
-  sqlite3_finalize(statement);
+  sqlite_release(statement);
   if (!sqlite_code_ok(r))
     return MESHMS_STATUS_ERROR;
   return MESHMS_STATUS_OK;
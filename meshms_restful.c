@@ -230,6 +230,18 @@ static int restful_meshms_(httpd_request *r, const char *remainder)
   return handler(r, remainder);
 }
 
+// The "my_sid" and "their_sid" per-conversation fields allow the same JSON structure to be used
+// in a future, non-SID-specific request, eg, to list all conversations for all currently open
+// identities.
+static const char *const conversationlist_headers[] = {
+  "_id",
+  "my_sid",
+  "their_sid",
+  "read",
+  "last_message",
+  "read_offset"
+};
+
 static HTTP_CONTENT_GENERATOR restful_meshms_conversationlist_json_content;
 
 static int restful_meshms_conversationlist_json(httpd_request *r, const char *remainder)
@@ -239,49 +251,34 @@ static int restful_meshms_conversationlist_json(httpd_request *r, const char *re
   assert(r->finalise_union == NULL);
   r->finalise_union = finalise_union_meshms_conversationlist;
   r->u.mclist.phase = LIST_HEADER;
-  r->u.mclist.rowcount = 0;
   r->u.mclist.conv = NULL;
+  const struct mime_content_type *content_type = http_response_list_init(r, NELS(conversationlist_headers));
+  if (!content_type)
+    return 400;
   enum meshms_status status;
   if (meshms_failed(status = meshms_conversations_list(NULL, &r->sid1, &r->u.mclist.conv)))
     return http_request_meshms_response(r, 0, NULL, status);
   if (r->u.mclist.conv != NULL)
     meshms_conversation_iterator_start(&r->u.mclist.iter, r->u.mclist.conv);
-  http_request_response_generated(&r->http, 200, &CONTENT_TYPE_JSON, restful_meshms_conversationlist_json_content);
+  http_request_response_generated(&r->http, 200, content_type, restful_meshms_conversationlist_json_content);
   return 1;
 }
 
-static HTTP_CONTENT_GENERATOR_STRBUF_CHUNKER restful_meshms_conversationlist_json_content_chunk;
+static HTTP_CONTENT_GENERATOR_LIST_CHUNKER restful_meshms_conversationlist_json_content_chunk;
 
 static int restful_meshms_conversationlist_json_content(struct http_request *hr, unsigned char *buf, size_t bufsz, struct http_content_generator_result *result)
 {
-  return generate_http_content_from_strbuf_chunks(hr, (char *)buf, bufsz, result, restful_meshms_conversationlist_json_content_chunk);
+  httpd_request *r = (httpd_request *) hr;
+  return generate_http_content_from_list_chunks(hr, &r->list, buf, bufsz, result, restful_meshms_conversationlist_json_content_chunk);
 }
 
-static int restful_meshms_conversationlist_json_content_chunk(struct http_request *hr, strbuf b)
+static int restful_meshms_conversationlist_json_content_chunk(struct http_request *hr, struct list_writer *w)
 {
   httpd_request *r = (httpd_request *) hr;
-  // The "my_sid" and "their_sid" per-conversation fields allow the same JSON structure to be used
-  // in a future, non-SID-specific request, eg, to list all conversations for all currently open
-  // identities.
-  const char *headers[] = {
-    "_id",
-    "my_sid",
-    "their_sid",
-    "read",
-    "last_message",
-    "read_offset"
-  };
   switch (r->u.mclist.phase) {
     case LIST_HEADER:
-      strbuf_puts(b, "{\n\"header\":[");
-      unsigned i;
-      for (i = 0; i != NELS(headers); ++i) {
-	if (i)
-	  strbuf_putc(b, ',');
-	strbuf_json_string(b, headers[i]);
-      }
-      strbuf_puts(b, "],\n\"rows\":[");
-      if (!strbuf_overrun(b))
+      lw_start(w);
+      if (lw_header(w, conversationlist_headers))
 	r->u.mclist.phase = LIST_FIRST;
       return 1;
 
@@ -291,32 +288,23 @@ static int restful_meshms_conversationlist_json_content_chunk(struct http_reques
 	r->u.mclist.phase = LIST_END;
 	// fall through...
       } else {
-	if (r->u.mclist.rowcount!=0)
-	  strbuf_putc(b, ',');
-	strbuf_puts(b, "\n[");
-	strbuf_sprintf(b, "%zu", r->u.mclist.rowcount);
-	strbuf_putc(b, ',');
-	strbuf_json_hex(b, r->sid1.binary, sizeof r->sid1.binary);
-	strbuf_putc(b, ',');
-	strbuf_json_hex(b, r->u.mclist.iter.current->them.binary, sizeof r->u.mclist.iter.current->them.binary);
-	strbuf_putc(b, ',');
-	strbuf_json_boolean(b, r->u.mclist.iter.current->metadata.read_offset >= r->u.mclist.iter.current->metadata.their_last_message);
-	strbuf_putc(b, ',');
-	strbuf_sprintf(b, "%"PRIu64, r->u.mclist.iter.current->metadata.their_last_message);
-	strbuf_putc(b, ',');
-	strbuf_sprintf(b, "%"PRIu64, r->u.mclist.iter.current->metadata.read_offset);
-	strbuf_puts(b, "]");
-	if (!strbuf_overrun(b)) {
+	const struct meshms_conversations *conv = r->u.mclist.iter.current;
+	lw_row_start(w);
+	lw_uint64(w, w->rowcount);
+	lw_hex(w, r->sid1.binary, sizeof r->sid1.binary);
+	lw_hex(w, conv->them.binary, sizeof conv->them.binary);
+	lw_boolean(w, conv->metadata.read_offset >= conv->metadata.their_last_message);
+	lw_uint64(w, conv->metadata.their_last_message);
+	lw_uint64(w, conv->metadata.read_offset);
+	if (lw_row_end(w)) {
 	  r->u.mclist.phase=LIST_ROWS;
 	  meshms_conversation_iterator_advance(&r->u.mclist.iter);
-	  ++r->u.mclist.rowcount;
 	}
 	return 1;
       }
       // fall through...
     case LIST_END:
-      strbuf_puts(b, "\n]\n}\n");
-      if (!strbuf_overrun(b))
+      if (lw_trailer(w))
 	r->u.mclist.phase = LIST_DONE;
       // fall through...
     case LIST_DONE:
@@ -326,6 +314,22 @@ static int restful_meshms_conversationlist_json_content_chunk(struct http_reques
   return 0;
 }
 
+// Include "my_sid" and "their_sid" per-message, so that the same JSON structure can be used by a
+// future, non-SID-specific request (eg, to get all messages for all currently open identities).
+static const char *const messagelist_headers[] = {
+  "type",
+  "my_sid",
+  "their_sid",
+  "my_offset",
+  "their_offset",
+  "token",
+  "text",
+  "delivered",
+  "read",
+  "timestamp",
+  "ack_offset"
+};
+
 static HTTP_CONTENT_GENERATOR restful_meshms_messagelist_json_content;
 
 static enum meshms_status reopen_meshms_message_iterator(httpd_request *r)
@@ -354,7 +358,9 @@ static int restful_meshms_messagelist_json(httpd_request *r, const char *remaind
     return 404;
   assert(r->finalise_union == NULL);
   r->finalise_union = finalise_union_meshms_messagelist;
-  r->u.msglist.rowcount = 0;
+  const struct mime_content_type *content_type = http_response_list_init(r, NELS(messagelist_headers));
+  if (!content_type)
+    return 400;
   r->u.msglist.phase = LIST_HEADER;
   r->u.msglist.token.which_ply = NEITHER_PLY;
   r->u.msglist.token.offset = 0;
@@ -363,7 +369,7 @@ static int restful_meshms_messagelist_json(httpd_request *r, const char *remaind
   enum meshms_status status;
   if (meshms_failed(status = reopen_meshms_message_iterator(r)))
     return http_request_meshms_response(r, 0, NULL, status);
-  http_request_response_generated(&r->http, 200, &CONTENT_TYPE_JSON, restful_meshms_messagelist_json_content);
+  http_request_response_generated(&r->http, 200, content_type, restful_meshms_messagelist_json_content);
   return 1;
 }
 
@@ -374,14 +380,16 @@ static int restful_meshms_newsince_messagelist_json(httpd_request *r, const char
   assert(r->finalise_union == NULL);
   r->finalise_union = finalise_union_meshms_messagelist;
   r->trigger_rhizome_bundle_added = on_rhizome_bundle_added;
-  r->u.msglist.rowcount = 0;
+  const struct mime_content_type *content_type = http_response_list_init(r, NELS(messagelist_headers));
+  if (!content_type)
+    return 400;
   r->u.msglist.phase = LIST_HEADER;
   r->u.msglist.dirty = 1;
   enum meshms_status status;
   if (meshms_failed(status = reopen_meshms_message_iterator(r)))
     return http_request_meshms_response(r, 0, NULL, status);
   r->u.msglist.end_time = gettime_ms() + config.api.restful.newsince_timeout * 1000;
-  http_request_response_generated(&r->http, 200, &CONTENT_TYPE_JSON, restful_meshms_messagelist_json_content);
+  http_request_response_generated(&r->http, 200, content_type, restful_meshms_messagelist_json_content);
   return 1;
 }
 
@@ -397,54 +405,30 @@ static void on_rhizome_bundle_added(httpd_request *r, rhizome_manifest *m)
   }
 }
 
-static HTTP_CONTENT_GENERATOR_STRBUF_CHUNKER restful_meshms_messagelist_json_content_chunk;
+static HTTP_CONTENT_GENERATOR_LIST_CHUNKER restful_meshms_messagelist_json_content_chunk;
 
 static int restful_meshms_messagelist_json_content(struct http_request *hr, unsigned char *buf, size_t bufsz, struct http_content_generator_result *result)
 {
   httpd_request *r = (httpd_request *) hr;
   if (meshms_failed(reopen_meshms_message_iterator(r)))
     return -1;
-  return generate_http_content_from_strbuf_chunks(hr, (char *)buf, bufsz, result, restful_meshms_messagelist_json_content_chunk);
+  return generate_http_content_from_list_chunks(hr, &r->list, buf, bufsz, result, restful_meshms_messagelist_json_content_chunk);
 }
 
-static void _messagelist_json_ack(struct httpd_request *r, strbuf b);
+static int _messagelist_json_ack(struct httpd_request *r, struct list_writer *w);
+static int _messagelist_json_message(struct httpd_request *r, struct list_writer *w);
 
-static int restful_meshms_messagelist_json_content_chunk(struct http_request *hr, strbuf b)
+static int restful_meshms_messagelist_json_content_chunk(struct http_request *hr, struct list_writer *w)
 {
   httpd_request *r = (httpd_request *) hr;
-  // Include "my_sid" and "their_sid" per-message, so that the same JSON structure can be used by a
-  // future, non-SID-specific request (eg, to get all messages for all currently open identities).
-  const char *headers[] = {
-    "type",
-    "my_sid",
-    "their_sid",
-    "my_offset",
-    "their_offset",
-    "token",
-    "text",
-    "delivered",
-    "read",
-    "timestamp",
-    "ack_offset"
-  };
   switch (r->u.msglist.phase) {
     case LIST_HEADER:
-      strbuf_puts(b, "{\n");
+      lw_start(w);
       if (!r->u.msglist.end_time) {
-	strbuf_sprintf(b, "\"read_offset\":%"PRIu64",\n\"latest_ack_offset\":%"PRIu64",\n",
-	    r->u.msglist.iter.metadata.read_offset,
-	    r->u.msglist.iter.metadata.their_last_ack
-	  );
-      }
-      strbuf_puts(b, "\"header\":[");
-      unsigned i;
-      for (i = 0; i != NELS(headers); ++i) {
-	if (i)
-	  strbuf_putc(b, ',');
-	strbuf_json_string(b, headers[i]);
+	lw_field_uint64(w, "read_offset", r->u.msglist.iter.metadata.read_offset);
+	lw_field_uint64(w, "latest_ack_offset", r->u.msglist.iter.metadata.their_last_ack);
       }
-      strbuf_puts(b, "],\n\"rows\":[");
-      if (!strbuf_overrun(b))
+      if (lw_header(w, messagelist_headers))
 	r->u.msglist.phase = LIST_ROWS;
       return 1;
     case LIST_FIRST:
@@ -459,11 +443,9 @@ static int restful_meshms_messagelist_json_content_chunk(struct http_request *hr
 	  if (r->u.msglist.end_time && (now = gettime_ms()) < r->u.msglist.end_time) {
 	    // If messages before the requested token have now been acked, add an extra ack record to the end
 	    if (r->u.msglist.token.their_ack != r->u.msglist.latest.their_ack){
-		r->u.msglist.current.their_ack = r->u.msglist.latest.their_ack;
-	      _messagelist_json_ack(r, b);
-	      if (strbuf_overrun(b))
+	      r->u.msglist.current.their_ack = r->u.msglist.latest.their_ack;
+	      if (!_messagelist_json_ack(r, w))
 		return 1;
-	      ++r->u.msglist.rowcount;
 	    }
 	    r->u.msglist.token = r->u.msglist.latest;
 	    meshms_message_iterator_close(&r->u.msglist.iter);
@@ -473,95 +455,37 @@ static int restful_meshms_messagelist_json_content_chunk(struct http_request *hr
 	  }
 	  r->u.msglist.phase = LIST_END;
 	} else {
-	  int rows=0;
-
 	  switch (r->u.msglist.iter.type) {
 	    case MESSAGE_SENT:
 	      // if you haven't seen the current ack && this is the message that was acked.
 	      // output the ack now
 	      if (r->u.msglist.token.their_ack != r->u.msglist.latest.their_ack &&
 		r->u.msglist.current.offset <= r->u.msglist.latest.their_ack){
-		_messagelist_json_ack(r, b);
-		if (!strbuf_overrun(b)){
-		  ++r->u.msglist.rowcount;
+		if (_messagelist_json_ack(r, w)){
 		  r->u.msglist.token.their_ack = r->u.msglist.latest.their_ack;
 		  r->u.msglist.current.their_ack = 0;
 		}
 		return 1;
 	      }
-	      if (r->u.msglist.rowcount != 0)
-		strbuf_putc(b, ',');
-	      strbuf_puts(b, "\n[");
-	      strbuf_json_string(b, ">");
-	      strbuf_putc(b, ',');
-	      strbuf_json_hex(b, r->u.msglist.iter.my_sid.binary, sizeof r->u.msglist.iter.my_sid.binary);
-	      strbuf_putc(b, ',');
-	      strbuf_json_hex(b, r->u.msglist.iter.their_sid.binary, sizeof r->u.msglist.iter.their_sid.binary);
-	      strbuf_putc(b, ',');
-	      strbuf_sprintf(b, "%"PRIu64, r->u.msglist.iter.my_offset);
-	      strbuf_putc(b, ',');
-	      strbuf_sprintf(b, "%"PRIu64, r->u.msglist.iter.their_offset);
-	      strbuf_putc(b, ',');
-	      strbuf_json_string(b, alloca_meshms_token(&r->u.msglist.current));
-	      strbuf_putc(b, ',');
-	      strbuf_json_string(b, r->u.msglist.iter.text);
-	      strbuf_putc(b, ',');
-	      strbuf_json_boolean(b, r->u.msglist.iter.delivered);
-	      strbuf_putc(b, ',');
-	      strbuf_json_boolean(b, 0);
-	      strbuf_putc(b, ',');
-	      strbuf_sprintf(b, "%d", r->u.msglist.iter.timestamp);
-	      strbuf_putc(b, ',');
-	      strbuf_json_null(b);
-	      strbuf_puts(b, "]");
-	      rows++;
-	      break;
+	      FALLTHROUGH;
 	    case MESSAGE_RECEIVED:
-	      if (r->u.msglist.rowcount != 0)
-		strbuf_putc(b, ',');
-	      strbuf_puts(b, "\n[");
-	      strbuf_json_string(b, "<");
-	      strbuf_putc(b, ',');
-	      strbuf_json_hex(b, r->u.msglist.iter.my_sid.binary, sizeof r->u.msglist.iter.my_sid.binary);
-	      strbuf_putc(b, ',');
-	      strbuf_json_hex(b, r->u.msglist.iter.their_sid.binary, sizeof r->u.msglist.iter.their_sid.binary);
-	      strbuf_putc(b, ',');
-	      strbuf_sprintf(b, "%"PRIu64, r->u.msglist.iter.my_offset);
-	      strbuf_putc(b, ',');
-	      strbuf_sprintf(b, "%"PRIu64, r->u.msglist.iter.their_offset);
-	      strbuf_putc(b, ',');
-	      strbuf_json_string(b, alloca_meshms_token(&r->u.msglist.current));
-	      strbuf_putc(b, ',');
-	      strbuf_json_string(b, r->u.msglist.iter.text);
-	      strbuf_putc(b, ',');
-	      strbuf_json_boolean(b, 1);
-	      strbuf_putc(b, ',');
-	      strbuf_json_boolean(b, r->u.msglist.iter.read);
-	      strbuf_putc(b, ',');
-	      strbuf_sprintf(b, "%d", r->u.msglist.iter.timestamp);
-	      strbuf_putc(b, ',');
-	      strbuf_json_null(b);
-	      strbuf_puts(b, "]");
-	      rows++;
+	      if (!_messagelist_json_message(r, w))
+		return 1;
 	      break;
 	    case ACK_RECEIVED:
 	      break;
 	  }
-	  if (!strbuf_overrun(b)) {
-	    r->u.msglist.rowcount+=rows;
-	    enum meshms_status status;
-	    if (meshms_failed(status = meshms_message_iterator_prev(&r->u.msglist.iter)))
-	      return http_request_meshms_response(r, 0, NULL, status);
-	    r->u.msglist.finished = status != MESHMS_STATUS_UPDATED;
-	  }
+	  enum meshms_status status;
+	  if (meshms_failed(status = meshms_message_iterator_prev(&r->u.msglist.iter)))
+	    return http_request_meshms_response(r, 0, NULL, status);
+	  r->u.msglist.finished = status != MESHMS_STATUS_UPDATED;
 	  return 1;
 	}
 	r->u.msglist.phase = LIST_END;
       }
       // fall through...
     case LIST_END:
-      strbuf_puts(b, "\n]\n}\n");
-      if (!strbuf_overrun(b))
+      if (lw_trailer(w))
 	r->u.msglist.phase = LIST_DONE;
       // fall through...
     case LIST_DONE:
@@ -571,33 +495,39 @@ static int restful_meshms_messagelist_json_content_chunk(struct http_request *hr
   return 0;
 }
 
-static void _messagelist_json_ack(struct httpd_request *r, strbuf b)
+static int _messagelist_json_message(struct httpd_request *r, struct list_writer *w)
+{
+  int sent = r->u.msglist.iter.type == MESSAGE_SENT;
+  lw_row_start(w);
+  lw_string(w, sent ? ">" : "<");
+  lw_hex(w, r->u.msglist.iter.my_sid.binary, sizeof r->u.msglist.iter.my_sid.binary);
+  lw_hex(w, r->u.msglist.iter.their_sid.binary, sizeof r->u.msglist.iter.their_sid.binary);
+  lw_uint64(w, r->u.msglist.iter.my_offset);
+  lw_uint64(w, r->u.msglist.iter.their_offset);
+  lw_string(w, alloca_meshms_token(&r->u.msglist.current));
+  lw_string(w, r->u.msglist.iter.text);
+  lw_boolean(w, sent ? r->u.msglist.iter.delivered : 1);
+  lw_boolean(w, sent ? 0 : r->u.msglist.iter.read);
+  lw_int64(w, r->u.msglist.iter.timestamp);
+  lw_null(w);
+  return lw_row_end(w);
+}
+
+static int _messagelist_json_ack(struct httpd_request *r, struct list_writer *w)
 {
-  if (r->u.msglist.rowcount != 0)
-    strbuf_putc(b, ',');
-  strbuf_puts(b, "\n[");
-  strbuf_json_string(b, "ACK");
-  strbuf_putc(b, ',');
-  strbuf_json_hex(b, r->u.msglist.iter.my_sid.binary, sizeof r->u.msglist.iter.my_sid.binary);
-  strbuf_putc(b, ',');
-  strbuf_json_hex(b, r->u.msglist.iter.their_sid.binary, sizeof r->u.msglist.iter.their_sid.binary);
-  strbuf_putc(b, ',');
-  strbuf_sprintf(b, "%"PRIu64, r->u.msglist.iter.my_offset);
-  strbuf_putc(b, ',');
-  strbuf_sprintf(b, "%"PRIu64, r->u.msglist.iter.metadata.their_last_ack_offset);
-  strbuf_putc(b, ',');
-  strbuf_json_string(b, alloca_meshms_token(&r->u.msglist.current));
-  strbuf_putc(b, ',');
-  strbuf_json_null(b);
-  strbuf_putc(b, ',');
-  strbuf_json_boolean(b, 1);
-  strbuf_putc(b, ',');
-  strbuf_json_boolean(b, 0);
-  strbuf_putc(b, ',');
-  strbuf_json_null(b); // no timestamp on ACKs
-  strbuf_putc(b, ',');
-  strbuf_sprintf(b, "%"PRIu64, r->u.msglist.iter.metadata.their_last_ack);
-  strbuf_puts(b, "]");
+  lw_row_start(w);
+  lw_string(w, "ACK");
+  lw_hex(w, r->u.msglist.iter.my_sid.binary, sizeof r->u.msglist.iter.my_sid.binary);
+  lw_hex(w, r->u.msglist.iter.their_sid.binary, sizeof r->u.msglist.iter.their_sid.binary);
+  lw_uint64(w, r->u.msglist.iter.my_offset);
+  lw_uint64(w, r->u.msglist.iter.metadata.their_last_ack_offset);
+  lw_string(w, alloca_meshms_token(&r->u.msglist.current));
+  lw_null(w);
+  lw_boolean(w, 1);
+  lw_boolean(w, 0);
+  lw_null(w); // no timestamp on ACKs
+  lw_uint64(w, r->u.msglist.iter.metadata.their_last_ack);
+  return lw_row_end(w);
 }
 
 static HTTP_REQUEST_PARSER restful_meshms_sendmessage_end;
@@ -38,7 +38,7 @@ DEFINE_FEATURE(cli_network);
 
 DEFINE_CMD(app_mdp_ping, 0,
   "Attempts to ping specified node via Mesh Datagram Protocol (MDP).",
-  "mdp","ping","[--interval=<ms>]","[--timeout=<seconds>]","[--wait-for-duplicates]",
+  "mdp","ping","[--interval=<ms>]","[--timeout=<seconds>]","[--wait-for-duplicates]","[--mixed-crypt]",
   "<SID>|broadcast","[<count>]");
 static int app_mdp_ping(const struct cli_parsed *parsed, struct cli_context *context)
 {
@@ -46,6 +46,8 @@ static int app_mdp_ping(const struct cli_parsed *parsed, struct cli_context *con
   DEBUG_cli_parsed(verbose, parsed);
   const char *sidhex, *count, *opt_timeout, *opt_interval;
   int opt_wait_for_duplicates = 0 == cli_arg(parsed, "--wait-for-duplicates", NULL, NULL, NULL);
+  // sign every second ping without encrypting it, so the daemon has to keep them in order
+  int opt_mixed_crypt = 0 == cli_arg(parsed, "--mixed-crypt", NULL, NULL, NULL);
   if (   cli_arg(parsed, "--timeout", &opt_timeout, cli_interval_ms, "1") == -1
       || cli_arg(parsed, "--interval", &opt_interval, cli_interval_ms, "1") == -1
       || cli_arg(parsed, "SID", &sidhex, str_is_subscriber_id, "broadcast") == -1
@@ -68,7 +70,8 @@ static int app_mdp_ping(const struct cli_parsed *parsed, struct cli_context *con
     timeout_ms = 60 * 60000; // 1 hour...
   int64_t interval_ms = 1000;
   str_to_uint64_interval_ms(opt_interval, &interval_ms, NULL);
-  if (interval_ms == 0)
+  // an interval of zero sends all the pings at once, so needs a count
+  if (interval_ms == 0 && icount == 0)
     interval_ms = 1000;
     
   /* First sequence number in the echo frames */
@@ -134,6 +137,12 @@ static int app_mdp_ping(const struct cli_parsed *parsed, struct cli_context *con
       uint8_t payload[12];
       write_uint32(&payload[0], sequence_number);
       write_uint64(&payload[4], now);
+      if (opt_mixed_crypt && !broadcast){
+	if (tx_count & 1)
+	  mdp_header.flags |= MDP_FLAG_NO_CRYPT;
+	else
+	  mdp_header.flags &= ~MDP_FLAG_NO_CRYPT;
+      }
       int r = mdp_send(mdp_sockfd, &mdp_header, payload, sizeof(payload));
       if (r != -1) {
 	DEBUGF(mdprequests, "ping seq=%lu", (unsigned long)(sequence_number - firstSeq) + 1);
@@ -156,10 +165,16 @@ static int app_mdp_ping(const struct cli_parsed *parsed, struct cli_context *con
     // Now look for replies ("pongs") until one second has passed, and print any replies with
     // appropriate information as required
     int all_sent = icount && tx_count >= icount;
-    time_ms_t finish = now + (all_sent ? timeout_ms : interval_ms);
-    while (!sigIntFlag && now < finish && (!all_sent || opt_wait_for_duplicates || missing_pong_count)) {
-      time_ms_t poll_timeout_ms = finish - now;
+    time_ms_t wait_ms = all_sent ? timeout_ms : interval_ms;
+    if (wait_ms == 0 && (mdp_header.flags & MDP_FLAG_BIND))
+      wait_ms = timeout_ms;
+    time_ms_t finish = now + wait_ms;
+    // without an interval, read any replies that are already waiting before sending the next ping
+    int drain = wait_ms == 0;
+    while (!sigIntFlag && (now < finish || drain) && (!all_sent || opt_wait_for_duplicates || missing_pong_count)) {
+      time_ms_t poll_timeout_ms = drain ? 0 : finish - now;
       if (mdp_poll(mdp_sockfd, poll_timeout_ms) <= 0) {
+	drain = 0;
 	now = gettime_ms();
 	continue;
       }
@@ -178,6 +193,8 @@ static int app_mdp_ping(const struct cli_parsed *parsed, struct cli_context *con
 	mdp_header.local = mdp_recv_header.local;
 	mdp_header.flags &= ~MDP_FLAG_BIND;
 	DEBUGF(mdprequests, "bound to %s:%d", alloca_tohex_sid_t(mdp_header.local.sid), mdp_header.local.port);
+	if (interval_ms == 0)
+	  break;
 	continue;
       }
       if ((size_t)len < sizeof(recv_payload)){
@@ -33,11 +33,146 @@ static uint8_t get_nibble(const uint8_t *binary, int pos)
   return byte&0xF;
 }
 
+static uint8_t node4_key(const struct tree_node *node, unsigned slot)
+{
+  return (node->keys >> (slot*4)) & 0xF;
+}
+
+// find the slot of a TREE_NODE4 for this nibble, or return -1
+static int node4_search(const struct tree_node *node, uint8_t nibble)
+{
+  // compare every packed key at once, the lowest nibble of (keys ^ nibble) that is zero is our slot
+  uint32_t x = node->keys ^ (nibble * 0x1111u);
+  uint32_t zero = (x - 0x1111u) & ~x & 0x8888u & ((1u << (node->count*4)) - 1);
+  if (!zero)
+    return -1;
+  return __builtin_ctz(zero) >> 2;
+}
+
+static void **node_slots(struct tree_node *node, unsigned *count)
+{
+  if (node->type == TREE_NODE4){
+    *count = node->count;
+    return ((struct tree_node4 *)node)->tree_nodes;
+  }
+  *count = 16;
+  return ((struct tree_node16 *)node)->tree_nodes;
+}
+
+static uint8_t slot_nibble(const struct tree_node *node, unsigned slot)
+{
+  return node->type == TREE_NODE4 ? node4_key(node, slot) : slot;
+}
+
+// return the slot for this nibble, or NULL if the node has no slot for it
+static void **node_slot(struct tree_node *node, uint8_t nibble, uint16_t *bit)
+{
+  if (node->type == TREE_NODE4){
+    int i = node4_search(node, nibble);
+    if (i < 0)
+      return NULL;
+    *bit = 1<<i;
+    return &((struct tree_node4 *)node)->tree_nodes[i];
+  }
+  *bit = 1<<nibble;
+  return &((struct tree_node16 *)node)->tree_nodes[nibble];
+}
+
+// add an empty slot for this nibble to the node at *ref, growing it if every slot is in use
+static void **node_insert(void **ref, uint8_t nibble, uint16_t *bit)
+{
+  struct tree_node *node = *ref;
+  assert(node->type == TREE_NODE4);
+  struct tree_node4 *node4 = (struct tree_node4 *)node;
+  unsigned i;
+
+  if (node->count == TREE_NODE4_SLOTS){
+    struct tree_node16 *node16 = (struct tree_node16 *) emalloc_zero(sizeof(struct tree_node16));
+    if (!node16)
+      return NULL;
+    for (i=0; i<node->count; i++){
+      uint8_t n = node4_key(node, i);
+      node16->tree_nodes[n] = node4->tree_nodes[i];
+      if (node->is_tree & (1<<i))
+	node16->header.is_tree |= 1<<n;
+    }
+    free(node4);
+    *ref = node16;
+    *bit = 1<<nibble;
+    return &node16->tree_nodes[nibble];
+  }
+
+  // keep the slots in ascending order
+  for (i=0; i<node->count && node4_key(node, i) < nibble; i++)
+    ;
+  uint16_t below = (1<<i) - 1;
+  uint16_t keys_below = (1<<(i*4)) - 1;
+  node->is_tree = (node->is_tree & below) | ((node->is_tree & ~below) << 1);
+  node->keys = (node->keys & keys_below) | (nibble << (i*4)) | ((node->keys & ~keys_below) << 4);
+  memmove(&node4->tree_nodes[i+1], &node4->tree_nodes[i], (node->count - i) * sizeof(void *));
+  node4->tree_nodes[i] = NULL;
+  node->count++;
+  *bit = 1<<i;
+  return &node4->tree_nodes[i];
+}
+
+// remove the empty slots of a TREE_NODE4
+static void node_compact(struct tree_node *node)
+{
+  if (node->type != TREE_NODE4)
+    return;
+  struct tree_node4 *node4 = (struct tree_node4 *)node;
+  unsigned i, j=0;
+  uint16_t is_tree=0, keys=0;
+  for (i=0; i<node->count; i++){
+    if (!node4->tree_nodes[i])
+      continue;
+    node4->tree_nodes[j] = node4->tree_nodes[i];
+    if (node->is_tree & (1<<i))
+      is_tree |= 1<<j;
+    keys |= node4_key(node, i) << (j*4);
+    j++;
+  }
+  node->count = j;
+  node->is_tree = is_tree;
+  node->keys = keys;
+}
+
+// replace a TREE_NODE16 at *ref with a TREE_NODE4 if it no longer needs more slots
+static void node_shrink(void **ref)
+{
+  struct tree_node *node = *ref;
+  if (node->type != TREE_NODE16)
+    return;
+  struct tree_node16 *node16 = (struct tree_node16 *)node;
+  unsigned i, used=0;
+  for (i=0; i<16; i++)
+    if (node16->tree_nodes[i] && ++used > TREE_NODE4_SLOTS)
+      return;
+  struct tree_node4 *node4 = (struct tree_node4 *) emalloc_zero(sizeof(struct tree_node4));
+  if (!node4)
+    return;
+  node4->header.type = TREE_NODE4;
+  for (i=0; i<16; i++){
+    if (!node16->tree_nodes[i])
+      continue;
+    unsigned slot = node4->header.count++;
+    node4->tree_nodes[slot] = node16->tree_nodes[i];
+    if (node->is_tree & (1<<i))
+      node4->header.is_tree |= 1<<slot;
+    node4->header.keys |= i << (slot*4);
+  }
+  free(node16);
+  *ref = node4;
+}
+
 enum tree_error_reason tree_find(struct tree_root *root, void **result, const uint8_t *binary, size_t bin_length,
   tree_create_callback create_node, void *context)
 {
   assert(bin_length <= root->binary_length);
-  struct tree_node *ptr = &root->_root_node;
+  struct tree_node *ptr = &root->_root_node.header;
+  // the parent's slot that points to ptr
+  void **ref = NULL;
 
   if (result)
     *result = NULL;
@@ -48,29 +183,39 @@ enum tree_error_reason tree_find(struct tree_root *root, void **result, const ui
       return TREE_NOT_UNIQUE;
 
     uint8_t nibble = get_nibble(binary, pos++);
-    void *node_ptr = ptr->tree_nodes[nibble];
+    uint16_t bit;
+    void **slot = node_slot(ptr, nibble, &bit);
 
-    if (ptr->is_tree & (1<<nibble)){
+    if (slot && (ptr->is_tree & bit)){
       // search the next level of the tree
-      ptr = (struct tree_node *)node_ptr;
+      ref = slot;
+      ptr = (struct tree_node *)*slot;
 
-    }else if(!node_ptr){
+    }else if(!slot || !*slot){
       // allow caller to provide a node constructor
       if (create_node && bin_length == root->binary_length){
-	node_ptr = create_node(context, binary, bin_length);
-	if (!node_ptr)
+	if (!slot){
+	  if ((slot = node_insert(ref, nibble, &bit)) == NULL)
+	    return TREE_ERROR;
+	  ptr = *ref;
+	}
+	void *node_ptr = create_node(context, binary, bin_length);
+	if (!node_ptr){
+	  node_compact(ptr);
 	  return TREE_ERROR;
+	}
 	struct tree_record *tree_record = (struct tree_record *)node_ptr;
 	assert(memcmp(tree_record->binary, binary, bin_length) == 0);
 	tree_record ->tree_depth = pos*4;
 	if (result)
 	  *result = node_ptr;
-	ptr->tree_nodes[nibble] = node_ptr;
+	*slot = node_ptr;
 	return TREE_FOUND;
       }
       return TREE_NOT_FOUND;
 
     }else{
+      void *node_ptr = *slot;
       struct tree_record *tree_record = (struct tree_record *)node_ptr;
 
       // check that the remaining bytes of the value are the same
@@ -84,18 +229,22 @@ enum tree_error_reason tree_find(struct tree_root *root, void **result, const ui
 	return TREE_NOT_FOUND;
 
       // no match? we need to bump this leaf node down a level so we can create a new record
-      struct tree_node *new_node = (struct tree_node *) emalloc_zero(sizeof(struct tree_node));
+      struct tree_node4 *new_node = (struct tree_node4 *) emalloc_zero(sizeof(struct tree_node4));
       if (!new_node)
 	return TREE_ERROR;
 
-      ptr->tree_nodes[nibble] = new_node;
-      ptr->is_tree |= (1<<nibble);
-      ptr = new_node;
+      *slot = new_node;
+      ptr->is_tree |= bit;
+      ref = slot;
+      ptr = &new_node->header;
 
       // get the nibble of the existing node
       nibble = get_nibble(tree_record->binary, pos);
       tree_record->tree_depth = (pos+1)*4;
-      ptr->tree_nodes[nibble] = node_ptr;
+      new_node->header.type = TREE_NODE4;
+      new_node->header.count = 1;
+      new_node->header.keys = nibble;
+      new_node->tree_nodes[0] = node_ptr;
     }
   }
 }
@@ -103,41 +252,47 @@ enum tree_error_reason tree_find(struct tree_root *root, void **result, const ui
 static int walk(struct tree_node *node, unsigned pos,
 	      uint8_t *empty, const uint8_t *binary, size_t bin_length,
 	      walk_callback callback, void *context){
-  unsigned i=0, e=16;
+  unsigned i=0, e;
+  void **slots = node_slots(node, &e);
   int ret=0;
-  *empty=1;
 
   if (binary){
     assert(pos*2 < bin_length);
     uint8_t n = get_nibble(binary, pos);
-    for(;i<n;i++){
-      if (node->tree_nodes[i]){
-	*empty=0;
+    for(;i<e && slot_nibble(node, i)<n;i++){
+      if (slots[i])
 	break;
-      }
     }
   }
 
   for (;i<e;i++){
     if (node->is_tree & (1<<i)){
       uint8_t child_empty=1;
-      ret = walk((struct tree_node *)node->tree_nodes[i], pos+1, &child_empty, binary, bin_length, callback, context);
+      ret = walk((struct tree_node *)slots[i], pos+1, &child_empty, binary, bin_length, callback, context);
       if (child_empty){
-	free(node->tree_nodes[i]);
-	node->tree_nodes[i]=NULL;
+	free(slots[i]);
+	slots[i]=NULL;
 	node->is_tree&=~(1<<i);
-      }
-    }else if(node->tree_nodes[i]){
-      ret = callback(&node->tree_nodes[i], context);
+      }else
+	node_shrink(&slots[i]);
+    }else if(slots[i]){
+      ret = callback(&slots[i], context);
     }
     if (ret)
-      return ret;
-    if (node->tree_nodes[i])
-      *empty=0;
+      break;
     // stop comparing the start binary after looking at the first branch of the tree
     binary=NULL;
   }
 
+  node_compact(node);
+  slots = node_slots(node, &e);
+  *empty=1;
+  for (i=0;i<e;i++){
+    if (slots[i]){
+      *empty=0;
+      break;
+    }
+  }
   return ret;
 }
 
@@ -147,29 +302,52 @@ int tree_walk(struct tree_root *root, const uint8_t *binary, size_t bin_length,
 {
   assert(!binary || bin_length <= root->binary_length);
   uint8_t ignore;
-  return walk(&root->_root_node, 0, &ignore, binary, bin_length, callback, context);
+  return walk(&root->_root_node.header, 0, &ignore, binary, bin_length, callback, context);
 }
 
 int tree_walk_prefix(struct tree_root *root, const uint8_t *binary, size_t bin_length, walk_callback callback, void *context)
 {
   assert(bin_length <= root->binary_length);
   //TODO if callback free's nodes, collapse parent tree nodes too without needing to walk again?
-  struct tree_node *node = &root->_root_node;
+  struct tree_node *node = &root->_root_node.header;
   unsigned pos=0;
   // look for a branch of the tree with a partial match
   for (; node && pos<bin_length*2; pos++){
-    uint8_t i=get_nibble(binary, pos);
-    if ((node->is_tree & (1<<i))==0){
-      struct tree_record *tree_record = (struct tree_record *)node->tree_nodes[i];
+    uint16_t bit;
+    void **slot = node_slot(node, get_nibble(binary, pos), &bit);
+    if (!slot)
+      return 0;
+    if ((node->is_tree & bit)==0){
+      struct tree_record *tree_record = (struct tree_record *)*slot;
       // only one match?
       if (tree_record && memcmp(tree_record->binary, binary, bin_length)==0){
-	return callback(&node->tree_nodes[i], context);
+	return callback(slot, context);
       }
       return 0;
     }
-    node = node->tree_nodes[i];
+    node = *slot;
   }
   // walk the whole branch
   uint8_t ignore;
   return walk(node, pos+1, &ignore, NULL, 0, callback, context);
 }
+
+static size_t node_memory(struct tree_node *node)
+{
+  unsigned i, e;
+  void **slots = node_slots(node, &e);
+  size_t size = 0;
+  for (i=0;i<e;i++){
+    if (node->is_tree & (1<<i)){
+      struct tree_node *child = (struct tree_node *)slots[i];
+      size += child->type == TREE_NODE4 ? sizeof(struct tree_node4) : sizeof(struct tree_node16);
+      size += node_memory(child);
+    }
+  }
+  return size;
+}
+
+size_t tree_memory(const struct tree_root *root)
+{
+  return node_memory((struct tree_node *)&root->_root_node.header);
+}
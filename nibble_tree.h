@@ -27,17 +27,40 @@ struct tree_record{
   uint8_t binary[0];
 };
 
-// each node has 16 slots based on the next 4 bits of the binary value
+// each node has a slot for each value of the next 4 bits of the binary value
 // each slot either points to another tree node or a data record
+// most nodes only use a few slots, so they are stored as a TREE_NODE4, with the nibble of each
+// slot packed into keys, and grown into a TREE_NODE16 once more slots are needed
+enum tree_node_type{
+  TREE_NODE16=0,
+  TREE_NODE4
+};
+
+#define TREE_NODE4_SLOTS 4
+
 struct tree_node{
-  // bit flags for the type of object each element points to
+  uint8_t type;
+  // the number of slots used by a TREE_NODE4
+  uint8_t count;
+  // bit flags for the type of object each slot points to
   uint16_t is_tree;
-  void  *tree_nodes[16];
+  // the nibble of each slot of a TREE_NODE4, in ascending order
+  uint16_t keys;
+};
+
+struct tree_node4{
+  struct tree_node header;
+  void *tree_nodes[TREE_NODE4_SLOTS];
+};
+
+struct tree_node16{
+  struct tree_node header;
+  void *tree_nodes[16];
 };
 
 struct tree_root{
   size_t binary_length;
-  struct tree_node _root_node;
+  struct tree_node16 _root_node;
 };
 
 enum tree_error_reason {
@@ -71,4 +94,7 @@ int tree_walk(struct tree_root *root, const uint8_t *binary, size_t bin_length,
 // walk the tree where nodes match the prefix binary / bin_length
 int tree_walk_prefix(struct tree_root *root, const uint8_t *binary, size_t bin_length, walk_callback callback, void *context);
 
+// the number of bytes allocated for the nodes of the tree, not including the records
+size_t tree_memory(const struct tree_root *root);
+
 #endif // __SERVAL_DNA__NIBBLE_TREE_H
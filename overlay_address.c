@@ -52,6 +52,167 @@ static struct broadcast bpilist[MAX_BPIS];
 
 static __thread struct tree_root root={.binary_length=SID_SIZE};
 
+/* Subscribers are looked up for nearly every address in every packet we decode. So as well as the
+ * tree, which we still need for walking prefixes, we keep two open addressing hash indexes. One
+ * finds whole SIDs, the other finds abbreviations of up to SUBSCRIBER_INDEX_PREFIX bytes, which
+ * covers the abbreviations that senders choose for all but enormous networks. An abbreviation
+ * that matches more than one subscriber is marked as ambiguous. Subscribers are only ever removed
+ * when the whole tree is freed, so the indexes never need to forget an entry.
+ */
+#define SUBSCRIBER_INDEX_PREFIX 4
+#define SUBSCRIBER_AMBIGUOUS ((struct subscriber *)1)
+#define SUBSCRIBER_SEARCH_TREE ((struct subscriber *)2)
+
+struct subscriber_index_entry{
+  uint64_t key;
+  struct subscriber *subscriber;
+};
+
+struct subscriber_index{
+  struct subscriber_index_entry *entries;
+  size_t size;
+  size_t count;
+};
+
+static __thread struct subscriber_index sid_index;
+static __thread struct subscriber_index prefix_index;
+static __thread uint64_t index_seed;
+// set if we ran out of memory, until the tree is freed
+static __thread bool_t index_disabled;
+
+// whole SIDs are keyed by their first 8 bytes, abbreviations by their bytes and length
+static uint64_t sid_key(const uint8_t *binary)
+{
+  uint64_t key = 0;
+  unsigned i;
+  for (i = 0; i < 8; i++)
+    key = (key << 8) | binary[i];
+  return key;
+}
+
+static uint64_t prefix_key(const uint8_t *binary, unsigned len)
+{
+  uint64_t key = 0;
+  unsigned i;
+  for (i = 0; i < len; i++)
+    key = (key << 8) | binary[i];
+  return (key << 8) | len;
+}
+
+static size_t index_hash(uint64_t key)
+{
+  // SIDs are public keys, but an abbreviation can be chosen by anyone, so mix in a random seed
+  uint64_t h = key ^ index_seed;
+  h = (h ^ (h >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  h = (h ^ (h >> 27)) * 0x94D049BB133111EBULL;
+  return (size_t)(h ^ (h >> 31));
+}
+
+// find the entry for this key, or the empty entry where it belongs
+static struct subscriber_index_entry *index_slot(struct subscriber_index *index, uint64_t key, const uint8_t *sid)
+{
+  size_t mask = index->size - 1;
+  size_t i = index_hash(key) & mask;
+  while(1){
+    struct subscriber_index_entry *entry = &index->entries[i];
+    if (!entry->subscriber)
+      return entry;
+    if (entry->key == key && (!sid || memcmp(entry->subscriber->sid.binary, sid, SID_SIZE) == 0))
+      return entry;
+    i = (i + 1) & mask;
+  }
+}
+
+// make room for 'count' more entries, keeping the table no more than half full
+static int index_reserve(struct subscriber_index *index, size_t count)
+{
+  if ((index->count + count) * 2 <= index->size)
+    return 0;
+  struct subscriber_index old = *index;
+  index->size = old.size ? old.size * 2 : 1024;
+  if ((index->entries = emalloc_zero(index->size * sizeof(struct subscriber_index_entry))) == NULL){
+    *index = old;
+    return -1;
+  }
+  if (!index_seed)
+    randombytes_buf(&index_seed, sizeof index_seed);
+  size_t mask = index->size - 1;
+  size_t i;
+  for (i = 0; i < old.size; i++){
+    if (!old.entries[i].subscriber)
+      continue;
+    size_t j = index_hash(old.entries[i].key) & mask;
+    while (index->entries[j].subscriber)
+      j = (j + 1) & mask;
+    index->entries[j] = old.entries[i];
+  }
+  free(old.entries);
+  return 0;
+}
+
+static void subscriber_index_free()
+{
+  free(sid_index.entries);
+  free(prefix_index.entries);
+  bzero(&sid_index, sizeof sid_index);
+  bzero(&prefix_index, sizeof prefix_index);
+  index_disabled = 0;
+}
+
+static void subscriber_index_add(struct subscriber *subscriber)
+{
+  if (index_disabled)
+    return;
+  if (index_reserve(&sid_index, 1) == -1 || index_reserve(&prefix_index, SUBSCRIBER_INDEX_PREFIX) == -1){
+    // the indexes are no use unless they know every subscriber
+    subscriber_index_free();
+    index_disabled = 1;
+    return;
+  }
+  const uint8_t *sid = subscriber->sid.binary;
+  struct subscriber_index_entry *entry = index_slot(&sid_index, sid_key(sid), sid);
+  assert(!entry->subscriber);
+  entry->key = sid_key(sid);
+  entry->subscriber = subscriber;
+  sid_index.count++;
+  unsigned len;
+  for (len = 1; len <= SUBSCRIBER_INDEX_PREFIX; len++){
+    uint64_t key = prefix_key(sid, len);
+    entry = index_slot(&prefix_index, key, NULL);
+    if (entry->subscriber){
+      entry->subscriber = SUBSCRIBER_AMBIGUOUS;
+    }else{
+      entry->key = key;
+      entry->subscriber = subscriber;
+      prefix_index.count++;
+    }
+  }
+}
+
+/* Returns the only subscriber that matches, NULL if there isn't exactly one, or
+ * SUBSCRIBER_SEARCH_TREE if the indexes can't tell.
+ */
+static struct subscriber *subscriber_index_find(const uint8_t *binary, unsigned len)
+{
+  if (index_disabled || len == 0 || len > SID_SIZE)
+    return SUBSCRIBER_SEARCH_TREE;
+  if (!sid_index.size)
+    return NULL;
+  if (len == SID_SIZE)
+    return index_slot(&sid_index, sid_key(binary), binary)->subscriber;
+  if (len <= SUBSCRIBER_INDEX_PREFIX){
+    struct subscriber *subscriber = index_slot(&prefix_index, prefix_key(binary, len), NULL)->subscriber;
+    return subscriber == SUBSCRIBER_AMBIGUOUS ? NULL : subscriber;
+  }
+  // a longer abbreviation can only match the one subscriber with the longest indexed prefix
+  struct subscriber *subscriber = index_slot(&prefix_index, prefix_key(binary, SUBSCRIBER_INDEX_PREFIX), NULL)->subscriber;
+  if (subscriber == SUBSCRIBER_AMBIGUOUS)
+    return SUBSCRIBER_SEARCH_TREE;
+  if (subscriber && memcmp(subscriber->sid.binary, binary, len) != 0)
+    return NULL;
+  return subscriber;
+}
+
 static __thread struct subscriber *my_subscriber=NULL;
 
 struct subscriber *get_my_subscriber(bool_t create){
@@ -108,6 +269,7 @@ void free_subscribers()
   if (serverMode)
     FATAL("Freeing subscribers from a running daemon is not supported");
   tree_walk(&root, NULL, 0, free_node, NULL);
+  subscriber_index_free();
 }
 
 /* Free the subscribers tree after every CLI command.
@@ -126,6 +288,7 @@ static void *create_subscriber(void *UNUSED(context), const uint8_t *binary, siz
   struct subscriber *ret = (struct subscriber *) emalloc_zero(sizeof(struct subscriber));
   if (ret){
     ret->sid = *(const sid_t *)binary;
+    subscriber_index_add(ret);
     DEBUGF(subscriber, "Stored %s", alloca_tohex_sid_t(ret->sid));
   }
   return ret;
@@ -134,7 +297,9 @@ static void *create_subscriber(void *UNUSED(context), const uint8_t *binary, siz
 // find a subscriber struct from a whole or abbreviated subscriber id
 struct subscriber *find_subscriber(const uint8_t *sidp, int len, int create)
 {
-  struct subscriber *result;
+  struct subscriber *result = subscriber_index_find(sidp, len);
+  if (result != SUBSCRIBER_SEARCH_TREE && (result || !create || len != SID_SIZE))
+    return result;
   tree_find(&root, (void**)&result, sidp, len, create && len == SID_SIZE ? create_subscriber : NULL, NULL);
   // ignore return code, just return the result
   return result;
@@ -237,10 +402,10 @@ static int add_explain_response(void **record, void *context)
   subscriber->last_explained = now;
 
   if (!response->please_explain){
-    if ((response->please_explain = emalloc_zero(sizeof(struct overlay_frame))) == NULL)
+    if ((response->please_explain = op_new()) == NULL)
       return 1; // stop walking
     if ((response->please_explain->payload = ob_new()) == NULL) {
-      free(response->please_explain);
+      op_free(response->please_explain);
       response->please_explain = NULL;
       return 1; // stop walking
     }
@@ -304,7 +469,7 @@ static int find_subscr_buffer(struct decode_context *context, struct overlay_buf
       
       // add the abbreviation you told me about
       if (!context->please_explain){
-	context->please_explain = calloc(sizeof(struct overlay_frame),1);
+	context->please_explain = op_new();
 	if ((context->please_explain->payload = ob_new()) == NULL)
 	  return -1;
 	ob_limitsize(context->please_explain->payload, MDP_MTU);
@@ -379,7 +544,7 @@ int overlay_address_parse(struct decode_context *context, struct overlay_buffer
 	if ((context->flags & DECODE_FLAG_DONT_EXPLAIN) == 0){
 	  // add the abbreviation you told me about
 	  if (!context->please_explain){
-	    context->please_explain = calloc(sizeof(struct overlay_frame),1);
+	    context->please_explain = op_new();
 	    if ((context->please_explain->payload = ob_new()) == NULL)
 	      return -1;
 	    ob_limitsize(context->please_explain->payload, MDP_MTU);
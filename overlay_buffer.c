@@ -23,6 +23,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include "mem.h"
 #include "str.h"
 #include "overlay_buffer.h"
+#include "pool.h"
 
 /*
  When writing to a buffer, sizeLimit may place an upper bound on the amount of space to use
@@ -32,9 +33,59 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
  In either case, functions that don't take an offset use and advance the position.
  */
 
+/* Buffers are created and freed for every packet we send or receive, so both the overlay_buffer
+ * structures and the byte arrays of packet sized buffers are recycled through pools. Larger
+ * buffers come from the heap.
+ */
+static struct pool buffer_pool = POOL_INIT("overlay_buffer", sizeof(struct overlay_buffer), 256);
+
+#define BYTES_POOL_MIN 64
+#define BYTES_POOL_MAX 2048
+static struct pool bytes_pools[] = {
+  POOL_INIT("overlay_buffer 64 bytes", 64, 64),
+  POOL_INIT("overlay_buffer 128 bytes", 128, 64),
+  POOL_INIT("overlay_buffer 256 bytes", 256, 64),
+  POOL_INIT("overlay_buffer 512 bytes", 512, 64),
+  POOL_INIT("overlay_buffer 1024 bytes", 1024, 64),
+  POOL_INIT("overlay_buffer 2048 bytes", 2048, 64),
+};
+
+// which pool holds byte arrays of this size, if any
+static struct pool *bytes_pool(size_t size)
+{
+  if (size > BYTES_POOL_MAX)
+    return NULL;
+  unsigned i = 0;
+  size_t pool_size = BYTES_POOL_MIN;
+  while (pool_size < size){
+    pool_size <<= 1;
+    i++;
+  }
+  assert(i < NELS(bytes_pools));
+  return &bytes_pools[i];
+}
+
+static struct overlay_buffer *ob_alloc(struct __sourceloc __whence)
+{
+  struct overlay_buffer *ret = pool_alloc(&buffer_pool);
+  if (ret)
+    bzero(ret, sizeof *ret);
+  return ret;
+}
+
+static void ob_free_bytes(struct overlay_buffer *b)
+{
+  struct pool *pool = bytes_pool(b->allocSize);
+  if (pool){
+    assert(pool->size == b->allocSize);
+    pool_free(pool, b->allocated);
+  }else
+    free(b->allocated);
+}
+
 struct overlay_buffer *_ob_new(struct __sourceloc __whence)
 {
-  struct overlay_buffer *ret = emalloc_zero(sizeof(struct overlay_buffer));
+  struct overlay_buffer *ret = ob_alloc(__whence);
   DEBUGF(overlaybuffer, "ob_new() return %p", ret);
   if (ret == NULL)
     return NULL;
@@ -46,7 +97,7 @@ struct overlay_buffer *_ob_new(struct __sourceloc __whence)
 // and allow other callers to use the ob_ convenience methods for reading and writing up to size bytes.
 struct overlay_buffer *_ob_static(struct __sourceloc __whence, unsigned char *bytes, size_t size)
 {
-  struct overlay_buffer *ret = emalloc_zero(sizeof(struct overlay_buffer));
+  struct overlay_buffer *ret = ob_alloc(__whence);
   DEBUGF(overlaybuffer, "ob_static(bytes=%p, size=%zu) return %p", bytes, size, ret);
   if (ret == NULL)
     return NULL;
@@ -66,7 +117,7 @@ struct overlay_buffer *_ob_slice(struct __sourceloc __whence, struct overlay_buf
     WHY("Buffer isn't long enough to slice");
     return NULL;
   }
-  struct overlay_buffer *ret = emalloc_zero(sizeof(struct overlay_buffer));
+  struct overlay_buffer *ret = ob_alloc(__whence);
   DEBUGF(overlaybuffer, "ob_slice(b=%p, offset=%zu, length=%zu) return %p", b, offset, length, ret);
   if (ret == NULL)
       return NULL;
@@ -79,7 +130,7 @@ struct overlay_buffer *_ob_slice(struct __sourceloc __whence, struct overlay_buf
 
 struct overlay_buffer *_ob_dup(struct __sourceloc __whence, struct overlay_buffer *b)
 {
-  struct overlay_buffer *ret = emalloc_zero(sizeof(struct overlay_buffer));
+  struct overlay_buffer *ret = ob_alloc(__whence);
   DEBUGF(overlaybuffer, "ob_dup(b=%p) return %p", b, ret);
   if (ret == NULL)
     return NULL;
@@ -106,8 +157,8 @@ void _ob_free(struct __sourceloc __whence, struct overlay_buffer *b)
   assert(b != NULL);
   DEBUGF(overlaybuffer, "ob_free(b=%p)", b);
   if (b->allocated)
-    free(b->allocated);
-  free(b);
+    ob_free_bytes(b);
+  pool_free(&buffer_pool, b);
 }
 
 int _ob_checkpoint(struct __sourceloc __whence, struct overlay_buffer *b)
@@ -182,21 +233,26 @@ ssize_t _ob_makespace(struct __sourceloc __whence, struct overlay_buffer *b, siz
     return 0;
   }
   size_t newSize = b->position + bytes;
-  if (newSize<64) newSize=64;
-  if (newSize&63) newSize+=64-(newSize&63);
-  if (newSize>1024 && (newSize&1023))
-    newSize+=1024-(newSize&1023);
-  if (newSize>65536 && (newSize&65535))
-    newSize+=65536-(newSize&65535);
+  struct pool *pool = bytes_pool(newSize);
+  unsigned char *new;
+  if (pool){
+    newSize = pool->size;
+    new = pool_alloc(pool);
+  }else{
+    if (newSize&1023)
+      newSize+=1024-(newSize&1023);
+    if (newSize>65536 && (newSize&65535))
+      newSize+=65536-(newSize&65535);
+    new = emalloc(newSize);
+  }
   DEBUGF(overlaybuffer, "realloc(b->bytes=%p, newSize=%zu)", b->bytes, newSize);
-  unsigned char *new = emalloc(newSize);
   if (!new)
     return 0;
   if (b->position)
     bcopy(b->bytes,new,b->position);
   if (b->allocated) {
     assert(b->allocated == b->bytes);
-    free(b->allocated);
+    ob_free_bytes(b);
   }
   b->bytes=new;
   b->allocated=new;
@@ -90,6 +90,13 @@ void overlay_interface_close(overlay_interface *interface)
   unschedule(&interface->alarm);
   if (interface->radio_link_state)
     radio_link_free(interface);
+  
+  // drop any datagrams we haven't sent yet
+  while(interface->tx_pending){
+    interface->tx_pending--;
+    ob_free(interface->tx_pending_buffer[interface->tx_pending]);
+    release_destination_ref(interface->tx_pending_destination[interface->tx_pending]);
+  }
 
   set_destination_ref(&interface->destination, NULL);
 
@@ -97,6 +104,9 @@ void overlay_interface_close(overlay_interface *interface)
   
   INFOF("Interface %s addr %s is down", 
 	interface->name, alloca_socket_address(&interface->address));
+  if (interface->ifconfig.socket_type == SOCK_DGRAM)
+    DEBUGF(overlayinterfaces, "Interface %s sent %d packets in %d calls, received %d packets in %d calls",
+	interface->name, interface->tx_count, interface->tx_calls, interface->recv_count, interface->recv_calls);
 
   unsigned i, count=0;
   for (i=0;i<OVERLAY_MAX_INTERFACES;i++){
@@ -173,6 +183,10 @@ void interface_state_html(struct strbuf *b, struct overlay_interface *interface)
   }
   strbuf_sprintf(b, "TX: %d<br>", interface->tx_count);
   strbuf_sprintf(b, "RX: %d<br>", interface->recv_count);
+  if (interface->ifconfig.socket_type == SOCK_DGRAM){
+    strbuf_sprintf(b, "TX system calls: %d<br>", interface->tx_calls);
+    strbuf_sprintf(b, "RX system calls: %d<br>", interface->recv_calls);
+  }
 }
 
 // create a socket with options common to all our UDP sockets
@@ -347,37 +361,51 @@ int overlay_interface_compare(overlay_interface *one, overlay_interface *two)
   return 0;
 }
 
+/* Read the UDP packets that are already waiting on a socket, a few at a time to share resources
+ * fairly, with as few system calls as the platform allows. Packets are only valid until the next
+ * call.
+ */
+#define DGRAM_READ_BATCH 8
+#define DGRAM_READ_SIZE 16384
+static int read_dgram_batch(int fd, struct message_batch *batch)
+{
+  static unsigned char packets[DGRAM_READ_BATCH][DGRAM_READ_SIZE];
+  unsigned i;
+  for (i=0;i<DGRAM_READ_BATCH;i++){
+    batch->iov[i].iov_base = packets[i];
+    batch->iov[i].iov_len = sizeof packets[i];
+  }
+  return recv_messages(fd, batch, DGRAM_READ_BATCH);
+}
+
 // OSX doesn't recieve broadcast packets on sockets bound to an interface's address
 // So we have to bind a socket to INADDR_ANY to receive these packets.
 static void
 overlay_interface_read_any(struct sched_ent *alarm)
 {
   if (alarm->poll.revents & POLLIN) {
-    int plen=0;
-    int recvttl=1;
-    unsigned char packet[16384];
-    overlay_interface *interface=NULL;
-    struct socket_address recvaddr;
-    recvaddr.addrlen = sizeof recvaddr.store;
-    
-    /* Read only one UDP packet per call to share resources more fairly, and also
-     enable stats to accurately count packets received */
-    plen = recv_message(alarm->poll.fd, &recvaddr, &recvttl, packet, sizeof(packet));
-    if (plen == -1) {
+    struct message_batch batch;
+    int count = read_dgram_batch(alarm->poll.fd, &batch);
+    if (count == -1) {
       unwatch(alarm);
       close(alarm->poll.fd);
       return;
     }
     
-    /* Try to identify the real interface that the packet arrived on */
-    interface = overlay_interface_find(recvaddr.inet.sin_addr, 0);
-    
-    /* Drop the packet if we don't find a match */
-    if (!interface){
-      DEBUGF(overlayinterfaces, "Could not find matching interface for packet received from %s", inet_ntoa(recvaddr.inet.sin_addr));
-      return;
+    int i;
+    for (i=0;i<count;i++){
+      struct socket_address *recvaddr = &batch.address[i];
+      
+      /* Try to identify the real interface that the packet arrived on */
+      overlay_interface *interface = overlay_interface_find(recvaddr->inet.sin_addr, 0);
+      
+      /* Drop the packet if we don't find a match */
+      if (!interface){
+	DEBUGF(overlayinterfaces, "Could not find matching interface for packet received from %s", inet_ntoa(recvaddr->inet.sin_addr));
+	continue;
+      }
+      packetOkOverlay(interface, batch.iov[i].iov_base, batch.length[i], recvaddr);
     }
-    packetOkOverlay(interface, packet, plen, &recvaddr);
   }
   if (alarm->poll.revents & (POLLHUP | POLLERR)) {
     INFO("Closing broadcast socket due to error");
@@ -662,21 +690,16 @@ cleanup:
 
 static void interface_read_dgram(struct overlay_interface *interface)
 {
-  int plen=0;
-  unsigned char packet[8096];
-  
-  struct socket_address recvaddr;
-  recvaddr.addrlen = sizeof recvaddr.store;
-
-  /* Read only one UDP packet per call to share resources more fairly, and also
-   enable stats to accurately count packets received */
-  int recvttl=1;
-  plen = recv_message(interface->alarm.poll.fd, &recvaddr, &recvttl, packet, sizeof(packet));
-  if (plen == -1) {
+  struct message_batch batch;
+  int count = read_dgram_batch(interface->alarm.poll.fd, &batch);
+  if (count == -1) {
     overlay_interface_close(interface);
     return;
   }
-  packetOkOverlay(interface, packet, plen, &recvaddr);
+  interface->recv_calls++;
+  int i;
+  for (i=0;i<count && interface->state==INTERFACE_STATE_UP;i++)
+    packetOkOverlay(interface, batch.iov[i].iov_base, batch.length[i], &batch.address[i]);
 }
 
 struct file_packet{
@@ -944,6 +967,72 @@ static int send_local_broadcast(int fd, const uint8_t *bytes, size_t len, const
   return 0;
 }
 
+/* Send all the datagrams that have been queued on this interface, with as few system calls as
+ * the platform allows.
+ */
+void overlay_interface_flush(struct overlay_interface *interface)
+{
+  unsigned count = interface->tx_pending;
+  if (count == 0)
+    return;
+  interface->tx_pending = 0;
+  
+  struct network_destination *destinations[MAX_MESSAGE_BATCH];
+  struct overlay_buffer *buffers[MAX_MESSAGE_BATCH];
+  struct message_batch batch;
+  unsigned i;
+  for (i=0;i<count;i++){
+    destinations[i] = interface->tx_pending_destination[i];
+    buffers[i] = interface->tx_pending_buffer[i];
+    batch.address[i] = destinations[i]->address;
+    batch.iov[i].iov_base = (void *)ob_ptr(buffers[i]);
+    batch.iov[i].iov_len = ob_position(buffers[i]);
+  }
+  batch.count = count;
+  
+  i=0;
+  while(i<count && interface->state==INTERFACE_STATE_UP){
+    int sent = send_messages(interface->alarm.poll.fd, &batch, i);
+    interface->tx_calls++;
+    if (sent == -1){
+      if (errno!=EAGAIN && errno!=EWOULDBLOCK && errno!=ENOENT && errno!=ENOTDIR){
+	WHYF_perror("sendmsg(fd=%d,len=%zu,addr=%s) on interface %s",
+	    interface->alarm.poll.fd,
+	    batch.iov[i].iov_len,
+	    alloca_socket_address(&batch.address[i]),
+	    interface->name
+	  );
+	
+	// if we had any error while sending broadcast packets,
+	// it could be because the interface is coming down
+	// or there might be some socket error that we can't fix.
+	// So bring the interface down, and scan for network changes soon
+	if (destinations[i] == interface->destination){
+	  overlay_interface_close(interface);
+	  rescan_soon(gettime_ms()+100);
+	}
+      }
+      // skip this packet and try the rest
+      i++;
+      continue;
+    }
+    interface->tx_count+=sent;
+    i+=sent;
+  }
+  
+  for (i=0;i<count;i++){
+    ob_free(buffers[i]);
+    release_destination_ref(destinations[i]);
+  }
+}
+
+void overlay_interface_flush_all()
+{
+  unsigned i;
+  for (i=0;i<OVERLAY_MAX_INTERFACES;i++)
+    overlay_interface_flush(&overlay_interfaces[i]);
+}
+
 int overlay_broadcast_ensemble(struct network_destination *destination, struct overlay_buffer *buffer)
 {
   assert(destination && destination->interface);
@@ -1044,34 +1133,22 @@ int overlay_broadcast_ensemble(struct network_destination *destination, struct o
 	// find all sockets in this folder and send to them
 	send_local_broadcast(interface->alarm.poll.fd, 
 		  bytes, (size_t)len, destination->address.local.sun_path);
-      }else{
-	ssize_t sent = sendto(interface->alarm.poll.fd, 
-		  bytes, (size_t)len, 0, 
-		  &destination->address.addr, destination->address.addrlen);
-	if (sent == -1){
-	  if (errno!=EAGAIN && errno!=EWOULDBLOCK && errno!=ENOENT && errno!=ENOTDIR){
-	    WHYF_perror("sendto(fd=%d,len=%zu,addr=%s) on interface %s",
-		interface->alarm.poll.fd,
-		(size_t)len,
-		alloca_socket_address(&destination->address),
-		interface->name
-	      );
-	
-	    // if we had any error while sending broadcast packets,
-	    // it could be because the interface is coming down
-	    // or there might be some socket error that we can't fix.
-	    // So bring the interface down, and scan for network changes soon
-	    if (destination == interface->destination){
-	      overlay_interface_close(interface);
-	      rescan_soon(gettime_ms()+100);
-	    }
-	  }
+	ob_free(buffer);
+	interface->tx_count++;
+	return 0;
+      }
+      
+      // hold on to the packet, so we can send any others built at the same time with it
+      if (interface->tx_pending >= MAX_MESSAGE_BATCH){
+	overlay_interface_flush(interface);
+	if (interface->state!=INTERFACE_STATE_UP){
 	  ob_free(buffer);
 	  return -1;
 	}
       }
-      ob_free(buffer);
-      interface->tx_count++;
+      interface->tx_pending_destination[interface->tx_pending] = add_destination_ref(destination);
+      interface->tx_pending_buffer[interface->tx_pending] = buffer;
+      interface->tx_pending++;
       return 0;
     }
       
@@ -74,6 +74,14 @@ typedef struct overlay_interface {
   
   int recv_count;
   int tx_count;
+  // system calls used to receive and send those packets
+  int recv_calls;
+  int tx_calls;
+  
+  // datagrams waiting to be sent together by overlay_interface_flush()
+  unsigned tx_pending;
+  struct network_destination *tx_pending_destination[MAX_MESSAGE_BATCH];
+  struct overlay_buffer *tx_pending_buffer[MAX_MESSAGE_BATCH];
   
   struct radio_link_state *radio_link_state;
 
@@ -133,6 +141,8 @@ overlay_interface * overlay_interface_find(struct in_addr addr, int return_defau
 overlay_interface * overlay_interface_find_name_addr(const char *name, struct socket_address *addr);
 int overlay_interface_compare(overlay_interface *one, overlay_interface *two);
 int overlay_broadcast_ensemble(struct network_destination *destination, struct overlay_buffer *buffer);
+void overlay_interface_flush(struct overlay_interface *interface);
+void overlay_interface_flush_all();
 void interface_state_html(struct strbuf *b, struct overlay_interface *interface);
 void overlay_interface_monitor_up();
 
@@ -61,6 +61,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include "overlay_packet.h"
 #include "mdp_client.h"
 #include "crypto.h"
+#include "crypto_workers.h"
 #include "keyring.h"
 #include "socket.h"
 #include "server.h"
@@ -102,6 +103,8 @@ struct mdp_binding{
 
 static struct mdp_binding *mdp_bindings=NULL;
 static mdp_port_t next_port_binding=256;
+// frames dropped after their crypto job finished
+static unsigned mdp_crypt_drops;
 static struct subscriber internal[0];
 
 static int overlay_saw_mdp_frame(
@@ -242,6 +245,7 @@ static void overlay_mdp_shutdown()
     mdp_sock2_inet.poll.fd=-1;
   }
   overlay_mdp_clean_socket_files();
+  DEBUGF(crypto, "MDP frames dropped after encryption or decryption: %u", mdp_crypt_drops);
 }
 DEFINE_TRIGGER(shutdown, overlay_mdp_shutdown);
 
@@ -457,52 +461,118 @@ static struct overlay_buffer *overlay_mdp_decrypt(struct internal_mdp_header *he
       overlay_mdp_decode_header(header, ret);
       break;
     }
-      
-  case 0:
-    {
-      unsigned char *k=keyring_get_nm_bytes(header->destination->identity->box_sk,
-	header->destination->identity->box_pk,
-	&header->source->sid);
-      if (!k){
-	WHY("I don't have the private key required to decrypt that");
-	break;
-      }
+  }
+  
+  RETURN(ret);
+  OUT();
+}
 
-      unsigned char *nonce=ob_get_bytes_ptr(payload, crypto_box_NONCEBYTES);
-      if (!nonce){
-	WHYF("Expected %d bytes of nonce", crypto_box_NONCEBYTES);
-	break;
-      }
-      
-      int cipher_len=ob_remaining(payload);
-      if (cipher_len < (int)crypto_box_MACBYTES){
-	WHYF("Expected at least %d bytes of cipher text", crypto_box_MACBYTES);
-	break;
-      }
-      unsigned char *cipher_text=ob_get_bytes_ptr(payload, cipher_len);
+/* Frames handed to the crypto workers are held in the order they were sent or received, along with
+ * any later frames that did not need a worker, until every frame ahead of them is ready.  So MDP
+ * frames are still queued and delivered first in, first out.
+ */
+enum mdp_crypt_state{
+  MDP_CRYPT_BUSY,
+  MDP_CRYPT_READY,
+  MDP_CRYPT_FAILED
+};
 
-      struct overlay_buffer *plaintext = ob_new();
-      if (!ob_makespace(plaintext, cipher_len - crypto_box_MACBYTES)){
-	ob_free(plaintext);
-	break;
-      }
-      ob_limitsize(plaintext, cipher_len - crypto_box_MACBYTES);
+struct mdp_decrypt_context{
+  struct mdp_decrypt_context *next;
+  enum mdp_crypt_state state;
+  struct internal_mdp_header header;
+  struct overlay_buffer *buffer;
+};
 
-      if (crypto_box_open_easy_afternm(ob_ptr(plaintext), cipher_text, cipher_len, nonce, k)) {
-	ob_free(plaintext);
-	WHYF("crypto_box_open_easy_afternm() failed (from %s, to %s, len %d)",
-		    alloca_tohex_sid_t(header->source->sid), alloca_tohex_sid_t(header->destination->sid), cipher_len);
-	break;
-      }
+// received frames, in the order they arrived
+static struct mdp_decrypt_context *decrypting, **decrypting_tail = &decrypting;
 
-      overlay_mdp_decode_header(header, plaintext);
-      ret=plaintext;
-      break;
+static void overlay_mdp_decrypt_hold(struct mdp_decrypt_context *context)
+{
+  context->next = NULL;
+  *decrypting_tail = context;
+  decrypting_tail = &context->next;
+}
+
+// deliver the received frames that are no longer waiting behind one that is still being decrypted
+static void overlay_mdp_decrypt_release()
+{
+  while (decrypting && decrypting->state != MDP_CRYPT_BUSY){
+    struct mdp_decrypt_context *context = decrypting;
+    if (!(decrypting = context->next))
+      decrypting_tail = &decrypting;
+    // an earlier frame may have released the identity that this one was sent to
+    if (context->state == MDP_CRYPT_READY && context->header.destination
+      && !context->header.destination->identity){
+      WHYF("Dropped MDP frame to %s, the identity was released while the frame was held",
+	alloca_tohex_sid_t(context->header.destination->sid));
+      context->state = MDP_CRYPT_FAILED;
     }
+    if (context->state == MDP_CRYPT_READY)
+      overlay_saw_mdp_frame(&context->header, context->buffer);
+    else
+      mdp_crypt_drops++;
+    ob_free(context->buffer);
+    free(context);
   }
-  
-  RETURN(ret);
-  OUT();
+}
+
+static void overlay_mdp_decrypted(struct crypto_job *job)
+{
+  struct mdp_decrypt_context *context = job->context;
+  if (job->result){
+    WHYF("crypto_box_open_easy_afternm() failed (from %s, to %s, len %zu)",
+	alloca_tohex_sid_t(context->header.source->sid), alloca_tohex_sid_t(context->header.destination->sid), job->input_len);
+    context->state = MDP_CRYPT_FAILED;
+  }else{
+    overlay_mdp_decode_header(&context->header, context->buffer);
+    context->state = MDP_CRYPT_READY;
+  }
+  crypto_job_free(job);
+  overlay_mdp_decrypt_release();
+}
+
+/* Copy the cipher text, and hand it to a crypto worker to decrypt in place. The frame is processed
+ * once the job is completed.
+ */
+static int overlay_mdp_decrypt_submit(struct internal_mdp_header *header, struct overlay_buffer *payload)
+{
+  if (!header->destination || !header->destination->identity)
+    return WHY("I don't have the private key required to decrypt that");
+
+  unsigned char *nonce=ob_get_bytes_ptr(payload, crypto_box_NONCEBYTES);
+  if (!nonce)
+    return WHYF("Expected %d bytes of nonce", crypto_box_NONCEBYTES);
+
+  size_t cipher_len=ob_remaining(payload);
+  if (cipher_len < crypto_box_MACBYTES)
+    return WHYF("Expected at least %d bytes of cipher text", crypto_box_MACBYTES);
+
+  struct mdp_decrypt_context *context = emalloc_zero(sizeof(struct mdp_decrypt_context));
+  if (!context)
+    return -1;
+  context->header = *header;
+  struct crypto_job *job = NULL;
+  if ((context->buffer = ob_new()) == NULL
+    || !ob_makespace(context->buffer, cipher_len)
+    || (job = crypto_job_new(CRYPTO_JOB_BOX_OPEN, header->destination->identity->box_sk,
+	  header->destination->identity->box_pk, &header->source->sid)) == NULL){
+    if (context->buffer)
+      ob_free(context->buffer);
+    free(context);
+    return -1;
+  }
+  bcopy(nonce, job->nonce, crypto_box_NONCEBYTES);
+  bcopy(ob_current_ptr(payload), ob_ptr(context->buffer), cipher_len);
+  job->input = job->output = ob_ptr(context->buffer);
+  job->input_len = cipher_len;
+  job->done = overlay_mdp_decrypted;
+  job->context = context;
+  ob_limitsize(context->buffer, cipher_len - crypto_box_MACBYTES);
+  context->state = MDP_CRYPT_BUSY;
+  overlay_mdp_decrypt_hold(context);
+  crypto_job_submit(job);
+  return 0;
 }
 
 int overlay_saw_mdp_containing_frame(struct overlay_frame *f)
@@ -534,10 +604,33 @@ int overlay_saw_mdp_containing_frame(struct overlay_frame *f)
   mdp.out.src.sid = f->source->sid;
 
   /* copy crypto flags from frame so that we know if we need to decrypt or verify it */
+  if (header.crypt_flags == 0)
+    RETURN(overlay_mdp_decrypt_submit(&header, f->payload));
   struct overlay_buffer *mdp_payload = overlay_mdp_decrypt(&header, f->payload);
   if (mdp_payload==NULL)
     RETURN(-1);
   
+  /* if an earlier frame is still being decrypted, this one must wait behind it, so copy it out of
+     the packet */
+  if (decrypting){
+    struct mdp_decrypt_context *context = emalloc_zero(sizeof(struct mdp_decrypt_context));
+    if (context && (context->buffer = ob_new()) != NULL){
+      ob_append_bytes(context->buffer, ob_current_ptr(mdp_payload), ob_remaining(mdp_payload));
+      ob_flip(context->buffer);
+    }
+    ob_free(mdp_payload);
+    if (!context || !context->buffer || ob_overrun(context->buffer)){
+      if (context && context->buffer)
+	ob_free(context->buffer);
+      free(context);
+      RETURN(-1);
+    }
+    context->header = header;
+    context->state = MDP_CRYPT_READY;
+    overlay_mdp_decrypt_hold(context);
+    RETURN(0);
+  }
+
   /* and do something with it! */
   int ret=overlay_saw_mdp_frame(&header, mdp_payload);
   ob_free(mdp_payload);
@@ -762,51 +855,157 @@ static int generate_nonce(uint8_t *nonce, size_t bytes)
   return 0;
 }
 
-static struct overlay_buffer * encrypt_payload(
-  struct subscriber *source, 
-  struct subscriber *dest, 
-  const unsigned char *buffer,
-  size_t msg_len)
+struct mdp_encrypt_context{
+  struct mdp_encrypt_context *next;
+  enum mdp_crypt_state state;
+  struct __sourceloc whence;
+  struct overlay_frame *frame;
+  struct overlay_buffer *plaintext;
+};
+
+/* Frames waiting to be queued for transmission, for each queue in the order they were sent.  They
+ * count against their queue's length, so that congestion is reported to the sender straight away,
+ * and any frame dropped after it was accepted is logged and counted.
+ */
+static struct mdp_encrypt_context_list{
+  struct mdp_encrypt_context *head;
+  struct mdp_encrypt_context **tail;
+  unsigned length;
+} encrypting[OQ_MAX];
+
+static int encrypt_hold(struct __sourceloc whence, struct overlay_frame *frame, struct mdp_encrypt_context *context)
+{
+  struct mdp_encrypt_context_list *list = &encrypting[frame->queue];
+  if (overlay_queue_remaining(frame->queue) <= (int)list->length)
+    return WHYF("Queue #%d congested", frame->queue);
+  if (!list->tail)
+    list->tail = &list->head;
+  context->whence = whence;
+  context->frame = frame;
+  context->next = NULL;
+  *list->tail = context;
+  list->tail = &context->next;
+  list->length++;
+  return 0;
+}
+
+// queue the frames that are no longer waiting behind one that is still being encrypted
+static void encrypt_release(int queue)
+{
+  struct mdp_encrypt_context_list *list = &encrypting[queue];
+  while (list->head && list->head->state != MDP_CRYPT_BUSY){
+    struct mdp_encrypt_context *context = list->head;
+    if (!(list->head = context->next))
+      list->tail = &list->head;
+    list->length--;
+    if (context->state == MDP_CRYPT_READY && _overlay_payload_enqueue(context->whence, context->frame)){
+      WHYF("Dropped MDP frame to %s after encryption",
+	context->frame->destination ? alloca_tohex_sid_t(context->frame->destination->sid) : "broadcast");
+      context->state = MDP_CRYPT_FAILED;
+    }
+    if (context->state == MDP_CRYPT_FAILED){
+      mdp_crypt_drops++;
+      op_free(context->frame);
+    }
+    free(context);
+  }
+}
+
+static void encrypted_payload(struct crypto_job *job)
+{
+  struct mdp_encrypt_context *context = job->context;
+  ob_free(context->plaintext);
+  context->plaintext = NULL;
+  if (job->result){
+    WHY("crypto_box_easy_afternm() failed");
+    context->state = MDP_CRYPT_FAILED;
+  }else
+    context->state = MDP_CRYPT_READY;
+  crypto_job_free(job);
+  encrypt_release(context->frame->queue);
+}
+
+/* Queue a frame that does not need encrypting, unless it must wait behind earlier frames in the
+ * same queue that are still being encrypted.  The frame is freed if this fails.
+ */
+static int encrypt_queue_or_hold(struct __sourceloc whence, struct overlay_frame *frame)
+{
+  if (!encrypting[frame->queue].head){
+    if (_overlay_payload_enqueue(whence, frame)){
+      op_free(frame);
+      return -1;
+    }
+    return 0;
+  }
+  struct mdp_encrypt_context *context = emalloc_zero(sizeof(struct mdp_encrypt_context));
+  if (!context || encrypt_hold(whence, frame, context) == -1){
+    free(context);
+    op_free(frame);
+    return -1;
+  }
+  context->state = MDP_CRYPT_READY;
+  return 0;
+}
+
+/* Hand the plain text to a crypto worker, and queue the frame once it has been encrypted. The
+ * frame and plain text belong to the job, unless this fails.
+ */
+static int encrypt_payload_submit(struct __sourceloc whence, struct overlay_frame *frame, struct overlay_buffer *plaintext)
 {
-  struct overlay_buffer *ret = ob_new();
-  if (ret == NULL)
-    return NULL;
+  struct subscriber *source = frame->source;
+  size_t msg_len = ob_position(plaintext);
+
+  struct overlay_buffer *payload = ob_new();
+  if (payload == NULL)
+    return -1;
   
-  unsigned char *nonce = ob_append_space(ret, msg_len + crypto_box_NONCEBYTES + crypto_box_MACBYTES);
+  unsigned char *nonce = ob_append_space(payload, msg_len + crypto_box_NONCEBYTES + crypto_box_MACBYTES);
   if (!nonce){
-    ob_free(ret);
-    return NULL;
+    ob_free(payload);
+    return -1;
   }
-  unsigned char *cipher_text = nonce + crypto_box_NONCEBYTES;
 
   if (generate_nonce(nonce, crypto_box_NONCEBYTES)){
-    ob_free(ret);
-    WHY("generate_nonce() failed to generate nonce");
-    return NULL;
+    ob_free(payload);
+    return WHY("generate_nonce() failed to generate nonce");
   }
   
   // reserve the high bit of the nonce as a flag for transmitting a shorter nonce.
   nonce[0]&=0x7f;
   
-  /* get pre-computed PKxSK bytes (the slow part of auth-cryption that can be
-     retained and reused, and use that to do the encryption quickly. */
-  unsigned char *k=keyring_get_nm_bytes(source->identity->box_sk, source->identity->box_pk, &dest->sid);
-  if (!k) {
-    ob_free(ret);
-    WHY("could not compute Curve25519(NxM)");
-    return NULL;
-  }
-  /* Actually authcrypt the payload */
-  if (crypto_box_easy_afternm(cipher_text, buffer, msg_len, nonce, k)) {
-    ob_free(ret);
-    WHY("crypto_box_easy_afternm() failed");
-    return NULL;
+  /* the worker uses the pre-computed PKxSK bytes (the slow part of auth-cryption that can be
+     retained and reused), or calculates them if they aren't cached yet */
+  struct mdp_encrypt_context *context = emalloc_zero(sizeof(struct mdp_encrypt_context));
+  struct crypto_job *job = NULL;
+  if (!context
+    || (job = crypto_job_new(CRYPTO_JOB_BOX, source->identity->box_sk, source->identity->box_pk, &frame->destination->sid)) == NULL){
+    free(context);
+    ob_free(payload);
+    return -1;
   }
-  
-  return ret;
+  // report congestion now, as we would if the frame was queued immediately
+  if (encrypt_hold(whence, frame, context) == -1){
+    crypto_job_free(job);
+    free(context);
+    ob_free(payload);
+    return -1;
+  }
+  context->state = MDP_CRYPT_BUSY;
+  context->plaintext = plaintext;
+  bcopy(nonce, job->nonce, crypto_box_NONCEBYTES);
+  job->input = ob_ptr(plaintext);
+  job->input_len = msg_len;
+  job->output = nonce + crypto_box_NONCEBYTES;
+  job->done = encrypted_payload;
+  job->context = context;
+  frame->payload = payload;
+  crypto_job_submit(job);
+  return 0;
 }
 
 // encrypt or sign the plaintext, then queue the frame for transmission.
+// Returns 0 once the frame has been accepted, which may be before it has been encrypted and queued;
+// frames leave each queue in the order they were sent, and any dropped after encryption are logged.
 // Note, the position of the payload MUST be at the start of the data, the limit MUST be used to specify the end
 int _overlay_send_frame(struct __sourceloc whence, struct internal_mdp_header *header, struct overlay_buffer *payload)
 {
@@ -840,7 +1039,7 @@ int _overlay_send_frame(struct __sourceloc whence, struct internal_mdp_header *h
          header->destination?alloca_tohex_sid_t(header->destination->sid):"broadcast", header->destination_port);
       
   /* Prepare the overlay frame for dispatch */
-  struct overlay_frame *frame = emalloc_zero(sizeof(struct overlay_frame));
+  struct overlay_frame *frame = op_new();
   if (!frame)
     return -1;
   
@@ -893,18 +1092,14 @@ int _overlay_send_frame(struct __sourceloc whence, struct internal_mdp_header *h
       return WHY("Cannot encrypt to broadcast destinations");
     }
   
-    /* crypted and signed (using CryptoBox authcryption primitive) */
-    frame->payload = encrypt_payload(frame->source, frame->destination, ob_ptr(plaintext), ob_position(plaintext));
-    ob_free(plaintext);
-    if (!frame->payload){
+    /* crypted and signed (using CryptoBox authcryption primitive), the frame is queued once the
+       payload has been encrypted */
+    if (encrypt_payload_submit(whence, frame, plaintext) == -1){
+      ob_free(plaintext);
       op_free(frame);
       return -1;
     }
-#if 0
-    if (IF_DEBUG(crypto))
-      dump("Frame signed ciphertext", ob_ptr(frame->payload), ob_position(frame->payload));
-#endif
-    break;
+    return 0;
       
   case MDP_FLAG_NO_CRYPT:
     // Lets just append some space into the existing payload buffer for the signature, without copying it.
@@ -935,12 +1130,7 @@ int _overlay_send_frame(struct __sourceloc whence, struct internal_mdp_header *h
   if (!frame->destination && frame->ttl>1)
     overlay_broadcast_generate_address(&frame->broadcast_id);
   
-  if (_overlay_payload_enqueue(whence, frame)){
-    op_free(frame);
-    return -1;
-  }
-  
-  return 0;
+  return encrypt_queue_or_hold(whence, frame);
 }
 
 /* Construct MDP packet frame from overlay_mdp_frame structure
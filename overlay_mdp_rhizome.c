@@ -121,6 +121,61 @@ static int overlay_mdp_service_rhizomerequest(struct internal_mdp_header *header
   return rhizome_mdp_send_block(header->source, bidp, version, fileOffset, bitmap, blockLength);
 }
 
+// enough chunk references to fill most of a packet
+#define CHUNK_LIST_MAX 24
+
+DEFINE_BINDING(MDP_PORT_RHIZOME_CHUNK_REQUEST, overlay_mdp_service_rhizome_chunk_request);
+static int overlay_mdp_service_rhizome_chunk_request(struct internal_mdp_header *header, struct overlay_buffer *payload)
+{
+  const rhizome_bid_t *bidp = (const rhizome_bid_t *) ob_get_bytes_ptr(payload, sizeof bidp->binary);
+  uint64_t version = ob_get_ui64_rv(payload);
+  uint32_t first = ob_get_ui32_rv(payload);
+  if (ob_overrun(payload))
+    return -1;
+  if (!is_rhizome_mdp_server_running())
+    return -1;
+
+  rhizome_filehash_t filehash;
+  if (rhizome_database_filehash_from_id(bidp, version, &filehash) != 0)
+    return 0;
+  struct rhizome_chunk_ref refs[CHUNK_LIST_MAX];
+  unsigned total = 0;
+  int count = rhizome_chunk_list(&filehash, first, refs, CHUNK_LIST_MAX, &total);
+  // no reply if we don't have the payload in chunks; the requester will just fetch every block
+  if (count <= 0)
+    return count;
+
+  DEBUGF(rhizome_tx, "Sending chunks %u to %u of %u for bid=%s, ver=%"PRIu64,
+	 first, first + count - 1, total, alloca_tohex_rhizome_bid_t(*bidp), version);
+
+  struct internal_mdp_header reply;
+  bzero(&reply, sizeof reply);
+  reply.crypt_flags = MDP_FLAG_NO_CRYPT | MDP_FLAG_NO_SIGN;
+  reply.source = get_my_subscriber(1);
+  reply.source_port = MDP_PORT_RHIZOME_RESPONSE;
+  reply.destination = header->source;
+  reply.destination_port = MDP_PORT_RHIZOME_RESPONSE;
+  reply.qos = OQ_ORDINARY;
+
+  uint8_t buff[MDP_MTU];
+  struct overlay_buffer *response = ob_static(buff, sizeof(buff));
+  ob_append_byte(response, 'C'); // contains a chunk list
+  ob_append_bytes(response, bidp->binary, 16);
+  ob_append_ui64_rv(response, version);
+  ob_append_ui32_rv(response, total);
+  ob_append_ui32_rv(response, first);
+  ob_append_ui64_rv(response, refs[0].offset);
+  int i;
+  for (i = 0; i < count; ++i) {
+    ob_append_ui32_rv(response, refs[i].length);
+    ob_append_bytes(response, refs[i].hash, sizeof refs[i].hash);
+  }
+  ob_flip(response);
+  int ret = overlay_send_frame(&reply, response);
+  ob_free(response);
+  return ret;
+}
+
 DEFINE_BINDING(MDP_PORT_RHIZOME_RESPONSE, overlay_mdp_service_rhizomeresponse);
 static int overlay_mdp_service_rhizomeresponse(struct internal_mdp_header *UNUSED(header), struct overlay_buffer *payload)
 {
@@ -157,6 +212,33 @@ static int overlay_mdp_service_rhizomeresponse(struct internal_mdp_header *UNUSE
       RETURN(0);
     }
     break;
+  case 'C': /* chunk list */
+    {
+      unsigned char *bidprefix=ob_get_bytes_ptr(payload, 16);
+      uint64_t version=ob_get_ui64_rv(payload);
+      uint32_t total=ob_get_ui32_rv(payload);
+      uint32_t first=ob_get_ui32_rv(payload);
+      uint64_t offset=ob_get_ui64_rv(payload);
+      if (ob_overrun(payload))
+	RETURN(WHYF("Payload too short"));
+      struct rhizome_chunk_ref refs[CHUNK_LIST_MAX];
+      unsigned count = 0;
+      while (count < CHUNK_LIST_MAX && ob_remaining(payload)) {
+	refs[count].offset = offset;
+	refs[count].length = ob_get_ui32_rv(payload);
+	const uint8_t *hash = ob_get_bytes_ptr(payload, sizeof refs[count].hash);
+	if (!hash)
+	  RETURN(WHYF("Malformed chunk list"));
+	bcopy(hash, refs[count].hash, sizeof refs[count].hash);
+	offset += refs[count].length;
+	++count;
+      }
+      DEBUGF(rhizome_mdp_rx, "bidprefix=%02x%02x%02x%02x*, chunks %u+%u of %u",
+	     bidprefix[0],bidprefix[1],bidprefix[2],bidprefix[3],first,count,total);
+      rhizome_received_chunk_list(bidprefix, version, total, first, refs, count);
+      RETURN(0);
+    }
+    break;
   }
 
   RETURN(-1);
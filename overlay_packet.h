@@ -46,6 +46,14 @@ struct overlay_frame {
   // packet queue pointers
   struct overlay_frame *prev;
   struct overlay_frame *next;
+  // frames that could be sent now are also in a ready list, in queue order,
+  // and frames that can't are in a heap ordered by when they will be ready.
+  struct overlay_frame *ready_prev;
+  struct overlay_frame *ready_next;
+  uint8_t queue_state;
+  uint32_t queue_seq;
+  unsigned waiting_index;
+  time_ms_t wait_until;
   
   // when did we insert into the queue?
   time_ms_t enqueued_at;
@@ -122,6 +130,7 @@ struct internal_mdp_header{
 };
 
 
+struct overlay_frame *op_new();
 int op_free(struct overlay_frame *p);
 struct overlay_frame *op_dup(struct overlay_frame *f);
 
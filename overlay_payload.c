@@ -22,6 +22,18 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include "str.h"
 #include "overlay_buffer.h"
 #include "overlay_packet.h"
+#include "pool.h"
+
+// frames are created for every payload we send or forward, so recycle them
+static struct pool frame_pool = POOL_INIT("overlay_frame", sizeof(struct overlay_frame), 256);
+
+struct overlay_frame *op_new()
+{
+  struct overlay_frame *frame = pool_alloc(&frame_pool);
+  if (frame)
+    bzero(frame, sizeof *frame);
+  return frame;
+}
 
 static int overlay_frame_build_header(int packet_version, struct decode_context *context, 
 			       struct overlay_buffer *buff, 
@@ -123,7 +135,7 @@ int op_free(struct overlay_frame *p)
   p->next=NULL;
   if (p->payload) ob_free(p->payload);
   p->payload=NULL;
-  free(p);
+  pool_free(&frame_pool, p);
   return 0;
 }
 
@@ -132,7 +144,7 @@ struct overlay_frame *op_dup(struct overlay_frame *in)
   if (!in) return NULL;
 
   /* clone the frame */
-  struct overlay_frame *out = emalloc(sizeof(struct overlay_frame));
+  struct overlay_frame *out = pool_alloc(&frame_pool);
   if (out == NULL)
     return NULL;
 
@@ -141,7 +153,7 @@ struct overlay_frame *op_dup(struct overlay_frame *in)
 
   if (in->payload) {
     if ((out->payload = ob_dup(in->payload)) == NULL) {
-      free(out);
+      pool_free(&frame_pool, out);
       return NULL;
     }
   }
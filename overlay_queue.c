@@ -27,11 +27,25 @@
 #include "str.h"
 #include "strbuf.h"
 #include "route_link.h"
+#include "overlay_queue_test.h"
 #include "server.h"
 
+#define FRAME_UNQUEUED 0
+#define FRAME_READY 1
+#define FRAME_WAITING 2
+
 typedef struct overlay_txqueue {
   struct overlay_frame *first;
   struct overlay_frame *last;
+  /* Frames that we might be able to send now, in queue order.
+   Every other frame is waiting for a retransmit timer or delay, in a heap ordered by wait_until,
+   so that building a packet doesn't need to look at them. */
+  struct overlay_frame *ready_first;
+  struct overlay_frame *ready_last;
+  struct overlay_frame **waiting;
+  unsigned waiting_count;
+  unsigned waiting_size;
+  uint32_t next_seq;
   int length; /* # frames in queue */
   int maxLength; /* max # frames in queue before we consider ourselves congested */
   int small_packet_grace_interval;
@@ -42,6 +56,10 @@ typedef struct overlay_txqueue {
 
 overlay_txqueue overlay_tx[OQ_MAX];
 
+// frames that are waiting for an ack, indexed by the low bits of their mdp sequence number
+#define MDP_SEQUENCE_WINDOW 64
+static struct overlay_frame *sent_frames[MDP_SEQUENCE_WINDOW];
+
 // short lived data while we are constructing an outgoing packet
 struct outgoing_packet{
   struct network_destination *destination;
@@ -79,9 +97,200 @@ int overlay_queue_init(){
   return 0;
 }
 
+static void waiting_set(overlay_txqueue *queue, unsigned i, struct overlay_frame *frame)
+{
+  queue->waiting[i] = frame;
+  frame->waiting_index = i;
+}
+
+static void waiting_sift_up(overlay_txqueue *queue, unsigned i)
+{
+  struct overlay_frame *frame = queue->waiting[i];
+  while(i>0){
+    unsigned parent = (i-1)/2;
+    if (queue->waiting[parent]->wait_until <= frame->wait_until)
+      break;
+    waiting_set(queue, i, queue->waiting[parent]);
+    i = parent;
+  }
+  waiting_set(queue, i, frame);
+}
+
+static void waiting_sift_down(overlay_txqueue *queue, unsigned i)
+{
+  struct overlay_frame *frame = queue->waiting[i];
+  while(1){
+    unsigned child = i*2+1;
+    if (child >= queue->waiting_count)
+      break;
+    if (child+1 < queue->waiting_count && queue->waiting[child+1]->wait_until < queue->waiting[child]->wait_until)
+      child++;
+    if (frame->wait_until <= queue->waiting[child]->wait_until)
+      break;
+    waiting_set(queue, i, queue->waiting[child]);
+    i = child;
+  }
+  waiting_set(queue, i, frame);
+}
+
+// take the frame out of the ready list or waiting heap
+static void queue_unlink_state(overlay_txqueue *queue, struct overlay_frame *frame)
+{
+  switch(frame->queue_state){
+    case FRAME_READY:
+      if (frame->ready_prev)
+	frame->ready_prev->ready_next = frame->ready_next;
+      else
+	queue->ready_first = frame->ready_next;
+      if (frame->ready_next)
+	frame->ready_next->ready_prev = frame->ready_prev;
+      else
+	queue->ready_last = frame->ready_prev;
+      frame->ready_prev = frame->ready_next = NULL;
+      break;
+    case FRAME_WAITING:
+    {
+      unsigned i = frame->waiting_index;
+      struct overlay_frame *last = queue->waiting[--queue->waiting_count];
+      if (last != frame){
+	waiting_set(queue, i, last);
+	waiting_sift_up(queue, i);
+	waiting_sift_down(queue, last->waiting_index);
+      }
+      break;
+    }
+  }
+  frame->queue_state = FRAME_UNQUEUED;
+}
+
+static void queue_set_ready(overlay_txqueue *queue, struct overlay_frame *frame)
+{
+  if (frame->queue_state == FRAME_READY)
+    return;
+  queue_unlink_state(queue, frame);
+  // frames usually become ready in the order they were queued, so search from the end
+  struct overlay_frame *prev = queue->ready_last;
+  while(prev && (int32_t)(prev->queue_seq - frame->queue_seq) > 0)
+    prev = prev->ready_prev;
+  frame->ready_prev = prev;
+  frame->ready_next = prev ? prev->ready_next : queue->ready_first;
+  if (frame->ready_next)
+    frame->ready_next->ready_prev = frame;
+  else
+    queue->ready_last = frame;
+  if (prev)
+    prev->ready_next = frame;
+  else
+    queue->ready_first = frame;
+  frame->queue_state = FRAME_READY;
+}
+
+static void queue_set_waiting(overlay_txqueue *queue, struct overlay_frame *frame, time_ms_t until)
+{
+  if (frame->queue_state == FRAME_WAITING){
+    time_ms_t old = frame->wait_until;
+    frame->wait_until = until;
+    if (until < old)
+      waiting_sift_up(queue, frame->waiting_index);
+    else
+      waiting_sift_down(queue, frame->waiting_index);
+    return;
+  }
+  if (queue->waiting_count >= queue->waiting_size){
+    unsigned size = queue->waiting_size ? queue->waiting_size * 2 : 64;
+    struct overlay_frame **waiting = erealloc(queue->waiting, size * sizeof(struct overlay_frame *));
+    if (!waiting){
+      // we'll just have to keep looking at it
+      queue_set_ready(queue, frame);
+      return;
+    }
+    queue->waiting = waiting;
+    queue->waiting_size = size;
+  }
+  queue_unlink_state(queue, frame);
+  frame->wait_until = until;
+  waiting_set(queue, queue->waiting_count++, frame);
+  waiting_sift_up(queue, frame->waiting_index);
+  frame->queue_state = FRAME_WAITING;
+}
+
+/* When could this frame be sent next? Either when we need to retransmit it, or when a rate limited
+ * destination will accept another packet. A busy radio will tell us when it is ready for more, so
+ * frames waiting for one stay in the ready list. We also need to look at the frame again when it
+ * expires, so that we can drop it.
+ */
+static time_ms_t overlay_frame_ready_at(overlay_txqueue *queue, struct overlay_frame *frame)
+{
+  if (frame->destination_count==0)
+    return frame->delay_until;
+
+  time_ms_t ready_at = TIME_MS_NEVER_WILL;
+  time_ms_t expires = TIME_MS_NEVER_WILL;
+  if (queue->latencyTarget!=0)
+    expires = frame->enqueued_at + queue->latencyTarget + 1;
+  int i;
+  for (i=0;i<frame->destination_count;i++){
+    struct packet_destination *dest = &frame->destinations[i];
+    time_ms_t next = 0;
+    if (!radio_link_is_busy(dest->destination->interface))
+      next = limit_next_allowed(&dest->destination->transfer_limit);
+    if (dest->transmit_time && next < dest->transmit_time + dest->destination->resend_delay)
+      next = dest->transmit_time + dest->destination->resend_delay;
+    if (next < ready_at)
+      ready_at = next;
+    time_ms_t timeout = frame->enqueued_at + dest->destination->ifconfig.transmit_timeout_ms + 1;
+    if (timeout < expires)
+      expires = timeout;
+  }
+  if (ready_at < frame->delay_until)
+    ready_at = frame->delay_until;
+  return ready_at < expires ? ready_at : expires;
+}
+
+// put the frame in the ready list or the waiting heap, depending on when it could be sent
+static void overlay_queue_update(overlay_txqueue *queue, struct overlay_frame *frame, time_ms_t now)
+{
+  time_ms_t ready_at = overlay_frame_ready_at(queue, frame);
+  if (ready_at > now)
+    queue_set_waiting(queue, frame, ready_at);
+  else
+    queue_set_ready(queue, frame);
+}
+
+/* Look at every waiting frame again, when something has changed that may allow them to be sent
+ * sooner.  Every queued frame is then ready, and the queue is already in queue order, so the ready
+ * list is rebuilt from it in one pass.
+ */
+static void overlay_queue_wake_all()
+{
+  unsigned i;
+  for(i=0;i<OQ_MAX;i++) {
+    overlay_txqueue *queue = &overlay_tx[i];
+    if (!queue->waiting_count)
+      continue;
+    queue->waiting_count = 0;
+    queue->ready_first = queue->ready_last = NULL;
+    struct overlay_frame *frame;
+    for (frame = queue->first; frame; frame = frame->next){
+      assert(frame->queue_state != FRAME_UNQUEUED);
+      frame->ready_prev = queue->ready_last;
+      frame->ready_next = NULL;
+      if (queue->ready_last)
+	queue->ready_last->ready_next = frame;
+      else
+	queue->ready_first = frame;
+      queue->ready_last = frame;
+      frame->queue_state = FRAME_READY;
+    }
+  }
+}
+
 /* remove and free a payload from the queue */
 static struct overlay_frame *
 overlay_queue_remove(overlay_txqueue *queue, struct overlay_frame *frame){
+  queue_unlink_state(queue, frame);
+  if (frame->mdp_sequence != -1 && sent_frames[frame->mdp_sequence % MDP_SEQUENCE_WINDOW] == frame)
+    sent_frames[frame->mdp_sequence % MDP_SEQUENCE_WINDOW] = NULL;
   struct overlay_frame *prev = frame->prev;
   struct overlay_frame *next = frame->next;
   if (prev)
@@ -104,11 +313,36 @@ overlay_queue_remove(overlay_txqueue *queue, struct overlay_frame *frame){
   return next;
 }
 
+// remove and free a frame while walking the ready list, returning the next ready frame
+static struct overlay_frame *
+overlay_queue_remove_ready(overlay_txqueue *queue, struct overlay_frame *frame){
+  struct overlay_frame *next = frame->ready_next;
+  overlay_queue_remove(queue, frame);
+  return next;
+}
+
+/* The next hop can only de-duplicate retransmissions of recent frames, so when we send a frame with
+ * a new mdp sequence number, the frame that was first sent a full window ago can be dropped.
+ */
+static void overlay_queue_sequenced(struct overlay_frame *frame)
+{
+  struct overlay_frame **slot = &sent_frames[frame->mdp_sequence % MDP_SEQUENCE_WINDOW];
+  if (*slot){
+    DEBUGF(overlayframes, "Retransmition of frame %p mdp seq %d, is too late to be de-duplicated", 
+	   *slot, (*slot)->mdp_sequence);
+    overlay_queue_remove(&overlay_tx[(*slot)->queue], *slot);
+  }
+  *slot = frame;
+}
+
 static void overlay_queue_release(){
   unsigned i;
   for(i=0;i<OQ_MAX;i++) {
     while(overlay_tx[i].first)
       overlay_queue_remove(&overlay_tx[i], overlay_tx[i].first);
+    free(overlay_tx[i].waiting);
+    overlay_tx[i].waiting = NULL;
+    overlay_tx[i].waiting_size = 0;
   }
 }
 DEFINE_TRIGGER(shutdown, overlay_queue_release);
@@ -154,6 +388,14 @@ int overlay_queue_remaining(int queue){
   return overlay_tx[queue].maxLength - overlay_tx[queue].length;
 }
 
+// allow a queue to grow beyond its normal congestion limit, eg for benchmarking
+int overlay_queue_set_max_length(int queue, int length){
+  if (queue<0 || queue>=OQ_MAX)
+    return -1;
+  overlay_tx[queue].maxLength = length;
+  return 0;
+}
+
 int _overlay_payload_enqueue(struct __sourceloc __whence, struct overlay_frame *p)
 {
   /* Add payload p to queue q.
@@ -229,6 +471,10 @@ int _overlay_payload_enqueue(struct __sourceloc __whence, struct overlay_frame *
   queue->last=p;
   if (!queue->first) queue->first=p;
   queue->length++;
+  p->queue_state = FRAME_UNQUEUED;
+  p->queue_seq = queue->next_seq++;
+  p->ready_prev = p->ready_next = NULL;
+  overlay_queue_update(queue, p, p->enqueued_at);
   if (p->queue==OQ_ISOCHRONOUS_VOICE)
     rhizome_saw_voice_traffic();
   
@@ -360,7 +606,11 @@ overlay_calc_queue_time(struct overlay_frame *frame)
 
 static void
 overlay_stuff_packet(struct outgoing_packet *packet, overlay_txqueue *queue, time_ms_t now, strbuf debug){
-  struct overlay_frame *frame = queue->first;
+  // any frames that have finished waiting can be sent again
+  while(queue->waiting_count && queue->waiting[0]->wait_until <= now)
+    queue_set_ready(queue, queue->waiting[0]);
+
+  struct overlay_frame *frame = queue->ready_first;
   
   // TODO stop when the packet is nearly full?
   while(frame){
@@ -369,7 +619,7 @@ overlay_stuff_packet(struct outgoing_packet *packet, overlay_txqueue *queue, tim
 	     frame, frame->type, frame->payload->checkpointLength,
 	     frame->destination?alloca_tohex_sid_t(frame->destination->sid):"All"
 	    );
-      frame = overlay_queue_remove(queue, frame);
+      frame = overlay_queue_remove_ready(queue, frame);
       continue;
     }
     
@@ -392,14 +642,6 @@ overlay_stuff_packet(struct outgoing_packet *packet, overlay_txqueue *queue, tim
     if (!frame->manual_destinations)
       link_add_destinations(frame);
     
-    if(frame->mdp_sequence != -1 && ((mdp_sequence - frame->mdp_sequence)&0xFFFF) >= 64){
-      // too late, we've sent too many packets for the next hop to correctly de-duplicate
-      DEBUGF(overlayframes, "Retransmition of frame %p mdp seq %d, is too late to be de-duplicated", 
-	     frame, frame->mdp_sequence);
-      frame = overlay_queue_remove(queue, frame);
-      continue;
-    }
-    
     int destination_index=-1;
     {
       int i;
@@ -474,7 +716,7 @@ overlay_stuff_packet(struct outgoing_packet *packet, overlay_txqueue *queue, tim
     }
     
     if (frame->destination_count==0){
-      frame = overlay_queue_remove(queue, frame);
+      frame = overlay_queue_remove_ready(queue, frame);
       continue;
     }
     
@@ -485,13 +727,14 @@ overlay_stuff_packet(struct outgoing_packet *packet, overlay_txqueue *queue, tim
       // last minute check if we really want to send this frame, or track when we sent it
       if (frame->send_hook(frame, packet->destination, packet->seq, frame->send_context)){
         // drop packet
-        frame = overlay_queue_remove(queue, frame);
+        frame = overlay_queue_remove_ready(queue, frame);
         continue;
       }
     }
     
     if (frame->mdp_sequence == -1){
       frame->mdp_sequence = mdp_sequence = (mdp_sequence+1)&0xFFFF;
+      overlay_queue_sequenced(frame);
     }
     
     char will_retransmit=1;
@@ -527,23 +770,34 @@ overlay_stuff_packet(struct outgoing_packet *packet, overlay_txqueue *queue, tim
       DEBUGF(overlayframes, "Not waiting for retransmission (%d, %d, %d)", frame->packet_version, frame->resend, packet->seq);
       frame_remove_destination(frame, destination_index);
       if (frame->destination_count==0){
-	frame = overlay_queue_remove(queue, frame);
+	frame = overlay_queue_remove_ready(queue, frame);
 	continue;
       }
     }
     
   skip:
-    // if we can't send the payload now, check when we should try next
-    overlay_calc_queue_time(frame);
-    frame = frame->next;
+    {
+      struct overlay_frame *next = frame->ready_next;
+      // if we can't send the payload now, check when we should try next
+      time_ms_t ready_at = overlay_frame_ready_at(queue, frame);
+      if (ready_at > now)
+	queue_set_waiting(queue, frame, ready_at);
+      else
+	overlay_calc_queue_time(frame);
+      frame = next;
+    }
   }
+  
+  if (queue->waiting_count)
+    overlay_queue_schedule_next(queue->waiting[0]->wait_until);
 }
 
-// fill a packet from our outgoing queues and send it
-static void
+// fill a packet from our outgoing queues and send it, returns 1 if a packet was sent
+static int
 overlay_fill_send_packet(struct outgoing_packet *packet, time_ms_t now, strbuf debug) {
   IN();
   int i;
+  int sent=0;
     
   // while we're looking at queues, work out when to schedule another packet
   unschedule(&next_packet);
@@ -563,20 +817,33 @@ overlay_fill_send_packet(struct outgoing_packet *packet, time_ms_t now, strbuf d
     }
 
     overlay_broadcast_ensemble(packet->destination, packet->buffer);
+    sent=1;
   }
   if (packet->destination)
     release_destination_ref(packet->destination);
+  RETURN(sent);
   OUT();
 }
 
-// when the queue timer elapses, send a packet
+/* When the queue timer elapses, send a packet. If more packets could be sent straight away, build
+ * a few of them now so that interfaces can send them together.
+ */
 static void overlay_send_packet(struct sched_ent *UNUSED(alarm))
 {
-  struct outgoing_packet packet;
-  bzero(&packet, sizeof(struct outgoing_packet));
-  packet.seq=-1;
+  unsigned count=0;
+  time_ms_t now;
   strbuf debug = IF_DEBUG(packets_sent) ? strbuf_alloca(256) : NULL;
-  overlay_fill_send_packet(&packet, gettime_ms(), debug);
+  do{
+    struct outgoing_packet packet;
+    bzero(&packet, sizeof(struct outgoing_packet));
+    packet.seq=-1;
+    if (debug)
+      strbuf_reset(debug);
+    now = gettime_ms();
+    if (!overlay_fill_send_packet(&packet, now, debug))
+      break;
+  }while(++count < MAX_MESSAGE_BATCH && is_scheduled(&next_packet) && next_packet.alarm <= now);
+  overlay_interface_flush_all();
 }
 
 int overlay_send_tick_packet(struct network_destination *destination)
@@ -593,6 +860,7 @@ int overlay_send_tick_packet(struct network_destination *destination)
 	packet.seq);
     }
     overlay_fill_send_packet(&packet, gettime_ms(), debug);
+    overlay_interface_flush(destination->interface);
     // This debug statement is used for testing; do not remove or alter.
     DEBUGF(overlaytick, "TICK name=%s destination=%s seq=%d",
 	packet.destination->interface->name,
@@ -641,11 +909,13 @@ int overlay_queue_ack(struct subscriber *neighbour, struct network_destination *
 	      continue;
 	    }
 	    frame_remove_destination(frame, j);
+	    overlay_queue_update(&overlay_tx[i], frame, now);
 	    
 	  }else if (seq_delta < 128 && frame->destination && frame->delay_until>now){
 	    // retransmit asap
 	    DEBUGF(ack, "RE-TX DUE TO NACK: Requeue packet %p to %s sent by seq %d due to ack of seq %d", frame, alloca_tohex_sid_t(neighbour->sid), frame_seq, ack_seq);
 	    frame->delay_until = now;
+	    overlay_queue_update(&overlay_tx[i], frame, now);
 	    overlay_calc_queue_time(frame);
 	  }
 	}
@@ -662,6 +932,7 @@ int overlay_queue_ack(struct subscriber *neighbour, struct network_destination *
       if (delay < destination->resend_delay){
 	destination->resend_delay = delay;
 	DEBUGF(linkstate, "Adjusting resend delay to %d", destination->resend_delay);
+	overlay_queue_wake_all();
       }
     }
     if (!destination->max_rtt || rtt > destination->max_rtt)
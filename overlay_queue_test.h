@@ -0,0 +1,29 @@
+/*
+Serval DNA overlay transmit queue test functions
+Copyright (C) 2026 Serval Project Inc.
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#ifndef __SERVAL_DNA__OVERLAY_QUEUE_TEST_H
+#define __SERVAL_DNA__OVERLAY_QUEUE_TEST_H
+
+/* Hooks into the transmit queue for the "test overlay" commands, which are not used by the daemon.
+ */
+
+// allow a queue to grow beyond its normal congestion limit, eg for benchmarking
+int overlay_queue_set_max_length(int queue, int length);
+
+#endif
@@ -0,0 +1,335 @@
+/*
+ Serval DNA - Overlay network testing command line functions
+ Copyright (C) 2026 Serval Project Inc.
+
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU General Public License
+ as published by the Free Software Foundation; either version 2
+ of the License, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <assert.h>
+#include <fcntl.h>
+#include "serval.h"
+#include "cli.h"
+#include "conf.h"
+#include "commandline.h"
+#include "keyring.h"
+#include "overlay_address.h"
+#include "overlay_buffer.h"
+#include "overlay_interface.h"
+#include "overlay_packet.h"
+#include "overlay_queue_test.h"
+#include "route_link.h"
+#include "server.h"
+#include "mem.h"
+
+DEFINE_FEATURE(cli_overlay_tests);
+
+#define BENCHMARK_FRAME_SIZE 500
+
+/* Queue one frame for a benchmark destination, large enough that it will be sent in a packet of
+ * its own.  If resend is set, the frame is kept until it is acked.
+ */
+static int benchmark_enqueue(struct network_destination *destination, int8_t resend)
+{
+  struct overlay_frame *frame = op_new();
+  if (!frame)
+    return -1;
+  frame->type = OF_TYPE_DATA;
+  frame->queue = OQ_ORDINARY;
+  frame->ttl = 1;
+  frame->resend = resend;
+  frame->source = get_my_subscriber(1);
+  if ((frame->payload = ob_new()) == NULL){
+    op_free(frame);
+    return -1;
+  }
+  ob_append_space(frame->payload, BENCHMARK_FRAME_SIZE);
+  frame_add_destination(frame, NULL, destination);
+  if (overlay_payload_enqueue(frame) == -1){
+    op_free(frame);
+    return -1;
+  }
+  return 0;
+}
+
+static struct network_destination *benchmark_destination(overlay_interface *interface, uint32_t rate_micro_seconds)
+{
+  struct network_destination *destination = new_destination(interface);
+  if (!destination)
+    return NULL;
+  destination->ifconfig.send = 1;
+  destination->ifconfig.mtu = 1200;
+  destination->ifconfig.encapsulation = ENCAP_OVERLAY;
+  destination->ifconfig.transmit_timeout_ms = 3600000;
+  destination->sequence_number = 0;
+  limit_init(&destination->transfer_limit, rate_micro_seconds);
+  return destination;
+}
+
+// a fake interface that writes every packet to /dev/null
+static overlay_interface *benchmark_interface()
+{
+  overlay_interface *interface = &overlay_interfaces[0];
+  bzero(interface, sizeof *interface);
+  strcpy(interface->name, "benchmark");
+  interface->state = INTERFACE_STATE_UP;
+  interface->ifconfig.socket_type = SOCK_FILE;
+  interface->alarm.poll.fd = open("/dev/null", O_WRONLY);
+  if (interface->alarm.poll.fd == -1){
+    WHY_perror("open(\"/dev/null\")");
+    return NULL;
+  }
+  return interface;
+}
+
+static void benchmark_interface_close(overlay_interface *interface)
+{
+  close(interface->alarm.poll.fd);
+  interface->state = INTERFACE_STATE_DOWN;
+}
+
+DEFINE_CMD(app_overlay_queue_test, 0,
+   "Measure how quickly frames can be sent while other frames are queued for a slow destination",
+   "test","overlay","queue","[<count>]");
+static int app_overlay_queue_test(const struct cli_parsed *parsed, struct cli_context *context)
+{
+  static const unsigned backlogs[] = {0, 1000, 10000};
+  const char *count_arg;
+  cli_arg(parsed, "count", &count_arg, cli_uint, NULL);
+  unsigned count = count_arg ? atoi(count_arg) : 1000;
+
+  // frames need a source address, which is only available to a running daemon
+  assert(keyring == NULL);
+  if (!(keyring = keyring_open_instance_cli(parsed)))
+    return -1;
+  serverMode = SERVER_RUNNING;
+  int ret = -1;
+  struct network_destination *fast = NULL, *slow = NULL;
+
+  overlay_interface *interface = benchmark_interface();
+  if (!interface)
+    goto end;
+  // the slow destination may only send one packet every 10 seconds, so its frames pile up
+  if ((fast = benchmark_destination(interface, 0)) == NULL
+    || (slow = benchmark_destination(interface, 10000000)) == NULL)
+    goto end;
+
+  overlay_queue_init();
+  overlay_queue_set_max_length(OQ_ORDINARY, backlogs[NELS(backlogs)-1] + count + 1);
+
+  unsigned i, queued = 0;
+  for (i = 0; i < NELS(backlogs); ++i) {
+    while (queued < backlogs[i]){
+      if (benchmark_enqueue(slow, 0) == -1)
+	goto end;
+      queued++;
+    }
+    unsigned sent_before = interface->tx_count;
+    time_ms_t start = gettime_ms();
+    unsigned n;
+    for (n = 0; n < count; n++){
+      if (benchmark_enqueue(fast, 0) == -1)
+	goto end;
+      fd_poll();
+    }
+    time_ms_t elapsed = gettime_ms() - start;
+    unsigned sent = interface->tx_count - sent_before;
+    cli_printf(context, "%6u frames queued for a slow destination - %u frames in %u packets took %"PRId64"ms - %.0f frames/second\n",
+	backlogs[i], count, sent, elapsed, elapsed ? count * 1000.0 / elapsed : 0.0);
+  }
+  ret = 0;
+
+end:
+  if (fast)
+    release_destination_ref(fast);
+  if (slow)
+    release_destination_ref(slow);
+  if (interface)
+    benchmark_interface_close(interface);
+  release_my_subscriber();
+  serverMode = SERVER_NOT_RUNNING;
+  return ret;
+}
+
+DEFINE_CMD(app_overlay_window_test, 0,
+   "Check that frames waiting for an ack are dropped once the mdp sequence window has moved past them",
+   "test","overlay","window","[<count>]");
+static int app_overlay_window_test(const struct cli_parsed *parsed, struct cli_context *context)
+{
+  const char *count_arg;
+  cli_arg(parsed, "count", &count_arg, cli_uint, NULL);
+  unsigned count = count_arg ? atoi(count_arg) : 100;
+
+  assert(keyring == NULL);
+  if (!(keyring = keyring_open_instance_cli(parsed)))
+    return -1;
+  serverMode = SERVER_RUNNING;
+  int ret = -1;
+  struct network_destination *destination = NULL;
+
+  overlay_interface *interface = benchmark_interface();
+  if (!interface)
+    goto end;
+  // nothing is ever acked, and the frames are not sent again before the test ends
+  if ((destination = benchmark_destination(interface, 0)) == NULL)
+    goto end;
+  destination->resend_delay = 3600000;
+
+  overlay_queue_init();
+  overlay_queue_set_max_length(OQ_ORDINARY, count + 1);
+  int empty = overlay_queue_remaining(OQ_ORDINARY);
+
+  unsigned n;
+  for (n = 0; n < count; n++){
+    if (benchmark_enqueue(destination, 1) == -1)
+      goto end;
+    fd_poll();
+  }
+  cli_printf(context, "%u frames sent in %u packets - %d waiting for an ack\n",
+      count, interface->tx_count, empty - overlay_queue_remaining(OQ_ORDINARY));
+  ret = 0;
+
+end:
+  if (destination)
+    release_destination_ref(destination);
+  if (interface)
+    benchmark_interface_close(interface);
+  release_my_subscriber();
+  serverMode = SERVER_NOT_RUNNING;
+  return ret;
+}
+
+DEFINE_CMD(app_overlay_buffer_test, 0,
+   "Measure how quickly packet buffers and frames can be allocated and freed",
+   "test","overlay","buffers","[<count>]");
+static int app_overlay_buffer_test(const struct cli_parsed *parsed, struct cli_context *context)
+{
+  const char *count_arg;
+  cli_arg(parsed, "count", &count_arg, cli_uint, NULL);
+  unsigned count = count_arg ? atoi(count_arg) : 1000000;
+
+  // receive a packet of four frames, and forward a copy of each one
+  time_ms_t start = gettime_ms();
+  unsigned n, i;
+  for (n = 0; n < count; n++){
+    struct overlay_buffer *packet = ob_new();
+    if (!packet)
+      return -1;
+    ob_limitsize(packet, 1200);
+    for (i = 0; i < 4; i++)
+      ob_append_space(packet, 250);
+    for (i = 0; i < 4; i++){
+      struct overlay_frame *frame = op_new();
+      if (!frame)
+	return -1;
+      frame->payload = ob_slice(packet, i * 250, 250);
+      struct overlay_frame *copy = op_dup(frame);
+      if (copy)
+	op_free(copy);
+      op_free(frame);
+    }
+    ob_free(packet);
+  }
+  time_ms_t elapsed = gettime_ms() - start;
+  cli_printf(context, "%u packets took %"PRId64"ms - %.0f packets/second\n",
+      count, elapsed, elapsed ? count * 1000.0 / elapsed : 0.0);
+  return 0;
+}
+
+#define BENCHMARK_ADDRESSES 10000
+
+// decode every address in the buffer, checking that we found the subscribers that were encoded
+static int benchmark_decode(struct overlay_buffer *b, struct subscriber **expected)
+{
+  struct decode_context context;
+  bzero(&context, sizeof context);
+  context.flags = DECODE_FLAG_DONT_EXPLAIN;
+  b->position = 0;
+  unsigned i;
+  for (i = 0; i < BENCHMARK_ADDRESSES; i++){
+    struct subscriber *subscriber = NULL;
+    if (overlay_address_parse(&context, b, &subscriber) || subscriber != expected[i])
+      return WHYF("Failed to decode address %u", i);
+  }
+  return 0;
+}
+
+DEFINE_CMD(app_overlay_address_test, 0,
+   "Measure how quickly addresses can be decoded when we know many subscribers",
+   "test","overlay","addresses","[--subscribers=<count>]","[<count>]");
+static int app_overlay_address_test(const struct cli_parsed *parsed, struct cli_context *context)
+{
+  const char *subscribers_arg, *count_arg;
+  cli_arg(parsed, "--subscribers", &subscribers_arg, cli_uint, NULL);
+  cli_arg(parsed, "count", &count_arg, cli_uint, NULL);
+  unsigned subscriber_count = subscribers_arg ? atoi(subscribers_arg) : 10000;
+  unsigned count = count_arg ? atoi(count_arg) : 1000000;
+  if (subscriber_count == 0)
+    return WHY("Need at least one subscriber");
+
+  int ret = -1;
+  struct subscriber **known = emalloc(subscriber_count * sizeof(struct subscriber *));
+  struct subscriber **expected = emalloc(BENCHMARK_ADDRESSES * sizeof(struct subscriber *));
+  struct overlay_buffer *abbreviated = ob_new();
+  struct overlay_buffer *whole = ob_new();
+  if (!known || !expected || !abbreviated || !whole)
+    goto end;
+
+  srandom(1);
+  unsigned i, j;
+  for (i = 0; i < subscriber_count; i++){
+    sid_t sid;
+    for (j = 0; j < SID_SIZE; j++)
+      sid.binary[j] = random();
+    if ((known[i] = find_subscriber(sid.binary, SID_SIZE, 1)) == NULL)
+      goto end;
+  }
+  // abbreviations are only chosen once every subscriber is known, as a sender would
+  for (i = 0; i < BENCHMARK_ADDRESSES; i++){
+    expected[i] = known[random() % subscriber_count];
+    overlay_address_append(NULL, abbreviated, expected[i]);
+    ob_append_byte(whole, SID_SIZE);
+    ob_append_bytes(whole, expected[i]->sid.binary, SID_SIZE);
+  }
+
+  struct {
+    const char *name;
+    struct overlay_buffer *buffer;
+  } tests[] = {
+    {"abbreviated", abbreviated},
+    {"whole", whole},
+  };
+  for (i = 0; i < NELS(tests); i++){
+    ob_flip(tests[i].buffer);
+    time_ms_t start = gettime_ms();
+    unsigned n;
+    for (n = 0; n < count; n += BENCHMARK_ADDRESSES){
+      if (benchmark_decode(tests[i].buffer, expected) == -1)
+	goto end;
+    }
+    time_ms_t elapsed = gettime_ms() - start;
+    cli_printf(context, "%u subscribers - decoded %u %s addresses in %"PRId64"ms - %.0f addresses/second\n",
+	subscriber_count, n, tests[i].name, elapsed, elapsed ? n * 1000.0 / elapsed : 0.0);
+  }
+  ret = 0;
+
+end:
+  if (abbreviated)
+    ob_free(abbreviated);
+  if (whole)
+    ob_free(whole);
+  free(known);
+  free(expected);
+  return ret;
+}
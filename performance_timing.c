@@ -49,6 +49,7 @@
 #include <inttypes.h> // for PRIu64 on Android
 #include "fdqueue.h"
 #include "conf.h"
+#include "pool.h"
 
 __thread struct profile_total *stats_head=NULL;
 __thread struct call_stats *current_call=NULL;
@@ -205,6 +206,7 @@ int fd_showstats()
       stats = stats->_next;
     }    
     fd_showstat(&total,&total);
+    pool_log_stats();
   }
   
   return 0;
@@ -0,0 +1,142 @@
+/*
+Copyright (C) 2026 Serval Project Inc.
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+#include "pool.h"
+#include "mem.h"
+#include "log.h"
+#include "conf.h"
+#include "debug.h"
+
+#if defined(__SANITIZE_ADDRESS__)
+#  define POOL_BYPASS 1
+#elif defined(__has_feature)
+#  if __has_feature(address_sanitizer)
+#    define POOL_BYPASS 1
+#  endif
+#endif
+
+#define POISON_BYTE 0xDB
+// marks a free block whose contents were poisoned when it was freed
+#define POISON_MAGIC 0x506F6F6C506F6F6CULL
+// marks a free block that was freed without debug.pool, so its contents were left alone
+#define FREE_MAGIC 0x46726565426C6B21ULL
+
+/* Every block is preceded by a header that holds the free list link, so that the whole of a free
+ * block can be poisoned and checked.  The header keeps the block aligned as malloc() would.
+ */
+struct block_header{
+  struct block_header *next;
+  uint64_t magic;
+};
+
+#define BLOCK_DATA(header) ((void *)((header) + 1))
+#define BLOCK_HEADER(ptr) ((struct block_header *)(ptr) - 1)
+
+static struct pool *pools = NULL;
+
+static void pool_register(struct pool *pool)
+{
+  pool->_next = pools;
+  pools = pool;
+  pool->_registered = 1;
+}
+
+static int is_poisoned(const struct pool *pool, const struct block_header *header)
+{
+  const unsigned char *p = BLOCK_DATA(header);
+  const unsigned char *end = p + pool->size;
+  for (; p < end; p++)
+    if (*p != POISON_BYTE)
+      return 0;
+  return 1;
+}
+
+void *_pool_alloc(struct __sourceloc __whence, struct pool *pool)
+{
+  if (!pool->_registered)
+    pool_register(pool);
+  pool->allocations++;
+  struct block_header *header = pool->free_list;
+  if (header){
+    if (header->magic == POISON_MAGIC){
+      if (!is_poisoned(pool, header))
+	FATALF("%s pool block %p was written to after it was freed", pool->name, BLOCK_DATA(header));
+    }else if (header->magic != FREE_MAGIC)
+      FATALF("%s pool block %p header was overwritten while it was free", pool->name, BLOCK_DATA(header));
+    pool->free_list = header->next;
+    if (!pool->free_list)
+      pool->free_tail = NULL;
+    pool->free_count--;
+    pool->reused++;
+  }else if ((header = emalloc(sizeof *header + pool->size)) == NULL)
+    return NULL;
+  header->next = NULL;
+  header->magic = 0;
+  if (++pool->in_use > pool->max_in_use)
+    pool->max_in_use = pool->in_use;
+  return BLOCK_DATA(header);
+}
+
+void _pool_free(struct __sourceloc __whence, struct pool *pool, void *ptr)
+{
+  assert(pool->_registered);
+  struct block_header *header = BLOCK_HEADER(ptr);
+  if (header->magic == POISON_MAGIC || header->magic == FREE_MAGIC)
+    FATALF("%s pool block %p was freed twice", pool->name, ptr);
+  assert(pool->in_use > 0);
+  pool->in_use--;
+#ifdef POOL_BYPASS
+  free(header);
+#else
+  if (pool->free_count >= pool->max_free){
+    free(header);
+    return;
+  }
+  if (IF_DEBUG(pool)){
+    // poison the whole block, and keep it free for as long as possible, so that stale reads see
+    // the poison and writes are caught when it is handed out again
+    memset(ptr, POISON_BYTE, pool->size);
+    header->magic = POISON_MAGIC;
+    header->next = NULL;
+    if (pool->free_tail)
+      ((struct block_header *)pool->free_tail)->next = header;
+    else
+      pool->free_list = header;
+    pool->free_tail = header;
+  }else{
+    header->magic = FREE_MAGIC;
+    header->next = pool->free_list;
+    pool->free_list = header;
+    if (!pool->free_tail)
+      pool->free_tail = header;
+  }
+  pool->free_count++;
+#endif
+}
+
+void pool_log_stats()
+{
+  struct pool *pool;
+  for (pool = pools; pool; pool = pool->_next)
+    INFOF("Pool %s: %u in use (max %u), %u free, %u allocations, %u reused",
+	  pool->name, pool->in_use, pool->max_in_use, pool->free_count, pool->allocations, pool->reused);
+}
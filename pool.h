@@ -0,0 +1,63 @@
+/*
+Copyright (C) 2026 Serval Project Inc.
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#ifndef __SERVAL_DNA__POOL_H
+#define __SERVAL_DNA__POOL_H
+
+#include <sys/types.h>
+#include "whence.h"
+
+/* A pool of fixed size memory blocks. Freed blocks are kept for the next allocation, instead of
+ * being returned to the heap, up to max_free blocks. Pools are not thread safe, and must only be
+ * used by the main thread.
+ *
+ * Each block is preceded by a small header that links it into the free list. With debug.pool set,
+ * the whole of a freed block is filled with a poison pattern, which is checked when the block is
+ * handed out again, so that writes after free are caught. Freed blocks then go to the back of the
+ * free list, so that reads after free see the poison for as long as possible. A block that is
+ * freed twice, or whose header is overwritten while it is free, is fatal. Pools are bypassed
+ * entirely when built with AddressSanitizer.
+ */
+struct pool{
+  const char *name;
+  size_t size;
+  unsigned max_free;
+
+  void *free_list;
+  void *free_tail;
+  unsigned free_count;
+
+  unsigned in_use;
+  unsigned max_in_use;
+  unsigned allocations;
+  unsigned reused;
+
+  struct pool *_next;
+  char _registered;
+};
+
+#define POOL_INIT(NAME, SIZE, MAX_FREE) {.name=(NAME), .size=(SIZE), .max_free=(MAX_FREE)}
+
+void *_pool_alloc(struct __sourceloc, struct pool *pool);
+void _pool_free(struct __sourceloc, struct pool *pool, void *ptr);
+void pool_log_stats();
+
+#define pool_alloc(pool)      _pool_alloc(__WHENCE__, (pool))
+#define pool_free(pool, ptr)  _pool_free(__WHENCE__, (pool), (ptr))
+
+#endif
@@ -375,13 +375,25 @@ int rhizome_manifest_createid(rhizome_manifest *m);
 struct rhizome_bundle_result rhizome_private_bundle(rhizome_manifest *m, const sign_keypair_t *keypair);
 void rhizome_new_bundle_from_secret(rhizome_manifest *m, const rhizome_bk_t *bsk);
 
+/* A compact view of a manifest's text, for paths like listing and adverts which only need a few
+ * of its fields.  rhizome_manifest_inspect() checks that every line is well formed and parses the
+ * id, version, filesize and filehash fields.  Any other field is found on demand.  Nothing is
+ * copied or allocated, so the summary is only valid while the text it was made from is.
+ */
 struct rhizome_manifest_summary {
   rhizome_bid_t bid;
   uint64_t version;
-  size_t body_len;
+  uint64_t filesize; // RHIZOME_SIZE_UNSET if the manifest has no filesize field
+  rhizome_filehash_t filehash;
+  bool_t has_filehash;
+  const char *body;
+  size_t body_len; // including the NUL that ends the body, if present
 };
 
 int rhizome_manifest_inspect(const char *buf, size_t len, struct rhizome_manifest_summary *summ);
+const char *rhizome_manifest_summary_field(const struct rhizome_manifest_summary *summ, const char *label, size_t *lenp);
+int rhizome_manifest_summary_sid(const struct rhizome_manifest_summary *summ, const char *label, sid_t *sidp);
+int rhizome_manifest_summary_int64(const struct rhizome_manifest_summary *summ, const char *label, int64_t *valuep);
 
 enum rhizome_bundle_status {
     RHIZOME_BUNDLE_STATUS_ERROR = -1,
@@ -466,6 +478,20 @@ const char *rhizome_manifest_validate_reason(rhizome_manifest *m);
 int rhizome_manifest_parse(rhizome_manifest *m);
 int rhizome_manifest_verify(rhizome_manifest *m);
 
+// the most signatures that rhizome_manifest_verify_batch() checks at once
+#define RHIZOME_VERIFY_BATCH 64
+unsigned rhizome_manifest_verify_batch(rhizome_manifest *const *manifests, unsigned count);
+
+struct rhizome_signature_stats {
+  unsigned hits;
+  unsigned misses;
+  unsigned evictions;
+  // checked in batches, before the manifest was verified
+  unsigned batched;
+};
+extern struct rhizome_signature_stats rhizome_signature_stats;
+void rhizome_signature_cache_clear();
+
 void _rhizome_manifest_free(struct __sourceloc, rhizome_manifest *m);
 #define rhizome_manifest_free(m) _rhizome_manifest_free(__WHENCE__,m)
 rhizome_manifest *_rhizome_new_manifest(struct __sourceloc);
@@ -496,12 +522,31 @@ int rhizome_apply_bundle_secret(rhizome_manifest *, const rhizome_bk_t *);
 int rhizome_manifest_add_bundle_key(rhizome_manifest *);
 
 int rhizome_lookup_author(rhizome_manifest *m);
+enum rhizome_bundle_authorship rhizome_lookup_authorship(enum rhizome_bundle_authorship authorship, sid_t *author, const rhizome_bid_t *bid, const sid_t *sender);
 void rhizome_authenticate_author(rhizome_manifest *m);
 
 struct rhizome_bundle_result rhizome_manifest_finalise(rhizome_manifest *m, rhizome_manifest **m_out, int deduplicate);
+struct rhizome_bundle_result rhizome_manifest_seal(rhizome_manifest *m);
 enum rhizome_bundle_status rhizome_manifest_check_stored(rhizome_manifest *m, rhizome_manifest **m_out);
 enum rhizome_bundle_status rhizome_add_manifest_to_store(rhizome_manifest *m_in, rhizome_manifest **m_out);
 
+/* A batch of manifests being added to the store in a single transaction, for bulk imports.  Every
+ * manifest added to the batch must remain allocated until the batch is committed or rolled back,
+ * because the bundle_add trigger is only called for each of them once the commit succeeds.
+ */
+struct rhizome_ingest {
+  sqlite_retry_state retry;
+  sqlite3_stmt *insert;
+  rhizome_manifest **added;
+  unsigned added_count;
+  unsigned added_size;
+};
+
+int rhizome_ingest_begin(struct rhizome_ingest *batch);
+enum rhizome_bundle_status rhizome_ingest_manifest(struct rhizome_ingest *batch, rhizome_manifest *m, rhizome_manifest **m_out);
+int rhizome_ingest_commit(struct rhizome_ingest *batch);
+void rhizome_ingest_rollback(struct rhizome_ingest *batch);
+
 void rhizome_bytes_to_hex_upper(unsigned const char *in, char *out, int byteCount);
 int rhizome_find_privatekey(rhizome_manifest *m);
 
@@ -547,6 +592,7 @@ enum sqlbind_type {
 };
 
 sqlite3_stmt *_sqlite_prepare(struct __sourceloc, int log_level, sqlite_retry_state *retry, const char *sqltext);
+void sqlite_release(sqlite3_stmt *statement);
 int _sqlite_bind(struct __sourceloc __whence, int log_level, sqlite_retry_state *retry, sqlite3_stmt *statement, ...);
 int _sqlite_vbind(struct __sourceloc __whence, int log_level, sqlite_retry_state *retry, sqlite3_stmt *statement, va_list ap);
 sqlite3_stmt *_sqlite_prepare_bind(struct __sourceloc, int log_level, sqlite_retry_state *retry, const char *sqltext, ...);
@@ -659,7 +705,18 @@ struct rhizome_list_cursor {
   // moves in descending (reverse chronological) order starting from the most
   // recent bundle.
   uint64_t rowid_since;
-  // Set by calling the next() function.
+  // Set by calling the next() function, and only valid until it is called again.  The manifest
+  // is only inspected, not parsed, so any other field must be found through the summary.
+  struct rhizome_list_row {
+    struct rhizome_manifest_summary summary;
+    uint64_t rowid;
+    time_ms_t inserttime;
+    const char *service;
+    const char *name; // NULL if the manifest has no name
+    bool_t has_author;
+    sid_t author;
+  } row;
+  // Set by calling rhizome_list_manifest().
   rhizome_manifest *manifest;
   // Private state - implementation that could change.
   sqlite_retry_state _retry;
@@ -670,6 +727,8 @@ struct rhizome_list_cursor {
 
 int rhizome_list_open(struct rhizome_list_cursor *);
 int rhizome_list_next(struct rhizome_list_cursor *);
+rhizome_manifest *rhizome_list_manifest(struct rhizome_list_cursor *);
+enum rhizome_bundle_authorship rhizome_list_authorship(struct rhizome_list_cursor *, sid_t *author);
 void rhizome_list_commit(struct rhizome_list_cursor *);
 void rhizome_list_release(struct rhizome_list_cursor *);
 
@@ -711,6 +770,9 @@ struct rhizome_write
 
   unsigned char key[RHIZOME_CRYPT_KEY_BYTES];
   unsigned char nonce[crypto_box_NONCEBYTES];
+
+  // worker thread that encrypts, hashes and writes large payloads within rhizome_write_file(), or NULL
+  struct rhizome_write_pipeline *pipeline;
 };
 
 struct rhizome_read_buffer{
@@ -726,6 +788,13 @@ struct rhizome_read
   
   uint64_t blob_rowid;
   int blob_fd;
+  // the first 'length' bytes of blob_fd mapped into memory, or NULL
+  unsigned char *blob_map;
+  // set if the payload is stored as chunks, and the location of the last chunk read
+  uint8_t chunked;
+  uint64_t chunk_rowid;
+  uint64_t chunk_offset;
+  uint32_t chunk_length;
   
   uint64_t tail;
   uint64_t offset;
@@ -894,6 +963,7 @@ int rhizome_crypt_xor_block(unsigned char *buffer, size_t buffer_size, uint64_t
 enum rhizome_payload_status rhizome_open_read(struct rhizome_read *read, const rhizome_filehash_t *hashp);
 ssize_t rhizome_read(struct rhizome_read *read, unsigned char *buffer, size_t buffer_length);
 ssize_t rhizome_read_buffered(struct rhizome_read *read, struct rhizome_read_buffer *buffer, unsigned char *data, size_t len);
+ssize_t rhizome_read_zero_copy(struct rhizome_read *read, size_t length, int *fdp, uint64_t *offsetp);
 void rhizome_read_close(struct rhizome_read *read);
 enum rhizome_payload_status rhizome_open_decrypt_read(rhizome_manifest *m, struct rhizome_read *read_state);
 enum rhizome_payload_status rhizome_extract_file(rhizome_manifest *m, const char *filepath);
@@ -902,8 +972,49 @@ ssize_t rhizome_read_cached(const rhizome_bid_t *bid, uint64_t version, time_ms_
                             uint64_t fileOffset, unsigned char *buffer, size_t length);
 int rhizome_cache_close();
 
+struct rhizome_cache_stats {
+  unsigned entries;
+  unsigned files;
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t evictions;
+  uint64_t expiries;
+};
+void rhizome_cache_get_stats(struct rhizome_cache_stats *stats);
+
 int rhizome_database_filehash_from_id(const rhizome_bid_t *bidp, uint64_t version, rhizome_filehash_t *hashp);
 
+/* Content-defined chunking of payloads, see rhizome_chunk.c.  Chunk boundaries are chosen by a
+ * rolling hash of the content, so an insertion or deletion only changes the chunks around it.
+ */
+#define RHIZOME_CHUNK_MIN_SIZE    (2*1024)
+#define RHIZOME_CHUNK_MAX_SIZE    (64*1024)
+#define RHIZOME_CHUNK_HASH_BYTES  32
+
+struct rhizome_chunker {
+  uint32_t hash;
+  size_t length;
+};
+
+struct rhizome_chunk_ref {
+  uint64_t offset;
+  uint32_t length;
+  uint8_t hash[RHIZOME_CHUNK_HASH_BYTES];
+};
+
+void rhizome_chunker_init(struct rhizome_chunker *chunker);
+size_t rhizome_chunker_scan(struct rhizome_chunker *chunker, const uint8_t *data, size_t len, int *boundary);
+void rhizome_chunk_hash(const uint8_t *data, size_t len, uint8_t hash[RHIZOME_CHUNK_HASH_BYTES]);
+int rhizome_store_chunks(const rhizome_filehash_t *hashp);
+int rhizome_release_chunks(sqlite_retry_state *retry, const char *file_id);
+int rhizome_is_chunked(sqlite_retry_state *retry, const rhizome_filehash_t *hashp);
+ssize_t rhizome_read_chunked(sqlite_retry_state *retry, struct rhizome_read *read_state, unsigned char *buffer, size_t bufsz);
+ssize_t rhizome_chunk_read(const uint8_t hash[RHIZOME_CHUNK_HASH_BYTES], unsigned char *buffer, size_t bufsz);
+int rhizome_chunk_list(const rhizome_filehash_t *hashp, unsigned first, struct rhizome_chunk_ref *refs, unsigned max, unsigned *total);
+int rhizome_received_chunk_list(const unsigned char *bidprefix, uint64_t version, unsigned total, unsigned first,
+                                const struct rhizome_chunk_ref *refs, unsigned count);
+
+
 void rhizome_sync_status();
 
 DECLARE_ALARM(rhizome_fetch_status);
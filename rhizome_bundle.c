@@ -479,11 +479,15 @@ static void rhizome_manifest_clear(rhizome_manifest *m)
 int rhizome_manifest_inspect(const char *buf, size_t len, struct rhizome_manifest_summary *summ)
 {
   const char *const end = buf + len;
-  int has_bid = 0;
-  int has_version = 0;
+  // the fields that are parsed straight away, one bit each in 'seen'
+  enum { Other, Id, Version, Filesize, Filehash } field = Other;
+  unsigned seen = 0;
   const char *begin = buf;
   const char *eol = NULL;
   enum { Label, Value, Error } state = Label;
+  summ->filesize = RHIZOME_SIZE_UNSET;
+  summ->has_filehash = 0;
+  summ->body = buf;
   const char *p;
   for (p = buf; state != Error && p < end && *p; ++p)
     switch (state) {
@@ -492,20 +496,24 @@ int rhizome_manifest_inspect(const char *buf, size_t len, struct rhizome_manifes
 	  if (!rhizome_manifest_field_label_is_valid(begin, p - begin))
 	    state = Error; // bad field name
 	  else {
-	    int *has = NULL;
-	    if (p == begin + 2 && strncmp(begin, "id", 2) == 0)
-	      has = &has_bid;
-	    else if (p == begin + 7 && strncmp(begin, "version", 7) == 0)
-	      has = &has_version;
+	    size_t label_len = p - begin;
+	    field = Other;
+	    if (label_len == 2 && strncmp(begin, "id", 2) == 0)
+	      field = Id;
+	    else if (label_len == 7 && strncmp(begin, "version", 7) == 0)
+	      field = Version;
+	    else if (label_len == 8 && strncmp(begin, "filesize", 8) == 0)
+	      field = Filesize;
+	    else if (label_len == 8 && strncmp(begin, "filehash", 8) == 0)
+	      field = Filehash;
 	    state = Value;
-	    if (has) {
-	      if (*has)
+	    if (field != Other) {
+	      if (seen & (1 << field))
 		state = Error; // duplicate
-	      else {
-		*has = 1;
-		begin = p + 1;
-	      }
+	      else
+		seen |= 1 << field;
 	    }
+	    begin = p + 1;
 	  }
 	}
 	break;
@@ -515,21 +523,36 @@ int rhizome_manifest_inspect(const char *buf, size_t len, struct rhizome_manifes
 	else if (*p == '\n') {
 	  if (!eol)
 	    eol = p;
-	  if (has_bid == 1) {
-	    const char *e;
-	    if (parse_rhizome_bid_t(&summ->bid, begin, eol - begin, &e) == 0 && e == eol)
-	      has_bid = 2;
-	    else
-	      state = Error; // invalid "id" field
-	  } else if (has_version == 1) {
-	    const char *e;
-	    if (str_to_uint64(begin, 10, &summ->version, &e) && e == eol)
-	      has_version = 2;
-	    else
-	      state = Error; // invalid "version" field
+	  const char *e = NULL;
+	  switch (field) {
+	    case Id:
+	      if (parse_rhizome_bid_t(&summ->bid, begin, eol - begin, &e) == -1)
+		e = NULL;
+	      break;
+	    case Version:
+	      if (!str_to_uint64(begin, 10, &summ->version, &e))
+		e = NULL;
+	      break;
+	    case Filesize:
+	      if (!str_to_uint64(begin, 10, &summ->filesize, &e) || summ->filesize == RHIZOME_SIZE_UNSET)
+		e = NULL;
+	      break;
+	    case Filehash: {
+	      rhizome_filehash_t *fh = &summ->filehash;
+	      if (parse_hexn_t(fh, begin, eol - begin, &e) == -1)
+		e = NULL;
+	      summ->has_filehash = 1;
+	      break;
+	    }
+	    case Other:
+	      e = eol;
+	      break;
 	  }
-	  if (state == Value) {
+	  if (e != eol)
+	    state = Error; // invalid value
+	  else {
 	    state = Label;
+	    field = Other;
 	    begin = p + 1;
 	    eol = NULL;
 	  }
@@ -542,7 +565,48 @@ int rhizome_manifest_inspect(const char *buf, size_t len, struct rhizome_manifes
   if (p < end && *p == '\0')
     ++p;
   summ->body_len = p - buf;
-  return state == Label && has_bid == 2 && has_version == 2;
+  return state == Label && (seen & (1 << Id)) && (seen & (1 << Version));
+}
+
+/* Find the value of any field of an inspected manifest, without parsing or copying the rest of it.
+ * Returns a pointer to the value within the manifest text, which is not NUL terminated, or NULL if
+ * the manifest has no such field.
+ */
+const char *rhizome_manifest_summary_field(const struct rhizome_manifest_summary *summ, const char *label, size_t *lenp)
+{
+  size_t label_len = strlen(label);
+  const char *p = summ->body;
+  const char *const end = summ->body + summ->body_len;
+  while (p < end && *p) {
+    const char *eol = memchr(p, '\n', end - p);
+    if (!eol)
+      break;
+    if (p + label_len < eol && p[label_len] == '=' && strncmp(p, label, label_len) == 0) {
+      const char *value = p + label_len + 1;
+      size_t len = eol - value;
+      if (len && value[len - 1] == '\r')
+	--len;
+      *lenp = len;
+      return value;
+    }
+    p = eol + 1;
+  }
+  return NULL;
+}
+
+int rhizome_manifest_summary_sid(const struct rhizome_manifest_summary *summ, const char *label, sid_t *sidp)
+{
+  size_t len;
+  const char *value = rhizome_manifest_summary_field(summ, label, &len);
+  return value && strn_to_sid_t(sidp, value, len) != -1;
+}
+
+int rhizome_manifest_summary_int64(const struct rhizome_manifest_summary *summ, const char *label, int64_t *valuep)
+{
+  size_t len;
+  const char *value = rhizome_manifest_summary_field(summ, label, &len);
+  const char *e;
+  return value && str_to_int64(value, 10, valuep, &e) && e == value + len;
 }
 
 /* Parse a Rhizome text manifest from its internal buffer up to and including the terminating NUL
@@ -1329,24 +1393,34 @@ struct rhizome_bundle_result rhizome_manifest_finalise(rhizome_manifest *m, rhiz
   assert(*mout == NULL);
   *mout = m;
 
+  struct rhizome_bundle_result result = rhizome_manifest_seal(m);
+  if (result.status == RHIZOME_BUNDLE_STATUS_NEW) {
+    rhizome_bundle_result_free(&result);
+    /* mark manifest as finalised */
+    result.status = rhizome_add_manifest_to_store(m, mout);
+  }
+
+  RETURN(result);
+  OUT();
+}
+
+/* Pack the variables of a validated manifest into its text body and sign it, without adding it to
+ * the store.  Returns RHIZOME_BUNDLE_STATUS_NEW if successful.
+ */
+struct rhizome_bundle_result rhizome_manifest_seal(rhizome_manifest *m)
+{
   /* Convert to final form for signing and writing to disk */
   struct rhizome_bundle_result result = rhizome_manifest_pack_variables(m);
   if (result.status != RHIZOME_BUNDLE_STATUS_NEW)
-    RETURN(result);
+    return result;
   rhizome_bundle_result_free(&result);
 
   /* Sign it */
   assert(!m->selfSigned);
   result = rhizome_manifest_selfsign(m);
-  if (result.status == RHIZOME_BUNDLE_STATUS_NEW) {
+  if (result.status == RHIZOME_BUNDLE_STATUS_NEW)
     assert(m->selfSigned);
-    rhizome_bundle_result_free(&result);
-    /* mark manifest as finalised */
-    result.status = rhizome_add_manifest_to_store(m, mout);
-  }
-
-  RETURN(result);
-  OUT();
+  return result;
 }
 
 /* Returns 1 if the name was successfully set, 0 if not.
@@ -1483,42 +1557,61 @@ struct rhizome_bundle_result rhizome_fill_manifest(rhizome_manifest *m, const ch
 int rhizome_lookup_author(rhizome_manifest *m)
 {
   IN();
-  switch (m->authorship) {
+  sid_t author = m->author;
+  enum rhizome_bundle_authorship authorship = rhizome_lookup_authorship(m->authorship, &author,
+      &m->keypair.public_key, m->has_sender ? &m->sender : NULL);
+  if (authorship != m->authorship) {
+    rhizome_manifest_set_author(m, &author);
+    m->authorship = authorship;
+  }
+  switch (authorship) {
     case AUTHOR_LOCAL:
     case AUTHOR_AUTHENTIC:
     case AUTHOR_REMOTE:
       RETURN(1);
+    default:
+      RETURN(0);
+  }
+  OUT();
+}
+
+/* The part of rhizome_lookup_author() that only needs the author, bundle ID and sender (NULL if
+ * none) of a bundle, so that listings can use it without a whole manifest.  If the sender turns out
+ * to be the author, then copies it to *author.  Returns the new authorship.
+ */
+enum rhizome_bundle_authorship rhizome_lookup_authorship(enum rhizome_bundle_authorship authorship, sid_t *author, const rhizome_bid_t *bid, const sid_t *sender)
+{
+  switch (authorship) {
+    case AUTHOR_LOCAL:
+    case AUTHOR_AUTHENTIC:
+    case AUTHOR_REMOTE:
+      return authorship;
     case AUTHOR_NOT_CHECKED:
-      DEBUGF(rhizome, "manifest %p lookup author=%s", m, alloca_tohex_sid_t(m->author));
-      if (keyring && keyring_find_identity_sid(keyring, &m->author)) {
+      DEBUGF(rhizome, "lookup author=%s", alloca_tohex_sid_t(*author));
+      if (keyring && keyring_find_identity_sid(keyring, author)) {
 	DEBUGF(rhizome, "found author");
-	m->authorship = AUTHOR_LOCAL;
-	RETURN(1);
+	return AUTHOR_LOCAL;
       }
-      // fall through
+      FALLTHROUGH;
     case ANONYMOUS:
-      if (m->has_sender) {
-	DEBUGF(rhizome, "manifest %p lookup sender=%s", m, alloca_tohex_sid_t(m->sender));
-	if (keyring && keyring_find_identity_sid(keyring, &m->sender)) {
+      if (sender) {
+	DEBUGF(rhizome, "lookup sender=%s", alloca_tohex_sid_t(*sender));
+	if (keyring && keyring_find_identity_sid(keyring, sender)) {
 	  DEBUGF(rhizome, "found sender");
-	  rhizome_manifest_set_author(m, &m->sender);
-	  m->authorship = AUTHOR_LOCAL;
-	  RETURN(1);
-	} else if(crypto_ismatching_sign_sid(&m->keypair.public_key, &m->sender)) {
+	  *author = *sender;
+	  return AUTHOR_LOCAL;
+	} else if(crypto_ismatching_sign_sid(bid, sender)) {
 	  // if the author matches the bundle id...
 	  DEBUGF(rhizome, "sender matches manifest signature");
-	  m->author = m->sender;
-	  m->authorship = AUTHOR_REMOTE;
-	  RETURN(1);
+	  *author = *sender;
+	  return AUTHOR_REMOTE;
 	}
       }
-      // fall through
+      FALLTHROUGH;
     case AUTHENTICATION_ERROR:
     case AUTHOR_UNKNOWN:
     case AUTHOR_IMPOSTOR:
-      RETURN(0);
+      return authorship;
   }
-  FATALF("m->authorship = %d", m->authorship);
-  RETURN(0);
-  OUT();
+  FATALF("authorship = %d", authorship);
 }
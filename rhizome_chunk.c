@@ -0,0 +1,372 @@
+/*
+Serval DNA Rhizome content-defined chunking
+Copyright (C) 2026 Serval Project Inc.
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+/* If rhizome.chunked_storage is enabled, each new payload is split into chunks whose boundaries
+ * are chosen by a rolling "gear" hash of the content.  Each distinct chunk is stored once in the
+ * CHUNKS table with a count of the payloads that refer to it, and FILECHUNKS lists the chunks of
+ * each payload in order.  Successive versions of a bundle, or lightly edited files, then share
+ * most of their chunks, both on disk and (via the chunk list MDP request) on the wire.
+ */
+
+#include <assert.h>
+#include "serval.h"
+#include "rhizome.h"
+#include "conf.h"
+#include "str.h"
+#include "mem.h"
+#include "debug.h"
+
+// average chunk size is RHIZOME_CHUNK_MIN_SIZE plus 2^(32 - number of bits in this mask)
+#define CHUNK_BOUNDARY_MASK 0xFFF80000u
+
+static uint32_t gear[256];
+
+/* Every node must agree on the gear table, or they will never choose the same boundaries, so it
+ * is generated from a fixed seed.
+ */
+static void gear_init()
+{
+  if (gear[255])
+    return;
+  uint64_t x = 0x53657276616c4443ull;
+  unsigned i;
+  for (i = 0; i < 256; ++i) {
+    // splitmix64
+    uint64_t z = (x += 0x9E3779B97F4A7C15ull);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    gear[i] = (uint32_t)((z ^ (z >> 31)) >> 32);
+  }
+}
+
+void rhizome_chunker_init(struct rhizome_chunker *chunker)
+{
+  gear_init();
+  chunker->hash = 0;
+  chunker->length = 0;
+}
+
+/* Scan up to 'len' bytes of content.  Returns the number of bytes that belong to the current
+ * chunk, and sets *boundary if the current chunk ends after them.
+ */
+size_t rhizome_chunker_scan(struct rhizome_chunker *chunker, const uint8_t *data, size_t len, int *boundary)
+{
+  size_t i;
+  *boundary = 0;
+  for (i = 0; i < len; ++i) {
+    chunker->hash = (chunker->hash << 1) + gear[data[i]];
+    chunker->length++;
+    if (chunker->length >= RHIZOME_CHUNK_MAX_SIZE
+      || (chunker->length >= RHIZOME_CHUNK_MIN_SIZE && (chunker->hash & CHUNK_BOUNDARY_MASK) == 0)) {
+      *boundary = 1;
+      chunker->hash = 0;
+      chunker->length = 0;
+      return i + 1;
+    }
+  }
+  return len;
+}
+
+void rhizome_chunk_hash(const uint8_t *data, size_t len, uint8_t hash[RHIZOME_CHUNK_HASH_BYTES])
+{
+  uint8_t full[crypto_hash_sha512_BYTES];
+  crypto_hash_sha512(full, data, len);
+  bcopy(full, hash, RHIZOME_CHUNK_HASH_BYTES);
+}
+
+static int store_chunk(sqlite_retry_state *retry, const rhizome_filehash_t *hashp, uint64_t offset, const uint8_t *data, size_t len)
+{
+  uint8_t hash[RHIZOME_CHUNK_HASH_BYTES];
+  rhizome_chunk_hash(data, len, hash);
+  if (sqlite_exec_void_retry(retry,
+	"INSERT OR IGNORE INTO CHUNKS(id, refs, length, data) VALUES(?, 0, ?, ?);",
+	TOHEX, hash, sizeof hash,
+	INT, (int)len,
+	STATIC_BLOB, data, (int)len,
+	END) == -1
+    || sqlite_exec_void_retry(retry,
+	"UPDATE CHUNKS SET refs = refs + 1 WHERE id = ?;",
+	TOHEX, hash, sizeof hash,
+	END) == -1
+    || sqlite_exec_void_retry(retry,
+	"INSERT OR REPLACE INTO FILECHUNKS(fileid, offset, length, chunk) VALUES(?, ?, ?, ?);",
+	RHIZOME_FILEHASH_T, hashp,
+	INT64, (int64_t)offset,
+	INT, (int)len,
+	TOHEX, hash, sizeof hash,
+	END) == -1)
+    return -1;
+  return 0;
+}
+
+/* Convert a stored payload into chunks, replacing the whole copy in FILEBLOBS or the blob
+ * directory.  The payload is hashed while it is read, so a corrupt payload is never chunked.
+ * Returns 0 if the payload is now stored as chunks, -1 if it was left as it was.
+ */
+int rhizome_store_chunks(const rhizome_filehash_t *hashp)
+{
+  struct rhizome_read read_state;
+  bzero(&read_state, sizeof read_state);
+  enum rhizome_payload_status status = rhizome_open_read(&read_state, hashp);
+  if (status != RHIZOME_PAYLOAD_STATUS_STORED)
+    return WHYF("Cannot chunk payload %s: %s", alloca_tohex_rhizome_filehash_t(*hashp), rhizome_payload_status_message_nonnull(status));
+  if (read_state.chunked) {
+    rhizome_read_close(&read_state);
+    return 0;
+  }
+  uint8_t *chunk = emalloc(RHIZOME_CHUNK_MAX_SIZE);
+  if (!chunk) {
+    rhizome_read_close(&read_state);
+    return -1;
+  }
+
+  sqlite_retry_state retry = SQLITE_RETRY_STATE_DEFAULT;
+  if (sqlite_exec_void_retry(&retry, "BEGIN TRANSACTION;", END) == -1)
+    goto fail;
+
+  struct rhizome_chunker chunker;
+  rhizome_chunker_init(&chunker);
+  uint8_t buffer[RHIZOME_CRYPT_PAGE_SIZE * 4];
+  uint64_t chunk_offset = 0;
+  size_t chunk_len = 0;
+  unsigned chunk_count = 0;
+  while (1) {
+    ssize_t r = rhizome_read(&read_state, buffer, sizeof buffer);
+    if (r == -1)
+      goto rollback;
+    if (r == 0)
+      break;
+    size_t ofs = 0;
+    while (ofs < (size_t)r) {
+      int boundary;
+      size_t n = rhizome_chunker_scan(&chunker, buffer + ofs, (size_t)r - ofs, &boundary);
+      assert(chunk_len + n <= RHIZOME_CHUNK_MAX_SIZE);
+      bcopy(buffer + ofs, chunk + chunk_len, n);
+      chunk_len += n;
+      ofs += n;
+      if (boundary) {
+	if (store_chunk(&retry, hashp, chunk_offset, chunk, chunk_len) == -1)
+	  goto rollback;
+	chunk_offset += chunk_len;
+	chunk_len = 0;
+	chunk_count++;
+      }
+    }
+  }
+  if (chunk_len) {
+    if (store_chunk(&retry, hashp, chunk_offset, chunk, chunk_len) == -1)
+      goto rollback;
+    chunk_offset += chunk_len;
+    chunk_count++;
+  }
+  if (chunk_offset != read_state.length || read_state.verified != 1) {
+    WHYF("Payload %s was not read completely", alloca_tohex_rhizome_filehash_t(*hashp));
+    goto rollback;
+  }
+  if (sqlite_exec_void_retry(&retry, "DELETE FROM FILEBLOBS WHERE id = ?;", RHIZOME_FILEHASH_T, hashp, END) == -1
+    || sqlite_exec_void_retry(&retry, "COMMIT;", END) == -1)
+    goto rollback;
+
+  int external = read_state.blob_fd != -1;
+  rhizome_read_close(&read_state);
+  free(chunk);
+
+  if (external) {
+    char blob_path[1024];
+    if (FORMF_RHIZOME_STORE_PATH(blob_path, "%s/%s", RHIZOME_BLOB_SUBDIR, alloca_tohex_rhizome_filehash_t(*hashp))
+      && unlink(blob_path) == -1)
+      WARNF_perror("unlink(%s)", alloca_str_toprint(blob_path));
+  }
+  DEBUGF(rhizome_store, "Stored payload %s as %u chunks", alloca_tohex_rhizome_filehash_t(*hashp), chunk_count);
+  return 0;
+
+rollback:
+  sqlite_exec_void_retry(&retry, "ROLLBACK;", END);
+fail:
+  rhizome_read_close(&read_state);
+  free(chunk);
+  return -1;
+}
+
+/* Drop a payload's references to its chunks, deleting any chunks that are no longer used.
+ */
+int rhizome_release_chunks(sqlite_retry_state *retry, const char *file_id)
+{
+  if (sqlite_exec_void_retry(retry,
+	"UPDATE CHUNKS SET refs = refs - ("
+	  "SELECT COUNT(*) FROM FILECHUNKS WHERE FILECHUNKS.fileid = ? AND FILECHUNKS.chunk = CHUNKS.id"
+	") WHERE id IN (SELECT chunk FROM FILECHUNKS WHERE fileid = ?);",
+	STATIC_TEXT, file_id,
+	STATIC_TEXT, file_id,
+	END) == -1
+    || sqlite_exec_void_retry(retry,
+	"DELETE FROM CHUNKS WHERE refs <= 0 AND id IN (SELECT chunk FROM FILECHUNKS WHERE fileid = ?);",
+	STATIC_TEXT, file_id,
+	END) == -1
+    || sqlite_exec_void_retry(retry,
+	"DELETE FROM FILECHUNKS WHERE fileid = ?;",
+	STATIC_TEXT, file_id,
+	END) == -1)
+    return -1;
+  return 0;
+}
+
+/* Returns 1 if the payload is stored as chunks, 0 if not, -1 on error.
+ */
+int rhizome_is_chunked(sqlite_retry_state *retry, const rhizome_filehash_t *hashp)
+{
+  uint64_t count = 0;
+  int stepcode = sqlite_exec_uint64_retry(retry, &count,
+      "SELECT COUNT(*) FROM FILECHUNKS WHERE fileid = ? AND offset = 0;",
+      RHIZOME_FILEHASH_T, hashp, END);
+  if (!sqlite_code_ok(stepcode))
+    return -1;
+  return count ? 1 : 0;
+}
+
+static ssize_t read_chunk_blob(sqlite_retry_state *retry, uint64_t rowid, unsigned char *buffer, size_t len, uint64_t offset)
+{
+  sqlite3_blob *blob = NULL;
+  if (sqlite_blob_open_retry(retry, "main", "CHUNKS", "data", rowid, 0 /* read only */, &blob) == -1)
+    return WHY("blob open failed");
+  assert(blob != NULL);
+  int ret;
+  do {
+    ret = sqlite3_blob_read(blob, buffer, (int) len, (int) offset);
+  } while (sqlite_code_busy(ret) && sqlite_retry(retry, "sqlite3_blob_read"));
+  sqlite_blob_close(blob);
+  if (ret != SQLITE_OK)
+    return WHYF("sqlite3_blob_read() failed: %s", sqlite3_errmsg(rhizome_db));
+  return len;
+}
+
+/* Read the content of a chunked payload at read_state->offset, crossing chunk boundaries as
+ * needed.
+ */
+ssize_t rhizome_read_chunked(sqlite_retry_state *retry, struct rhizome_read *read_state, unsigned char *buffer, size_t bufsz)
+{
+  assert(read_state->chunked);
+  assert(read_state->offset <= read_state->length);
+  if (bufsz > read_state->length - read_state->offset)
+    bufsz = read_state->length - read_state->offset;
+  if (!buffer)
+    return 0;
+  size_t bytes_read = 0;
+  while (bytes_read < bufsz) {
+    uint64_t offset = read_state->offset + bytes_read;
+    if (!read_state->chunk_rowid
+      || offset < read_state->chunk_offset
+      || offset >= read_state->chunk_offset + read_state->chunk_length) {
+      sqlite3_stmt *statement = sqlite_prepare_bind(retry,
+	  "SELECT CHUNKS.rowid, FILECHUNKS.offset, FILECHUNKS.length "
+	  "FROM FILECHUNKS, CHUNKS "
+	  "WHERE FILECHUNKS.fileid = ? AND FILECHUNKS.offset <= ? AND CHUNKS.id = FILECHUNKS.chunk "
+	  "ORDER BY FILECHUNKS.offset DESC LIMIT 1;",
+	  RHIZOME_FILEHASH_T, &read_state->id,
+	  INT64, (int64_t)offset,
+	  END);
+      if (!statement)
+	return -1;
+      int stepcode = sqlite_step_retry(retry, statement);
+      if (stepcode == SQLITE_ROW) {
+	read_state->chunk_rowid = sqlite3_column_int64(statement, 0);
+	read_state->chunk_offset = sqlite3_column_int64(statement, 1);
+	read_state->chunk_length = sqlite3_column_int(statement, 2);
+      }
+      sqlite_release(statement);
+      if (stepcode != SQLITE_ROW
+	|| offset >= read_state->chunk_offset + read_state->chunk_length) {
+	read_state->chunk_rowid = 0;
+	return WHYF("Payload %s is missing the chunk at %"PRIu64, alloca_tohex_rhizome_filehash_t(read_state->id), offset);
+      }
+    }
+    size_t len = read_state->chunk_offset + read_state->chunk_length - offset;
+    if (len > bufsz - bytes_read)
+      len = bufsz - bytes_read;
+    if (read_chunk_blob(retry, read_state->chunk_rowid, buffer + bytes_read, len, offset - read_state->chunk_offset) == -1)
+      return -1;
+    bytes_read += len;
+  }
+  DEBUGF(rhizome_store, "Read %zu bytes from chunks @%"PRIx64, bytes_read, read_state->offset);
+  return bytes_read;
+}
+
+/* Fetch the content of a chunk from our store.  Returns its length, or 0 if we don't have it.
+ */
+ssize_t rhizome_chunk_read(const uint8_t hash[RHIZOME_CHUNK_HASH_BYTES], unsigned char *buffer, size_t bufsz)
+{
+  sqlite_retry_state retry = SQLITE_RETRY_STATE_DEFAULT;
+  sqlite3_stmt *statement = sqlite_prepare_bind(&retry,
+      "SELECT rowid, length FROM CHUNKS WHERE id = ?;",
+      TOHEX, hash, RHIZOME_CHUNK_HASH_BYTES,
+      END);
+  if (!statement)
+    return -1;
+  uint64_t rowid = 0;
+  size_t length = 0;
+  if (sqlite_step_retry(&retry, statement) == SQLITE_ROW) {
+    rowid = sqlite3_column_int64(statement, 0);
+    length = sqlite3_column_int(statement, 1);
+  }
+  sqlite_release(statement);
+  if (!rowid)
+    return 0;
+  if (length > bufsz)
+    return WHYF("Chunk is too large (%zu > %zu)", length, bufsz);
+  return read_chunk_blob(&retry, rowid, buffer, length, 0);
+}
+
+/* Fill in up to 'max' chunk references of a payload, starting at chunk number 'first'.  Returns
+ * the number of references filled in, and sets *total to the number of chunks in the payload (zero
+ * if the payload isn't stored as chunks).  Returns -1 on error.
+ */
+int rhizome_chunk_list(const rhizome_filehash_t *hashp, unsigned first, struct rhizome_chunk_ref *refs, unsigned max, unsigned *total)
+{
+  sqlite_retry_state retry = SQLITE_RETRY_STATE_DEFAULT;
+  uint64_t count = 0;
+  if (!sqlite_code_ok(sqlite_exec_uint64_retry(&retry, &count,
+	"SELECT COUNT(*) FROM FILECHUNKS WHERE fileid = ?;",
+	RHIZOME_FILEHASH_T, hashp, END)))
+    return -1;
+  *total = count;
+  if (first >= count)
+    return 0;
+  sqlite3_stmt *statement = sqlite_prepare_bind(&retry,
+      "SELECT offset, length, chunk FROM FILECHUNKS WHERE fileid = ? ORDER BY offset LIMIT ? OFFSET ?;",
+      RHIZOME_FILEHASH_T, hashp,
+      INT, (int)max,
+      INT, (int)first,
+      END);
+  if (!statement)
+    return -1;
+  unsigned n = 0;
+  while (n < max && sqlite_step_retry(&retry, statement) == SQLITE_ROW) {
+    refs[n].offset = sqlite3_column_int64(statement, 0);
+    refs[n].length = sqlite3_column_int(statement, 1);
+    const char *chunk = (const char *) sqlite3_column_text(statement, 2);
+    if (!chunk || fromhexstr(refs[n].hash, sizeof refs[n].hash, chunk) == -1) {
+      WHYF("Malformed chunk id %s", alloca_str_toprint(chunk));
+      sqlite_release(statement);
+      return -1;
+    }
+    ++n;
+  }
+  sqlite_release(statement);
+  return n;
+}
@@ -737,15 +737,19 @@ static int app_rhizome_list(const struct cli_parsed *parsed, struct cli_context
     if (rowcount <= rowoffset)
       continue;
     if (rowlimit == 0 || rowcount <= rowoffset + rowlimit) {
-      rhizome_manifest *m = cursor.manifest;
-      assert(m->filesize != RHIZOME_SIZE_UNSET);
-      rhizome_lookup_author(m);
-      cli_put_long(context, m->rowid, ":");
-      cli_put_string(context, m->service, ":");
-      cli_put_hexvalue(context, m->keypair.public_key.binary, sizeof m->keypair.public_key.binary, ":");
-      cli_put_long(context, m->version, ":");
-      cli_put_long(context, m->has_date ? m->date : 0, ":");
-      cli_put_long(context, m->inserttime, ":");
+      const struct rhizome_list_row *row = &cursor.row;
+      const struct rhizome_manifest_summary *summ = &row->summary;
+      sid_t author, sender, recipient;
+      enum rhizome_bundle_authorship authorship = rhizome_list_authorship(&cursor, &author);
+      int64_t date;
+      if (!rhizome_manifest_summary_int64(summ, "date", &date))
+	date = 0;
+      cli_put_long(context, row->rowid, ":");
+      cli_put_string(context, row->service, ":");
+      cli_put_hexvalue(context, summ->bid.binary, sizeof summ->bid.binary, ":");
+      cli_put_long(context, summ->version, ":");
+      cli_put_long(context, date, ":");
+      cli_put_long(context, row->inserttime, ":");
       // The 'fromhere' flag indicates if the author is a known (unlocked) identity in the local
       // keyring.  The values are 0 (no), 1 (yes), 2 (yes and cryptographically verified).  In the
       // implementation below, the 0 value (no) is redundant, because it only occurs when the
@@ -753,28 +757,28 @@ static int app_rhizome_list(const struct cli_parsed *parsed, struct cli_context
       // authors, so clients should only use 'fromhere != 0', never 'author != null', to detect
       // local authorship.
       int fromhere = 0;
-      switch (m->authorship) {
+      switch (authorship) {
 	case AUTHOR_AUTHENTIC:
 	  fromhere = 2;
-	  cli_put_hexvalue(context, m->author.binary, sizeof m->author.binary, ":");
+	  cli_put_hexvalue(context, author.binary, sizeof author.binary, ":");
 	  break;
 	case AUTHOR_LOCAL:
 	  fromhere = 1;
-	  cli_put_hexvalue(context, m->author.binary, sizeof m->author.binary, ":");
+	  cli_put_hexvalue(context, author.binary, sizeof author.binary, ":");
 	  break;
 	case AUTHOR_REMOTE:
-	  cli_put_hexvalue(context, m->author.binary, sizeof m->author.binary, ":");
+	  cli_put_hexvalue(context, author.binary, sizeof author.binary, ":");
 	  break;
 	default:
 	  cli_put_string(context, NULL, ":");
 	  break;
       }
       cli_put_long(context, fromhere, ":");
-      cli_put_long(context, m->filesize, ":");
-      cli_put_hexvalue(context, m->filesize ? m->filehash.binary : NULL, sizeof m->filehash.binary, ":");
-      cli_put_hexvalue(context, m->has_sender ? m->sender.binary : NULL, sizeof m->sender.binary, ":");
-      cli_put_hexvalue(context, m->has_recipient ? m->recipient.binary : NULL, sizeof m->recipient.binary, ":");
-      cli_put_string(context, m->name, "\n");
+      cli_put_long(context, summ->filesize, ":");
+      cli_put_hexvalue(context, summ->filesize && summ->has_filehash ? summ->filehash.binary : NULL, sizeof summ->filehash.binary, ":");
+      cli_put_hexvalue(context, rhizome_manifest_summary_sid(summ, "sender", &sender) ? sender.binary : NULL, sizeof sender.binary, ":");
+      cli_put_hexvalue(context, rhizome_manifest_summary_sid(summ, "recipient", &recipient) ? recipient.binary : NULL, sizeof recipient.binary, ":");
+      cli_put_string(context, row->name, "\n");
     }
   }
   rhizome_list_release(&cursor);
@@ -27,6 +27,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include "str.h"
 #include "rhizome.h"
 #include "crypto.h"
+#include "crypto_workers.h"
 #include "keyring.h"
 #include "dataformats.h"
 
@@ -400,47 +401,141 @@ int rhizome_apply_bundle_secret(rhizome_manifest *m, const rhizome_bk_t *bsk)
   OUT();
 }
 
-typedef struct manifest_signature_block_cache {
+/* Signatures that have been checked are remembered by manifest hash, because the same manifest
+ * often arrives from several neighbours, through adverts and sync.  The cache is divided into sets
+ * of four entries, chosen by the manifest hash, and the least recently used entry of a set is
+ * replaced.
+ */
+#define SIGNATURE_BLOCK_BYTES (crypto_sign_BYTES + crypto_sign_PUBLICKEYBYTES)
+
+struct signature_cache_entry {
   unsigned char manifest_hash[crypto_hash_sha512_BYTES];
-  unsigned char signature_bytes[256];
-  size_t signature_length;
+  // the signature, followed by the public key of the signatory
+  unsigned char signature[SIGNATURE_BLOCK_BYTES];
+  // zero if the entry is empty
+  uint32_t last_used;
   int signature_valid;
-} manifest_signature_block_cache;
+};
 
-#define SIG_CACHE_SIZE 1024
-manifest_signature_block_cache sig_cache[SIG_CACHE_SIZE];
+#define SIG_CACHE_SETS 512
+#define SIG_CACHE_WAYS 4
+static struct signature_cache_entry sig_cache[SIG_CACHE_SETS][SIG_CACHE_WAYS];
+static uint32_t sig_cache_clock = 0;
+struct rhizome_signature_stats rhizome_signature_stats;
 
-static int rhizome_manifest_lookup_signature_validity(const unsigned char *hash, const unsigned char *sig, size_t sig_len)
+static struct signature_cache_entry *signature_cache_set(const unsigned char *hash)
 {
-  IN();
-  unsigned slot=0;
-  unsigned i;
+  // the hash is already uniformly distributed
+  return sig_cache[(hash[0] | hash[1] << 8) % SIG_CACHE_SETS];
+}
 
-  for(i=0;i<crypto_hash_sha512_BYTES;i++) {
-    slot=(slot<<1)+(slot&0x80000000?1:0);
-    slot+=hash[i];
+static struct signature_cache_entry *signature_cache_find(const unsigned char *hash, const unsigned char *sig)
+{
+  struct signature_cache_entry *set = signature_cache_set(hash);
+  unsigned i;
+  for (i = 0; i < SIG_CACHE_WAYS; i++){
+    if (set[i].last_used
+      && memcmp(hash, set[i].manifest_hash, crypto_hash_sha512_BYTES) == 0
+      && memcmp(sig, set[i].signature, SIGNATURE_BLOCK_BYTES) == 0){
+      set[i].last_used = ++sig_cache_clock;
+      return &set[i];
+    }
   }
-  for(i=0;i<sig_len;i++) {
-    slot=(slot<<1)+(slot&0x80000000?1:0);
-    slot+=sig[i];
+  return NULL;
+}
+
+static struct signature_cache_entry *signature_cache_store(const unsigned char *hash, const unsigned char *sig, int valid)
+{
+  struct signature_cache_entry *set = signature_cache_set(hash);
+  struct signature_cache_entry *entry = &set[0];
+  unsigned i;
+  for (i = 1; i < SIG_CACHE_WAYS && entry->last_used; i++){
+    if (!set[i].last_used || set[i].last_used < entry->last_used)
+      entry = &set[i];
   }
-  slot%=SIG_CACHE_SIZE;
+  if (entry->last_used)
+    rhizome_signature_stats.evictions++;
+  bcopy(hash, entry->manifest_hash, crypto_hash_sha512_BYTES);
+  bcopy(sig, entry->signature, SIGNATURE_BLOCK_BYTES);
+  entry->signature_valid = valid;
+  entry->last_used = ++sig_cache_clock;
+  return entry;
+}
 
-  if (sig_cache[slot].signature_length!=sig_len || 
-      memcmp(hash, sig_cache[slot].manifest_hash, crypto_hash_sha512_BYTES) ||
-      memcmp(sig, sig_cache[slot].signature_bytes, sig_len)){
-    bcopy(hash, sig_cache[slot].manifest_hash, crypto_hash_sha512_BYTES);
-    bcopy(sig, sig_cache[slot].signature_bytes, sig_len);
-    sig_cache[slot].signature_length=sig_len;
+void rhizome_signature_cache_clear()
+{
+  bzero(sig_cache, sizeof sig_cache);
+  sig_cache_clock = 0;
+}
 
-    sig_cache[slot].signature_valid=
-      crypto_sign_verify_detached(sig, hash, crypto_hash_sha512_BYTES, &sig[crypto_sign_BYTES])
+static int rhizome_manifest_lookup_signature_validity(const unsigned char *hash, const unsigned char *sig)
+{
+  IN();
+  struct signature_cache_entry *entry = signature_cache_find(hash, sig);
+  if (entry){
+    rhizome_signature_stats.hits++;
+  }else{
+    rhizome_signature_stats.misses++;
+    int valid = crypto_sign_verify_detached(sig, hash, crypto_hash_sha512_BYTES, &sig[crypto_sign_BYTES])
       ? -1 : 0;
+    entry = signature_cache_store(hash, sig, valid);
   }
-  RETURN(sig_cache[slot].signature_valid);
+  RETURN(entry->signature_valid);
   OUT();
 }
 
+static void signature_jobs_run(struct crypto_job *jobs, unsigned count)
+{
+  crypto_jobs_run(jobs, count);
+  unsigned i;
+  for (i = 0; i < count; i++)
+    signature_cache_store(jobs[i].input, jobs[i].signature, jobs[i].result ? -1 : 0);
+  rhizome_signature_stats.batched += count;
+}
+
+/* Verify a batch of manifests, as if by calling rhizome_manifest_verify() on each one that has
+ * been finalised and not yet verified.  Signatures that are not in the cache are all checked first,
+ * spread across the crypto worker threads.  Returns the number of manifests that are self-signed.
+ */
+unsigned rhizome_manifest_verify_batch(rhizome_manifest *const *manifests, unsigned count)
+{
+  struct crypto_job jobs[RHIZOME_VERIFY_BATCH];
+  unsigned i, job_count = 0;
+  for (i = 0; i < count; i++){
+    rhizome_manifest *m = manifests[i];
+    if (!m->finalised || m->selfSigned || m->sig_count)
+      continue;
+    crypto_hash_sha512(m->manifesthash.binary, m->manifestdata, m->manifest_body_bytes);
+    unsigned ofs = m->manifest_body_bytes;
+    while (ofs < m->manifest_all_bytes){
+      const unsigned char *sig = m->manifestdata + ofs;
+      unsigned len = (sig[0] << 2) + 4 + 1;
+      if (ofs + len > m->manifest_all_bytes)
+	break;
+      ofs += len;
+      if (sig[0] != 0x17 || signature_cache_find(m->manifesthash.binary, sig + 1))
+	continue;
+      if (job_count == NELS(jobs)){
+	signature_jobs_run(jobs, job_count);
+	job_count = 0;
+      }
+      crypto_job_verify(&jobs[job_count++], m->manifesthash.binary, crypto_hash_sha512_BYTES,
+	sig + 1, sig + 1 + crypto_sign_BYTES);
+    }
+  }
+  signature_jobs_run(jobs, job_count);
+
+  unsigned verified = 0;
+  for (i = 0; i < count; i++){
+    rhizome_manifest *m = manifests[i];
+    if (m->finalised && !m->selfSigned && !m->sig_count)
+      rhizome_manifest_verify(m);
+    if (m->selfSigned)
+      verified++;
+  }
+  return verified;
+}
+
 int rhizome_manifest_extract_signature(rhizome_manifest *m, unsigned *ofs)
 {
   IN();
@@ -466,7 +561,7 @@ int rhizome_manifest_extract_signature(rhizome_manifest *m, unsigned *ofs)
     {
       assert(len == 97);
       /* Reconstitute signature block */
-      int r = rhizome_manifest_lookup_signature_validity(m->manifesthash.binary, sig + 1, 96);
+      int r = rhizome_manifest_lookup_signature_validity(m->manifesthash.binary, sig + 1);
       if (r) {
 	WARN("Signature verification failed");
 	RETURN(4);
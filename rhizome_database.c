@@ -64,6 +64,8 @@ const struct __sourceloc *sqlite_trace_whence = NULL;
 static int sqlite_trace_done;
 static uint64_t max_rowid=0;
 
+static void sqlite_stmt_cache_close();
+
 /* This callback conditionally logs all rendered SQL statements.  This function is registered with
  * SQLite as the 'trace callback'.  SQLite invokes it with mask == SQLITE_TRACE_STMT when about to
  * execute a statement using sqlite3_step(), and with mask == SQLITE_TRACE_PROFILE when the
@@ -136,74 +138,92 @@ void sqlite_log(void *UNUSED(ignored), int result, const char *msg)
   WARNF("Sqlite: %d %s", result, msg);
 }
 
+static void verify_bundle(sqlite_retry_state *retry, sqlite3_int64 rowid, rhizome_manifest *m)
+{
+  int ret = -1;
+  if (m->selfSigned) {
+    assert(m->finalised);
+
+    if (m->filesize == 0 || rhizome_exists(&m->filehash) == RHIZOME_PAYLOAD_STATUS_STORED){
+      // Attempt to update the manifest
+      rhizome_bar_t bar;
+      rhizome_manifest_to_bar(m, &bar);
+      rhizome_authenticate_author(m);
+
+      if (sqlite_exec_void("UPDATE MANIFESTS SET "
+	  "id = ?, "
+	  "version = ?, "
+	  "bar = ?, "
+	  "filesize = ?, "
+	  "filehash = ?, "
+	  "author = ?, "
+	  "service = ?, "
+	  "name = ?, "
+	  "sender = ?, "
+	  "recipient = ?, "
+	  "tail = ?, "
+	  "manifest_hash = ? "
+	"WHERE ROWID = ?;",
+	RHIZOME_BID_T, &m->keypair.public_key,
+	INT64, m->version,
+	RHIZOME_BAR_T, &bar,
+	INT64, m->filesize,
+	RHIZOME_FILEHASH_T|NUL, m->filesize > 0 ? &m->filehash : NULL,
+	SID_T|NUL, m->authorship == AUTHOR_AUTHENTIC ? &m->author : NULL,
+	STATIC_TEXT, m->service,
+	STATIC_TEXT|NUL, m->name,
+	SID_T|NUL, m->has_sender ? &m->sender : NULL,
+	SID_T|NUL, m->has_recipient ? &m->recipient : NULL,
+	INT64, m->tail,
+	RHIZOME_FILEHASH_T, &m->manifesthash,
+	INT64, rowid,
+	END
+      )!=-1)
+	ret = 0;
+    }
+  }
+
+  if (ret) {
+    DEBUGF(rhizome, "Removing invalid manifest entry @%lld", rowid);
+    sqlite_exec_void_retry(retry, "DELETE FROM MANIFESTS WHERE ROWID = ?;", INT64, rowid, END);
+  }
+  rhizome_manifest_free(m);
+}
+
 void verify_bundles()
 {
   // assume that only the manifest itself can be trusted
   // fetch all manifests, parse and update or delete them.
   sqlite_retry_state retry = SQLITE_RETRY_STATE_DEFAULT;
   sqlite3_stmt *statement = sqlite_prepare(&retry, "SELECT ROWID, MANIFEST FROM MANIFESTS ORDER BY ROWID DESC;");
-  while (sqlite_step_retry(&retry, statement) == SQLITE_ROW) {
-    sqlite3_int64 rowid = sqlite3_column_int64(statement, 0);
-    const void *blob = sqlite3_column_blob(statement, 1);
-    size_t blob_length = sqlite3_column_bytes(statement, 1);
-    rhizome_manifest *m = rhizome_new_manifest();
-    if (m) {
-      memcpy(m->manifestdata, blob, blob_length);
-      m->manifest_all_bytes = blob_length;
-      int ret = -1;
-      if (   rhizome_manifest_parse(m) != -1
-	  && rhizome_manifest_validate(m)
-	  && rhizome_manifest_verify(m)
-      ) {
-	assert(m->finalised);
-
-	if (m->filesize == 0 || rhizome_exists(&m->filehash) == RHIZOME_PAYLOAD_STATUS_STORED){
-	  // Attempt to update the manifest
-	  rhizome_bar_t bar;
-	  rhizome_manifest_to_bar(m, &bar);
-	  rhizome_authenticate_author(m);
-
-	  if (sqlite_exec_void("UPDATE MANIFESTS SET "
-	      "id = ?, "
-	      "version = ?, "
-	      "bar = ?, "
-	      "filesize = ?, "
-	      "filehash = ?, "
-	      "author = ?, "
-	      "service = ?, "
-	      "name = ?, "
-	      "sender = ?, "
-	      "recipient = ?, "
-	      "tail = ?, "
-	      "manifest_hash = ? "
-	    "WHERE ROWID = ?;",
-	    RHIZOME_BID_T, &m->keypair.public_key,
-	    INT64, m->version,
-	    RHIZOME_BAR_T, &bar,
-	    INT64, m->filesize,
-	    RHIZOME_FILEHASH_T|NUL, m->filesize > 0 ? &m->filehash : NULL,
-	    SID_T|NUL, m->authorship == AUTHOR_AUTHENTIC ? &m->author : NULL,
-	    STATIC_TEXT, m->service,
-	    STATIC_TEXT|NUL, m->name,
-	    SID_T|NUL, m->has_sender ? &m->sender : NULL,
-	    SID_T|NUL, m->has_recipient ? &m->recipient : NULL,
-	    INT64, m->tail,
-	    RHIZOME_FILEHASH_T, &m->manifesthash,
-	    INT64, rowid,
-	    END
-	  )!=-1)
-	    ret = 0;
-	}
-      }
-
-      if (ret) {
-	DEBUGF(rhizome, "Removing invalid manifest entry @%lld", rowid);
-	sqlite_exec_void_retry(&retry, "DELETE FROM MANIFESTS WHERE ROWID = ?;", INT64, rowid, END);
+  // signatures are checked a batch of manifests at a time
+  rhizome_manifest *manifests[RHIZOME_VERIFY_BATCH];
+  sqlite3_int64 rowids[RHIZOME_VERIFY_BATCH];
+  unsigned count = 0, i;
+  int more = 1;
+  while (more) {
+    more = sqlite_step_retry(&retry, statement) == SQLITE_ROW;
+    if (more) {
+      const void *blob = sqlite3_column_blob(statement, 1);
+      size_t blob_length = sqlite3_column_bytes(statement, 1);
+      rhizome_manifest *m = rhizome_new_manifest();
+      if (m) {
+	memcpy(m->manifestdata, blob, blob_length);
+	m->manifest_all_bytes = blob_length;
+	if (rhizome_manifest_parse(m) != -1)
+	  rhizome_manifest_validate(m);
+	rowids[count] = sqlite3_column_int64(statement, 0);
+	manifests[count++] = m;
       }
-      rhizome_manifest_free(m);
+    }
+    if (count == NELS(manifests) || (!more && count)) {
+      rhizome_manifest_verify_batch(manifests, count);
+      for (i = 0; i < count; i++)
+	verify_bundle(&retry, rowids[i], manifests[i]);
+      count = 0;
     }
   }
-  sqlite3_finalize(statement);
+  sqlite_release(statement);
 }
 
 /*
@@ -288,6 +308,19 @@ int rhizome_opendb()
   
   sqlite_retry_state retry = SQLITE_RETRY_STATE_DEFAULT;
 
+  // The journal mode is stored in the database file, so only change it if the config disagrees.
+  // Write-ahead logging lets readers proceed during a write, and only needs to fsync at checkpoints
+  // when synchronous=NORMAL, which makes bulk ingestion much cheaper.
+  char mode[16];
+  if (sqlite_exec_strbuf_retry(&retry, strbuf_local_buf(mode), "PRAGMA journal_mode;", END) == 1) {
+    int wal = strcasecmp(mode, "wal") == 0;
+    if (wal != (config.rhizome.database_wal ? 1 : 0))
+      sqlite_exec_strbuf_retry(&retry, strbuf_local_buf(mode),
+	config.rhizome.database_wal ? "PRAGMA journal_mode=WAL;" : "PRAGMA journal_mode=DELETE;", END);
+  }
+  if (config.rhizome.database_wal)
+    sqlite_exec_void_loglevel(LOG_LEVEL_WARN, "PRAGMA synchronous=NORMAL;", END);
+
   uint64_t version;
   if (sqlite_exec_uint64_retry(&retry, &version, "PRAGMA user_version;", END) != SQLITE_ROW)
     RETURN(-1);
@@ -382,6 +415,25 @@ int rhizome_opendb()
     sqlite_exec_void_loglevel(LOG_LEVEL_WARN, "PRAGMA user_version=8;", END);
   }
   
+  if (version<9){
+    sqlite_exec_void_loglevel(LOG_LEVEL_WARN,
+      "CREATE TABLE IF NOT EXISTS CHUNKS("
+	"id text not null primary key, "
+	"refs integer, "
+	"length integer, "
+	"data blob"
+      ");", END);
+    sqlite_exec_void_loglevel(LOG_LEVEL_WARN,
+      "CREATE TABLE IF NOT EXISTS FILECHUNKS("
+	"fileid text not null, "
+	"offset integer not null, "
+	"length integer, "
+	"chunk text not null, "
+	"primary key(fileid, offset)"
+      ");", END);
+    sqlite_exec_void_loglevel(LOG_LEVEL_WARN, "PRAGMA user_version=9;", END);
+  }
+  
   // TODO recreate tables with collate nocase on all hex columns
 
   /* Future schema updates should be performed here. 
@@ -434,6 +486,7 @@ int rhizome_close_db()
       WHY("Uncommitted transaction!");
       sqlite_exec_void("ROLLBACK;", END);
     }
+    sqlite_stmt_cache_close();
     sqlite3_stmt *stmt = NULL;
     while ((stmt = sqlite3_next_stmt(rhizome_db, stmt))) {
       const char *sql = sqlite3_sql(stmt);
@@ -555,6 +608,110 @@ void _sqlite_retry_done(struct __sourceloc __whence, sqlite_retry_state *retry,
     retry->start = -1;
 }
 
+/* Prepared statements are cached by their SQL text, so that each query is only parsed once per
+ * database connection.  sqlite_release() resets a cached statement and clears its bindings, ready
+ * for its next use, and rhizome_close_db() finalises them all.  If the same SQL is prepared again
+ * while its cached statement is still in use (eg, by a nested query), then an uncached statement is
+ * prepared instead.  The time spent stepping each cached statement is tallied in its own
+ * profile_total, so shows up in the periodic timing stats.
+ */
+#define SQLITE_STMT_CACHE_SIZE 64
+
+struct sqlite_stmt_cache_entry {
+  sqlite3_stmt *statement;
+  char *sqltext; // also the name of the stats
+  uint32_t hash;
+  bool_t in_use;
+  unsigned last_used;
+  struct profile_total stats;
+};
+
+static __thread struct sqlite_stmt_cache_entry stmt_cache[SQLITE_STMT_CACHE_SIZE];
+static __thread unsigned stmt_cache_clock;
+
+static uint32_t sqlite_text_hash(const char *sqltext)
+{
+  // FNV-1a
+  uint32_t hash = 2166136261u;
+  for (; *sqltext; ++sqltext)
+    hash = (hash ^ (unsigned char) *sqltext) * 16777619u;
+  return hash;
+}
+
+static struct sqlite_stmt_cache_entry *sqlite_stmt_cache_find(const sqlite3_stmt *statement)
+{
+  unsigned i;
+  for (i = 0; i < SQLITE_STMT_CACHE_SIZE; ++i)
+    if (stmt_cache[i].statement == statement)
+      return &stmt_cache[i];
+  return NULL;
+}
+
+/* Return an idle cache entry for the given SQL text, either one that already holds a statement for
+ * it, or the least recently used idle entry, which must then be (re)filled by the caller.  Returns
+ * NULL if every entry is in use.
+ */
+static struct sqlite_stmt_cache_entry *sqlite_stmt_cache_lookup(const char *sqltext, uint32_t hash)
+{
+  struct sqlite_stmt_cache_entry *victim = NULL;
+  unsigned i;
+  for (i = 0; i < SQLITE_STMT_CACHE_SIZE; ++i) {
+    struct sqlite_stmt_cache_entry *e = &stmt_cache[i];
+    if (e->in_use)
+      continue;
+    if (e->sqltext && e->hash == hash && strcmp(e->sqltext, sqltext) == 0)
+      return e;
+    if (!victim || !e->sqltext || (victim->sqltext && e->last_used < victim->last_used))
+      victim = e;
+  }
+  if (victim && victim->sqltext) {
+    if (victim->statement)
+      sqlite3_finalize(victim->statement);
+    victim->statement = NULL;
+    // the stats stay linked into the profiling list, so keep them valid while renaming them
+    char *old = victim->sqltext;
+    victim->sqltext = NULL;
+    victim->stats.name = "sqlite (evicted)";
+    fd_clearstat(&victim->stats);
+    free(old);
+  }
+  return victim;
+}
+
+/* Release a statement returned by any of the sqlite_prepare functions, instead of finalising it.
+ */
+void sqlite_release(sqlite3_stmt *statement)
+{
+  if (!statement)
+    return;
+  struct sqlite_stmt_cache_entry *e = sqlite_stmt_cache_find(statement);
+  if (!e) {
+    sqlite3_finalize(statement);
+    return;
+  }
+  // releasing twice is harmless
+  if (e->in_use) {
+    sqlite3_reset(statement);
+    sqlite3_clear_bindings(statement);
+    e->in_use = 0;
+  }
+}
+
+static void sqlite_stmt_cache_close()
+{
+  unsigned i;
+  for (i = 0; i < SQLITE_STMT_CACHE_SIZE; ++i) {
+    struct sqlite_stmt_cache_entry *e = &stmt_cache[i];
+    if (e->in_use)
+      WARNF("closing Rhizome db while statement is in use: %s", e->sqltext);
+    if (e->statement)
+      sqlite3_finalize(e->statement);
+    // keep the SQL text, so it can be prepared again after the database is re-opened
+    e->statement = NULL;
+    e->in_use = 0;
+  }
+}
+
 /* Prepare an SQL command from a simple string.  Returns NULL if an error occurs (logged as an
  * error), otherwise returns a pointer to the prepared SQLite statement.
  *
@@ -576,10 +733,25 @@ sqlite3_stmt *_sqlite_prepare(struct __sourceloc __whence, int log_level, sqlite
   IN();
   sqlite3_stmt *statement = NULL;
   assert(rhizome_db);
+  uint32_t hash = sqlite_text_hash(sqltext);
+  struct sqlite_stmt_cache_entry *e = sqlite_stmt_cache_lookup(sqltext, hash);
+  if (e && e->statement) {
+    e->in_use = 1;
+    e->last_used = ++stmt_cache_clock;
+    sqlite_trace_done = 0;
+    RETURN(e->statement);
+  }
   while (1) {
     switch (sqlite3_prepare_v2(rhizome_db, sqltext, -1, &statement, NULL)) {
       case SQLITE_OK:
 	sqlite_trace_done = 0;
+	if (e && (e->sqltext || (e->sqltext = str_edup(sqltext)))) {
+	  e->statement = statement;
+	  e->hash = hash;
+	  e->in_use = 1;
+	  e->last_used = ++stmt_cache_clock;
+	  e->stats.name = e->sqltext;
+	}
 	RETURN(statement);
       case SQLITE_BUSY:
       case SQLITE_LOCKED:
@@ -657,7 +829,7 @@ int _sqlite_vbind(struct __sourceloc __whence, int log_level, sqlite_retry_state
 	      FALLTHROUGH; \
 	    default: \
 	      LOGF(log_level, #FUNC "(%d) failed, %s: %s", index, sqlite3_errmsg(rhizome_db), sqlite3_sql(statement)); \
-	      sqlite3_finalize(statement); \
+	      sqlite_release(statement); \
 	      return -1; \
 	  } \
 	  break; \
@@ -668,7 +840,7 @@ int _sqlite_vbind(struct __sourceloc __whence, int log_level, sqlite_retry_state
 	  BIND_RETRY(sqlite3_bind_null); \
 	} else { \
 	  LOGF(log_level, "at bind arg %u, %s%s parameter is NULL: %s", argnum, #TYP, strbuf_str(ext), sqlite3_sql(statement)); \
-	  sqlite3_finalize(statement); \
+	  sqlite_release(statement); \
 	  return -1; \
 	}
     switch (typ) {
@@ -931,7 +1103,7 @@ sqlite3_stmt *_sqlite_prepare_bind(struct __sourceloc __whence, int log_level, s
     int ret = _sqlite_vbind(__whence, log_level, retry, statement, ap);
     va_end(ap);
     if (ret == -1) {
-      sqlite3_finalize(statement);
+      sqlite_release(statement);
       statement = NULL;
     }
   }
@@ -943,6 +1115,10 @@ int _sqlite_step(struct __sourceloc __whence, int log_level, sqlite_retry_state
   IN();
   int ret = -1;
   sqlite_trace_whence = &__whence;
+  struct sqlite_stmt_cache_entry *e = statement ? sqlite_stmt_cache_find(statement) : NULL;
+  struct call_stats this_step = {.totals = e ? &e->stats : NULL};
+  if (e)
+    fd_func_enter(__whence, &this_step);
   while (statement) {
     ret = sqlite3_step(statement);
     switch (ret) {
@@ -966,6 +1142,8 @@ int _sqlite_step(struct __sourceloc __whence, int log_level, sqlite_retry_state
 	break;
     }
   }
+  if (e)
+    fd_func_exit(__whence, &this_step);
   sqlite_trace_whence = NULL;
   OUT();
   return ret;
@@ -979,7 +1157,7 @@ int _sqlite_exec_code(struct __sourceloc __whence, int log_level, sqlite_retry_s
   int stepcode;
   while ((stepcode = _sqlite_step(__whence, log_level, retry, statement)) == SQLITE_ROW)
     ++(*rowcount);
-  sqlite3_finalize(statement);
+  sqlite_release(statement);
   if (sqlite_trace_func())
     _DEBUGF("rowcount=%d changes=%d", *rowcount, sqlite3_changes(rhizome_db));
   return stepcode;
@@ -1092,7 +1270,7 @@ static int _sqlite_vexec_uint64(struct __sourceloc __whence, sqlite_retry_state
   }
   if (rows > 1)
     FATALF("query unexpectedly returned %d rows", rows);
-  sqlite3_finalize(statement);
+  sqlite_release(statement);
   if (sqlite_trace_func())
     _DEBUGF("rowcount=%d changes=%d result=%"PRIu64, rows, sqlite3_changes(rhizome_db), *result);
   if (sqlite_code_ok(stepcode) && rows>0)
@@ -1170,7 +1348,7 @@ int _sqlite_vexec_strbuf_retry(struct __sourceloc __whence, sqlite_retry_state *
   }
   if (rowcount > 1)
     WARNF("query unexpectedly returned %d rows, ignored all but first", rowcount);
-  sqlite3_finalize(statement);
+  sqlite_release(statement);
   return sqlite_code_ok(stepcode) && ret != -1 ? rowcount : -1;
 }
 
@@ -1306,7 +1484,7 @@ int rhizome_cleanup(struct rhizome_cleanup_report *report)
     if (rhizome_delete_file_id(id)==0 && report)
       ++report->deleted_stale_incoming_files;
   }
-  sqlite3_finalize(statement);
+  sqlite_release(statement);
 
   // Remove external payload files for old, unreferenced payloads.
   statement = sqlite_prepare_bind(&retry,
@@ -1317,7 +1495,7 @@ int rhizome_cleanup(struct rhizome_cleanup_report *report)
     if (rhizome_delete_file_id(id)==0 && report)
       ++report->deleted_orphan_files;
   }
-  sqlite3_finalize(statement);
+  sqlite_release(statement);
 
   // TODO Iterate through all files in RHIZOME_BLOB_SUBDIR and delete any which are no longer
   // referenced or are stale.  This could take a long time, so for scalability should be done
@@ -1407,6 +1585,53 @@ end:
  * @author Andrew Bettison <andrew@servalproject.com>
  */
 enum rhizome_bundle_status rhizome_add_manifest_to_store(rhizome_manifest *m, rhizome_manifest **mout)
+{
+  struct rhizome_ingest batch;
+  if (rhizome_ingest_begin(&batch) == -1)
+    return RHIZOME_BUNDLE_STATUS_ERROR;
+  enum rhizome_bundle_status status = rhizome_ingest_manifest(&batch, m, mout);
+  if (status == RHIZOME_BUNDLE_STATUS_NEW) {
+    if (rhizome_ingest_commit(&batch) == -1) {
+      if (mout && *mout == m)
+	*mout = NULL;
+      return RHIZOME_BUNDLE_STATUS_ERROR;
+    }
+  } else
+    rhizome_ingest_rollback(&batch);
+  return status;
+}
+
+/* Start a batch of manifest insertions in a single transaction.  Returns 0 if the transaction was
+ * started, -1 otherwise.  The batch must be ended with rhizome_ingest_commit() or
+ * rhizome_ingest_rollback().
+ */
+int rhizome_ingest_begin(struct rhizome_ingest *batch)
+{
+  bzero(batch, sizeof *batch);
+  batch->retry = SQLITE_RETRY_STATE_DEFAULT;
+  if (sqlite_exec_void_retry(&batch->retry, "BEGIN TRANSACTION;", END) == -1)
+    return WHY("Failed to begin transaction");
+  return 0;
+}
+
+static void rhizome_ingest_free(struct rhizome_ingest *batch)
+{
+  if (batch->insert)
+    sqlite_release(batch->insert);
+  batch->insert = NULL;
+  if (batch->added)
+    free(batch->added);
+  batch->added = NULL;
+  batch->added_count = batch->added_size = 0;
+}
+
+/* Add a manifest to the batch.  Performs the same checks, and returns the same status codes, as
+ * rhizome_add_manifest_to_store(), but the manifest only becomes visible to other database
+ * connections, and the bundle_add trigger is only called, once the batch is committed.  The INSERT
+ * statement is prepared once and reused for every manifest in the batch.  A failure to store one
+ * manifest does not abort the batch.
+ */
+enum rhizome_bundle_status rhizome_ingest_manifest(struct rhizome_ingest *batch, rhizome_manifest *m, rhizome_manifest **mout)
 {
   if (mout == NULL)
     DEBUGF(rhizome, "%s(m=manifest %p, mout=NULL)", __func__, m);
@@ -1442,40 +1667,54 @@ enum rhizome_bundle_status rhizome_add_manifest_to_store(rhizome_manifest *m, rh
 
   // manifest is complete, and not already stored
 
+  if (batch->added_count >= batch->added_size) {
+    unsigned size = batch->added_size ? batch->added_size * 2 : 16;
+    rhizome_manifest **added = erealloc(batch->added, size * sizeof *added);
+    if (!added)
+      return RHIZOME_BUNDLE_STATUS_ERROR;
+    batch->added = added;
+    batch->added_size = size;
+  }
+
+  // The INSERT OR REPLACE statement will delete a row with the same ID (primary key) if it exists,
+  // so a new autoincremented ROWID will be allocated whether or not the manifest with this ID is
+  // already in the table.  Other code depends on this property: that ROWID is monotonically
+  // increasing with time and unique.
+  if (!batch->insert) {
+    if ((batch->insert = sqlite_prepare(&batch->retry,
+	  "INSERT OR REPLACE INTO MANIFESTS("
+	    "id,"
+	    "manifest,"
+	    "version,"
+	    "inserttime,"
+	    "bar,"
+	    "filesize,"
+	    "filehash,"
+	    "author,"
+	    "service,"
+	    "name,"
+	    "sender,"
+	    "recipient,"
+	    "tail,"
+	    "manifest_hash"
+	  ") VALUES("
+	    "?,?,?,?,?,?,?,?,?,?,?,?,?,?"
+	  ");"
+	)
+      ) == NULL)
+      goto fail;
+  } else {
+    sqlite3_reset(batch->insert);
+    sqlite3_clear_bindings(batch->insert);
+  }
+
   /* Bind BAR to data field */
   rhizome_bar_t bar;
   rhizome_manifest_to_bar(m, &bar);
 
-  sqlite_retry_state retry = SQLITE_RETRY_STATE_DEFAULT;
-  if (sqlite_exec_void_retry(&retry, "BEGIN TRANSACTION;", END) == -1)
-    return WHY("Failed to begin transaction");
-
   time_ms_t now = gettime_ms();
 
-  // The INSERT OR REPLACE statement will delete a row with the same ID (primary key) if it exists,
-  // so a new autoincremented ROWID will be allocated whether or not the manifest with this ID is
-  // already in the table.  Other code depends on this property: that ROWID is monotonically
-  // increasing with time and unique.
-  sqlite3_stmt *stmt;
-  if ((stmt = sqlite_prepare_bind(&retry,
-	"INSERT OR REPLACE INTO MANIFESTS("
-	  "id,"
-	  "manifest,"
-	  "version,"
-	  "inserttime,"
-	  "bar,"
-	  "filesize,"
-	  "filehash,"
-	  "author,"
-	  "service,"
-	  "name,"
-	  "sender,"
-	  "recipient,"
-	  "tail,"
-	  "manifest_hash"
-	") VALUES("
-	  "?,?,?,?,?,?,?,?,?,?,?,?,?,?"
-	");",
+  if (sqlite_bind(&batch->retry, batch->insert,
 	RHIZOME_BID_T, &m->keypair.public_key,
 	STATIC_BLOB, m->manifestdata, m->manifest_all_bytes,
 	INT64, m->version,
@@ -1492,17 +1731,42 @@ enum rhizome_bundle_status rhizome_add_manifest_to_store(rhizome_manifest *m, rh
 	INT64, m->tail,
 	RHIZOME_FILEHASH_T, &m->manifesthash,
 	END
-      )
-  ) == NULL)
-    goto rollback;
-  if (!sqlite_code_ok(sqlite_step_retry(&retry, stmt)))
-    goto rollback;
-  sqlite3_finalize(stmt);
-  stmt = NULL;
+      ) == -1)
+    goto fail;
+  if (!sqlite_code_ok(sqlite_step_retry(&batch->retry, batch->insert)))
+    goto fail;
+  // the bound manifest data must not outlive this call
+  sqlite3_reset(batch->insert);
+  sqlite3_clear_bindings(batch->insert);
   rhizome_manifest_set_rowid(m, sqlite3_last_insert_rowid(rhizome_db));
   rhizome_manifest_set_inserttime(m, now);
+  batch->added[batch->added_count++] = m;
+  if (mout)
+    *mout = m;
+  return RHIZOME_BUNDLE_STATUS_NEW;
+
+fail:
+  WHYF("Failed to store bundle bid=%s", alloca_tohex_rhizome_bid_t(m->keypair.public_key));
+  return RHIZOME_BUNDLE_STATUS_ERROR;
+}
 
-  if (sqlite_exec_void_retry(&retry, "COMMIT;", END) != -1){
+/* Commit all the manifests added to the batch, then announce each of them.  Returns 0 on success.
+ * If the commit fails, the transaction is rolled back, none of the manifests are stored, and
+ * returns -1.
+ */
+int rhizome_ingest_commit(struct rhizome_ingest *batch)
+{
+  if (batch->insert)
+    sqlite_release(batch->insert);
+  batch->insert = NULL;
+  if (sqlite_exec_void_retry(&batch->retry, "COMMIT;", END) == -1){
+    WHYF("Failed to store %u bundles", batch->added_count);
+    rhizome_ingest_rollback(batch);
+    return -1;
+  }
+  unsigned i;
+  for (i = 0; i < batch->added_count; ++i) {
+    rhizome_manifest *m = batch->added[i];
     // This message used in tests; do not modify or remove.
     INFOF("RHIZOME ADD MANIFEST service=%s bid=%s version=%"PRIu64,
 	  m->service ? m->service : "NULL",
@@ -1518,20 +1782,23 @@ enum rhizome_bundle_status rhizome_add_manifest_to_store(rhizome_manifest *m, rh
 	server_rhizome_add_bundle(m->rowid);
       max_rowid = m->rowid;
       CALL_TRIGGER(bundle_add, m);
-    }else{
-      sync_rhizome();
     }
-    if (mout)
-      *mout = m;
-    return RHIZOME_BUNDLE_STATUS_NEW;
   }
+  if (!serverMode && batch->added_count)
+    sync_rhizome();
+  rhizome_ingest_free(batch);
+  return 0;
+}
 
-rollback:
-  if (stmt)
-    sqlite3_finalize(stmt);
-  WHYF("Failed to store bundle bid=%s", alloca_tohex_rhizome_bid_t(m->keypair.public_key));
-  sqlite_exec_void_retry(&retry, "ROLLBACK;", END);
-  return RHIZOME_BUNDLE_STATUS_ERROR;
+/* Abandon the batch, so that none of the manifests added to it are stored.
+ */
+void rhizome_ingest_rollback(struct rhizome_ingest *batch)
+{
+  if (batch->insert)
+    sqlite_release(batch->insert);
+  batch->insert = NULL;
+  sqlite_exec_void_retry(&batch->retry, "ROLLBACK;", END);
+  rhizome_ingest_free(batch);
 }
 
 static void trigger_rhizome_bundle_added_debug(rhizome_manifest *m)
@@ -1564,7 +1831,7 @@ int rhizome_list_open(struct rhizome_list_cursor *c)
         );
   IN();
   strbuf b = strbuf_alloca(1024);
-  strbuf_sprintf(b, "SELECT id, manifest, version, inserttime, author, rowid FROM manifests WHERE 1=1");
+  strbuf_sprintf(b, "SELECT id, manifest, version, inserttime, author, rowid, service, name FROM manifests WHERE 1=1");
   if (c->service)
     strbuf_puts(b, " AND service = @service");
   if (c->name)
@@ -1607,7 +1874,7 @@ int rhizome_list_open(struct rhizome_list_cursor *c)
   RETURN(0);
   OUT();
 failure:
-  sqlite3_finalize(c->_statement);
+  sqlite_release(c->_statement);
   c->_statement = NULL;
   RETURN(-1);
   OUT();
@@ -1616,8 +1883,11 @@ failure:
 /* Guaranteed to return manifests with monotonically descending rowid.  The first manifest will have
  * the greatest rowid.
  *
- * Returns 1 if a new manifest has been fetched from the list, in which case the cursor 'manifest'
- * field points to the fetched manifest.  Returns 0 if there are no more manifests in the list.
+ * Returns 1 if a new manifest has been fetched from the list, in which case the cursor 'row' field
+ * describes the fetched manifest.  Returns 0 if there are no more manifests in the list.
+ *
+ * The manifest is only inspected, so listing does not allocate or parse whole manifests.  Call
+ * rhizome_list_manifest() for the rare rows that need one.
  *
  * @author Andrew Bettison <andrew@servalproject.com>
  */
@@ -1639,12 +1909,12 @@ int rhizome_list_next(struct rhizome_list_cursor *c)
   while (1) {
     if (c->manifest) {
       rhizome_manifest_free(c->manifest);
-      c->_rowid_current = 0;
       c->manifest = NULL;
     }
+    c->_rowid_current = 0;
     if ((r=sqlite_step_retry(&c->_retry, c->_statement)) != SQLITE_ROW)
       break;
-    assert(sqlite3_column_count(c->_statement) == 6);
+    assert(sqlite3_column_count(c->_statement) == 8);
     assert(sqlite3_column_type(c->_statement, 0) == SQLITE_TEXT);
     assert(sqlite3_column_type(c->_statement, 1) == SQLITE_BLOB);
     assert(sqlite3_column_type(c->_statement, 2) == SQLITE_INTEGER);
@@ -1652,40 +1922,37 @@ int rhizome_list_next(struct rhizome_list_cursor *c)
     assert(sqlite3_column_type(c->_statement, 4) == SQLITE_TEXT || sqlite3_column_type(c->_statement, 4) == SQLITE_NULL);
     assert(sqlite3_column_type(c->_statement, 5) == SQLITE_INTEGER);
 
-    uint64_t q_rowid = c->_rowid_current = sqlite3_column_int64(c->_statement, 5);
+    struct rhizome_list_row *row = &c->row;
     const char *q_manifestid = (const char *) sqlite3_column_text(c->_statement, 0);
     const char *manifestblob = (char *) sqlite3_column_blob(c->_statement, 1);
     size_t manifestblobsize = sqlite3_column_bytes(c->_statement, 1); // must call after sqlite3_column_blob()
     uint64_t q_version = sqlite3_column_int64(c->_statement, 2);
-    int64_t q_inserttime = sqlite3_column_int64(c->_statement, 3);
     const char *q_author = (const char *) sqlite3_column_text(c->_statement, 4);
-    sid_t author;
+    row->has_author = 0;
     if (q_author) {
-      if (str_to_sid_t(&author, q_author) == -1) {
+      if (str_to_sid_t(&row->author, q_author) == -1) {
 	WHYF("MANIFESTS row id=%s has invalid author column %s -- skipped", q_manifestid, alloca_str_toprint(q_author));
 	continue;
       }
+      row->has_author = 1;
     }
-    rhizome_manifest *m = c->manifest = rhizome_new_manifest();
-    if (m == NULL)
-      RETURN(-1);
-    memcpy(m->manifestdata, manifestblob, manifestblobsize);
-    m->manifest_all_bytes = manifestblobsize;
-    if (   rhizome_manifest_parse(m) == -1
-	|| !rhizome_manifest_validate(m)
+    if (!rhizome_manifest_inspect(manifestblob, manifestblobsize, &row->summary)
+	|| row->summary.filesize == RHIZOME_SIZE_UNSET
     ) {
       WHYF("MANIFESTS row id=%s has invalid manifest blob -- skipped", q_manifestid);
       continue;
     }
-    if (m->version != q_version) {
+    if (row->summary.version != q_version) {
       WHYF("MANIFESTS row id=%s version=%"PRIu64" does not match manifest blob version=%"PRIu64" -- skipped",
-	  q_manifestid, q_version, m->version);
+	  q_manifestid, q_version, row->summary.version);
       continue;
     }
-    if (q_author)
-      rhizome_manifest_set_author(m, &author);
-    rhizome_manifest_set_rowid(m, q_rowid);
-    rhizome_manifest_set_inserttime(m, q_inserttime);
+    row->rowid = c->_rowid_current = sqlite3_column_int64(c->_statement, 5);
+    row->inserttime = sqlite3_column_int64(c->_statement, 3);
+    row->service = (const char *) sqlite3_column_text(c->_statement, 6);
+    row->name = (const char *) sqlite3_column_text(c->_statement, 7);
+    if (!row->service)
+      row->service = "";
     assert(c->_rowid_current != 0);
     // Don't do rhizome_verify_author(m); too CPU expensive for a listing.  Save that for when
     // the bundle is extracted or exported.
@@ -1696,6 +1963,46 @@ int rhizome_list_next(struct rhizome_list_cursor *c)
   OUT();
 }
 
+/* Parse the whole manifest of the current row of the list.  Returns NULL if it is not valid.  The
+ * manifest is freed by the next call to rhizome_list_next() or rhizome_list_release().
+ */
+rhizome_manifest *rhizome_list_manifest(struct rhizome_list_cursor *c)
+{
+  assert(c->_rowid_current != 0);
+  if (c->manifest)
+    return c->manifest;
+  rhizome_manifest *m = rhizome_new_manifest();
+  if (m == NULL)
+    return NULL;
+  const char *manifestblob = (char *) sqlite3_column_blob(c->_statement, 1);
+  size_t manifestblobsize = sqlite3_column_bytes(c->_statement, 1);
+  memcpy(m->manifestdata, manifestblob, manifestblobsize);
+  m->manifest_all_bytes = manifestblobsize;
+  if (   rhizome_manifest_parse(m) == -1
+      || !rhizome_manifest_validate(m)
+  ) {
+    WHYF("MANIFESTS row id=%s has invalid manifest blob", alloca_tohex_rhizome_bid_t(c->row.summary.bid));
+    rhizome_manifest_free(m);
+    return NULL;
+  }
+  if (c->row.has_author)
+    rhizome_manifest_set_author(m, &c->row.author);
+  rhizome_manifest_set_rowid(m, c->row.rowid);
+  rhizome_manifest_set_inserttime(m, c->row.inserttime);
+  return c->manifest = m;
+}
+
+/* Work out the local authorship of the current row of the list, like rhizome_lookup_author().
+ */
+enum rhizome_bundle_authorship rhizome_list_authorship(struct rhizome_list_cursor *c, sid_t *author)
+{
+  sid_t sender;
+  int has_sender = rhizome_manifest_summary_sid(&c->row.summary, "sender", &sender);
+  *author = c->row.author;
+  return rhizome_lookup_authorship(c->row.has_author ? AUTHOR_NOT_CHECKED : ANONYMOUS, author,
+      &c->row.summary.bid, has_sender ? &sender : NULL);
+}
+
 void rhizome_list_commit(struct rhizome_list_cursor *c)
 {
   DEBUGF(rhizome, "c=%p c->oldest_first=%d c->_rowid_current=%"PRIu64" c->_rowid_last=%"PRIu64,
@@ -1710,11 +2017,11 @@ void rhizome_list_release(struct rhizome_list_cursor *c)
   DEBUGF(rhizome, "c=%p", c);
   if (c->manifest) {
     rhizome_manifest_free(c->manifest);
-    c->_rowid_current = 0;
     c->manifest = NULL;
   }
+  c->_rowid_current = 0;
   if (c->_statement) {
-    sqlite3_finalize(c->_statement);
+    sqlite_release(c->_statement);
     c->_statement = NULL;
   }
 }
@@ -1809,7 +2116,7 @@ next:
     if (blob_m)
       rhizome_manifest_free(blob_m);
   }
-  sqlite3_finalize(statement);
+  sqlite_release(statement);
   if (!sqlite_code_ok(r))
     ret=-1;
   return ret;
@@ -1883,7 +2190,7 @@ enum rhizome_bundle_status rhizome_retrieve_manifest(const rhizome_bid_t *bidp,
   if (!statement)
     return RHIZOME_BUNDLE_STATUS_ERROR;
   enum rhizome_bundle_status ret = step_unpack_manifest_row(&retry, m, statement);
-  sqlite3_finalize(statement);
+  sqlite_release(statement);
   return ret;
 }
 
@@ -1910,7 +2217,7 @@ enum rhizome_bundle_status rhizome_retrieve_manifest_by_prefix(const unsigned ch
   if (!statement)
     return RHIZOME_BUNDLE_STATUS_ERROR;
   enum rhizome_bundle_status ret = step_unpack_manifest_row(&retry, m, statement);
-  sqlite3_finalize(statement);
+  sqlite_release(statement);
   return ret;
 }
 
@@ -1929,7 +2236,7 @@ enum rhizome_bundle_status rhizome_retrieve_manifest_by_hash_prefix(const uint8_
   if (!statement)
     return RHIZOME_BUNDLE_STATUS_ERROR;
   enum rhizome_bundle_status ret = step_unpack_manifest_row(&retry, m, statement);
-  sqlite3_finalize(statement);
+  sqlite_release(statement);
   return ret;
 }
 
@@ -1975,7 +2282,7 @@ enum rhizome_bundle_status rhizome_retrieve_bar_by_hash_prefix(const uint8_t *pr
   ret = RHIZOME_BUNDLE_STATUS_SAME;
   
 end:
-  sqlite3_finalize(statement);
+  sqlite_release(statement);
   return ret;
 }
 
@@ -1987,21 +2294,35 @@ void server_rhizome_add_bundle(uint64_t rowid){
     "SELECT id, manifest, version, inserttime, author, rowid FROM manifests WHERE rowid > ? AND rowid < ?"
     "ORDER BY rowid",
     INT64, max_rowid, INT64, rowid, END);
-  while (sqlite_step_retry(&retry, statement) == SQLITE_ROW) {
-    rhizome_manifest *m = rhizome_new_manifest();
-    if (!m)
-      break;
-    if (unpack_manifest_row(m, statement)!=-1){
-      if (rhizome_manifest_verify(m)){
-	if (max_rowid < m->rowid)
-	  max_rowid = m->rowid;
-	CALL_TRIGGER(bundle_add, m);
-	// Note that a trigger might cause a new bundle to be added, and max_rowid to jump
+  // a bulk import may have added many bundles, so check their signatures in batches
+  rhizome_manifest *manifests[RHIZOME_VERIFY_BATCH];
+  unsigned count = 0, i;
+  int more = 1;
+  while (more) {
+    rhizome_manifest *m = NULL;
+    more = sqlite_step_retry(&retry, statement) == SQLITE_ROW && (m = rhizome_new_manifest()) != NULL;
+    if (more){
+      if (unpack_manifest_row(m, statement)!=-1)
+	manifests[count++] = m;
+      else
+	rhizome_manifest_free(m);
+    }
+    if (count == NELS(manifests) || (!more && count)) {
+      rhizome_manifest_verify_batch(manifests, count);
+      for (i = 0; i < count; i++) {
+	m = manifests[i];
+	if (m->selfSigned){
+	  if (max_rowid < m->rowid)
+	    max_rowid = m->rowid;
+	  CALL_TRIGGER(bundle_add, m);
+	  // Note that a trigger might cause a new bundle to be added, and max_rowid to jump
+	}
+	rhizome_manifest_free(m);
       }
+      count = 0;
     }
-    rhizome_manifest_free(m);
   }
-  sqlite3_finalize(statement);
+  sqlite_release(statement);
 }
 
 static int rhizome_delete_manifest_retry(sqlite_retry_state *retry, const rhizome_bid_t *bidp)
@@ -2113,7 +2434,7 @@ static enum rhizome_bundle_status is_interesting(const char *id_hex, uint64_t ve
   }else{
     status = RHIZOME_BUNDLE_STATUS_NEW;
   }
-  sqlite3_finalize(statement);
+  sqlite_release(statement);
   RETURN(status);
   OUT();
 }
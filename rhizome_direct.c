@@ -649,7 +649,7 @@ int rhizome_direct_get_bars(const rhizome_bid_t *bidp_low,
       }
     }
   if (statement)
-    sqlite3_finalize(statement);
+    sqlite_release(statement);
   statement = NULL;
   
   return bars_written;
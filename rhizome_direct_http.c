@@ -843,7 +843,7 @@ static rhizome_manifest *rhizome_direct_get_manifest(unsigned char *bid_prefix,
       while (sqlite_code_busy(ret) && sqlite_retry(&retry, "sqlite3_blob_open"));
       if (!sqlite_code_ok(ret)) {
 	WHYF("sqlite3_blob_open() failed, %s", sqlite3_errmsg(rhizome_db));
-	sqlite3_finalize(statement);
+	sqlite_release(statement);
 	return NULL;
 	
       }
@@ -872,18 +872,18 @@ static rhizome_manifest *rhizome_direct_get_manifest(unsigned char *bid_prefix,
       
       DEBUGF(rhizome_direct, "Read manifest");
       sqlite3_blob_close(blob);
-      sqlite3_finalize(statement);
+      sqlite_release(statement);
       return m;
 
  error:
       sqlite3_blob_close(blob);
-      sqlite3_finalize(statement);
+      sqlite_release(statement);
       return NULL;
     }
   else 
     {
       DEBUGF(rhizome_direct, "no matching manifests");
-      sqlite3_finalize(statement);
+      sqlite_release(statement);
       return NULL;
     }
 
@@ -88,10 +88,21 @@ struct rhizome_fetch_slot {
   int mdpResponsesOutstanding;
   int mdpRXBlockLength;
   unsigned char mdpRXWindow[32*200];
+
+  /* Chunk list of the payload, if the peer stores it in chunks (see rhizome_chunk.c) */
+  struct rhizome_chunk_ref *chunks;
+  unsigned chunk_count; // received so far
+  unsigned chunk_total;
+  unsigned chunk_next; // next chunk to look for in our own store
+  uint64_t chunk_bytes; // payload bytes copied from our own store
 };
 
 static enum rhizome_start_fetch_result rhizome_fetch_switch_to_mdp(struct rhizome_fetch_slot *slot);
 static int rhizome_fetch_mdp_requestblocks(struct rhizome_fetch_slot *slot);
+static int rhizome_write_complete(struct rhizome_fetch_slot *slot);
+
+// how far ahead of the received data we will fill in chunks from our own store
+#define RHIZOME_FETCH_CHUNK_WINDOW (512*1024)
 
 /* Represents a queue of fetch candidates and a single active fetch for bundle payloads whose size
  * is less than a given threshold.
@@ -977,6 +988,12 @@ static void rhizome_fetch_close(struct rhizome_fetch_slot *slot)
   if (slot->previous)
     rhizome_manifest_free(slot->previous);
   slot->previous = NULL;
+
+  if (slot->chunks)
+    free(slot->chunks);
+  slot->chunks = NULL;
+  slot->chunk_count = slot->chunk_total = slot->chunk_next = 0;
+  slot->chunk_bytes = 0;
   
   if (slot->write_state.blob_fd != -1 || slot->write_state.blob_rowid != 0)
     rhizome_fail_write(&slot->write_state);
@@ -1093,6 +1110,89 @@ static int rhizome_fetch_mdp_requestblocks(struct rhizome_fetch_slot *slot)
   OUT();
 }
 
+static int rhizome_fetch_mdp_requestchunks(struct rhizome_fetch_slot *slot)
+{
+  struct internal_mdp_header header;
+  bzero(&header, sizeof header);
+  
+  header.source = get_my_subscriber(1);
+  header.source_port = MDP_PORT_RHIZOME_RESPONSE;
+  header.destination = (struct subscriber *)slot->peer;
+  header.destination_port = MDP_PORT_RHIZOME_CHUNK_REQUEST;
+  header.ttl = 1;
+  header.qos = OQ_ORDINARY;
+  
+  struct overlay_buffer *payload = ob_new();
+  ob_append_bytes(payload, slot->bid.binary, sizeof slot->bid.binary);
+  ob_append_ui64_rv(payload, slot->bidVersion);
+  ob_append_ui32_rv(payload, slot->chunk_count);
+  
+  DEBUGF(rhizome_rx, "Requesting chunk list from %u", slot->chunk_count);
+  ob_flip(payload);
+  int ret = overlay_send_frame(&header, payload);
+  ob_free(payload);
+  return ret;
+}
+
+/* Copy any chunks of the payload that we already have into the write, as long as they are close
+ * enough to the data received so far to fit in the write buffer.  The whole payload hash is still
+ * checked at the end, so a bad chunk list can only cause the fetch to fail.
+ */
+static int rhizome_fetch_apply_chunks(struct rhizome_fetch_slot *slot)
+{
+  static unsigned char buffer[RHIZOME_CHUNK_MAX_SIZE];
+  uint64_t window_end = slot->write_state.file_offset + RHIZOME_FETCH_CHUNK_WINDOW;
+  while (slot->chunk_next < slot->chunk_count) {
+    const struct rhizome_chunk_ref *chunk = &slot->chunks[slot->chunk_next];
+    if (chunk->offset >= window_end)
+      break;
+    slot->chunk_next++;
+    if (chunk->offset + chunk->length <= slot->write_state.file_offset)
+      continue;
+    if (rhizome_chunk_read(chunk->hash, buffer, sizeof buffer) != (ssize_t)chunk->length)
+      continue;
+    DEBUGF(rhizome_rx, "Using our own copy of %"PRIu32" bytes @%"PRIu64, chunk->length, chunk->offset);
+    if (rhizome_random_write(&slot->write_state, chunk->offset, buffer, chunk->length))
+      return -1;
+    slot->chunk_bytes += chunk->length;
+  }
+  return 0;
+}
+
+int rhizome_received_chunk_list(const unsigned char *bidprefix, uint64_t version, unsigned total, unsigned first,
+				const struct rhizome_chunk_ref *refs, unsigned count)
+{
+  struct rhizome_fetch_slot *slot = fetch_search_slot(bidprefix, 16);
+  if (!slot || slot->bidVersion != version || slot->state != RHIZOME_FETCH_RXFILEMDP || !slot->manifest)
+    return 0;
+  // ignore duplicates, or anything inconsistent with what we've already been told
+  if (first != slot->chunk_count || (slot->chunks && total != slot->chunk_total))
+    return 0;
+  if (!slot->chunks) {
+    if (total == 0 || total > slot->manifest->filesize / RHIZOME_CHUNK_MIN_SIZE + 1)
+      return WHYF("Implausible chunk count %u", total);
+    if ((slot->chunks = emalloc(total * sizeof *slot->chunks)) == NULL)
+      return -1;
+    slot->chunk_total = total;
+  }
+  unsigned i;
+  for (i = 0; i < count && slot->chunk_count < slot->chunk_total; ++i) {
+    uint64_t expected = slot->chunk_count ? slot->chunks[slot->chunk_count - 1].offset + slot->chunks[slot->chunk_count - 1].length : 0;
+    if (refs[i].offset != expected || refs[i].length == 0 || refs[i].length > RHIZOME_CHUNK_MAX_SIZE
+      || refs[i].offset + refs[i].length > slot->manifest->filesize)
+      return WHY("Malformed chunk list");
+    slot->chunks[slot->chunk_count++] = refs[i];
+  }
+  if (slot->chunk_count < slot->chunk_total)
+    rhizome_fetch_mdp_requestchunks(slot);
+  if (rhizome_fetch_apply_chunks(slot) == -1) {
+    rhizome_fetch_close(slot);
+    return -1;
+  }
+  rhizome_write_complete(slot);
+  return 0;
+}
+
 static int pipe_journal(struct rhizome_fetch_slot *slot){
   if (!slot->previous)
     return 0;
@@ -1183,6 +1283,9 @@ static enum rhizome_start_fetch_result rhizome_fetch_switch_to_mdp(struct rhizom
     slot->mdpIdleTimeout *= 1+(q - rhizome_fetch_queues);
   
   slot->mdpRXBlockLength = config.rhizome.mdp.block_size; // Rhizome over MDP block size
+  // if the peer stores this payload in chunks, we may already have some of them
+  if (config.rhizome.chunked_storage)
+    rhizome_fetch_mdp_requestchunks(slot);
   rhizome_fetch_mdp_requestblocks(slot);
 
   RETURN(STARTED);
@@ -1281,10 +1384,11 @@ static int rhizome_write_complete(struct rhizome_fetch_slot *slot)
     time_ms_t interval = now - slot->start_time;
     if (interval <= 0)
       interval = 1;
-    DEBUGF(rhizome_rx, "Closing rhizome fetch slot = 0x%p.  Received %"PRIu64" bytes in %"PRIu64"ms (%"PRIu64"KB/sec).",
+    DEBUGF(rhizome_rx, "Closing rhizome fetch slot = 0x%p.  Received %"PRIu64" bytes in %"PRIu64"ms (%"PRIu64"KB/sec), %"PRIu64" bytes from local chunks.",
            slot, slot->write_state.file_offset,
            (uint64_t)interval,
-           slot->write_state.file_offset / (uint64_t)interval
+           slot->write_state.file_offset / (uint64_t)interval,
+           slot->chunk_bytes
 	  );
   }
 
@@ -1343,7 +1447,8 @@ int rhizome_received_content(const unsigned char *bidprefix,
   
   if (slot && slot->bidVersion == version && slot->state == RHIZOME_FETCH_RXFILEMDP){
     DEBUGF(rhizome, "Rhizome over MDP receiving %zu bytes.", count);
-    if (rhizome_random_write(&slot->write_state, offset, bytes, count)){
+    if (rhizome_random_write(&slot->write_state, offset, bytes, count)
+      || rhizome_fetch_apply_chunks(slot)){
       DEBUGF(rhizome, "Write failed!");
       RETURN (-1);
     }
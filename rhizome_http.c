@@ -92,7 +92,12 @@ static int rhizome_status_page(httpd_request *r, const char *remainder)
   strbuf b = strbuf_local_buf(buf);
   strbuf_puts(b, "<html><head><meta http-equiv=\"refresh\" content=\"5\" ></head><body>");
   strbuf_sprintf(b, "%d HTTP requests<br>", current_httpd_request_count);
-  strbuf_sprintf(b, "%d Bundles transferring via MDP<br>", rhizome_cache_count());
+  httpd_route_stats_html(b);
+  struct rhizome_cache_stats cache_stats;
+  rhizome_cache_get_stats(&cache_stats);
+  strbuf_sprintf(b, "%u Bundles transferring via MDP (%u open files)<br>", cache_stats.entries, cache_stats.files);
+  strbuf_sprintf(b, "MDP read cache: %"PRIu64" hits, %"PRIu64" misses, %"PRIu64" evictions, %"PRIu64" expiries<br>",
+      cache_stats.hits, cache_stats.misses, cache_stats.evictions, cache_stats.expiries);
   rhizome_fetch_status_html(b);
   strbuf_puts(b, "</body></html>");
   if (strbuf_overrun(b))
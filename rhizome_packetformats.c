@@ -144,8 +144,7 @@ uint64_t rhizome_bar_bidprefix_ll(const rhizome_bar_t *bar)
 
 /* Queue an advertisment for a single manifest */
 int rhizome_advertise_manifest(struct subscriber *dest, rhizome_manifest *m){
-  struct overlay_frame *frame = malloc(sizeof(struct overlay_frame));
-  bzero(frame,sizeof(struct overlay_frame));
+  struct overlay_frame *frame = op_new();
   frame->type = OF_TYPE_RHIZOME_ADVERT;
   frame->source = get_my_subscriber(1);
   if (dest && dest->reachable&REACHABLE)
@@ -245,6 +244,13 @@ int overlay_rhizome_saw_advertisements(struct decode_context *context, struct ov
 	goto next;
       }
 
+      // Most advertisements are for bundles we already hold, so check the id and version from the
+      // summary before allocating and fully parsing a manifest.
+      if (rhizome_is_interesting(&summ.bid, summ.version, NULL) != RHIZOME_BUNDLE_STATUS_NEW) {
+	DEBUGF(rhizome_ads, "Ignoring uninteresting manifest bid=%s version=%"PRIu64, alloca_tohex_rhizome_bid_t(summ.bid), summ.version);
+	goto next;
+      }
+
       // The manifest looks potentially interesting, so now do a full parse and validation.
       if ((m = rhizome_new_manifest()) == NULL)
 	goto next;
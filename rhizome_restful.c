@@ -62,10 +62,7 @@ static void finalise_union_rhizome_list(httpd_request *r)
   r->u.rhlist.cursor.name=NULL;
 }
 
-#define LIST_TOKEN_STRLEN (BASE64_ENCODED_LEN(sizeof(serval_uuid_t) + 8))
-#define alloca_list_token(rowid) list_token_to_str(alloca(LIST_TOKEN_STRLEN + 1), (rowid))
-
-static char *list_token_to_str(char *buf, uint64_t rowid)
+char *list_token_to_str(char *buf, uint64_t rowid)
 {
   struct iovec iov[2];
   iov[0].iov_base = rhizome_db_uuid.u.binary;
@@ -199,7 +196,6 @@ static int restful_open_cursor(httpd_request *r)
   assert(r->finalise_union == NULL);
   r->finalise_union = finalise_union_rhizome_list;
   r->u.rhlist.phase = LIST_HEADER;
-  r->u.rhlist.rowcount = 0;
 
   const char *service = http_request_get_query_param(&r->http, "service");
   if (service && *service){
@@ -227,11 +223,15 @@ static int restful_open_cursor(httpd_request *r)
     // TODO fail?
   }
 
+  const struct mime_content_type *content_type = http_response_list_init(r, RHIZOME_LIST_COLUMNS);
+  if (!content_type)
+    return 400;
+
   int ret = rhizome_list_open(&r->u.rhlist.cursor);
   if (ret == -1)
     return http_request_rhizome_response(r, 500, "Failed to open list");
 
-  http_request_response_generated(&r->http, 200, &CONTENT_TYPE_JSON, restful_rhizome_bundlelist_json_content);
+  http_request_response_generated(&r->http, 200, content_type, restful_rhizome_bundlelist_json_content);
   return 1;
 }
 
@@ -251,12 +251,12 @@ static int restful_rhizome_bundlelist_json(httpd_request *r, const char *remaind
   return restful_open_cursor(r);
 }
 
-static HTTP_CONTENT_GENERATOR_STRBUF_CHUNKER restful_rhizome_bundlelist_json_content_chunk;
+static HTTP_CONTENT_GENERATOR_LIST_CHUNKER restful_rhizome_bundlelist_json_content_chunk;
 
 static int restful_rhizome_bundlelist_json_content(struct http_request *hr, unsigned char *buf, size_t bufsz, struct http_content_generator_result *result)
 {
   httpd_request *r = (httpd_request *) hr;
-  int ret = generate_http_content_from_strbuf_chunks(hr, (char *)buf, bufsz, result, restful_rhizome_bundlelist_json_content_chunk);
+  int ret = generate_http_content_from_list_chunks(hr, &r->list, buf, bufsz, result, restful_rhizome_bundlelist_json_content_chunk);
   rhizome_list_release(&r->u.rhlist.cursor);
   return ret;
 }
@@ -288,36 +288,86 @@ static void on_rhizome_bundle_added(httpd_request *r, rhizome_manifest *UNUSED(m
   http_request_resume_response(&r->http);
 }
 
-static int restful_rhizome_bundlelist_json_content_chunk(struct http_request *hr, strbuf b)
+const char *const rhizome_list_headers[RHIZOME_LIST_COLUMNS] = {
+  ".token",
+  "_id",
+  "service",
+  "id",
+  "version",
+  "date",
+  ".inserttime",
+  ".author",
+  ".fromhere",
+  "filesize",
+  "filehash",
+  "sender",
+  "recipient",
+  "name"
+};
+
+/* Write the current row of a bundle list.  A list token is only given for rows that are newer than
+ * any already written, which are those with a rowid above *rowid_highest.
+ */
+void rhizome_list_write_row(struct list_writer *w, struct rhizome_list_cursor *c, uint64_t *rowid_highest)
+{
+  const struct rhizome_list_row *row = &c->row;
+  const struct rhizome_manifest_summary *summ = &row->summary;
+  sid_t author, sender, recipient;
+  enum rhizome_bundle_authorship authorship = rhizome_list_authorship(c, &author);
+  int64_t date;
+  lw_row_start(w);
+  if (row->rowid > *rowid_highest) {
+    lw_string(w, alloca_list_token(row->rowid));
+    *rowid_highest = row->rowid;
+  } else
+    lw_null(w);
+  lw_uint64(w, row->rowid);
+  lw_string(w, row->service);
+  lw_hex(w, summ->bid.binary, sizeof summ->bid.binary);
+  lw_uint64(w, summ->version);
+  if (rhizome_manifest_summary_int64(summ, "date", &date))
+    lw_int64(w, date);
+  else
+    lw_null(w);
+  lw_int64(w, row->inserttime);
+  // The 'fromhere' flag indicates if the author is a known (unlocked) identity in the local
+  // keyring.  The values are 0 (no), 1 (yes), 2 (yes and cryptographically verified).  In the
+  // implementation below, the 0 value (no) is redundant, because it only occurs when the
+  // 'author' column is null, but in future the author SID might be reported for non-local
+  // authors, so clients should only use 'fromhere != 0', never 'author != null', to detect
+  // local authorship.
+  int fromhere = 0;
+  switch (authorship) {
+    case AUTHOR_AUTHENTIC:
+      fromhere = 2;
+      lw_hex(w, author.binary, sizeof author.binary);
+      break;
+    case AUTHOR_LOCAL:
+      fromhere = 1;
+      lw_hex(w, author.binary, sizeof author.binary);
+      break;
+    case AUTHOR_REMOTE:
+      lw_hex(w, author.binary, sizeof author.binary);
+      break;
+    default:
+      lw_null(w);
+      break;
+  }
+  lw_uint64(w, fromhere);
+  lw_uint64(w, summ->filesize);
+  lw_hex(w, summ->filesize && summ->has_filehash ? summ->filehash.binary : NULL, sizeof summ->filehash.binary);
+  lw_hex(w, rhizome_manifest_summary_sid(summ, "sender", &sender) ? sender.binary : NULL, sizeof sender.binary);
+  lw_hex(w, rhizome_manifest_summary_sid(summ, "recipient", &recipient) ? recipient.binary : NULL, sizeof recipient.binary);
+  lw_string(w, row->name);
+}
+
+static int restful_rhizome_bundlelist_json_content_chunk(struct http_request *hr, struct list_writer *w)
 {
   httpd_request *r = (httpd_request *) hr;
-  const char *headers[] = {
-    ".token",
-    "_id",
-    "service",
-    "id",
-    "version",
-    "date",
-    ".inserttime",
-    ".author",
-    ".fromhere",
-    "filesize",
-    "filehash",
-    "sender",
-    "recipient",
-    "name"
-  };
   switch (r->u.rhlist.phase) {
     case LIST_HEADER:
-      strbuf_puts(b, "{\n\"header\":[");
-      unsigned i;
-      for (i = 0; i != NELS(headers); ++i) {
-	if (i)
-	  strbuf_putc(b, ',');
-	strbuf_json_string(b, headers[i]);
-      }
-      strbuf_puts(b, "],\n\"rows\":[");
-      if (!strbuf_overrun(b))
+      lw_start(w);
+      if (lw_header(w, rhizome_list_headers))
 	r->u.rhlist.phase = LIST_ROWS;
       return 1;
     case LIST_FIRST:
@@ -335,77 +385,16 @@ static int restful_rhizome_bundlelist_json_content_chunk(struct http_request *hr
 	  http_request_pause_response(&r->http, r->u.rhlist.end_time);
 	  return 0;
 	}
-	rhizome_manifest *m = r->u.rhlist.cursor.manifest;
-	assert(m->filesize != RHIZOME_SIZE_UNSET);
-	rhizome_lookup_author(m);
-	if (r->u.rhlist.rowcount != 0)
-	  strbuf_putc(b, ',');
-	strbuf_puts(b, "\n[");
-	if (m->rowid > r->u.rhlist.rowid_highest) {
-	  strbuf_json_string(b, alloca_list_token(m->rowid));
-	  r->u.rhlist.rowid_highest = m->rowid;
-	} else
-	  strbuf_json_null(b);
-	strbuf_putc(b, ',');
-	strbuf_sprintf(b, "%"PRIu64, m->rowid);
-	strbuf_putc(b, ',');
-	strbuf_json_string(b, m->service);
-	strbuf_putc(b, ',');
-	strbuf_json_hex(b, m->keypair.public_key.binary, sizeof m->keypair.public_key.binary);
-	strbuf_putc(b, ',');
-	strbuf_sprintf(b, "%"PRIu64, m->version);
-	strbuf_putc(b, ',');
-	if (m->has_date)
-	  strbuf_sprintf(b, "%"PRItime_ms_t, m->date);
-	else
-	  strbuf_json_null(b);
-	strbuf_putc(b, ',');
-	strbuf_sprintf(b, "%"PRItime_ms_t",", m->inserttime);
-	// The 'fromhere' flag indicates if the author is a known (unlocked) identity in the local
-	// keyring.  The values are 0 (no), 1 (yes), 2 (yes and cryptographically verified).  In the
-	// implementation below, the 0 value (no) is redundant, because it only occurs when the
-	// 'author' column is null, but in future the author SID might be reported for non-local
-	// authors, so clients should only use 'fromhere != 0', never 'author != null', to detect
-	// local authorship.
-	int fromhere = 0;
-	switch (m->authorship) {
-	  case AUTHOR_AUTHENTIC:
-	    fromhere = 2;
-	    strbuf_json_hex(b, m->author.binary, sizeof m->author.binary);
-	    break;
-	  case AUTHOR_LOCAL:
-	    fromhere = 1;
-	    strbuf_json_hex(b, m->author.binary, sizeof m->author.binary);
-	    break;
-	  case AUTHOR_REMOTE:
-	    strbuf_json_hex(b, m->author.binary, sizeof m->author.binary);
-	    break;
-	  default:
-	    strbuf_json_null(b);
-	    break;
-	}
-	strbuf_putc(b, ',');
-	strbuf_sprintf(b, "%d", fromhere);
-	strbuf_putc(b, ',');
-	strbuf_sprintf(b, "%"PRIu64, m->filesize);
-	strbuf_putc(b, ',');
-	strbuf_json_hex(b, m->filesize ? m->filehash.binary : NULL, sizeof m->filehash.binary);
-	strbuf_putc(b, ',');
-	strbuf_json_hex(b, m->has_sender ? m->sender.binary : NULL, sizeof m->sender.binary);
-	strbuf_putc(b, ',');
-	strbuf_json_hex(b, m->has_recipient ? m->recipient.binary : NULL, sizeof m->recipient.binary);
-	strbuf_putc(b, ',');
-	strbuf_json_string(b, m->name);
-	strbuf_puts(b, "]");
-	if (!strbuf_overrun(b)) {
+	uint64_t rowid_highest = r->u.rhlist.rowid_highest;
+	rhizome_list_write_row(w, &r->u.rhlist.cursor, &rowid_highest);
+	if (lw_row_end(w)) {
+	  r->u.rhlist.rowid_highest = rowid_highest;
 	  rhizome_list_commit(&r->u.rhlist.cursor);
-	  ++r->u.rhlist.rowcount;
 	}
       }
       return 1;
     case LIST_END:
-      strbuf_puts(b, "\n]\n}\n");
-      if (!strbuf_overrun(b))
+      if (lw_trailer(w))
 	r->u.rhlist.phase = LIST_DONE;
       // fall through...
     case LIST_DONE:
@@ -1109,24 +1098,40 @@ int rhizome_payload_content(struct http_request *hr, unsigned char *buf, size_t
   const size_t blocksz = 1 << 12;
   // Ask for a large buffer for all future reads.
   const size_t preferred_bufsz = 16 * blocksz;
+  // Hash and send this much of a file at a time when not copying.
+  const size_t zero_copy_chunk = 64 * blocksz;
   // Reads the next part of the payload into the supplied buffer.
   httpd_request *r = (httpd_request *) hr;
   assert(r->u.read_state.length != RHIZOME_SIZE_UNSET);
   assert(r->u.read_state.offset < r->u.read_state.length);
-  uint64_t remain = r->u.read_state.length - r->u.read_state.offset;
+  // Stop at the end of the requested range, not the end of the payload.
+  uint64_t range_end = r->http.response.header.content_range_start + r->http.response.header.content_length;
+  assert(range_end <= r->u.read_state.length);
+  assert(r->u.read_state.offset < range_end);
+  uint64_t remain = range_end - r->u.read_state.offset;
   size_t readlen = bufsz;
   if (remain <= bufsz)
     readlen = remain;
   else
     readlen &= ~(blocksz - 1);
   if (readlen > 0) {
-    ssize_t n = rhizome_read(&r->u.read_state, buf, readlen);
+    // Unencrypted payloads in external blob files are sent straight from the file, a large chunk at
+    // a time, without copying them through the buffer.
+    ssize_t n = rhizome_read_zero_copy(&r->u.read_state, remain < zero_copy_chunk ? remain : zero_copy_chunk,
+				       &result->sendfile_fd, &result->sendfile_offset);
     if (n == -1)
       return -1;
-    result->generated = (size_t) n;
+    if (n > 0)
+      result->sendfile_length = (size_t) n;
+    else {
+      n = rhizome_read(&r->u.read_state, buf, readlen);
+      if (n == -1)
+	return -1;
+      result->generated = (size_t) n;
+    }
   }
-  assert(r->u.read_state.offset <= r->u.read_state.length);
-  remain = r->u.read_state.length - r->u.read_state.offset;
+  assert(r->u.read_state.offset <= range_end);
+  remain = range_end - r->u.read_state.offset;
   result->need = remain < preferred_bufsz ? remain : preferred_bufsz;
   return remain ? 1 : 0;
 }
@@ -22,6 +22,9 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #endif
 
 #include <assert.h>
+#ifdef HAVE_PTHREAD
+#  include <pthread.h>
+#endif
 #ifdef HAVE_SYS_STATVFS_H
 #  include <sys/statvfs.h>
 #else
@@ -38,6 +41,8 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include "numeric_str.h"
 
 #define RHIZOME_BUFFER_MAXIMUM_SIZE (1024*1024)
+// how much data may be waiting for the write pipeline thread before writers must wait
+#define RHIZOME_PIPELINE_MAXIMUM_SIZE (4*RHIZOME_BUFFER_MAXIMUM_SIZE)
 
 uint64_t rhizome_copy_file_to_blob(int fd, uint64_t id, size_t size);
 
@@ -73,6 +78,13 @@ enum rhizome_payload_status rhizome_exists(const rhizome_filehash_t *hashp)
     return RHIZOME_PAYLOAD_STATUS_ERROR;
   if (blob_rowid!=0)
     return RHIZOME_PAYLOAD_STATUS_STORED;
+
+  switch (rhizome_is_chunked(&retry, hashp)) {
+    case -1:
+      return RHIZOME_PAYLOAD_STATUS_ERROR;
+    case 1:
+      return RHIZOME_PAYLOAD_STATUS_STORED;
+  }
   return RHIZOME_PAYLOAD_STATUS_NEW;
 }
 
@@ -117,6 +129,8 @@ static int rhizome_delete_file_id_retry(sqlite_retry_state *retry, const char *i
 {
   int ret = 0;
   rhizome_delete_external(id);
+  if (rhizome_release_chunks(retry, id) == -1)
+    ret = -1;
   sqlite3_stmt *statement = sqlite_prepare_bind(retry, "DELETE FROM fileblobs WHERE id = ?", STATIC_TEXT, id, END);
   if (!statement || sqlite_exec_retry(retry, statement) == -1)
     ret = -1;
@@ -239,6 +253,10 @@ static enum rhizome_payload_status store_make_space(uint64_t bytes, struct rhizo
 	    "SELECT 1  "
 	    "FROM FILEBLOBS "
 	    "WHERE FILES.ID = FILEBLOBS.ID "
+	  ") AND NOT EXISTS( "
+	    "SELECT 1 "
+	    "FROM FILECHUNKS "
+	    "WHERE FILES.ID = FILECHUNKS.FILEID "
 	  ");", END);
 
   if (sqlite_code_busy(stepcode))
@@ -313,7 +331,7 @@ static enum rhizome_payload_status store_make_space(uint64_t bytes, struct rhizo
       report->deleted_expired_files++;
     db_used = external_bytes + db_page_size * (db_page_count - db_free_page_count);
   }
-  sqlite3_finalize(statement);
+  sqlite_release(statement);
 
   if (sqlite_code_busy(stepcode))
     return RHIZOME_PAYLOAD_STATUS_BUSY;
@@ -345,6 +363,7 @@ enum rhizome_payload_status rhizome_open_write(struct rhizome_write *write, cons
 
   write->blob_fd=-1;
   write->sql_blob=NULL;
+  write->pipeline=NULL;
   
   if (expectedHashp){
     if (rhizome_exists(expectedHashp) == RHIZOME_PAYLOAD_STATUS_STORED)
@@ -371,6 +390,193 @@ enum rhizome_payload_status rhizome_open_write(struct rhizome_write *write, cons
   return RHIZOME_PAYLOAD_STATUS_NEW;
 }
 
+/* While rhizome_write_file() reads a large payload into an external blob file, a worker thread
+ * encrypts, hashes and writes each block, so that work overlaps the reading of the next one.  The
+ * main thread hands over copies of each block in file order, and waits for the worker if more than
+ * RHIZOME_PIPELINE_MAXIMUM_SIZE bytes are still queued.  rhizome_write_file() blocks until the whole
+ * file is read anyway, so it also waits for the worker to finish before it returns.  Writes that
+ * are fed in pieces from the event loop, like fetches and HTTP uploads, are processed inline, so
+ * that finishing them never has to wait for a thread.
+ *
+ * The worker must not log, touch the database or change any part of the rhizome_write state except
+ * the hash context, so errors are recorded as an errno value and reported by the main thread.
+ */
+
+#ifdef HAVE_PTHREAD
+
+struct rhizome_write_pipeline {
+  pthread_t thread;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  struct rhizome_write *write;
+  struct rhizome_write_buffer *head;
+  struct rhizome_write_buffer *tail;
+  size_t queued;
+  int error;
+  uint8_t stop:1;
+};
+
+static int pipeline_process(struct rhizome_write *write_state, struct rhizome_write_buffer *block)
+{
+  if (write_state->crypt
+    && rhizome_crypt_xor_block(block->data, block->data_size, block->offset + write_state->tail, write_state->key, write_state->nonce))
+    return EINVAL;
+  crypto_hash_sha512_update(&write_state->sha512_context, block->data, block->data_size);
+  if (lseek64(write_state->blob_fd, (off64_t) block->offset, SEEK_SET) == -1)
+    return errno;
+  size_t ofs = 0;
+  while (ofs < block->data_size){
+    ssize_t r = write(write_state->blob_fd, block->data + ofs, block->data_size - ofs);
+    if (r == -1)
+      return errno;
+    ofs += (size_t)r;
+  }
+  return 0;
+}
+
+static void *pipeline_thread(void *context)
+{
+  struct rhizome_write_pipeline *pipeline = context;
+  pthread_mutex_lock(&pipeline->mutex);
+  while (1){
+    while (!pipeline->head && !pipeline->stop)
+      pthread_cond_wait(&pipeline->cond, &pipeline->mutex);
+    struct rhizome_write_buffer *block = pipeline->head;
+    if (!block)
+      break;
+    int error = pipeline->error;
+    pthread_mutex_unlock(&pipeline->mutex);
+    // blocks are only removed from the queue once they have been written, so the main thread can
+    // keep appending to the tail while this one is busy
+    if (!error)
+      error = pipeline_process(pipeline->write, block);
+    pthread_mutex_lock(&pipeline->mutex);
+    if (error && !pipeline->error)
+      pipeline->error = error;
+    pipeline->head = block->_next;
+    if (!pipeline->head)
+      pipeline->tail = NULL;
+    pipeline->queued -= block->data_size;
+    free(block);
+    pthread_cond_broadcast(&pipeline->cond);
+  }
+  pthread_mutex_unlock(&pipeline->mutex);
+  return NULL;
+}
+
+// start a worker thread if this write is large enough to be worth it
+static void pipeline_start(struct rhizome_write *write_state)
+{
+  if (write_state->file_offset != write_state->written_offset)
+    return;
+  if (write_state->file_length == RHIZOME_SIZE_UNSET){
+    if (write_state->file_offset < RHIZOME_BUFFER_MAXIMUM_SIZE)
+      return;
+  }else if(write_state->file_length <= config.rhizome.max_blob_size
+    || write_state->file_length < RHIZOME_BUFFER_MAXIMUM_SIZE)
+    return;
+
+  struct rhizome_write_pipeline *pipeline = emalloc_zero(sizeof *pipeline);
+  if (!pipeline)
+    return;
+  pipeline->write = write_state;
+  pthread_mutex_init(&pipeline->mutex, NULL);
+  pthread_cond_init(&pipeline->cond, NULL);
+  int err = pthread_create(&pipeline->thread, NULL, pipeline_thread, pipeline);
+  if (err){
+    // not fatal, the main thread can do the work itself
+    WARNF("pthread_create: %s", strerror(err));
+    pthread_cond_destroy(&pipeline->cond);
+    pthread_mutex_destroy(&pipeline->mutex);
+    free(pipeline);
+    return;
+  }
+  DEBUGF(rhizome_store, "Started write pipeline at offset %"PRIu64, write_state->file_offset);
+  write_state->pipeline = pipeline;
+}
+
+static int pipeline_write(struct rhizome_write_pipeline *pipeline, uint64_t file_offset, const uint8_t *buffer, size_t data_size)
+{
+  struct rhizome_write_buffer *block = emalloc(sizeof(struct rhizome_write_buffer) + data_size);
+  if (!block)
+    return -1;
+  block->_next = NULL;
+  block->offset = file_offset;
+  block->buffer_size = block->data_size = data_size;
+  bcopy(buffer, block->data, data_size);
+
+  pthread_mutex_lock(&pipeline->mutex);
+  while (pipeline->queued && pipeline->queued + data_size > RHIZOME_PIPELINE_MAXIMUM_SIZE && !pipeline->error)
+    pthread_cond_wait(&pipeline->cond, &pipeline->mutex);
+  int error = pipeline->error;
+  if (!error){
+    if (pipeline->tail)
+      pipeline->tail->_next = block;
+    else
+      pipeline->head = block;
+    pipeline->tail = block;
+    pipeline->queued += data_size;
+    pthread_cond_broadcast(&pipeline->cond);
+  }
+  pthread_mutex_unlock(&pipeline->mutex);
+
+  if (error){
+    free(block);
+    errno = error;
+    return WHY_perror("Write pipeline failed");
+  }
+  return 0;
+}
+
+/* Wait for all queued data to be processed and stop the worker thread.  If 'discard' is set, any
+ * queued data is thrown away instead.  Returns -1 if any data could not be written.
+ */
+static int pipeline_stop(struct rhizome_write *write_state, int discard)
+{
+  struct rhizome_write_pipeline *pipeline = write_state->pipeline;
+  if (!pipeline)
+    return 0;
+  write_state->pipeline = NULL;
+
+  pthread_mutex_lock(&pipeline->mutex);
+  if (discard && !pipeline->error)
+    pipeline->error = ECANCELED;
+  pipeline->stop = 1;
+  pthread_cond_broadcast(&pipeline->cond);
+  pthread_mutex_unlock(&pipeline->mutex);
+  pthread_join(pipeline->thread, NULL);
+
+  int error = pipeline->error;
+  pthread_cond_destroy(&pipeline->cond);
+  pthread_mutex_destroy(&pipeline->mutex);
+  free(pipeline);
+
+  if (error && !discard){
+    errno = error;
+    return WHY_perror("Write pipeline failed");
+  }
+  DEBUGF(rhizome_store, "Stopped write pipeline");
+  return 0;
+}
+
+#else // !HAVE_PTHREAD
+
+static void pipeline_start(struct rhizome_write *UNUSED(write_state))
+{
+}
+
+static int pipeline_write(struct rhizome_write_pipeline *UNUSED(pipeline), uint64_t UNUSED(file_offset), const uint8_t *UNUSED(buffer), size_t UNUSED(data_size))
+{
+  return WHY("Write pipelines are not supported");
+}
+
+static int pipeline_stop(struct rhizome_write *UNUSED(write_state), int UNUSED(discard))
+{
+  return 0;
+}
+
+#endif // !HAVE_PTHREAD
+
 /* blob_open / close will lock the database, this is bad for other processes that might attempt to 
  * use it at the same time. However, opening a blob has about O(n^2) performance. 
  * */
@@ -388,6 +594,12 @@ static int prepare_data(struct rhizome_write *write_state, uint8_t *buffer, size
     return WHYF("Too much content supplied, %"PRIu64" + %zu > %"PRIu64,
 		write_state->file_offset, data_size, write_state->file_length);
 
+  if (write_state->pipeline){
+    // the pipeline thread will encrypt and hash this data when write_data() hands it over
+    write_state->file_offset+=data_size;
+    return 0;
+  }
+
   if (write_state->crypt){
     if (rhizome_crypt_xor_block(
 	  buffer, data_size, 
@@ -452,7 +664,10 @@ static int write_data(struct rhizome_write *write_state, uint64_t file_offset, u
   if (file_offset != write_state->written_offset)
     WARNF("Writing file data out of order! [%"PRId64",%"PRId64"]", file_offset, write_state->written_offset);
     
-  if (write_state->blob_fd != -1) {
+  if (write_state->pipeline) {
+    if (pipeline_write(write_state->pipeline, file_offset, buffer, data_size) == -1)
+      return -1;
+  }else if (write_state->blob_fd != -1) {
     size_t ofs = 0;
     // keep trying until all of the data is written.
     if (lseek64(write_state->blob_fd, (off64_t) file_offset, SEEK_SET) == -1)
@@ -644,13 +859,18 @@ int rhizome_write_buffer(struct rhizome_write *write_state, uint8_t *buffer, siz
 
 /* If file_length is known, then expects file to be at least file_length in size, ignoring anything
  * longer than that.  Returns 0 if successful, -1 if error (logged).
+ *
+ * The whole file is read on the calling thread before this returns; only the encryption, hashing
+ * and writing of large payloads run alongside the reading, on the write pipeline, which is finished
+ * before this returns.
  */
 int rhizome_write_file(struct rhizome_write *write, const char *filename, off_t offset, uint64_t length)
 {
   int fd = open(filename, O_RDONLY);
   if (fd == -1)
     return WHYF_perror("open(%s,O_RDONLY)", alloca_str_toprint(filename));
-  unsigned char buffer[RHIZOME_CRYPT_PAGE_SIZE];
+  // read in large enough pieces that the write pipeline isn't dominated by hand-over costs
+  unsigned char buffer[RHIZOME_CRYPT_PAGE_SIZE * 16];
   int ret=0;
   if (offset){
     if (lseek(fd, offset, SEEK_SET)==-1)
@@ -659,6 +879,8 @@ int rhizome_write_file(struct rhizome_write *write, const char *filename, off_t
   if (length == RHIZOME_SIZE_UNSET || length > write->file_length)
     length = write->file_length;
   while (length == RHIZOME_SIZE_UNSET || write->file_offset < length) {
+    if (!write->pipeline)
+      pipeline_start(write);
     size_t size = sizeof buffer;
     if (length != RHIZOME_SIZE_UNSET && write->file_offset + size > length)
       size = length - write->file_offset;
@@ -678,6 +900,8 @@ int rhizome_write_file(struct rhizome_write *write, const char *filename, off_t
     if ((size_t) r != size)
       break;
   }
+  if (pipeline_stop(write, ret == -1) == -1)
+    ret = -1;
   if (write_release_lock(write))
     ret = -1;
   close(fd);
@@ -757,7 +981,7 @@ enum rhizome_payload_status rhizome_finish_write(struct rhizome_write *write)
       goto failure;
     }
   }
-  
+
   if (write->file_offset < write->file_length) {
     WHYF("Only wrote %"PRIu64" bytes, expected %"PRIu64, write->file_offset, write->file_length);
     status = RHIZOME_PAYLOAD_STATUS_WRONG_SIZE;
@@ -891,6 +1115,10 @@ enum rhizome_payload_status rhizome_finish_write(struct rhizome_write *write)
   if (status == RHIZOME_PAYLOAD_STATUS_NEW)
     DEBUGF(rhizome_store, "Stored file %s", alloca_tohex_rhizome_filehash_t(write->id));
 
+  // not fatal if this fails, the payload is still stored whole
+  if (status == RHIZOME_PAYLOAD_STATUS_NEW && config.rhizome.chunked_storage)
+    rhizome_store_chunks(&write->id);
+
   return status;
 
 dbfailure:
@@ -1072,6 +1300,9 @@ enum rhizome_payload_status rhizome_open_read(struct rhizome_read *read, const r
   read->id = *hashp;
   read->blob_rowid = 0;
   read->blob_fd = -1;
+  read->blob_map = NULL;
+  read->chunked = 0;
+  read->chunk_rowid = 0;
   read->verified = 0;
   read->offset = 0;
   read->hash_offset = 0;
@@ -1105,6 +1336,15 @@ enum rhizome_payload_status rhizome_open_read(struct rhizome_read *read, const r
       if (read->length <= (uint64_t)pos){
 	read->blob_fd = fd;
 	DEBUGF(rhizome_store, "Opened stored file %s as fd %d, len %"PRIu64" (%"PRIu64")", blob_path, read->blob_fd, read->length, pos);
+	// Stored blob files are never modified, so it is safe to map them.  If mapping fails (eg, not
+	// enough address space for a large payload), fall back to read(2).
+	if (read->length <= SIZE_MAX){
+	  void *map = mmap(NULL, (size_t) read->length, PROT_READ, MAP_SHARED, fd, 0);
+	  if (map == MAP_FAILED)
+	    DEBUGF(rhizome_store, "mmap(%s) failed: %s", blob_path, strerror(errno));
+	  else
+	    read->blob_map = map;
+	}
 	return RHIZOME_PAYLOAD_STATUS_STORED;
       }
       DEBUGF(rhizome_store, "Ignoring file? %s fd %d, len %"PRIu64", seek %zd", blob_path, fd, read->length, pos);
@@ -1127,6 +1367,15 @@ enum rhizome_payload_status rhizome_open_read(struct rhizome_read *read, const r
     DEBUGF(rhizome_store, "Opened stored blob, rowid %d", read->blob_rowid);
     return RHIZOME_PAYLOAD_STATUS_STORED;
   }
+
+  switch (rhizome_is_chunked(&retry, &read->id)) {
+    case -1:
+      return RHIZOME_PAYLOAD_STATUS_ERROR;
+    case 1:
+      read->chunked = 1;
+      DEBUGF(rhizome_store, "Opened chunked payload");
+      return RHIZOME_PAYLOAD_STATUS_STORED;
+  }
   // database is inconsistent, clean it up
   rhizome_delete_file(&read->id);
   return RHIZOME_PAYLOAD_STATUS_NEW;
@@ -1135,6 +1384,14 @@ enum rhizome_payload_status rhizome_open_read(struct rhizome_read *read, const r
 static ssize_t rhizome_read_retry(sqlite_retry_state *retry, struct rhizome_read *read_state, unsigned char *buffer, size_t bufsz)
 {
   IN();
+  if (read_state->blob_map) {
+    assert(read_state->offset <= read_state->length);
+    if (bufsz + read_state->offset > read_state->length)
+      bufsz = read_state->length - read_state->offset;
+    if (bufsz && buffer)
+      bcopy(read_state->blob_map + read_state->offset, buffer, bufsz);
+    RETURN(bufsz);
+  }
   if (read_state->blob_fd != -1) {
     assert(read_state->offset <= read_state->length);
     if (lseek64(read_state->blob_fd, (off64_t) read_state->offset, SEEK_SET) == -1)
@@ -1149,6 +1406,8 @@ static ssize_t rhizome_read_retry(sqlite_retry_state *retry, struct rhizome_read
     DEBUGF(rhizome_store, "Read %zu bytes from fd=%d @%"PRIx64, (size_t) rd, read_state->blob_fd, read_state->offset);
     RETURN(rd);
   }
+  if (read_state->chunked)
+    RETURN(rhizome_read_chunked(retry, read_state, buffer, bufsz));
   if (read_state->blob_rowid == 0)
     RETURN(WHY("blob not created"));
   sqlite3_blob *blob = NULL;
@@ -1179,6 +1438,29 @@ static ssize_t rhizome_read_retry(sqlite_retry_state *retry, struct rhizome_read
   OUT();
 }
 
+// hash the payload as we go, but only if we happen to read the payload data in order
+static int rhizome_read_hash(struct rhizome_read *read_state, const unsigned char *data, size_t length)
+{
+  if (read_state->hash_offset != read_state->offset || !data || length == 0)
+    return 0;
+  crypto_hash_sha512_update(&read_state->sha512_context, data, length);
+  read_state->hash_offset += length;
+
+  // if we hash everything and the hash doesn't match, we need to delete the payload
+  if (read_state->hash_offset >= read_state->length){
+    rhizome_filehash_t hash_out;
+    crypto_hash_sha512_final(&read_state->sha512_context, hash_out.binary);
+    if (cmp_rhizome_filehash_t(&read_state->id, &hash_out) != 0) {
+      // hash failure, mark the payload as invalid
+      read_state->verified = -1;
+      return WHYF("Expected hash=%s, got %s", alloca_tohex_rhizome_filehash_t(read_state->id), alloca_tohex_rhizome_filehash_t(hash_out));
+    }
+    // we read it, and it's good. Lets remember that (not fatal if the database is locked)
+    read_state->verified = 1;
+  }
+  return 0;
+}
+
 /* Read content from the store, hashing and decrypting as we go. 
  Random access is supported, but hashing requires all payload contents to be read sequentially. */
 // returns the number of bytes read
@@ -1195,25 +1477,8 @@ ssize_t rhizome_read(struct rhizome_read *read_state, unsigned char *buffer, siz
     RETURN(-1);
   size_t bytes_read = (size_t) n;
 
-  // hash the payload as we go, but only if we happen to read the payload data in order
-  if (read_state->hash_offset == read_state->offset && buffer && bytes_read>0){
-    crypto_hash_sha512_update(&read_state->sha512_context, buffer, bytes_read);
-    read_state->hash_offset += bytes_read;
-    
-    // if we hash everything and the hash doesn't match, we need to delete the payload
-    if (read_state->hash_offset >= read_state->length){
-      rhizome_filehash_t hash_out;
-      crypto_hash_sha512_final(&read_state->sha512_context, hash_out.binary);
-      if (cmp_rhizome_filehash_t(&read_state->id, &hash_out) != 0) {
-	// hash failure, mark the payload as invalid
-	read_state->verified = -1;
-	RETURN(WHYF("Expected hash=%s, got %s", alloca_tohex_rhizome_filehash_t(read_state->id), alloca_tohex_rhizome_filehash_t(hash_out)));
-      }else{
-	// we read it, and it's good. Lets remember that (not fatal if the database is locked)
-	read_state->verified = 1;
-      }
-    }
-  }
+  if (rhizome_read_hash(read_state, buffer, bytes_read) == -1)
+    RETURN(-1);
   
   if (read_state->crypt && buffer && bytes_read>0){
     if(rhizome_crypt_xor_block(
@@ -1229,9 +1494,39 @@ ssize_t rhizome_read(struct rhizome_read *read_state, unsigned char *buffer, siz
   OUT();
 }
 
+/* Consume up to 'length' bytes of an unencrypted payload without copying them, so that the caller
+ * can send them straight from the blob file, eg, using sendfile(2).  The payload is hashed in place
+ * (as rhizome_read() would), so if the final part fails verification, it is not returned.
+ *
+ * Returns the number of bytes consumed, and sets *fdp and *offsetp to their location.  Returns 0 if
+ * the payload cannot be read this way (eg, it is encrypted, or stored in the database), in which
+ * case the caller must use rhizome_read().  Returns -1 on error.
+ */
+ssize_t rhizome_read_zero_copy(struct rhizome_read *read_state, size_t length, int *fdp, uint64_t *offsetp)
+{
+  if (read_state->verified == -1)
+    return -1;
+  if (!read_state->blob_map || read_state->crypt)
+    return 0;
+  assert(read_state->offset <= read_state->length);
+  if (length > read_state->length - read_state->offset)
+    length = read_state->length - read_state->offset;
+  if (rhizome_read_hash(read_state, read_state->blob_map + read_state->offset, length) == -1)
+    return -1;
+  *fdp = read_state->blob_fd;
+  *offsetp = read_state->offset;
+  read_state->offset += length;
+  DEBUGF(rhizome_store, "zero copy %zu bytes from fd=%d @%"PRIx64, length, *fdp, *offsetp);
+  return length;
+}
+
 /* Read len bytes from read->offset into data, using *buffer to cache any reads */
 ssize_t rhizome_read_buffered(struct rhizome_read *read, struct rhizome_read_buffer *buffer, unsigned char *data, size_t len)
 {
+  // a mapped, unencrypted payload can be copied directly, without the intermediate buffer
+  if (read->blob_map && !read->crypt)
+    return rhizome_read(read, data, len);
+
   size_t bytes_copied=0;
   
   while (len>0){
@@ -1311,6 +1606,10 @@ void rhizome_read_close(struct rhizome_read *read)
     // bzero'd & never opened, or already closed
     return;
 
+  if (read->blob_map) {
+    munmap(read->blob_map, (size_t) read->length);
+    read->blob_map = NULL;
+  }
   if (read->blob_fd != -1) {
     DEBUGF(rhizome_store, "Closing store fd %d", read->blob_fd);
     close(read->blob_fd);
@@ -1334,72 +1633,166 @@ void rhizome_read_close(struct rhizome_read *read)
   read->tail = 0;
 }
 
+/* Open read states for payloads being served over MDP, indexed by bundle id and version.
+ *
+ * Every entry is on a least-recently-used list, and those holding an open blob file descriptor
+ * are also on a second LRU list, so that both the rhizome.mdp.cache_entries and
+ * rhizome.mdp.cache_files budgets can be enforced by evicting from the tail in constant time.
+ * Entries are moved to the head whenever they are read, and their expiry time only ever moves
+ * forward, so the tail of the LRU list is always the next entry to expire (as long as callers
+ * supply a fixed timeout from now, which is all they do at present).
+ */
+
+/* The hash table has a power of two buckets, at least one for each entry allowed by the
+ * rhizome.mdp.cache_entries budget, so chains stay short whatever the budget.
+ */
+#define CACHE_MIN_BUCKETS 16
+#define CACHE_MAX_BUCKETS (1 << 20)
+
 struct cache_entry{
-  struct cache_entry *_left;
-  struct cache_entry *_right;
+  struct cache_entry *_hash_next;
+  struct cache_entry *_lru_prev;
+  struct cache_entry *_lru_next;
+  struct cache_entry *_file_prev;
+  struct cache_entry *_file_next;
   rhizome_bid_t bundle_id;
   uint64_t version;
   struct rhizome_read read_state;
   time_ms_t expires;
 };
-struct cache_entry *root;
 
-static struct cache_entry ** find_entry_location(struct cache_entry **ptr, const rhizome_bid_t *bundle_id, uint64_t version)
+struct cache_list{
+  struct cache_entry *head;
+  struct cache_entry *tail;
+};
+
+static struct cache_entry *cache_min_buckets[CACHE_MIN_BUCKETS];
+static struct cache_entry **cache_buckets = cache_min_buckets;
+static unsigned cache_bucket_count = CACHE_MIN_BUCKETS;
+static unsigned cache_bucket_budget;
+static struct cache_list cache_lru;
+static struct cache_list cache_files;
+static unsigned cache_entry_count;
+static unsigned cache_file_count;
+static struct rhizome_cache_stats cache_stats;
+
+#define CACHE_LINK(LIST, ENTRY, PREV, NEXT) do { \
+    (ENTRY)->PREV = NULL; \
+    (ENTRY)->NEXT = (LIST)->head; \
+    if ((LIST)->head) \
+      (LIST)->head->PREV = (ENTRY); \
+    else \
+      (LIST)->tail = (ENTRY); \
+    (LIST)->head = (ENTRY); \
+  } while(0)
+
+#define CACHE_UNLINK(LIST, ENTRY, PREV, NEXT) do { \
+    if ((ENTRY)->PREV) \
+      (ENTRY)->PREV->NEXT = (ENTRY)->NEXT; \
+    else \
+      (LIST)->head = (ENTRY)->NEXT; \
+    if ((ENTRY)->NEXT) \
+      (ENTRY)->NEXT->PREV = (ENTRY)->PREV; \
+    else \
+      (LIST)->tail = (ENTRY)->PREV; \
+    (ENTRY)->PREV = (ENTRY)->NEXT = NULL; \
+  } while(0)
+
+static inline int cache_entry_has_file(const struct cache_entry *entry)
+{
+  return entry->read_state.blob_fd != -1;
+}
+
+static struct cache_entry **cache_bucket(const rhizome_bid_t *bundle_id, uint64_t version)
+{
+  // bundle ids are public keys, so any of their bytes are as good a hash as any other
+  unsigned hash = ((unsigned)bundle_id->binary[0] << 24 | bundle_id->binary[1] << 16
+		| bundle_id->binary[2] << 8 | bundle_id->binary[3]) ^ (unsigned)version;
+  return &cache_buckets[hash & (cache_bucket_count - 1)];
+}
+
+// resize the hash table to suit the current entry budget, rehashing all the entries
+static void cache_resize_buckets()
+{
+  if (cache_bucket_budget == config.rhizome.mdp.cache_entries)
+    return;
+  cache_bucket_budget = config.rhizome.mdp.cache_entries;
+  unsigned count = CACHE_MIN_BUCKETS;
+  while (count < cache_bucket_budget && count < CACHE_MAX_BUCKETS)
+    count <<= 1;
+  if (count == cache_bucket_count)
+    return;
+  struct cache_entry **buckets = count == CACHE_MIN_BUCKETS ? cache_min_buckets : emalloc(count * sizeof *buckets);
+  if (buckets == NULL)
+    return; // keep the old table, with longer chains
+  bzero(buckets, count * sizeof *buckets);
+  if (cache_buckets != cache_min_buckets)
+    free(cache_buckets);
+  cache_buckets = buckets;
+  cache_bucket_count = count;
+  DEBUGF(rhizome_store, "Resized MDP read cache to %u buckets", count);
+  struct cache_entry *entry;
+  for (entry = cache_lru.head; entry; entry = entry->_lru_next){
+    struct cache_entry **bucket = cache_bucket(&entry->bundle_id, entry->version);
+    entry->_hash_next = *bucket;
+    *bucket = entry;
+  }
+}
+
+static struct cache_entry ** find_entry_location(const rhizome_bid_t *bundle_id, uint64_t version)
 {
+  struct cache_entry **ptr = cache_bucket(bundle_id, version);
   while(*ptr){
     struct cache_entry *entry = *ptr;
-    int cmp = cmp_rhizome_bid_t(bundle_id, &entry->bundle_id);
-    if (cmp==0){
-      if (entry->version==version)
-	break;
-      if (version < entry->version)
-	ptr = &entry->_left;
-      else
-	ptr = &entry->_right;
-      continue;
-    }
-    if (cmp<0)
-      ptr = &entry->_left;
-    else
-      ptr = &entry->_right;
+    if (entry->version == version && cmp_rhizome_bid_t(bundle_id, &entry->bundle_id) == 0)
+      break;
+    ptr = &entry->_hash_next;
   }
   return ptr;
 }
 
-static time_ms_t close_entries(struct cache_entry **entry, time_ms_t timeout)
+static void cache_entry_touch(struct cache_entry *entry)
 {
-  if (!*entry)
-    return 0;
-    
-  time_ms_t ret = close_entries(&(*entry)->_left, timeout);
-  time_ms_t t_right = close_entries(&(*entry)->_right, timeout);
-  if (t_right!=0 && (t_right < ret || ret==0))
-    ret=t_right;
-    
-  if ((*entry)->expires < timeout || timeout==0){
-    rhizome_read_close(&(*entry)->read_state);
-    // remember the two children
-    struct cache_entry *left=(*entry)->_left;
-    struct cache_entry *right=(*entry)->_right;
-    // free this entry
-    free(*entry);
-    // re-add both children to the tree
-    *entry=left;
-    if (right){
-      entry = find_entry_location(entry, &right->bundle_id, right->version);
-      *entry=right;
-    }
-  }else{
-    if ((*entry)->expires < ret || ret==0)
-      ret=(*entry)->expires;
+  if (cache_lru.head != entry){
+    CACHE_UNLINK(&cache_lru, entry, _lru_prev, _lru_next);
+    CACHE_LINK(&cache_lru, entry, _lru_prev, _lru_next);
+  }
+  if (cache_entry_has_file(entry) && cache_files.head != entry){
+    CACHE_UNLINK(&cache_files, entry, _file_prev, _file_next);
+    CACHE_LINK(&cache_files, entry, _file_prev, _file_next);
   }
-  return ret;
+}
+
+static void cache_entry_close(struct cache_entry *entry)
+{
+  struct cache_entry **ptr = find_entry_location(&entry->bundle_id, entry->version);
+  assert(*ptr == entry);
+  *ptr = entry->_hash_next;
+  CACHE_UNLINK(&cache_lru, entry, _lru_prev, _lru_next);
+  if (cache_entry_has_file(entry)){
+    CACHE_UNLINK(&cache_files, entry, _file_prev, _file_next);
+    cache_file_count--;
+  }
+  cache_entry_count--;
+  rhizome_read_close(&entry->read_state);
+  free(entry);
+}
+
+// close expired cache entries, returning the time the next one will expire, or 0 if empty
+static time_ms_t close_entries(time_ms_t timeout)
+{
+  while (cache_lru.tail && (timeout == 0 || cache_lru.tail->expires < timeout)){
+    if (timeout)
+      cache_stats.expiries++;
+    cache_entry_close(cache_lru.tail);
+  }
+  return cache_lru.tail ? cache_lru.tail->expires : 0;
 }
 
 // close any expired cache entries
 static void rhizome_cache_alarm(struct sched_ent *alarm)
 {
-  alarm->alarm = close_entries(&root, gettime_ms());
+  alarm->alarm = close_entries(gettime_ms());
   if (alarm->alarm){
     alarm->deadline = alarm->alarm + 1000;
     schedule(alarm);
@@ -1417,32 +1810,51 @@ static struct sched_ent cache_alarm={
 // close all cache entries
 int rhizome_cache_close()
 {
-  close_entries(&root, 0);
+  close_entries(0);
   unschedule(&cache_alarm);
   return 0;
 }
 
-static int _rhizome_cache_count(struct cache_entry *entry)
+int rhizome_cache_count()
+{
+  return cache_entry_count;
+}
+
+void rhizome_cache_get_stats(struct rhizome_cache_stats *stats)
 {
-  if (!entry)
-    return 0;
-  return 1+_rhizome_cache_count(entry->_left)+_rhizome_cache_count(entry->_right);
+  *stats = cache_stats;
+  stats->entries = cache_entry_count;
+  stats->files = cache_file_count;
 }
 
-int rhizome_cache_count()
+// make room for a new entry, evicting the least recently used entries that exceed the budget
+static void cache_make_room(int needs_file)
 {
-  return _rhizome_cache_count(root);
+  unsigned max_entries = config.rhizome.mdp.cache_entries;
+  unsigned max_files = config.rhizome.mdp.cache_files;
+  while (cache_lru.tail && cache_entry_count >= max_entries){
+    cache_stats.evictions++;
+    cache_entry_close(cache_lru.tail);
+  }
+  while (needs_file && cache_files.tail && cache_file_count >= max_files){
+    cache_stats.evictions++;
+    cache_entry_close(cache_files.tail);
+  }
 }
 
 // read a block of data, caching meta data for reuse
 ssize_t rhizome_read_cached(const rhizome_bid_t *bidp, uint64_t version, time_ms_t timeout, uint64_t fileOffset, unsigned char *buffer, size_t length)
 {
   // look for a cached entry
-  struct cache_entry **ptr = find_entry_location(&root, bidp, version);
-  struct cache_entry *entry = *ptr;
+  cache_resize_buckets();
+  struct cache_entry *entry = *find_entry_location(bidp, version);
   
-  // if we don't have one yet, create one and open it
-  if (!entry){
+  if (entry){
+    cache_stats.hits++;
+    cache_entry_touch(entry);
+  }else{
+    // if we don't have one yet, create one and open it
+    cache_stats.misses++;
     rhizome_filehash_t filehash;
     if (rhizome_database_filehash_from_id(bidp, version, &filehash) != 0){
       DEBUGF(rhizome_store, "Payload not found for bundle bid=%s version=%"PRIu64, 
@@ -1471,7 +1883,16 @@ ssize_t rhizome_read_cached(const rhizome_bid_t *bidp, uint64_t version, time_ms
     }
     entry->bundle_id = *bidp;
     entry->version = version;
-    *ptr = entry;
+    cache_make_room(cache_entry_has_file(entry));
+    struct cache_entry **bucket = cache_bucket(bidp, version);
+    entry->_hash_next = *bucket;
+    *bucket = entry;
+    CACHE_LINK(&cache_lru, entry, _lru_prev, _lru_next);
+    cache_entry_count++;
+    if (cache_entry_has_file(entry)){
+      CACHE_LINK(&cache_files, entry, _file_prev, _file_next);
+      cache_file_count++;
+    }
   }
   
   entry->read_state.offset = fileOffset;
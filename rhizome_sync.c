@@ -491,7 +491,7 @@ static void sync_send_response(struct subscriber *dest, int forwards, uint64_t t
     }
   }
 
-  sqlite3_finalize(statement);
+  sqlite_release(statement);
 
   // send a zero lower bound if we reached the end of our manifest list
   if (count && count < max_count && !forwards){
@@ -545,6 +545,10 @@ static int overlay_mdp_service_rhizome_sync(struct internal_mdp_header *header,
 {
   if (!config.rhizome.enable || !rhizome_db)
     return 0;
+  
+  // ignore our own broadcast announcements, otherwise we end up syncing with ourselves
+  if (header->source->reachable == REACHABLE_SELF)
+    return 0;
     
   struct rhizome_sync *state = header->source->sync_state;
   
@@ -229,15 +229,19 @@ void sync_keys_status(struct sched_ent *alarm)
 }
 
 static int sync_complete_transfers(){
-  // attempt to finish payload transfers and write manifests to the store
-  while(completing){
-    struct transfers *transfer = completing;
+  // attempt to finish payload transfers
+  int ret = 0;
+  struct transfers **ptr = &completing;
+  while(*ptr){
+    struct transfers *transfer = *ptr;
     assert(transfer->state == STATE_COMPLETING);
 
     if (transfer->write){
       enum rhizome_payload_status status = rhizome_finish_write(transfer->write);
-      if (status == RHIZOME_PAYLOAD_STATUS_BUSY)
-	return 1;
+      if (status == RHIZOME_PAYLOAD_STATUS_BUSY){
+	ret = 1;
+	break;
+      }
 
       free(transfer->write);
       transfer->write = NULL;
@@ -246,14 +250,53 @@ static int sync_complete_transfers(){
 	WARNF("Write failed %s (hash %s)",
 	    rhizome_payload_status_message_nonnull(status),
 	    alloca_sync_key(&transfer->key));
-	goto cleanup;
+	*ptr = transfer->next;
+	if (transfer->manifest)
+	  rhizome_manifest_free(transfer->manifest);
+	free(transfer);
+	continue;
       }
     }
+    ptr = &transfer->next;
+  }
+
+  // then write the manifests of all complete payloads to the store in a single transaction
+  if (!completing)
+    return ret;
+
+  // check the signatures of those manifests together, so they can be spread across threads
+  rhizome_manifest *manifests[RHIZOME_VERIFY_BATCH];
+  unsigned count = 0;
+  struct transfers *t;
+  for (t = completing; t; t = t->next){
+    if (t->write || !t->manifest)
+      continue;
+    manifests[count++] = t->manifest;
+    if (count == NELS(manifests)){
+      rhizome_manifest_verify_batch(manifests, count);
+      count = 0;
+    }
+  }
+  rhizome_manifest_verify_batch(manifests, count);
+
+  struct rhizome_ingest batch;
+  if (rhizome_ingest_begin(&batch) == -1)
+    return 1;
+  struct transfers *added = NULL;
+  ptr = &completing;
+  while(*ptr){
+    struct transfers *transfer = *ptr;
+    if (transfer->write){
+      ptr = &transfer->next;
+      continue;
+    }
 
-    enum rhizome_bundle_status add_state = rhizome_add_manifest_to_store(transfer->manifest, NULL);
+    enum rhizome_bundle_status add_state = rhizome_ingest_manifest(&batch, transfer->manifest, NULL);
+    if (add_state == RHIZOME_BUNDLE_STATUS_BUSY){
+      ret = 1;
+      break;
+    }
     switch(add_state){
-      case RHIZOME_BUNDLE_STATUS_BUSY:
-	return 1;
       case RHIZOME_BUNDLE_STATUS_NEW:
       case RHIZOME_BUNDLE_STATUS_SAME:
 	break;
@@ -262,15 +305,22 @@ static int sync_complete_transfers(){
 	  alloca_sync_key(&transfer->key), rhizome_bundle_status_message_nonnull(add_state));
     }
 
-cleanup:
+    // the manifest must outlive the transaction
+    *ptr = transfer->next;
+    transfer->next = added;
+    added = transfer;
+  }
+  if (rhizome_ingest_commit(&batch) == -1)
+    WARN("Failed to commit received manifests");
+
+  while(added){
+    struct transfers *transfer = added;
+    added = transfer->next;
     if (transfer->manifest)
       rhizome_manifest_free(transfer->manifest);
-    transfer->manifest=NULL;
-
-    completing = transfer->next;
     free(transfer);
   }
-  return 0;
+  return ret;
 }
 
 static int sync_manifest_rank(rhizome_manifest *m, struct subscriber *peer, uint8_t sending, uint64_t written_offset)
@@ -588,19 +638,52 @@ static void sync_peer_now_has (void * UNUSED(context), void *peer_context, void
     alloca_sync_key(key));
 }
 
-// this is probably fast enough. For huge stores, or slow storage media
-// we might need to use an alarm to slowly build this tree
-static void build_tree()
+// The tree is built from the store in small slices, newest manifests first, so a large store
+// doesn't stall the server.  We start reconciling with peers straight away; until the build
+// completes, peers may offer us BARs for bundles we already have, which we quickly ignore.
+// Manifests added in the meantime go straight into the tree via sync_bundle_add().
+#define SYNC_BUILD_ROWS 1000
+#define SYNC_BUILD_SLICE_MS 10
+
+static int64_t build_before_rowid = 0; // only manifests below this rowid remain to be added
+static unsigned build_key_count = 0;
+static time_ms_t build_start = 0;
+
+// Neighbours that also understand summaries can find a few differences from a single message,
+// instead of a round trip for each level of the tree.  We send a summary when a neighbour
+// appears, or when we first hear a summary from a neighbour.
+#define SYNC_SUMMARY_INTERVAL 1000
+
+static uint8_t summary_due = 0;
+static time_ms_t summary_sent = 0;
+
+DECLARE_ALARM(sync_send_keys);
+
+DEFINE_ALARM(sync_build_tree);
+void sync_build_tree(struct sched_ent *alarm)
 {
-  sync_tree = sync_alloc_state(NULL, sync_peer_has, sync_peer_does_not_have, sync_peer_now_has);
-  
+  if (!sync_tree || !build_before_rowid)
+    return;
+
+  time_ms_t now = gettime_ms();
+  time_ms_t slice_end = now + SYNC_BUILD_SLICE_MS;
+  unsigned rows = 0;
   sqlite_retry_state retry = SQLITE_RETRY_STATE_DEFAULT;
-  sqlite3_stmt *statement = sqlite_prepare(&retry, "SELECT id, version, manifest_hash FROM manifests "
-    "WHERE manifests.filehash IS NULL OR EXISTS(SELECT 1 FROM files WHERE files.id = manifests.filehash);");
-  while (sqlite_step_retry(&retry, statement) == SQLITE_ROW) {
-    const char *q_id = (const char *) sqlite3_column_text(statement, 0);
-    uint64_t q_version = sqlite3_column_int64(statement, 1);
-    const char *hash = (const char *) sqlite3_column_text(statement, 2);
+  sqlite3_stmt *statement = sqlite_prepare_bind(&retry, "SELECT rowid, id, version, manifest_hash FROM manifests "
+    "WHERE rowid < ? AND (manifests.filehash IS NULL OR EXISTS(SELECT 1 FROM files WHERE files.id = manifests.filehash)) "
+    "ORDER BY rowid DESC LIMIT ?;",
+    INT64, build_before_rowid,
+    INT, SYNC_BUILD_ROWS,
+    END);
+  if (!statement)
+    return;
+  int r;
+  while ((r = sqlite_step_retry(&retry, statement)) == SQLITE_ROW) {
+    ++rows;
+    build_before_rowid = sqlite3_column_int64(statement, 0);
+    const char *q_id = (const char *) sqlite3_column_text(statement, 1);
+    uint64_t q_version = sqlite3_column_int64(statement, 2);
+    const char *hash = (const char *) sqlite3_column_text(statement, 3);
 
     rhizome_filehash_t manifest_hash;
     if (str_to_rhizome_filehash_t(&manifest_hash, hash)==0){
@@ -611,9 +694,64 @@ static void build_tree()
 	q_version,
 	alloca_sync_key(&key));
       sync_add_key(sync_tree, &key, NULL);
+      build_key_count++;
+    }
+    if (rows % 64 == 0 && gettime_ms() >= slice_end)
+      break;
+  }
+  sqlite_release(statement);
+
+  now = gettime_ms();
+  if (r == SQLITE_ROW || rows == SYNC_BUILD_ROWS){
+    // more to do, but let everything else run first
+    RESCHEDULE(alarm, now, now, TIME_MS_NEVER_WILL);
+  }else if (sqlite_code_ok(r)){
+    DEBUGF(rhizome_sync_keys, "Built tree of %u keys in %"PRId64"ms", build_key_count, (int64_t)(now - build_start));
+    build_before_rowid = 0;
+    if (summary_due){
+      // we held back our summary until it was complete
+      struct sched_ent *send_alarm = &ALARM_STRUCT(sync_send_keys);
+      RESCHEDULE(send_alarm, now, now, now);
     }
+  }else{
+    // try again later
+    RESCHEDULE(alarm, now + 1000, now + 1000, TIME_MS_NEVER_WILL);
   }
-  sqlite3_finalize(statement);
+}
+
+static void build_tree()
+{
+  sync_tree = sync_alloc_state(NULL, sync_peer_has, sync_peer_does_not_have, sync_peer_now_has);
+  build_before_rowid = INT64_MAX;
+  build_key_count = 0;
+  build_start = gettime_ms();
+  struct sched_ent *alarm = &ALARM_STRUCT(sync_build_tree);
+  RESCHEDULE(alarm, build_start, build_start, TIME_MS_NEVER_WILL);
+}
+
+static void sync_send_summary()
+{
+  uint8_t buff[MDP_MTU];
+  size_t len = sync_build_summary(sync_tree, buff, sizeof buff);
+  if (len==0)
+    return;
+  
+  DEBUGF(rhizome_sync_keys, "Sending summary (%zu bytes)", len);
+  
+  struct overlay_buffer *payload = ob_static(buff, sizeof(buff));
+  ob_limitsize(payload, len);
+  
+  struct internal_mdp_header header;
+  bzero(&header, sizeof header);
+  
+  header.crypt_flags = MDP_FLAG_NO_CRYPT | MDP_FLAG_NO_SIGN;
+  header.source = get_my_subscriber(1);
+  header.source_port = MDP_PORT_RHIZOME_SYNC_SUMMARY;
+  header.destination_port = MDP_PORT_RHIZOME_SYNC_SUMMARY;
+  header.qos = OQ_OPPORTUNISTIC;
+  header.ttl = 1;
+  overlay_send_frame(&header, payload);
+  ob_free(payload);
 }
 
 DEFINE_ALARM(sync_send_keys);
@@ -622,6 +760,17 @@ void sync_send_keys(struct sched_ent *alarm)
   if (!sync_tree)
     build_tree();
   
+  // our summary isn't useful to anyone until the tree has been built
+  if (summary_due && !build_before_rowid){
+    if (!config.rhizome.advertise.summary){
+      summary_due = 0;
+    }else if (gettime_ms() >= summary_sent + SYNC_SUMMARY_INTERVAL){
+      sync_send_summary();
+      summary_due = 0;
+      summary_sent = gettime_ms();
+    }
+  }
+  
   uint8_t buff[MDP_MTU];
   size_t len = sync_build_message(sync_tree, buff, sizeof buff);
   if (len==0)
@@ -652,6 +801,9 @@ void sync_send_keys(struct sched_ent *alarm)
   if (sync_has_transmit_queued(sync_tree)){
     DEBUG(rhizome_sync_keys,"Queueing next message for now");
     RESCHEDULE(alarm, now, now, now);
+  }else if (summary_due && !build_before_rowid){
+    time_ms_t next = summary_sent + SYNC_SUMMARY_INTERVAL;
+    RESCHEDULE(alarm, next, next, next);
   }else{
     RESCHEDULE(alarm, now+5000, now+30000, TIME_MS_NEVER_WILL);
   }
@@ -726,6 +878,19 @@ static int process_transfer_message(struct subscriber *peer, struct rhizome_sync
 	  break;
 	}
 	
+	enum rhizome_bundle_status bstatus = rhizome_is_interesting(&summ.bid, summ.version, NULL);
+	if (bstatus == RHIZOME_BUNDLE_STATUS_SAME || bstatus == RHIZOME_BUNDLE_STATUS_OLD){
+	  DEBUGF(rhizome_sync_keys, "Ignoring manifest %s:%"PRIu64" (hash %s), (Uninteresting)",
+	    alloca_tohex_rhizome_bid_t(summ.bid),
+	    summ.version,
+	    alloca_sync_key(&key));
+	  break;
+	}else if (bstatus != RHIZOME_BUNDLE_STATUS_NEW){
+	  // don't consume the payload
+	  ob_rewind(payload);
+	  return 1;
+	}
+
 	// The manifest looks potentially interesting, so now do a full parse and validation.
 	rhizome_manifest *m = rhizome_new_manifest();
 	if (!m){
@@ -747,19 +912,10 @@ static int process_transfer_message(struct subscriber *peer, struct rhizome_sync
 	  break;
 	}
 
-	enum rhizome_bundle_status bstatus = rhizome_is_manifest_interesting(m);
-	if (bstatus == RHIZOME_BUNDLE_STATUS_SAME || bstatus == RHIZOME_BUNDLE_STATUS_OLD){
-	  DEBUGF(rhizome_sync_keys, "Ignoring manifest %s:%u"PRIu64" (hash %s), (Uninteresting)",
-	    alloca_tohex_rhizome_bid_t(m->keypair.public_key),
-	    m->version,
-	    alloca_sync_key(&key));
+	if (cmp_rhizome_bid_t(&m->keypair.public_key, &summ.bid) != 0 || m->version != summ.version){
+	  WHYF("Ignoring manifest (hash %s), (Inconsistent)", alloca_sync_key(&key));
 	  rhizome_manifest_free(m);
 	  break;
-	}else if (bstatus != RHIZOME_BUNDLE_STATUS_NEW){
-	  // don't consume the payload
-	  rhizome_manifest_free(m);
-	  ob_rewind(payload);
-	  return 1;
 	}
 	
 	// start writing the payload
@@ -847,6 +1003,27 @@ static int process_transfer_message(struct subscriber *peer, struct rhizome_sync
 	  }
 	}
 
+	if (!m->is_journal && config.rhizome.chunked_storage && m->filesize > RHIZOME_CHUNK_MAX_SIZE){
+	  // if we have a previous version, it probably shares most of its chunks with this one,
+	  // so hand over to the MDP fetcher which can ask the peer for a chunk list
+	  sqlite_retry_state retry = SQLITE_RETRY_STATE_DEFAULT;
+	  rhizome_manifest *previous = rhizome_new_manifest();
+	  int have_previous = previous
+	    && rhizome_retrieve_manifest(&m->keypair.public_key, previous)==RHIZOME_BUNDLE_STATUS_SAME
+	    && rhizome_is_chunked(&retry, &previous->filehash);
+	  if (previous)
+	    rhizome_manifest_free(previous);
+	  if (have_previous){
+	    DEBUGF(rhizome_sync_keys, "%s Fetching chunks of updated payload via MDP", alloca_sync_key(&key));
+	    rhizome_fail_write(write);
+	    free(write);
+	    struct socket_address addr;
+	    bzero(&addr, sizeof addr);
+	    rhizome_suggest_queue_manifest_import(m, &addr, peer);
+	    break;
+	  }
+	}
+
 	// TODO improve rank algo here;
 	// Note that we still need to deal with this manifest, we don't want to run out of RAM
 
@@ -950,7 +1127,8 @@ static int sync_keys_recv(struct internal_mdp_header *header, struct overlay_buf
   if (!sync_tree)
     build_tree();
   
-  header->source->sync_version = 1;
+  if (header->source->sync_version < 1)
+    header->source->sync_version = 1;
   
   if (!header->destination){
     if (IF_DEBUG(rhizome_sync_keys)){
@@ -1013,6 +1191,42 @@ static int sync_keys_recv(struct internal_mdp_header *header, struct overlay_buf
   return 0;
 }
 
+DEFINE_BINDING(MDP_PORT_RHIZOME_SYNC_SUMMARY, sync_summary_recv);
+static int sync_summary_recv(struct internal_mdp_header *header, struct overlay_buffer *payload)
+{
+  if (header->source->reachable == REACHABLE_SELF || !is_rhizome_advertise_enabled())
+    return 0;
+  
+  if (!sync_tree)
+    build_tree();
+  
+  if (header->source->sync_version < 2){
+    // make sure this peer learns that we understand summaries too
+    header->source->sync_version = 2;
+    if (config.rhizome.advertise.summary)
+      summary_due = 1;
+  }
+  
+  // until our tree is complete, every bundle we haven't added yet would look like a difference
+  if (config.rhizome.advertise.summary && !build_before_rowid){
+    int r = sync_recv_summary(sync_tree, header->source, ob_current_ptr(payload), ob_remaining(payload));
+    if (r==1)
+      DEBUGF(rhizome_sync_keys, "Found all differences from summary of %s", alloca_tohex_sid_t(header->source->sid));
+    else if (r==0)
+      DEBUGF(rhizome_sync_keys, "Too many differences in summary of %s", alloca_tohex_sid_t(header->source->sid));
+  }
+  
+  if (sync_has_transmit_queued(sync_tree) || summary_due){
+    struct sched_ent *alarm=&ALARM_STRUCT(sync_send_keys);
+    time_ms_t next = gettime_ms() + 5;
+    if (alarm->alarm > next || !is_scheduled(alarm)){
+      DEBUG(rhizome_sync_keys,"Queueing next message for 5ms");
+      RESCHEDULE(alarm, next, next, next);
+    }
+  }
+  return 0;
+}
+
 static void sync_neighbour_changed(struct subscriber *neighbour, uint8_t found, unsigned count)
 {
   struct sched_ent *alarm = &ALARM_STRUCT(sync_send_keys);
@@ -1020,9 +1234,13 @@ static void sync_neighbour_changed(struct subscriber *neighbour, uint8_t found,
 
   if (count>0 && enabled){
     time_ms_t now = gettime_ms();
+    if (found && config.rhizome.advertise.summary)
+      summary_due = 1;
     if (alarm->alarm == TIME_MS_NEVER_WILL){
       DEBUG(rhizome_sync_keys,"Queueing next message now");
       RESCHEDULE(alarm, now, now, TIME_MS_NEVER_WILL);
+    }else if (found && alarm->alarm > now + 5){
+      RESCHEDULE(alarm, now + 5, now + 5, now + 5);
     }
   }else{
     DEBUG(rhizome_sync_keys,"Stop queueing messages");
@@ -1042,8 +1260,10 @@ static void sync_config_changed(){
     unschedule(&ALARM_STRUCT(sync_keys_status));
 
     if (sync_tree){
+      unschedule(&ALARM_STRUCT(sync_build_tree));
       sync_free_state(sync_tree);
       sync_tree = NULL;
+      build_before_rowid = 0;
     }
   }
 }
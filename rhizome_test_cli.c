@@ -0,0 +1,596 @@
+/*
+ Serval DNA - Rhizome testing command line functions
+ Copyright (C) 2026 Serval Project Inc.
+
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU General Public License
+ as published by the Free Software Foundation; either version 2
+ of the License, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include "base64.h"
+#include "cli.h"
+#include "conf.h"
+#include "httpd.h"
+#include "list_writer.h"
+#include "mem.h"
+#include "commandline.h"
+#include "rhizome.h"
+#include "str.h"
+#include "strbuf_helpers.h"
+#include "sync_keys.h"
+
+DEFINE_FEATURE(cli_rhizome_tests);
+
+#define BENCHMARK_SERVICE "benchmark"
+#define BENCHMARK_BATCH 1000
+
+/* Create, sign and return up to 'count' new empty bundles that are not in the store.
+ */
+static unsigned benchmark_manifests(rhizome_manifest **manifests, unsigned count, unsigned first)
+{
+  unsigned i;
+  for (i = 0; i < count; ++i) {
+    rhizome_manifest *m = rhizome_new_manifest();
+    if (!m)
+      break;
+    manifests[i] = m;
+    if (rhizome_manifest_createid(m) == -1)
+      break;
+    rhizome_manifest_set_service(m, BENCHMARK_SERVICE);
+    char name[32];
+    rhizome_manifest_set_name(m, strbuf_str(strbuf_sprintf(strbuf_local_buf(name), "bundle%u", first + i)));
+    rhizome_manifest_set_filesize(m, 0);
+    struct rhizome_bundle_result result = rhizome_fill_manifest(m, NULL);
+    enum rhizome_bundle_status status = result.status;
+    rhizome_bundle_result_free(&result);
+    if (status != RHIZOME_BUNDLE_STATUS_NEW || !rhizome_manifest_validate(m))
+      break;
+    result = rhizome_manifest_seal(m);
+    status = result.status;
+    rhizome_bundle_result_free(&result);
+    if (status != RHIZOME_BUNDLE_STATUS_NEW)
+      break;
+  }
+  if (i < count) {
+    WHYF("Failed to create benchmark bundle %u", first + i);
+    for (; i < count && manifests[i]; ++i)
+      rhizome_manifest_free(manifests[i]);
+    return 0;
+  }
+  return count;
+}
+
+/* Add 'count' new bundles to the store, either one transaction per bundle or in batches, and
+ * return the number of milliseconds spent in the store, not counting the time taken to create and
+ * sign the manifests.
+ */
+static time_ms_t benchmark_ingest(unsigned count, int batched)
+{
+  rhizome_manifest *manifests[BENCHMARK_BATCH];
+  time_ms_t elapsed = 0;
+  unsigned done;
+  for (done = 0; done < count; ) {
+    unsigned n = count - done < BENCHMARK_BATCH ? count - done : BENCHMARK_BATCH;
+    bzero(manifests, sizeof manifests);
+    if (benchmark_manifests(manifests, n, done) != n)
+      return -1;
+    time_ms_t start = gettime_ms();
+    unsigned i;
+    int ret = 0;
+    if (batched) {
+      struct rhizome_ingest batch;
+      if (rhizome_ingest_begin(&batch) == -1)
+	ret = -1;
+      for (i = 0; ret == 0 && i < n; ++i)
+	if (rhizome_ingest_manifest(&batch, manifests[i], NULL) != RHIZOME_BUNDLE_STATUS_NEW) {
+	  rhizome_ingest_rollback(&batch);
+	  ret = -1;
+	}
+      if (ret == 0)
+	ret = rhizome_ingest_commit(&batch);
+    } else {
+      for (i = 0; ret == 0 && i < n; ++i)
+	if (rhizome_add_manifest_to_store(manifests[i], NULL) != RHIZOME_BUNDLE_STATUS_NEW)
+	  ret = -1;
+    }
+    elapsed += gettime_ms() - start;
+    for (i = 0; i < n; ++i)
+      rhizome_manifest_free(manifests[i]);
+    if (ret == -1)
+      return WHY("Failed to store benchmark bundles");
+    done += n;
+  }
+  return elapsed;
+}
+
+DEFINE_CMD(app_rhizome_ingest_test, 0,
+   "Run Rhizome manifest ingestion speed test, using the instance's Rhizome store",
+   "test","rhizome","ingest","[<count>]");
+static int app_rhizome_ingest_test(const struct cli_parsed *parsed, struct cli_context *context)
+{
+  static const unsigned sizes[] = {10000, 100000};
+  const char *count_arg;
+  cli_arg(parsed, "count", &count_arg, cli_uint, NULL);
+  unsigned count = count_arg ? atoi(count_arg) : 0;
+
+  if (rhizome_opendb() == -1)
+    return -1;
+  char mode[16];
+  if (sqlite_exec_strbuf(strbuf_local_buf(mode), "PRAGMA journal_mode;", END) == -1)
+    return -1;
+  cli_printf(context, "Benchmarking manifest ingestion, journal_mode=%s:\n", mode);
+  unsigned j;
+  for (j = 0; j < (count ? 1 : NELS(sizes)); ++j) {
+    unsigned n = count ? count : sizes[j];
+    int batched;
+    for (batched = 0; batched <= 1; ++batched) {
+      time_ms_t elapsed = benchmark_ingest(n, batched);
+      if (sqlite_exec_void("DELETE FROM MANIFESTS WHERE service = ?;", STATIC_TEXT, BENCHMARK_SERVICE, END) == -1
+	|| elapsed == -1)
+	return -1;
+      if (elapsed <= 0)
+	elapsed = 1;
+      cli_printf(context, "%6u bundles - %-20s took %"PRId64"ms - %.0f manifests/second\n",
+	  n, batched ? "batched transactions" : "one transaction each",
+	  (int64_t)elapsed, n * 1000.0 / elapsed);
+    }
+  }
+  return 0;
+}
+
+/* Parse a copy of each manifest, so that none of them have been verified yet.
+ */
+static int benchmark_copy_manifests(rhizome_manifest **copies, rhizome_manifest *const *manifests, unsigned count)
+{
+  unsigned i;
+  for (i = 0; i < count; ++i) {
+    rhizome_manifest *m = copies[i] = rhizome_new_manifest();
+    if (!m)
+      return -1;
+    bcopy(manifests[i]->manifestdata, m->manifestdata, manifests[i]->manifest_all_bytes);
+    m->manifest_all_bytes = manifests[i]->manifest_all_bytes;
+    if (rhizome_manifest_parse(m) == -1 || !rhizome_manifest_validate(m))
+      return WHYF("Failed to parse benchmark manifest %u", i);
+  }
+  return 0;
+}
+
+/* Verify copies of every manifest, either one at a time or in batches, and return the number of
+ * milliseconds spent verifying them.
+ */
+static time_ms_t benchmark_verify(rhizome_manifest *const *manifests, unsigned count, int batched)
+{
+  rhizome_manifest **copies = emalloc_zero(sizeof(rhizome_manifest *) * count);
+  if (!copies)
+    return -1;
+  time_ms_t elapsed = -1;
+  unsigned i;
+  if (benchmark_copy_manifests(copies, manifests, count) != -1) {
+    time_ms_t start = gettime_ms();
+    unsigned verified = 0;
+    if (batched) {
+      for (i = 0; i < count; i += RHIZOME_VERIFY_BATCH)
+	verified += rhizome_manifest_verify_batch(&copies[i], count - i < RHIZOME_VERIFY_BATCH ? count - i : RHIZOME_VERIFY_BATCH);
+    } else {
+      for (i = 0; i < count; ++i)
+	verified += rhizome_manifest_verify(copies[i]);
+    }
+    elapsed = gettime_ms() - start;
+    if (verified != count)
+      elapsed = WHYF("Only %u of %u benchmark manifests verified", verified, count);
+  }
+  for (i = 0; i < count && copies[i]; ++i)
+    rhizome_manifest_free(copies[i]);
+  free(copies);
+  return elapsed;
+}
+
+DEFINE_CMD(app_rhizome_verify_test, 0,
+   "Run Rhizome manifest signature verification speed test",
+   "test","rhizome","verify","[<count>]");
+static int app_rhizome_verify_test(const struct cli_parsed *parsed, struct cli_context *context)
+{
+  const char *count_arg;
+  cli_arg(parsed, "count", &count_arg, cli_uint, NULL);
+  unsigned count = count_arg ? atoi(count_arg) : 1000;
+  if (count == 0)
+    return 0;
+
+  if (rhizome_opendb() == -1)
+    return -1;
+  rhizome_manifest **manifests = emalloc_zero(sizeof(rhizome_manifest *) * count);
+  if (!manifests)
+    return -1;
+  int ret = -1;
+  unsigned created, n;
+  for (created = 0; created < count; created += n) {
+    n = count - created < BENCHMARK_BATCH ? count - created : BENCHMARK_BATCH;
+    if (benchmark_manifests(&manifests[created], n, created) != n)
+      goto end;
+  }
+
+  cli_printf(context, "Benchmarking verification of %u manifests, %u crypto threads:\n", count, config.mdp.crypto_threads);
+  static const char *passes[] = {"one at a time", "in batches", "already cached"};
+  unsigned pass;
+  for (pass = 0; pass < NELS(passes); ++pass) {
+    if (pass < 2)
+      rhizome_signature_cache_clear();
+    bzero(&rhizome_signature_stats, sizeof rhizome_signature_stats);
+    time_ms_t elapsed = benchmark_verify(manifests, count, pass == 1);
+    if (elapsed == -1)
+      goto end;
+    if (elapsed <= 0)
+      elapsed = 1;
+    cli_printf(context, "%-16s took %6"PRId64"ms - %8.0f manifests/second (%u hits, %u misses, %u batched)\n",
+	passes[pass], (int64_t)elapsed, count * 1000.0 / elapsed,
+	rhizome_signature_stats.hits, rhizome_signature_stats.misses, rhizome_signature_stats.batched);
+  }
+  ret = 0;
+end:
+  // a batch that failed to be created has already been freed
+  while (created > 0)
+    rhizome_manifest_free(manifests[--created]);
+  free(manifests);
+  return ret;
+}
+
+/* Return the number of bytes of memory that a parsed manifest occupies, including the strings and
+ * signatories it allocates.
+ */
+static size_t benchmark_manifest_bytes(const rhizome_manifest *m)
+{
+  size_t bytes = sizeof *m;
+  unsigned i;
+  for (i = 0; i < m->var_count; ++i)
+    bytes += strlen(m->vars[i]) + 1 + strlen(m->values[i]) + 1;
+  return bytes + m->sig_count * crypto_sign_PUBLICKEYBYTES;
+}
+
+DEFINE_CMD(app_rhizome_parse_test, 0,
+   "Run Rhizome manifest parsing speed test, comparing full parsing with inspection",
+   "test","rhizome","parse","[<count>]");
+static int app_rhizome_parse_test(const struct cli_parsed *parsed, struct cli_context *context)
+{
+  const char *count_arg;
+  cli_arg(parsed, "count", &count_arg, cli_uint, NULL);
+  unsigned count = count_arg ? atoi(count_arg) : 100000;
+  if (count == 0)
+    return 0;
+
+  if (rhizome_opendb() == -1)
+    return -1;
+  // Parsing speed does not depend on the content, so cycle through one batch of manifests.
+  unsigned n = count < BENCHMARK_BATCH ? count : BENCHMARK_BATCH;
+  rhizome_manifest *manifests[BENCHMARK_BATCH];
+  bzero(manifests, sizeof manifests);
+  if (benchmark_manifests(manifests, n, 0) != n)
+    return -1;
+
+  int ret = -1;
+  unsigned i;
+  cli_printf(context, "Benchmarking parsing of %u manifests:\n", count);
+
+  size_t parsed_bytes = 0;
+  time_ms_t start = gettime_ms();
+  for (i = 0; i < count; ++i) {
+    const rhizome_manifest *src = manifests[i % n];
+    rhizome_manifest *m = rhizome_new_manifest();
+    if (!m)
+      goto end;
+    bcopy(src->manifestdata, m->manifestdata, src->manifest_all_bytes);
+    m->manifest_all_bytes = src->manifest_all_bytes;
+    int valid = rhizome_manifest_parse(m) != -1 && rhizome_manifest_validate(m);
+    if (i < n)
+      parsed_bytes += benchmark_manifest_bytes(m);
+    rhizome_manifest_free(m);
+    if (!valid) {
+      WHYF("Failed to parse benchmark manifest %u", i);
+      goto end;
+    }
+  }
+  time_ms_t elapsed = gettime_ms() - start;
+  if (elapsed <= 0)
+    elapsed = 1;
+  cli_printf(context, "%-16s took %6"PRId64"ms - %9.0f manifests/second, %5zu bytes each\n",
+      "parse+validate", (int64_t)elapsed, count * 1000.0 / elapsed, parsed_bytes / n);
+
+  start = gettime_ms();
+  for (i = 0; i < count; ++i) {
+    const rhizome_manifest *src = manifests[i % n];
+    struct rhizome_manifest_summary summ;
+    int64_t date;
+    if (!rhizome_manifest_inspect((const char *)src->manifestdata, src->manifest_all_bytes, &summ)
+      || summ.filesize == RHIZOME_SIZE_UNSET
+      || !rhizome_manifest_summary_int64(&summ, "date", &date)) {
+      WHYF("Failed to inspect benchmark manifest %u", i);
+      goto end;
+    }
+  }
+  elapsed = gettime_ms() - start;
+  if (elapsed <= 0)
+    elapsed = 1;
+  cli_printf(context, "%-16s took %6"PRId64"ms - %9.0f manifests/second, %5zu bytes each\n",
+      "inspect", (int64_t)elapsed, count * 1000.0 / elapsed, sizeof(struct rhizome_manifest_summary));
+  ret = 0;
+end:
+  for (i = 0; i < n; ++i)
+    rhizome_manifest_free(manifests[i]);
+  return ret;
+}
+
+#define BENCHMARK_LIST_BUFSIZ 8192
+
+struct benchmark_list_output {
+  size_t bytes;
+  size_t flushes;
+  uint32_t checksum;
+};
+
+static void benchmark_list_flush(struct benchmark_list_output *out, const unsigned char *buf, size_t len)
+{
+  size_t i;
+  for (i = 0; i < len; ++i)
+    out->checksum = (out->checksum ^ buf[i]) * 16777619;
+  out->bytes += len;
+  out->flushes++;
+}
+
+/* Render one row the way the RESTful bundle list did before it used a list writer, for comparison.
+ */
+static void benchmark_list_strbuf_row(strbuf b, struct rhizome_list_cursor *c, size_t rowcount, uint64_t *rowid_highest)
+{
+  const struct rhizome_list_row *row = &c->row;
+  const struct rhizome_manifest_summary *summ = &row->summary;
+  sid_t author, sender, recipient;
+  enum rhizome_bundle_authorship authorship = rhizome_list_authorship(c, &author);
+  int64_t date;
+  if (rowcount != 0)
+    strbuf_putc(b, ',');
+  strbuf_puts(b, "\n[");
+  if (row->rowid > *rowid_highest) {
+    strbuf_json_string(b, alloca_list_token(row->rowid));
+    *rowid_highest = row->rowid;
+  } else
+    strbuf_json_null(b);
+  strbuf_sprintf(b, ",%"PRIu64",", row->rowid);
+  strbuf_json_string(b, row->service);
+  strbuf_putc(b, ',');
+  strbuf_json_hex(b, summ->bid.binary, sizeof summ->bid.binary);
+  strbuf_sprintf(b, ",%"PRIu64",", summ->version);
+  if (rhizome_manifest_summary_int64(summ, "date", &date))
+    strbuf_sprintf(b, "%"PRId64, date);
+  else
+    strbuf_json_null(b);
+  strbuf_sprintf(b, ",%"PRItime_ms_t",", row->inserttime);
+  int fromhere = authorship == AUTHOR_AUTHENTIC ? 2 : authorship == AUTHOR_LOCAL ? 1 : 0;
+  if (authorship == AUTHOR_AUTHENTIC || authorship == AUTHOR_LOCAL || authorship == AUTHOR_REMOTE)
+    strbuf_json_hex(b, author.binary, sizeof author.binary);
+  else
+    strbuf_json_null(b);
+  strbuf_sprintf(b, ",%d,%"PRIu64",", fromhere, summ->filesize);
+  strbuf_json_hex(b, summ->filesize && summ->has_filehash ? summ->filehash.binary : NULL, sizeof summ->filehash.binary);
+  strbuf_putc(b, ',');
+  strbuf_json_hex(b, rhizome_manifest_summary_sid(summ, "sender", &sender) ? sender.binary : NULL, sizeof sender.binary);
+  strbuf_putc(b, ',');
+  strbuf_json_hex(b, rhizome_manifest_summary_sid(summ, "recipient", &recipient) ? recipient.binary : NULL, sizeof recipient.binary);
+  strbuf_putc(b, ',');
+  strbuf_json_string(b, row->name);
+  strbuf_puts(b, "]");
+}
+
+/* List every benchmark bundle into a fixed size buffer, as the RESTful bundle list does, and
+ * return the number of milliseconds taken, or -1 on error.  A 'format' of -1 selects the old
+ * strbuf rendering of JSON.
+ */
+static time_ms_t benchmark_list(int format, unsigned count, struct benchmark_list_output *out)
+{
+  unsigned char buf[BENCHMARK_LIST_BUFSIZ];
+  struct rhizome_list_cursor cursor;
+  bzero(&cursor, sizeof cursor);
+  bzero(out, sizeof *out);
+  cursor.service = BENCHMARK_SERVICE;
+  if (rhizome_list_open(&cursor) == -1)
+    return -1;
+  time_ms_t start = gettime_ms();
+  uint64_t rowid_highest = 0;
+  unsigned rows = 0;
+  int n;
+  if (format == -1) {
+    strbuf b = strbuf_local((char *)buf, sizeof buf);
+    strbuf_puts(b, "{\n\"header\":[");
+    unsigned i;
+    for (i = 0; i != RHIZOME_LIST_COLUMNS; ++i) {
+      if (i)
+	strbuf_putc(b, ',');
+      strbuf_json_string(b, rhizome_list_headers[i]);
+    }
+    strbuf_puts(b, "],\n\"rows\":[");
+    while ((n = rhizome_list_next(&cursor)) == 1) {
+      size_t mark = strbuf_len(b);
+      uint64_t highest = rowid_highest;
+      benchmark_list_strbuf_row(b, &cursor, rows, &highest);
+      if (strbuf_overrun(b)) {
+	benchmark_list_flush(out, buf, mark);
+	strbuf_init(b, (char *)buf, sizeof buf);
+	highest = rowid_highest;
+	benchmark_list_strbuf_row(b, &cursor, rows, &highest);
+      }
+      rowid_highest = highest;
+      ++rows;
+    }
+    strbuf_puts(b, "\n]\n}\n");
+    benchmark_list_flush(out, buf, strbuf_len(b));
+  } else {
+    struct list_writer w;
+    lw_init(&w, format, RHIZOME_LIST_COLUMNS);
+    lw_buffer(&w, buf, sizeof buf);
+    lw_start(&w);
+    lw_header(&w, rhizome_list_headers);
+    while ((n = rhizome_list_next(&cursor)) == 1) {
+      uint64_t highest = rowid_highest;
+      rhizome_list_write_row(&w, &cursor, &highest);
+      if (!lw_row_end(&w)) {
+	benchmark_list_flush(out, buf, w.committed);
+	lw_buffer(&w, buf, sizeof buf);
+	highest = rowid_highest;
+	rhizome_list_write_row(&w, &cursor, &highest);
+	lw_row_end(&w);
+      }
+      rowid_highest = highest;
+      ++rows;
+    }
+    lw_trailer(&w);
+    benchmark_list_flush(out, buf, w.committed);
+  }
+  time_ms_t elapsed = gettime_ms() - start;
+  rhizome_list_release(&cursor);
+  if (n == -1)
+    return -1;
+  if (rows != count)
+    return WHYF("Listed %u of %u benchmark bundles", rows, count);
+  return elapsed;
+}
+
+DEFINE_CMD(app_rhizome_list_test, 0,
+   "Run Rhizome bundle list rendering speed test, as JSON and CBOR",
+   "test","rhizome","list","[<count>]");
+static int app_rhizome_list_test(const struct cli_parsed *parsed, struct cli_context *context)
+{
+  const char *count_arg;
+  cli_arg(parsed, "count", &count_arg, cli_uint, NULL);
+  unsigned count = count_arg ? atoi(count_arg) : 100000;
+  if (count == 0)
+    return 0;
+
+  if (rhizome_opendb() == -1)
+    return -1;
+  if (benchmark_ingest(count, 1) == -1)
+    return -1;
+  cli_printf(context, "Benchmarking listing of %u bundles into %u byte buffers:\n", count, BENCHMARK_LIST_BUFSIZ);
+  static const struct { int format; const char *name; } passes[] = {
+    {-1, "strbuf JSON"},
+    {LIST_FORMAT_JSON, "writer JSON"},
+    {LIST_FORMAT_CBOR, "writer CBOR"},
+  };
+  int ret = 0;
+  uint32_t json_checksum = 0;
+  unsigned i;
+  for (i = 0; i < NELS(passes); ++i) {
+    struct benchmark_list_output out;
+    time_ms_t elapsed = benchmark_list(passes[i].format, count, &out);
+    if (elapsed == -1) {
+      ret = -1;
+      break;
+    }
+    if (elapsed <= 0)
+      elapsed = 1;
+    cli_printf(context, "%-12s took %6"PRId64"ms - %8.0f rows/second, %6.1f MB/second, %4zu bytes/row\n",
+	passes[i].name, (int64_t)elapsed, count * 1000.0 / elapsed,
+	out.bytes / 1000.0 / elapsed, out.bytes / count);
+    if (passes[i].format == -1)
+      json_checksum = out.checksum;
+    else if (passes[i].format == LIST_FORMAT_JSON && out.checksum != json_checksum) {
+      ret = WHY("Writer JSON differs from strbuf JSON");
+      break;
+    }
+  }
+  if (sqlite_exec_void("DELETE FROM MANIFESTS WHERE service = ?;", STATIC_TEXT, BENCHMARK_SERVICE, END) == -1)
+    return -1;
+  return ret;
+}
+
+struct sync_sim_node{
+  struct sync_state *state;
+  unsigned found;
+};
+
+static void sync_sim_does_not_have(void *context, void *UNUSED(peer_context), void *UNUSED(key_context), const sync_key_t *UNUSED(key))
+{
+  struct sync_sim_node *node = context;
+  node->found++;
+}
+
+static void sync_sim_random_key(sync_key_t *key)
+{
+  unsigned i;
+  for (i=0;i<KEY_LEN;i++)
+    key->key[i] = random() & 0xFF;
+}
+
+/* Simulate two neighbours that share 'common' keys and each have 'different' keys of their own,
+ * exchanging messages in turn until each has found every key the other is missing.  Return the
+ * number of messages sent, or 0 if they failed to converge.
+ */
+static unsigned sync_simulate(unsigned common, unsigned different, int summary, size_t *bytes)
+{
+  struct sync_sim_node nodes[2];
+  unsigned i, n;
+  for (n=0;n<2;n++){
+    nodes[n].state = sync_alloc_state(&nodes[n], NULL, sync_sim_does_not_have, NULL);
+    nodes[n].found = 0;
+  }
+  for (i=0;i<common + different*2;i++){
+    sync_key_t key;
+    sync_sim_random_key(&key);
+    for (n=0;n<2;n++)
+      if (i<common || (i - common) % 2 == n)
+	sync_add_key(nodes[n].state, &key, NULL);
+  }
+
+  unsigned messages;
+  *bytes = 0;
+  for (messages=0;messages<10000;){
+    struct sync_sim_node *sender = &nodes[messages & 1];
+    struct sync_sim_node *receiver = &nodes[(messages & 1) ^ 1];
+    uint8_t buff[MDP_MTU];
+    // when summaries are enabled, each neighbour introduces itself with one
+    int send_summary = summary && messages < 2;
+    size_t len = send_summary
+      ? sync_build_summary(sender->state, buff, sizeof buff)
+      : sync_build_message(sender->state, buff, sizeof buff);
+    if (send_summary)
+      sync_recv_summary(receiver->state, sender, buff, len);
+    else
+      sync_recv_message(receiver->state, sender, buff, len);
+    messages++;
+    *bytes += len;
+    if (nodes[0].found >= different && nodes[1].found >= different)
+      break;
+  }
+  for (n=0;n<2;n++)
+    sync_free_state(nodes[n].state);
+  return messages<10000 ? messages : 0;
+}
+
+DEFINE_CMD(app_rhizome_sync_test, 0,
+   "Simulate Rhizome sync_keys reconciliation between two neighbours, with and without summaries",
+   "test","rhizome","sync","[<common>]");
+static int app_rhizome_sync_test(const struct cli_parsed *parsed, struct cli_context *context)
+{
+  static const unsigned differences[] = {1, 5, 20, 50, 200};
+  const char *common_arg;
+  cli_arg(parsed, "common", &common_arg, cli_uint, NULL);
+  unsigned common = common_arg ? atoi(common_arg) : 10000;
+
+  srandom(1);
+  cli_printf(context, "Reconciling %u common keys:\n", common);
+  unsigned i;
+  for (i = 0; i < NELS(differences); ++i) {
+    size_t tree_bytes, summary_bytes;
+    unsigned tree = sync_simulate(common, differences[i], 0, &tree_bytes);
+    unsigned summary = sync_simulate(common, differences[i], 1, &summary_bytes);
+    cli_printf(context, "%4u different each - tree: %4u messages %7zu bytes, summary: %4u messages %7zu bytes\n",
+	differences[i], tree, tree_bytes, summary, summary_bytes);
+  }
+  return 0;
+}
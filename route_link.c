@@ -29,6 +29,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include "server.h"
 #include "mdp_client.h"
 #include "route_link.h"
+#include "route_link_test.h"
 
 /*
 Link state routing;
@@ -39,6 +40,8 @@ Link state routing;
 - every heartbeat interval, send link cost details
   - send link cost for every neighbour, they need to know we can still hear them.
 - after parsing incoming link details, if anything has changed, mark routes as dirty
+  - only the routes that pass through a changed link are marked, and if recalculating a route
+    changes the next hop, the routes that depend on it are recalculated in turn
 
 */
 
@@ -59,6 +62,9 @@ struct link{
 
   struct subscriber *transmitter;
   struct link *parent;
+  // other links in this neighbour's tree, which are transmitted by our receiver
+  struct link *first_child;
+  struct link *next_sibling;
   struct network_destination *destination;
   struct subscriber *receiver;
 
@@ -66,7 +72,7 @@ struct link{
   int last_ack_seq;
 
   // neighbour path version when path scores were last updated
-  char path_version;
+  int path_version;
 
   // link quality stats;
   char link_version;
@@ -114,7 +120,7 @@ struct neighbour{
   struct subscriber *subscriber;
 
   // whenever we hear about a link change, update the version to mark all link path scores as dirty
-  char path_version;
+  int path_version;
 
   // when do we assume the link is dead because they stopped hearing us or vice versa?
   time_ms_t link_in_timeout;
@@ -161,11 +167,15 @@ struct link_state{
   // don't use this pointer directly, call find_best_link instead
   struct link *link;
   char calculating;
+  char recalculate;
 
   // when do we need to send a new link state message.
   time_ms_t next_update;
 };
 
+// limit the recursion when a route change forces other routes to be recalculated
+#define MAX_ROUTE_CASCADE 32
+
 DEFINE_ALARM(link_send);
 static int append_link(void **record, void *context);
 static int neighbour_find_best_link(struct neighbour *n);
@@ -173,6 +183,7 @@ static int neighbour_find_best_link(struct neighbour *n);
 struct neighbour *neighbours=NULL;
 unsigned neighbour_count=0;
 int route_version=0;
+struct route_stats route_stats;
 
 struct network_destination * new_destination(struct overlay_interface *interface){
   assert(interface);
@@ -295,6 +306,8 @@ static void free_links(struct link *link)
   free(link);
 }
 
+static void adopt_children(struct link *node, struct link *parent);
+
 static struct link *find_link(struct neighbour *neighbour, struct subscriber *receiver, char create)
 {
   struct link **link_ptr=&neighbour->root, *link=neighbour->root;
@@ -306,6 +319,8 @@ static struct link *find_link(struct neighbour *neighbour, struct subscriber *re
         link->path_version = neighbour->path_version -1;
 	link->last_ack_seq = -1;
 	link->link_version = -1;
+	// we may have already heard about links that are transmitted by this receiver
+	adopt_children(neighbour->root, link);
       }
       break;
     }
@@ -317,16 +332,89 @@ static struct link *find_link(struct neighbour *neighbour, struct subscriber *re
   return link;
 }
 
-static struct link *get_parent(struct neighbour *neighbour, struct link *link)
+static void attach_link(struct link *link, struct link *parent)
 {
-  // root of the routing table.
-  if (link->receiver == neighbour->subscriber || link->transmitter == NULL)
-    return NULL;
+  link->parent = parent;
+  link->next_sibling = parent->first_child;
+  parent->first_child = link;
+}
 
+static void detach_link(struct link *link)
+{
   if (!link->parent)
-    link->parent = find_link(neighbour, link->transmitter, 0);
+    return;
+  struct link **ptr = &link->parent->first_child;
+  while(*ptr && *ptr != link)
+    ptr = &(*ptr)->next_sibling;
+  if (*ptr)
+    *ptr = link->next_sibling;
+  link->next_sibling = NULL;
+  link->parent = NULL;
+}
 
-  return link->parent;
+// find any links that don't have a parent yet, that are transmitted by the receiver of this new link
+static void adopt_children(struct link *node, struct link *parent)
+{
+  if (!node)
+    return;
+  if (!node->parent && node != parent && node->transmitter == parent->receiver)
+    attach_link(node, parent);
+  adopt_children(node->_left, parent);
+  adopt_children(node->_right, parent);
+}
+
+// move this link to its new position in the neighbour's tree
+static void set_transmitter(struct neighbour *neighbour, struct link *link, struct subscriber *transmitter)
+{
+  if (link->transmitter == transmitter && (link->parent || !transmitter))
+    return;
+  detach_link(link);
+  link->transmitter = transmitter;
+  // the root of the routing table has no parent
+  if (transmitter && link->receiver != neighbour->subscriber){
+    struct link *parent = find_link(neighbour, transmitter, 0);
+    if (parent && parent != link)
+      attach_link(link, parent);
+  }
+}
+
+// the route to this subscriber needs to be recalculated
+static void invalidate_route(struct subscriber *subscriber)
+{
+  struct link_state *state = subscriber->link_state;
+  if (!state)
+    return;
+  if (state->calculating){
+    // we're part way through the calculation and may have already used stale information
+    state->recalculate = 1;
+  }else if (state->route_version == route_version){
+    state->route_version = route_version - 1;
+    route_stats.invalidations++;
+  }
+}
+
+// the path to this link has changed, along with every path below it in the neighbour's tree
+static void invalidate_link(struct link *link)
+{
+  // loop prevention
+  if (link->calculating)
+    return;
+  link->calculating = 1;
+  invalidate_route(link->receiver);
+  struct link *child;
+  for (child = link->first_child; child; child = child->next_sibling)
+    invalidate_link(child);
+  link->calculating = 0;
+}
+
+// every route through this neighbour needs to be recalculated
+static void invalidate_neighbour(struct link *node)
+{
+  if (!node)
+    return;
+  invalidate_route(node->receiver);
+  invalidate_neighbour(node->_left);
+  invalidate_neighbour(node->_right);
 }
 
 static void update_path_score(struct neighbour *neighbour, struct link *link){
@@ -344,7 +432,7 @@ static void update_path_score(struct neighbour *neighbour, struct link *link){
       hop_count = 1;
     }
   }else{
-    struct link *parent = get_parent(neighbour, link);
+    struct link *parent = link->parent;
     if (parent && (!parent->calculating)){
       update_path_score(neighbour, parent);
       // TODO more interesting path cost metrics...
@@ -386,6 +474,7 @@ static struct link * find_best_link(struct subscriber *subscriber)
   if (state->calculating)
     RETURN(NULL);
   state->calculating = 1;
+  route_stats.calculations++;
 
   struct neighbour *neighbour = neighbours;
   struct network_destination *destination = NULL;
@@ -431,6 +520,7 @@ next:
   int changed =0;
   if (state->transmitter != transmitter || state->link != best_link)
     changed = 1;
+  struct subscriber *old_next_hop = state->next_hop;
 
   state->next_hop = next_hop;
   state->transmitter = transmitter;
@@ -455,6 +545,32 @@ next:
   if (changed)
     state->next_update = now+5;
 
+  if (state->next_hop != old_next_hop){
+    // Routes to other subscribers, that our neighbours transmit via this subscriber,
+    // are only valid while we route to this subscriber via the same neighbour.
+    // Recalculate them now, unless we are already too deep, then they'll be calculated on demand.
+    static unsigned cascade_depth = 0;
+    cascade_depth++;
+    for (neighbour = neighbours; neighbour; neighbour = neighbour->_next){
+      struct link *link = find_link(neighbour, subscriber, 0);
+      if (!link)
+	continue;
+      struct link *child;
+      for (child = link->first_child; child; child = child->next_sibling){
+	invalidate_route(child->receiver);
+	if (cascade_depth < MAX_ROUTE_CASCADE)
+	  find_best_link(child->receiver);
+      }
+    }
+    cascade_depth--;
+  }
+
+  if (state->recalculate){
+    state->recalculate = 0;
+    state->route_version = route_version - 1;
+    best_link = find_best_link(subscriber);
+  }
+
   RETURN(best_link);
 }
 
@@ -590,6 +706,7 @@ static void free_neighbour(struct neighbour **neighbour_ptr){
     free(l);
   }
   
+  invalidate_neighbour(n->root);
   free_links(n->root);
   n->root=NULL;
   *neighbour_ptr = n->_next;
@@ -640,7 +757,7 @@ static void clean_neighbours(time_ms_t now)
     if (state->next_hop == subscriber && 
 	(n->link_in_timeout < now || !n->links || !alive) && 
 	state->route_version == route_version)
-      route_version++;
+      invalidate_neighbour(n->root);
       
     if (!n->links || !alive){
       free_neighbour(n_ptr);
@@ -761,7 +878,7 @@ int link_destination_has_neighbours(struct network_destination *dest)
 }
 
 static int send_legacy_self_announce_ack(struct neighbour *neighbour, struct link_in *link, time_ms_t now){
-  struct overlay_frame *frame=emalloc_zero(sizeof(struct overlay_frame));
+  struct overlay_frame *frame=op_new();
   frame->type = OF_TYPE_SELFANNOUNCE_ACK;
   frame->ttl = 6;
   frame->destination = neighbour->subscriber;
@@ -849,7 +966,7 @@ static int send_neighbour_link(struct neighbour *n)
     send_legacy_self_announce_ack(n, n->best_link, now);
     n->last_update = now;
   } else {
-    struct overlay_frame *frame = emalloc_zero(sizeof(struct overlay_frame));
+    struct overlay_frame *frame = op_new();
     frame->type=OF_TYPE_DATA;
     frame->source=get_my_subscriber(1);
     frame->ttl=1;
@@ -1559,17 +1676,17 @@ static int link_receive(struct internal_mdp_header *header, struct overlay_buffe
 
     if (link->transmitter != transmitter || link->link_version != version){
       changed = 1;
-      link->transmitter = transmitter;
+      set_transmitter(neighbour, link, transmitter);
       link->link_version = version & 0xFF;
       link->drop_rate = drop_rate;
       // TODO other link attributes...
+      invalidate_link(link);
     }
   }
 
   send_please_explain(&context, myself, header->source);
 
   if (changed){
-    route_version++;
     neighbour->path_version ++;
     if (ALARM_STRUCT(link_send).alarm>now+5){
       RESCHEDULE(&ALARM_STRUCT(link_send), now+5, now+5, now+25);
@@ -1624,7 +1741,7 @@ int link_state_legacy_ack(struct overlay_frame *frame, time_ms_t now)
   if (link->transmitter != get_my_subscriber(1))
     changed = 1;
 
-  link->transmitter = get_my_subscriber(1);
+  set_transmitter(neighbour, link, get_my_subscriber(1));
   link->link_version = 1;
   link->destination = interface->destination;
 
@@ -1639,7 +1756,7 @@ int link_state_legacy_ack(struct overlay_frame *frame, time_ms_t now)
   neighbour->link_in_timeout = now + link->destination->ifconfig.reachable_timeout_ms;
 
   if (changed){
-    route_version++;
+    invalidate_neighbour(neighbour->root);
     neighbour->path_version ++;
     if (ALARM_STRUCT(link_send).alarm>now+5){
       RESCHEDULE(&ALARM_STRUCT(link_send), now+5, now+5, now+25);
@@ -1649,3 +1766,56 @@ int link_state_legacy_ack(struct overlay_frame *frame, time_ms_t now)
   return 0;
 }
 
+/* Apply a single link state record, as if it had been parsed from a link state message sent by
+ * this neighbour. A transmitter of NULL means the receiver is no longer reachable via the neighbour.
+ */
+void link_replay_record(struct subscriber *subscriber, struct subscriber *receiver, struct subscriber *transmitter, int drop_rate)
+{
+  struct subscriber *myself = get_my_subscriber(1);
+  struct neighbour *neighbour = get_neighbour(subscriber, 1);
+
+  if (receiver == subscriber && transmitter == myself)
+    neighbour->link_in_timeout = TIME_MS_NEVER_WILL;
+  else if (transmitter == myself)
+    transmitter = NULL;
+
+  struct link *link = find_link(neighbour, receiver, transmitter?1:0);
+  if (!link)
+    return;
+  if (link->transmitter != transmitter || link->drop_rate != drop_rate){
+    set_transmitter(neighbour, link, transmitter);
+    link->link_version = (link->link_version + 1) & 0xFF;
+    link->drop_rate = drop_rate;
+    invalidate_link(link);
+    neighbour->path_version ++;
+  }
+}
+
+static int update_route(void **record, void *UNUSED(context))
+{
+  struct subscriber *subscriber = *record;
+  find_best_link(subscriber);
+  return 0;
+}
+
+// calculate every route that is out of date, as we would before sending our own link state
+void link_replay_update_routes()
+{
+  enum_subscribers(NULL, update_route, NULL);
+}
+
+// mark every route as out of date, this is what every link change used to do
+void link_replay_invalidate_routes()
+{
+  route_version++;
+}
+
+// forget every neighbour and route
+void link_replay_reset()
+{
+  while(neighbours)
+    free_neighbour(&neighbours);
+  neighbour_count = 0;
+  enum_subscribers(NULL, free_subscriber_link_state, NULL);
+  bzero(&route_stats, sizeof route_stats);
+}
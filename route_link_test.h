@@ -0,0 +1,41 @@
+/*
+Serval DNA link state routing test functions
+Copyright (C) 2026 Serval Project Inc.
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#ifndef __SERVAL_DNA__ROUTE_LINK_TEST_H
+#define __SERVAL_DNA__ROUTE_LINK_TEST_H
+
+/* Hooks into the routing calculations for the "test route" commands, which replay link state
+ * changes without a network.  They are not used by the daemon.
+ */
+
+struct subscriber;
+
+// counters for measuring how much work the routing calculations are doing
+struct route_stats{
+  unsigned calculations;
+  unsigned invalidations;
+};
+extern struct route_stats route_stats;
+
+void link_replay_record(struct subscriber *neighbour, struct subscriber *receiver, struct subscriber *transmitter, int drop_rate);
+void link_replay_update_routes();
+void link_replay_invalidate_routes();
+void link_replay_reset();
+
+#endif
@@ -0,0 +1,353 @@
+/*
+ Serval DNA - Routing testing command line functions
+ Copyright (C) 2026 Serval Project Inc.
+
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU General Public License
+ as published by the Free Software Foundation; either version 2
+ of the License, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <assert.h>
+#include "cli.h"
+#include "conf.h"
+#include "commandline.h"
+#include "keyring.h"
+#include "overlay_address.h"
+#include "route_link.h"
+#include "route_link_test.h"
+#include "server.h"
+#include "str.h"
+#include "mem.h"
+
+DEFINE_FEATURE(cli_route_tests);
+
+/* A link state churn trace is a sequence of records, each describing one link that a neighbour
+ * has told us about, as the neighbour, receiver and transmitter node numbers plus a drop rate.
+ * Node 0 is always this node. After each batch of records there is an update, where we would
+ * recalculate our routing table before sending our own link state message.
+ *
+ * In a trace file each record is one line "<neighbour> <receiver> <transmitter> <drop_rate>",
+ * with "-" as the transmitter of a link that has gone away, and each update is the line "update".
+ */
+
+// the transmitter of a link that has gone away, and the neighbour of an update record
+#define CHURN_NONE 0xFFFF
+#define CHURN_UPDATE 0xFFFE
+
+struct churn_record{
+  uint16_t neighbour;
+  uint16_t receiver;
+  uint16_t transmitter;
+  uint8_t drop_rate;
+};
+
+struct churn_trace{
+  unsigned nodes;
+  unsigned updates;
+  unsigned count;
+  unsigned size;
+  struct churn_record *records;
+};
+
+static void churn_append(struct churn_trace *trace, unsigned neighbour, unsigned receiver, unsigned transmitter, unsigned drop_rate)
+{
+  if (trace->count >= trace->size){
+    trace->size = trace->size ? trace->size * 2 : 1024;
+    trace->records = erealloc(trace->records, trace->size * sizeof(struct churn_record));
+    if (!trace->records)
+      abort();
+  }
+  struct churn_record *r = &trace->records[trace->count++];
+  r->neighbour = neighbour;
+  r->receiver = receiver;
+  r->transmitter = transmitter;
+  r->drop_rate = drop_rate;
+  if (neighbour == CHURN_UPDATE)
+    trace->updates++;
+}
+
+/* Build a random mesh of nodes scattered over a unit square, where nodes can hear each other if
+ * they are close enough, then repeatedly break or repair one link between two nearby nodes.
+ * After each change every neighbour of node 0 advertises the shortest path tree it can see, and
+ * the records in the trace are the differences from the tree it advertised last time.
+ */
+static void churn_generate(struct churn_trace *trace, unsigned nodes, unsigned changes)
+{
+  double *x = emalloc(nodes * sizeof(double));
+  double *y = emalloc(nodes * sizeof(double));
+  uint8_t *edge = emalloc_zero(nodes * nodes);
+  uint8_t *edge_drop = emalloc_zero(nodes * nodes);
+  uint16_t *candidates = emalloc(nodes * nodes * 2 * sizeof(uint16_t));
+  int *advertised = emalloc(nodes * nodes * sizeof(int));
+  uint8_t *advertised_drop = emalloc_zero(nodes * nodes);
+  int *parent = emalloc(nodes * sizeof(int));
+  unsigned *queue = emalloc(nodes * sizeof(unsigned));
+  uint8_t *neighbour = emalloc_zero(nodes);
+  if (!x || !y || !edge || !edge_drop || !candidates || !advertised || !advertised_drop || !parent || !queue || !neighbour)
+    abort();
+
+  unsigned i, j, candidate_count = 0;
+  // about 6 neighbours per node, compare squared distances to avoid a dependency on libm
+  double radius2 = 6.0 / (3.14159265 * nodes);
+  for (i = 0; i < nodes; i++){
+    x[i] = (double)random() / RAND_MAX;
+    y[i] = (double)random() / RAND_MAX;
+  }
+  for (i = 0; i < nodes; i++){
+    for (j = 0; j < i; j++){
+      double d2 = (x[i]-x[j])*(x[i]-x[j]) + (y[i]-y[j])*(y[i]-y[j]);
+      if (d2 > radius2 * 2.25)
+	continue;
+      candidates[candidate_count*2] = i;
+      candidates[candidate_count*2+1] = j;
+      candidate_count++;
+      uint8_t drop = (random() % 5) ? 0 : 3 + random() % 10;
+      edge_drop[i*nodes+j] = edge_drop[j*nodes+i] = drop;
+      if (d2 <= radius2)
+	edge[i*nodes+j] = edge[j*nodes+i] = 1;
+    }
+  }
+  for (i = 0; i < nodes * nodes; i++)
+    advertised[i] = -1;
+
+  trace->nodes = nodes;
+  unsigned change;
+  for (change = 0; change <= changes; change++){
+    if (change > 0 && candidate_count > 0){
+      unsigned c = random() % candidate_count;
+      unsigned a = candidates[c*2], b = candidates[c*2+1];
+      edge[a*nodes+b] = edge[b*nodes+a] = !edge[a*nodes+b];
+    }
+    unsigned n;
+    for (n = 1; n < nodes; n++){
+      if (!edge[n]){
+	if (neighbour[n])
+	  churn_append(trace, n, n, CHURN_NONE, 0);
+	neighbour[n] = 0;
+	continue;
+      }
+      if (!neighbour[n])
+	churn_append(trace, n, n, 0, edge_drop[n]);
+      neighbour[n] = 1;
+
+      // breadth first search from this neighbour
+      for (i = 0; i < nodes; i++)
+	parent[i] = -1;
+      unsigned head = 0, tail = 0;
+      queue[tail++] = n;
+      parent[n] = n;
+      while (head < tail){
+	unsigned from = queue[head++];
+	for (i = 0; i < nodes; i++){
+	  if (edge[from*nodes+i] && parent[i] == -1){
+	    parent[i] = from;
+	    queue[tail++] = i;
+	  }
+	}
+      }
+
+      int *adv = &advertised[n*nodes];
+      uint8_t *adv_drop = &advertised_drop[n*nodes];
+      for (i = 1; i < nodes; i++){
+	if (i == n)
+	  continue;
+	uint8_t drop = parent[i] == -1 ? 0 : edge_drop[parent[i]*nodes+i];
+	if (adv[i] == parent[i] && adv_drop[i] == drop)
+	  continue;
+	adv[i] = parent[i];
+	adv_drop[i] = drop;
+	churn_append(trace, n, i, parent[i] == -1 ? CHURN_NONE : (unsigned)parent[i], drop);
+      }
+    }
+    churn_append(trace, CHURN_UPDATE, 0, 0, 0);
+  }
+
+  free(x);
+  free(y);
+  free(edge);
+  free(edge_drop);
+  free(candidates);
+  free(advertised);
+  free(advertised_drop);
+  free(parent);
+  free(queue);
+  free(neighbour);
+}
+
+static int churn_write(const struct churn_trace *trace, const char *path)
+{
+  FILE *f = fopen(path, "w");
+  if (!f)
+    return WHYF_perror("fopen(%s, \"w\")", alloca_str_toprint(path));
+  fprintf(f, "nodes %u\n", trace->nodes);
+  unsigned i;
+  for (i = 0; i < trace->count; i++){
+    const struct churn_record *r = &trace->records[i];
+    if (r->neighbour == CHURN_UPDATE)
+      fprintf(f, "update\n");
+    else if (r->transmitter == CHURN_NONE)
+      fprintf(f, "%u %u - %u\n", r->neighbour, r->receiver, r->drop_rate);
+    else
+      fprintf(f, "%u %u %u %u\n", r->neighbour, r->receiver, r->transmitter, r->drop_rate);
+  }
+  if (fclose(f) == EOF)
+    return WHYF_perror("fclose(%s)", alloca_str_toprint(path));
+  return 0;
+}
+
+static int churn_read(struct churn_trace *trace, const char *path)
+{
+  FILE *f = fopen(path, "r");
+  if (!f)
+    return WHYF_perror("fopen(%s, \"r\")", alloca_str_toprint(path));
+  char line[80];
+  unsigned lineno = 0;
+  int ret = 0;
+  while (fgets(line, sizeof line, f)){
+    lineno++;
+    unsigned neighbour, receiver, transmitter, drop_rate;
+    if (strcmp(line, "update\n") == 0)
+      churn_append(trace, CHURN_UPDATE, 0, 0, 0);
+    else if (sscanf(line, "nodes %u", &trace->nodes) == 1 && trace->nodes < CHURN_UPDATE)
+      ;
+    else if (sscanf(line, "%u %u - %u", &neighbour, &receiver, &drop_rate) == 3
+	  && neighbour < trace->nodes && receiver < trace->nodes)
+      churn_append(trace, neighbour, receiver, CHURN_NONE, drop_rate);
+    else if (sscanf(line, "%u %u %u %u", &neighbour, &receiver, &transmitter, &drop_rate) == 4
+	  && neighbour < trace->nodes && receiver < trace->nodes && transmitter < trace->nodes)
+      churn_append(trace, neighbour, receiver, transmitter, drop_rate);
+    else{
+      ret = WHYF("%s:%u: malformed churn record", path, lineno);
+      break;
+    }
+  }
+  fclose(f);
+  return ret;
+}
+
+/* Replay the trace against the real routing table, and return a checksum of every route after
+ * every update. If 'full' is set every route is recalculated at every update.
+ */
+static uint32_t churn_replay(const struct churn_trace *trace, struct subscriber **subscribers, int full,
+  struct route_stats *stats, time_ms_t *elapsed)
+{
+  link_replay_reset();
+  uint32_t checksum = 0;
+  time_ms_t start = gettime_ms();
+  unsigned i, updates = 0;
+  for (i = 0; i < trace->count; i++){
+    const struct churn_record *r = &trace->records[i];
+    if (r->neighbour != CHURN_UPDATE){
+      link_replay_record(subscribers[r->neighbour], subscribers[r->receiver],
+	r->transmitter == CHURN_NONE ? NULL : subscribers[r->transmitter], r->drop_rate);
+      continue;
+    }
+    if (full)
+      link_replay_invalidate_routes();
+    link_replay_update_routes();
+    unsigned n;
+    for (n = 1; n < trace->nodes; n++){
+      const struct subscriber *s = subscribers[n];
+      checksum = checksum * 31 + s->reachable;
+      checksum = checksum * 31 + s->hop_count;
+      checksum = checksum * 31 + (s->next_hop ? s->next_hop->sid.binary[0] << 8 | s->next_hop->sid.binary[1] : 0);
+    }
+    // the first update loads the initial topology, only measure the churn that follows
+    if (updates++ == 0){
+      bzero(&route_stats, sizeof route_stats);
+      start = gettime_ms();
+    }
+  }
+  *elapsed = gettime_ms() - start;
+  *stats = route_stats;
+  return checksum;
+}
+
+DEFINE_CMD(app_route_churn_test, 0,
+   "Replay link state churn through the routing table, comparing incremental and full route calculation",
+   "test","route","churn","[--nodes=<count>]","[--changes=<count>]","[--record=<file>]","[<file>]");
+static int app_route_churn_test(const struct cli_parsed *parsed, struct cli_context *context)
+{
+  const char *nodes_arg, *changes_arg, *record, *path;
+  cli_arg(parsed, "--nodes", &nodes_arg, cli_uint, NULL);
+  cli_arg(parsed, "--changes", &changes_arg, cli_uint, NULL);
+  cli_arg(parsed, "--record", &record, NULL, NULL);
+  cli_arg(parsed, "file", &path, NULL, NULL);
+  unsigned nodes = nodes_arg ? atoi(nodes_arg) : 200;
+  unsigned changes = changes_arg ? atoi(changes_arg) : 2000;
+  if (nodes < 2 || nodes >= CHURN_UPDATE)
+    return WHYF("Invalid number of nodes %u", nodes);
+
+  struct churn_trace trace;
+  bzero(&trace, sizeof trace);
+  int ret = -1;
+  struct subscriber **subscribers = NULL;
+  if (path){
+    if (churn_read(&trace, path) == -1)
+      goto end;
+  }else{
+    srandom(1);
+    churn_generate(&trace, nodes, changes);
+  }
+  if (record && churn_write(&trace, record) == -1)
+    goto end;
+
+  // routing needs our own identity, which is only available to a running daemon
+  assert(keyring == NULL);
+  if (!(keyring = keyring_open_instance_cli(parsed)))
+    goto end;
+  serverMode = SERVER_RUNNING;
+  subscribers = emalloc_zero(trace.nodes * sizeof(struct subscriber *));
+  if (!subscribers)
+    goto end;
+  if (!(subscribers[0] = get_my_subscriber(1)))
+    goto end;
+  unsigned i;
+  for (i = 1; i < trace.nodes; i++){
+    uint8_t sid[SID_SIZE];
+    uint32_t h = i * 2654435761u;
+    unsigned j;
+    for (j = 0; j < SID_SIZE; j++){
+      h ^= h << 13;
+      h ^= h >> 17;
+      h ^= h << 5;
+      sid[j] = h;
+    }
+    subscribers[i] = find_subscriber(sid, SID_SIZE, 1);
+    if (!subscribers[i])
+      goto end;
+    // don't try to ask anyone for their public keys
+    subscribers[i]->id_valid = 1;
+  }
+
+  cli_printf(context, "Replaying %u link records and %u updates over %u nodes:\n",
+    trace.count - trace.updates, trace.updates, trace.nodes);
+  struct route_stats incremental_stats, full_stats;
+  time_ms_t incremental_ms, full_ms;
+  uint32_t incremental = churn_replay(&trace, subscribers, 0, &incremental_stats, &incremental_ms);
+  uint32_t full = churn_replay(&trace, subscribers, 1, &full_stats, &full_ms);
+  cli_printf(context, "incremental: %9u route calculations, %8u invalidations, %6"PRId64"ms\n",
+    incremental_stats.calculations, incremental_stats.invalidations, incremental_ms);
+  cli_printf(context, "full:        %9u route calculations, %8s invalidations, %6"PRId64"ms\n",
+    full_stats.calculations, "-", full_ms);
+  cli_printf(context, "routes %s\n", incremental == full ? "match" : "DIFFER");
+  link_replay_reset();
+  ret = incremental == full ? 0 : 1;
+
+end:
+  release_my_subscriber();
+  serverMode = SERVER_NOT_RUNNING;
+  free(subscribers);
+  free(trace.records);
+  return ret;
+}
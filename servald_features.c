@@ -46,9 +46,11 @@ void servald_features()
   USE_FEATURE(mdp_binding_MDP_PORT_VOMP);
   USE_FEATURE(mdp_binding_MDP_PORT_RHIZOME_SYNC);
   USE_FEATURE(mdp_binding_MDP_PORT_RHIZOME_SYNC_KEYS);
+  USE_FEATURE(mdp_binding_MDP_PORT_RHIZOME_SYNC_SUMMARY);
   USE_FEATURE(mdp_binding_MDP_PORT_RHIZOME_REQUEST);
   USE_FEATURE(mdp_binding_MDP_PORT_RHIZOME_RESPONSE);
   USE_FEATURE(mdp_binding_MDP_PORT_RHIZOME_MANIFEST_REQUEST);
+  USE_FEATURE(mdp_binding_MDP_PORT_RHIZOME_CHUNK_REQUEST);
 
   USE_FEATURE(http_server);
   USE_FEATURE(http_rhizome);
@@ -357,6 +357,116 @@ ssize_t _recv_message(struct __sourceloc __whence, int fd, struct socket_address
   return _recv_message_frag(__whence, fd, address, ttl, &data);
 }
 
+/* Send the messages in the batch from 'offset' onwards, stopping at the first one that fails.
+ * Returns the number of messages sent, or -1 if the first one could not be sent, with errno set.
+ */
+int _send_messages(struct __sourceloc __whence, int fd, struct message_batch *batch, unsigned offset)
+{
+  assert(offset < batch->count);
+#ifdef HAVE_SENDMMSG
+  struct mmsghdr msgs[MAX_MESSAGE_BATCH];
+  bzero(msgs, sizeof msgs);
+  unsigned i;
+  for (i = offset; i < batch->count; i++){
+    struct msghdr *hdr = &msgs[i - offset].msg_hdr;
+    hdr->msg_name = (void *)&batch->address[i].addr;
+    hdr->msg_namelen = batch->address[i].addrlen;
+    hdr->msg_iov = &batch->iov[i];
+    hdr->msg_iovlen = 1;
+  }
+  int ret = sendmmsg(fd, msgs, batch->count - offset, 0);
+  DEBUGF(verbose_io, "sendmmsg(%d, %u) -> %d", fd, batch->count - offset, ret);
+  return ret;
+#else
+  struct msghdr hdr={
+    .msg_name=(void *)&batch->address[offset].addr,
+    .msg_namelen=batch->address[offset].addrlen,
+    .msg_iov=&batch->iov[offset],
+    .msg_iovlen=1,
+  };
+  ssize_t ret = sendmsg(fd, &hdr, 0);
+  DEBUGF(verbose_io, "sendmsg(%d, %s) -> %zd", fd, alloca_socket_address(&batch->address[offset]), ret);
+  return ret == -1 ? -1 : 1;
+#endif
+}
+
+/* Receive up to 'count' datagrams that are already waiting, into the buffers described by the
+ * batch iov[] entries. Returns the number of datagrams received, with their lengths and source
+ * addresses in the batch, 0 if nothing was waiting, or -1 on error.  Datagrams that are too long
+ * for their buffer are logged and dropped, and the rest are moved up to fill their places.
+ */
+int _recv_messages(struct __sourceloc __whence, int fd, struct message_batch *batch, unsigned count)
+{
+  assert(count <= MAX_MESSAGE_BATCH);
+  batch->count = 0;
+  bzero(batch->address, sizeof(struct socket_address) * count);
+#ifdef HAVE_RECVMMSG
+  struct mmsghdr msgs[MAX_MESSAGE_BATCH];
+  bzero(msgs, sizeof msgs);
+  unsigned i;
+  for (i = 0; i < count; i++){
+    struct msghdr *hdr = &msgs[i].msg_hdr;
+    hdr->msg_name = (void *)&batch->address[i].addr;
+    hdr->msg_namelen = sizeof batch->address[i].raw;
+    hdr->msg_iov = &batch->iov[i];
+    hdr->msg_iovlen = 1;
+  }
+  int ret = recvmmsg(fd, msgs, count, MSG_DONTWAIT, NULL);
+  if (ret == -1){
+    if (errno == EAGAIN || errno == EWOULDBLOCK)
+      return 0;
+    return WHYF_perror("recvmmsg(%d, %u)", fd, count);
+  }
+  for (i = 0; i < (unsigned)ret; i++){
+    unsigned n = batch->count;
+    batch->address[i].addrlen = msgs[i].msg_hdr.msg_namelen;
+    if (msgs[i].msg_hdr.msg_flags & MSG_TRUNC){
+      WHYF("Dropped datagram from %s, longer than the %zu byte buffer",
+	alloca_socket_address(&batch->address[i]), batch->iov[i].iov_len);
+      continue;
+    }
+    // keep the messages that were received whole at the start of the batch
+    if (n != i){
+      struct iovec iov = batch->iov[n];
+      batch->iov[n] = batch->iov[i];
+      batch->iov[i] = iov;
+      batch->address[n] = batch->address[i];
+    }
+    batch->length[n] = msgs[i].msg_len;
+    batch->count++;
+  }
+  DEBUGF(verbose_io, "recvmmsg(%d, %u) -> %d", fd, count, ret);
+#else
+  while (batch->count < count){
+    unsigned i = batch->count;
+    struct msghdr hdr = {
+      .msg_name       = (void *)&batch->address[i].addr,
+      .msg_namelen    = sizeof batch->address[i].raw,
+      .msg_iov        = &batch->iov[i],
+      .msg_iovlen     = 1,
+    };
+    ssize_t ret = recvmsg(fd, &hdr, MSG_DONTWAIT);
+    if (ret == -1){
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+	break;
+      if (batch->count)
+	break;
+      return WHYF_perror("recvmsg(%d)", fd);
+    }
+    batch->address[i].addrlen = hdr.msg_namelen;
+    if (hdr.msg_flags & MSG_TRUNC){
+      WHYF("Dropped datagram from %s, longer than the %zu byte buffer",
+	alloca_socket_address(&batch->address[i]), batch->iov[i].iov_len);
+      continue;
+    }
+    batch->length[i] = ret;
+    batch->count++;
+  }
+  DEBUGF(verbose_io, "recvmsg(%d) -> %u messages", fd, batch->count);
+#endif
+  return batch->count;
+}
+
 int socket_resolve_name(int family, const char *name, const char *service, struct socket_address *address){
   int ret=-1;
   struct addrinfo hint={
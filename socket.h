@@ -90,8 +90,24 @@ ssize_t _send_message(struct __sourceloc, int fd, const struct socket_address *a
 ssize_t _recv_message_frag(struct __sourceloc, int fd, struct socket_address *address, int *ttl, struct fragmented_data *data);
 ssize_t _recv_message(struct __sourceloc __whence, int fd, struct socket_address *address, int *ttl, unsigned char *buffer, size_t buflen);
 
+/* A batch of datagrams that can be sent or received with a single system call, where the
+ * platform allows it.
+ */
+#define MAX_MESSAGE_BATCH 16
+struct message_batch{
+  unsigned count;
+  struct socket_address address[MAX_MESSAGE_BATCH];
+  struct iovec iov[MAX_MESSAGE_BATCH];
+  size_t length[MAX_MESSAGE_BATCH];
+};
+
+int _send_messages(struct __sourceloc, int fd, struct message_batch *batch, unsigned offset);
+int _recv_messages(struct __sourceloc, int fd, struct message_batch *batch, unsigned count);
+
 #define send_message(fd, address, data)      _send_message(__WHENCE__, (fd), (address), (data))
 #define recv_message_frag(fd, address, ttl, data) _recv_message(__WHENCE__, (fd), (address), (ttl), (data))
 #define recv_message(fd, address, ttl, buf, len) _recv_message(__WHENCE__, (fd), (address), (ttl), (buf), (len))
+#define send_messages(fd, batch, offset)     _send_messages(__WHENCE__, (fd), (batch), (offset))
+#define recv_messages(fd, batch, count)      _recv_messages(__WHENCE__, (fd), (batch), (count))
 
 #endif // __SERVAL_DNA___SOCKET_H
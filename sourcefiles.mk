@@ -16,6 +16,7 @@ SERVAL_CLIENT_SOURCES = \
 	fdqueue.c \
         instance.c \
 	limit.c \
+	list_writer.c \
 	logMessage.c \
 	log_cli.c \
 	log_context.c \
@@ -25,6 +26,7 @@ SERVAL_CLIENT_SOURCES = \
 	numeric_str.c \
 	os.c \
 	performance_timing.c \
+	pool.c \
 	rotbuf.c \
 	sighandlers.c \
 	socket.c \
@@ -51,6 +53,7 @@ SERVAL_DAEMON_SOURCES = \
 	servald_main.c \
         conf_cli.c \
 	crypto.c \
+	crypto_workers.c \
 	directory_client.c \
 	dna_helper.c \
 	golay.c \
@@ -98,6 +101,7 @@ SERVAL_DAEMON_SOURCES = \
 	route_link.c \
 	rhizome.c \
 	rhizome_bundle.c \
+	rhizome_chunk.c \
 	rhizome_crypto.c \
 	rhizome_database.c \
 	overlay_mdp_rhizome.c \
@@ -112,6 +116,11 @@ SERVAL_DAEMON_SOURCES = \
 	rhizome_sync_keys.c \
 	rhizome_restful.c \
 	rhizome_cli.c \
+	rhizome_test_cli.c \
+	route_test_cli.c \
+	overlay_test_cli.c \
+	http_test_cli.c \
+	keyring_test_cli.c \
 	sync_keys.c \
 	serval_packetvisualise.c \
 	server.c \
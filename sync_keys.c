@@ -36,6 +36,23 @@ typedef struct {
 #define QUEUED 2
 #define DONT_SEND 3
 
+// definitions for the summary of a set of keys, an invertible bloom lookup table (IBLT).
+// Each key is XOR'd into one cell of each table, so a peer can subtract our summary from theirs
+// and "peel" out every key that is in only one of the sets, provided there aren't too many.
+// The tables can be folded in half without rehashing, so smaller summaries can be sent.
+
+#define SUMMARY_TABLES 3
+#define SUMMARY_MAX_BITS 5
+#define SUMMARY_CELLS (1<<SUMMARY_MAX_BITS)
+#define SUMMARY_CELL_BYTES (KEY_LEN + 3)
+#define SUMMARY_BYTES(BITS) ((size_t)(1 + SUMMARY_TABLES * (1<<(BITS)) * SUMMARY_CELL_BYTES))
+
+struct summary_cell{
+  int count;
+  sync_key_t key;
+  uint16_t check;
+};
+
 struct node{
   struct node *transmit_next;
   struct node *transmit_prev;
@@ -66,9 +83,13 @@ struct sync_state{
   unsigned received_record_count;
   unsigned received_uninteresting;
   unsigned progress;
+  unsigned sent_summaries;
+  unsigned received_summaries;
+  unsigned decoded_summaries;
   struct sync_peer_state *peers;
   struct node *root;
   struct node *transmit_ptr;
+  struct summary_cell summary[SUMMARY_TABLES][SUMMARY_CELLS];
 };
 
 
@@ -111,6 +132,43 @@ static uint8_t sync_get_bits(uint8_t offset, uint8_t len, const sync_key_t *key)
   return (context >> (16 - (offset & 7) - len)) & ((1<<len) -1);
 }
 
+// keys are already uniformly distributed, so we only need to mix the bits a little
+// to derive independent cell indexes and a check value for each key
+static const uint64_t summary_seeds[SUMMARY_TABLES+1] = {
+  0x9E3779B97F4A7C15ull, 0xC2B2AE3D27D4EB4Full, 0x165667B19E3779F9ull, 0xD6E8FEB86659FD93ull
+};
+
+static uint64_t summary_hash(const sync_key_t *key, unsigned seed)
+{
+  uint64_t v=0;
+  unsigned i;
+  for (i=0;i<KEY_LEN;i++)
+    v = (v<<8) | key->key[i];
+  v *= summary_seeds[seed];
+  return v ^ (v >> 29);
+}
+
+#define summary_index(K,T) ((unsigned)(summary_hash((K),(T)) >> 40) & (SUMMARY_CELLS - 1))
+#define summary_check(K) ((uint16_t)(summary_hash((K),SUMMARY_TABLES) >> 48))
+
+static void summary_cell_toggle(struct summary_cell *cell, const sync_key_t *key, uint16_t check, int count)
+{
+  unsigned i;
+  cell->count += count;
+  for (i=0;i<KEY_LEN;i++)
+    cell->key.key[i] ^= key->key[i];
+  cell->check ^= check;
+}
+
+// add or remove a key from a summary with SUMMARY_CELLS cells per table
+static void summary_toggle(struct summary_cell summary[SUMMARY_TABLES][SUMMARY_CELLS], const sync_key_t *key, int count)
+{
+  uint16_t check = summary_check(key);
+  unsigned t;
+  for (t=0;t<SUMMARY_TABLES;t++)
+    summary_cell_toggle(&summary[t][summary_index(key, t)], key, check, count);
+}
+
 #define MIN_VAL(X,Y) ((X)<(Y)?(X):(Y))
 #define MAX_VAL(X,Y) ((X)<(Y)?(Y):(X))
 
@@ -368,6 +426,7 @@ void sync_add_key(struct sync_state *state, const sync_key_t *key, void *context
   state->key_count++;
   state->progress=0;
   add_key(&state->root, key, context, 1);
+  summary_toggle(state->summary, key, 1);
   
   struct sync_peer_state *peer_state = state->peers;
   while(peer_state){
@@ -855,8 +914,7 @@ static int recv_key(struct sync_state *state, struct sync_peer_state *peer_state
   }
 }
 
-// Process all incoming messages from this packet buffer
-int sync_recv_message(struct sync_state *state, void *peer_context, const uint8_t *buff, size_t len)
+static struct sync_peer_state *find_peer_state(struct sync_state *state, void *peer_context)
 {
   assert(peer_context);
   
@@ -871,6 +929,13 @@ int sync_recv_message(struct sync_state *state, void *peer_context, const uint8_
     peer_state->next = state->peers;
     state->peers = peer_state;
   }
+  return peer_state;
+}
+
+// Process all incoming messages from this packet buffer
+int sync_recv_message(struct sync_state *state, void *peer_context, const uint8_t *buff, size_t len)
+{
+  struct sync_peer_state *peer_state = find_peer_state(state, peer_context);
   
   size_t offset=0;
   if (len%MESSAGE_BYTES)
@@ -893,6 +958,130 @@ int sync_recv_message(struct sync_state *state, void *peer_context, const uint8_
   return 0;
 }
 
+// Write the largest summary of all our keys that fits in the buffer, returns packet length
+size_t sync_build_summary(struct sync_state *state, uint8_t *buff, size_t len)
+{
+  int bits = SUMMARY_MAX_BITS;
+  while(bits>=0 && SUMMARY_BYTES(bits) > len)
+    bits--;
+  if (bits<0)
+    return 0;
+  
+  unsigned cells = 1<<bits;
+  size_t offset=0;
+  buff[offset++] = bits;
+  
+  unsigned t, i, j;
+  for (t=0;t<SUMMARY_TABLES;t++){
+    for (i=0;i<cells;i++){
+      // fold the remaining cells of the table into this one
+      struct summary_cell cell = state->summary[t][i];
+      for (j=i+cells;j<SUMMARY_CELLS;j+=cells)
+	summary_cell_toggle(&cell, &state->summary[t][j].key, state->summary[t][j].check, state->summary[t][j].count);
+      buff[offset++] = cell.count & 0xFF;
+      memcpy(&buff[offset], cell.key.key, KEY_LEN);
+      offset+=KEY_LEN;
+      buff[offset++] = cell.check >> 8;
+      buff[offset++] = cell.check & 0xFF;
+    }
+  }
+  state->sent_summaries++;
+  return offset;
+}
+
+// Process a summary of all of a peer's keys.
+// If we can decode every difference between their keys and ours, the peer's state is updated as if
+// we had worked out those differences by exchanging tree messages. Returns 1 in that case,
+// 0 if there were too many differences to decode, or -1 if the summary was malformed.
+int sync_recv_summary(struct sync_state *state, void *peer_context, const uint8_t *buff, size_t len)
+{
+  if (len<1 || buff[0] > SUMMARY_MAX_BITS || len != SUMMARY_BYTES(buff[0]))
+    return WHYF("Malformed summary (len = %u)", (unsigned)len);
+  
+  struct sync_peer_state *peer_state = find_peer_state(state, peer_context);
+  state->received_summaries++;
+  
+  unsigned bits = buff[0];
+  unsigned cells = 1<<bits;
+  struct summary_cell diff[SUMMARY_TABLES][SUMMARY_CELLS];
+  size_t offset=1;
+  unsigned t, i, j;
+  
+  // subtract our folded summary from theirs
+  for (t=0;t<SUMMARY_TABLES;t++){
+    for (i=0;i<cells;i++){
+      struct summary_cell *cell = &diff[t][i];
+      int count = buff[offset++];
+      memcpy(cell->key.key, &buff[offset], KEY_LEN);
+      offset+=KEY_LEN;
+      cell->check = (buff[offset]<<8) | buff[offset+1];
+      offset+=2;
+      for (j=i;j<SUMMARY_CELLS;j+=cells){
+	count -= state->summary[t][j].count;
+	summary_cell_toggle(cell, &state->summary[t][j].key, state->summary[t][j].check, 0);
+      }
+      // counts are only sent modulo 256, but the difference should be small
+      cell->count = (int8_t)(count & 0xFF);
+    }
+  }
+  
+  // peel out every cell that contains exactly one key, until none are left
+  struct{
+    sync_key_t key;
+    int theirs;
+  } found[SUMMARY_TABLES * SUMMARY_CELLS];
+  unsigned found_count=0;
+  int progress=1;
+  while(progress){
+    progress=0;
+    for (t=0;t<SUMMARY_TABLES;t++){
+      for (i=0;i<cells;i++){
+	struct summary_cell *cell = &diff[t][i];
+	if ((cell->count!=1 && cell->count!=-1)
+	  || cell->check != summary_check(&cell->key)
+	  || (summary_index(&cell->key, t) & (cells - 1)) != i
+	  || found_count >= NELS(found))
+	  continue;
+	sync_key_t key = cell->key;
+	int count = cell->count;
+	found[found_count].key = key;
+	found[found_count].theirs = count>0;
+	found_count++;
+	unsigned k;
+	for (k=0;k<SUMMARY_TABLES;k++)
+	  summary_cell_toggle(&diff[k][summary_index(&key, k) & (cells - 1)], &key, summary_check(&key), -count);
+	progress=1;
+      }
+    }
+  }
+  
+  // anything left over means there were too many differences, fall back to tree messages
+  for (t=0;t<SUMMARY_TABLES;t++){
+    for (i=0;i<cells;i++){
+      if (diff[t][i].count || diff[t][i].check)
+	return 0;
+      for (j=0;j<KEY_LEN;j++)
+	if (diff[t][i].key.key[j])
+	  return 0;
+    }
+  }
+  
+  state->decoded_summaries++;
+  for (i=0;i<found_count;i++){
+    key_message_t message = MESSAGE_FROM_KEY(&found[i].key);
+    message.stored = 1;
+    struct node *node = (struct node *)find_message(state->root, &message);
+    if (found[i].theirs){
+      if (!node)
+	peer_add_key(state, peer_state, &message);
+    }else if(node){
+      if (peer_is_missing(state, peer_state, node, 0))
+	queue_node(state, node, 1);
+    }
+  }
+  return 1;
+}
+
 static void enum_diffs(struct sync_state *state, struct sync_peer_state *peer_state, struct node *node, 
   void (*callback)(void *context, void *peer_context, const sync_key_t *key, uint8_t theirs))
 {
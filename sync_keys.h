@@ -41,6 +41,14 @@ size_t sync_build_message(struct sync_state *state, uint8_t *buff, size_t len);
 // process a message received from a peer.
 int sync_recv_message(struct sync_state *state, void *peer_context, const uint8_t *buff, size_t len);
 
+// ask for a summary of all of our keys to be inserted into buff, returns packet length
+// peers with only a few differences can find all of them from a single summary
+size_t sync_build_summary(struct sync_state *state, uint8_t *buff, size_t len);
+
+// process a summary received from a peer
+// returns 1 if all differences were found, 0 if there were too many, -1 if malformed
+int sync_recv_summary(struct sync_state *state, void *peer_context, const uint8_t *buff, size_t len);
+
 void sync_enum_differences(struct sync_state *state, 
   void (*callback)(void *context, void *peer_context, const sync_key_t *key, uint8_t theirs));
 
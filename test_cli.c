@@ -18,12 +18,15 @@
  */
 
 #include <stdlib.h>
+#include <string.h>
+#include <assert.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <poll.h>
 #include <sys/stat.h>
+#include <sys/resource.h>
 
 #include "cli.h"
 #include "serval_types.h"
@@ -33,6 +36,8 @@
 #include "commandline.h"
 #include "mem.h"
 #include "str.h"
+#include "fdqueue.h"
+#include "nibble_tree.h"
 
 DEFINE_FEATURE(cli_tests);
 
@@ -250,6 +255,210 @@ static int app_mem_test(const struct cli_parsed *UNUSED(parsed), struct cli_cont
   return 0;
 }
 
+static unsigned fdqueue_test_wakeups;
+static void fdqueue_test_read(struct sched_ent *alarm)
+{
+  char buf[16];
+  if (read(alarm->poll.fd, buf, sizeof buf)==-1)
+    WHY_perror("read");
+  fdqueue_test_wakeups++;
+}
+
+DEFINE_CMD(app_fdqueue_test, 0,
+   "Run file descriptor event backend speed test",
+   "test","fdqueue");
+static int app_fdqueue_test(const struct cli_parsed *UNUSED(parsed), struct cli_context *context)
+{
+  static struct profile_total stats = {.name="fdqueue_test_read"};
+  static const char *backends[] = {"poll", "epoll"};
+  static const unsigned sizes[] = {16, 64, 256, 1000};
+
+  // each watched fd needs a pipe, so we may need more than the default number of open files
+  struct rlimit limit;
+  if (getrlimit(RLIMIT_NOFILE, &limit)==0 && limit.rlim_cur < limit.rlim_max){
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+  }
+
+  unsigned b;
+  for (b = 0; b < NELS(backends); ++b) {
+    if (fd_select_backend(backends[b])==-1)
+      continue;
+    cli_printf(context, "Benchmarking %s event backend:\n", fd_backend_name());
+    unsigned j;
+    for (j = 0; j < NELS(sizes); ++j) {
+      unsigned n = sizes[j];
+      if (getrlimit(RLIMIT_NOFILE, &limit)==0 && limit.rlim_cur < n * 2 + 16) {
+	cli_printf(context, "%u fds - skipped, open file limit is %u\n", n, (unsigned)limit.rlim_cur);
+	break;
+      }
+      struct sched_ent *alarms = emalloc_zero(n * sizeof(struct sched_ent));
+      int *writers = emalloc(n * sizeof(int));
+      if (!alarms || !writers)
+	return -1;
+      unsigned i;
+      for (i = 0; i < n; ++i) {
+	int fd[2];
+	if (pipe(fd)==-1)
+	  return WHY_perror("pipe");
+	writers[i] = fd[1];
+	alarms[i].poll.fd = fd[0];
+	alarms[i].poll.events = POLLIN;
+	alarms[i]._poll_index = -1;
+	alarms[i].function = fdqueue_test_read;
+	alarms[i].stats = &stats;
+	watch(&alarms[i]);
+      }
+      fdqueue_test_wakeups = 0;
+      unsigned count;
+      time_ms_t start = gettime_ms();
+      time_ms_t end;
+      for (count = 0; (end = gettime_ms()) < start + 200; ++count) {
+	if (write(writers[random() % n], "x", 1)==-1)
+	  return WHY_perror("write");
+	fd_poll();
+      }
+      cli_printf(context, "%4u fds - %u wakeups took %"PRId64"ms - mean time = %.2fus\n",
+	  n, fdqueue_test_wakeups, (int64_t)(end - start), (end - start) * 1000.0 / count);
+      for (i = 0; i < n; ++i) {
+	unwatch(&alarms[i]);
+	close(alarms[i].poll.fd);
+	close(writers[i]);
+      }
+      free(alarms);
+      free(writers);
+    }
+  }
+  return 0;
+}
+
+static void schedule_test_alarm(struct sched_ent *UNUSED(alarm))
+{
+}
+
+DEFINE_CMD(app_schedule_test, 0,
+   "Run alarm scheduling speed test",
+   "test","schedule");
+static int app_schedule_test(const struct cli_parsed *UNUSED(parsed), struct cli_context *context)
+{
+  static struct profile_total stats = {.name="schedule_test_alarm"};
+  static const unsigned sizes[] = {1000, 10000, 100000};
+
+  cli_printf(context, "Benchmarking alarm rescheduling:\n");
+  unsigned j;
+  for (j = 0; j < NELS(sizes); ++j) {
+    unsigned n = sizes[j];
+    struct sched_ent *alarms = emalloc_zero(n * sizeof(struct sched_ent));
+    if (!alarms)
+      return -1;
+    time_ms_t now = gettime_ms();
+    unsigned i;
+    for (i = 0; i < n; ++i) {
+      alarms[i].function = schedule_test_alarm;
+      alarms[i].stats = &stats;
+      alarms[i]._poll_index = -1;
+      alarms[i].alarm = now + 1000 + random() % 60000;
+      alarms[i].deadline = alarms[i].alarm + 1000;
+      schedule(&alarms[i]);
+    }
+    // reschedule random alarms to random times, like idle timeouts being pushed back
+    unsigned count = 1000000;
+    time_ms_t start = gettime_ms();
+    for (i = 0; i < count; ++i) {
+      struct sched_ent *alarm = &alarms[random() % n];
+      time_ms_t at = now + 1000 + random() % 60000;
+      RESCHEDULE(alarm, at, at, at + 1000);
+    }
+    time_ms_t end = gettime_ms();
+    cli_printf(context, "%6u alarms - %u reschedules took %"PRId64"ms - mean time = %.3fus\n",
+	n, count, (int64_t)(end - start), (end - start) * 1000.0 / count);
+    for (i = 0; i < n; ++i)
+      unschedule(&alarms[i]);
+    free(alarms);
+  }
+  return 0;
+}
+
+struct tree_test_record{
+  size_t tree_depth;
+  uint8_t binary[32];
+};
+
+static void *tree_test_create(void *context, const uint8_t *binary, size_t bin_length)
+{
+  struct tree_test_record *record = (struct tree_test_record *)context;
+  assert(bin_length == sizeof record->binary);
+  memcpy(record->binary, binary, bin_length);
+  return record;
+}
+
+static int tree_test_count(void **UNUSED(record), void *context)
+{
+  (*(unsigned *)context)++;
+  return 0;
+}
+
+static int tree_test_release(void **record, void *UNUSED(context))
+{
+  *record = NULL;
+  return 0;
+}
+
+DEFINE_CMD(app_tree_test, 0,
+   "Run nibble tree memory and lookup speed test",
+   "test","tree");
+static int app_tree_test(const struct cli_parsed *UNUSED(parsed), struct cli_context *context)
+{
+  static const unsigned sizes[] = {1000, 10000, 100000};
+
+  cli_printf(context, "Benchmarking nibble tree:\n");
+  unsigned j;
+  for (j = 0; j < NELS(sizes); ++j) {
+    unsigned n = sizes[j];
+    struct tree_test_record *records = emalloc_zero(n * sizeof(struct tree_test_record));
+    if (!records)
+      return -1;
+    struct tree_root root = {.binary_length = sizeof records[0].binary};
+    unsigned i, k;
+    uint8_t binary[sizeof records[0].binary];
+    time_ms_t start = gettime_ms();
+    for (i = 0; i < n; ++i) {
+      for (k = 0; k < sizeof binary; ++k)
+	binary[k] = random();
+      if (tree_find(&root, NULL, binary, sizeof binary, tree_test_create, &records[i]) != TREE_FOUND)
+	return WHY("Failed to insert record");
+    }
+    time_ms_t inserted = gettime_ms();
+    // look up random records by their whole value, then by their shortest unique abbreviation
+    unsigned count = 1000000;
+    for (i = 0; i < count; ++i) {
+      struct tree_test_record *record = &records[random() % n];
+      if (tree_find(&root, NULL, record->binary, sizeof record->binary, NULL, NULL) != TREE_FOUND)
+	return WHY("Failed to find record");
+    }
+    time_ms_t found = gettime_ms();
+    for (i = 0; i < count; ++i) {
+      struct tree_test_record *record = &records[random() % n];
+      if (tree_find(&root, NULL, record->binary, (record->tree_depth >> 3) + 1, NULL, NULL) != TREE_FOUND)
+	return WHY("Failed to find abbreviated record");
+    }
+    time_ms_t abbreviated = gettime_ms();
+    unsigned walked = 0;
+    for (i = 0; i < 100; ++i)
+      tree_walk(&root, NULL, 0, tree_test_count, &walked);
+    time_ms_t end = gettime_ms();
+    cli_printf(context, "%6u records - %zu bytes of nodes (%.1f per record) - insert %.3fus, find %.3fus, find abbreviated %.3fus, walk %.3fus per record\n",
+	n, tree_memory(&root), (double)tree_memory(&root) / n,
+	(inserted - start) * 1000.0 / n,
+	(found - inserted) * 1000.0 / count,
+	(abbreviated - found) * 1000.0 / count,
+	(end - abbreviated) * 1000.0 / walked);
+    tree_walk(&root, NULL, 0, tree_test_release, NULL);
+    free(records);
+  }
+  return 0;
+}
+
 DEFINE_CMD(app_config_test, 0,
    "Load a test config file and log various fields",
    "config","test","<file>");
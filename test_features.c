@@ -26,6 +26,12 @@ void test_features()
   USE_FEATURE(cli_log);
   USE_FEATURE(cli_vomp_console);
   USE_FEATURE(cli_tests);
+  USE_FEATURE(cli_rhizome_tests);
+  USE_FEATURE(cli_route_tests);
+  USE_FEATURE(cli_overlay_tests);
+  USE_FEATURE(cli_http_tests);
+  USE_FEATURE(cli_keyring_tests);
+  USE_FEATURE(http_server);
 }
 
 void command_cleanup() {}